@@ -31,8 +31,10 @@
 #include "tabrmd.h"
 
 #include "access-broker.h"
+#include "buffer-pool.h"
 #include "tcti.h"
 #include "tpm2-command.h"
+#include "tpm2-header.h"
 #include "tpm2-response.h"
 #include "util.h"
 
@@ -45,6 +47,38 @@ enum {
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * Retry policy for a TPM response code. When the TPM responds with one of
+ * these codes the command wasn't executed and may simply be sent again.
+ * We wait 'delay' microseconds before the first retry, doubling it for
+ * each one after, and give up after 'max_retries'.
+ */
+typedef struct {
+    TSS2_RC   rc;
+    guint     max_retries;
+    gulong    delay;
+} retry_policy_t;
+static const retry_policy_t retry_policies [] = {
+    { .rc = TPM2_RC_YIELDED, .max_retries = 8,  .delay = 0     },
+    { .rc = TPM2_RC_RETRY,   .max_retries = 8,  .delay = 1000  },
+    { .rc = TPM2_RC_TESTING, .max_retries = 10, .delay = 10000 },
+};
+/*
+ * Get the retry policy for the provided response code. Returns NULL if
+ * responses with this code shouldn't be retried.
+ */
+static const retry_policy_t*
+access_broker_retry_policy (TSS2_RC rc)
+{
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS (retry_policies); ++i) {
+        if (retry_policies [i].rc == rc) {
+            return &retry_policies [i];
+        }
+    }
+    return NULL;
+}
 /**
  * GObject property setter.
  */
@@ -110,10 +144,14 @@ access_broker_dispose (GObject *obj)
 {
     AccessBroker *self = ACCESS_BROKER (obj);
 
+    g_info ("AccessBroker 0x%" PRIxPTR " retried %" PRIu64 " commands "
+            "spending %" PRIu64 "us", (uintptr_t)self, self->retry_count,
+            self->retry_time);
     if (self->sapi_context != NULL) {
         Tss2_Sys_Finalize (self->sapi_context);
     }
     g_clear_pointer (&self->sapi_context, g_free);
+    g_clear_object (&self->in_flight);
     g_clear_object (&self->tcti);
     G_OBJECT_CLASS (access_broker_parent_class)->dispose (obj);
 }
@@ -361,6 +399,17 @@ access_broker_get_max_response (AccessBroker *broker,
                                              TPM2_PT_MAX_RESPONSE_SIZE,
                                              value);
 }
+/**
+ * Return the TPM2_PT_CONTEXT_GAP_MAX fixed TPM property.
+ */
+TSS2_RC
+access_broker_get_context_gap_max (AccessBroker *broker,
+                                   guint32      *value)
+{
+    return access_broker_get_fixed_property (broker,
+                                             TPM2_PT_CONTEXT_GAP_MAX,
+                                             value);
+}
 /* Send the parameter Tpm2Command to the TPM. Return the TSS2_RC. */
 static TSS2_RC
 access_broker_send_cmd (AccessBroker *broker,
@@ -379,7 +428,8 @@ access_broker_send_cmd (AccessBroker *broker,
 }
 /*
  * Get a response buffer from the TPM. Return the TSS2_RC through the
- * 'rc' parameter. Returns a buffer (that must be freed by the caller)
+ * 'rc' parameter. Returns a buffer from the buffer pool (that must be freed by
+ * the caller with buffer_pool_free)
  * containing the response from the TPM. Determine the size of the buffer
  * by reading the size field from the TPM command header.
  */
@@ -398,15 +448,171 @@ access_broker_get_response (AccessBroker *broker,
     if (rc != TSS2_RC_SUCCESS)
         return rc;
 
-    *buffer = calloc (1, max_size);
-    if (*buffer == NULL) {
-        g_warning ("failed to allocate buffer for Tpm2Response: %s",
-                   strerror (errno));
-        return RM_RC (TPM2_RC_MEMORY);
-    }
+    *buffer = buffer_pool_alloc (max_size);
     *buffer_size = max_size;
     rc = tcti_receive (broker->tcti, buffer_size, *buffer, TSS2_TCTI_TIMEOUT_BLOCK);
-    *buffer = realloc (*buffer, *buffer_size);
+    if (rc != TSS2_RC_SUCCESS) {
+        buffer_pool_free (*buffer);
+        *buffer = NULL;
+        *buffer_size = 0;
+    }
+
+    return rc;
+}
+/*
+ * Submit a command to the TPM without waiting for the response. The
+ * sapi_mutex is taken and, if the command was transmitted successfully,
+ * it remains held until the response is collected with
+ * access_broker_complete. This leaves the calling thread free to do other
+ * work while the TPM is busy. If transmission fails the lock is released
+ * and the TCTI RC is returned.
+ * The caller MUST NOT hold the lock when calling.
+ */
+TSS2_RC
+access_broker_submit (AccessBroker *broker,
+                      Tpm2Command  *command)
+{
+    TSS2_RC rc;
+
+    g_debug ("%s: AccessBroker: 0x%" PRIxPTR " Tpm2Command: 0x%" PRIxPTR,
+             __func__, (uintptr_t)broker, (uintptr_t)command);
+    access_broker_lock (broker);
+    g_assert (broker->in_flight == NULL);
+    rc = access_broker_send_cmd (broker, command);
+    if (rc != TSS2_RC_SUCCESS) {
+        access_broker_unlock (broker);
+        return rc;
+    }
+    pthread_mutex_lock (&broker->cancel_mutex);
+    broker->in_flight = g_object_ref (command);
+    pthread_mutex_unlock (&broker->cancel_mutex);
+    return rc;
+}
+/*
+ * Collect the response to the command submitted with access_broker_submit,
+ * blocking until the TPM is done with it.
+ * Once a response is returned the command is no longer in flight and the
+ * lock is released. Like access_broker_send_command, in all error cases a
+ * Tpm2Response object with the appropriate RC populated is returned.
+ * Responses that should be retried are returned like any other, see
+ * access_broker_should_retry.
+ */
+Tpm2Response*
+access_broker_complete (AccessBroker  *broker,
+                        TSS2_RC       *rc)
+{
+    Tpm2Response   *response = NULL;
+    Tpm2Command    *command = broker->in_flight;
+    Connection     *connection = NULL;
+    guint8         *buffer = NULL;
+    size_t          buffer_size = 0;
+
+    g_assert_nonnull (command);
+    *rc = access_broker_get_response (broker, &buffer, &buffer_size);
+    if (*rc != TSS2_RC_SUCCESS)
+        goto unlock_out;
+    connection = tpm2_command_get_connection (command);
+    response = tpm2_response_new (connection,
+                                  buffer,
+                                  buffer_size,
+                                  tpm2_command_get_attributes (command));
+    g_debug ("%s: AccessBroker: 0x%" PRIxPTR " Tpm2Response: 0x%" PRIxPTR
+             " RC: 0x%" PRIx32, __func__, (uintptr_t)broker,
+             (uintptr_t)response, tpm2_response_get_code (response));
+    goto out;
+
+unlock_out:
+    connection = tpm2_command_get_connection (command);
+    response = tpm2_response_new_rc (connection, *rc);
+out:
+    pthread_mutex_lock (&broker->cancel_mutex);
+    broker->in_flight = NULL;
+    pthread_mutex_unlock (&broker->cancel_mutex);
+    access_broker_unlock (broker);
+    g_object_unref (connection);
+    g_object_unref (command);
+    return response;
+}
+/*
+ * Decide whether 'command' should be sent to the TPM again because of the
+ * code in 'response'. If the code has a retry policy (see retry_policies)
+ * and the command has retries left the retry is counted and the time
+ * before which the command must not be sent again is set on the command
+ * (see tpm2_command_get_not_before). The caller then submits it again
+ * once that time has passed. Nothing is held in the meantime so commands
+ * from other connections can run between retries.
+ * The caller MUST NOT hold the lock when calling.
+ */
+gboolean
+access_broker_should_retry (AccessBroker *broker,
+                            Tpm2Command  *command,
+                            Tpm2Response *response)
+{
+    const retry_policy_t *policy;
+    guint retries;
+    gint64 retry_start;
+
+    retries = tpm2_command_get_retries (command);
+    policy = access_broker_retry_policy (tpm2_response_get_code (response));
+    if (policy != NULL &&
+        retries < policy->max_retries &&
+        !tpm2_command_is_canceled (command))
+    {
+        g_debug ("%s: TPM returned RC 0x%" PRIx32 ", retry %u of %u",
+                 __func__, policy->rc, retries + 1, policy->max_retries);
+        tpm2_command_retry_at (command, g_get_monotonic_time () +
+                               (gint64)(policy->delay << retries));
+        access_broker_lock (broker);
+        broker->retry_count++;
+        access_broker_unlock (broker);
+        return TRUE;
+    }
+    retry_start = tpm2_command_get_retry_start (command);
+    if (retry_start != 0) {
+        access_broker_lock (broker);
+        broker->retry_time += g_get_monotonic_time () - retry_start;
+        access_broker_unlock (broker);
+    }
+    return FALSE;
+}
+/*
+ * Try to abort the command the TPM is running if it came from
+ * 'connection'. This is best effort only. It uses the TCTI cancel function
+ * which not every TCTI implements: if it doesn't the command runs to
+ * completion. A TPM that does abort the command responds with
+ * TPM2_RC_CANCELED and that goes back to the client like any other
+ * response.
+ * This may be called from any thread. It doesn't take the sapi_mutex since
+ * that's held for as long as the command is in flight, and so the TCTI
+ * cancel function is called while the ResourceManager thread may be
+ * blocked in the TCTI receive function. The TCTI spec doesn't promise
+ * that's safe for every TCTI, so callers must not depend on the cancel
+ * taking effect. The cancel_mutex keeps us from canceling the next command
+ * if this one completes underneath us.
+ */
+TSS2_RC
+access_broker_cancel (AccessBroker *broker,
+                      Connection   *connection)
+{
+    Connection *in_flight_connection = NULL;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    pthread_mutex_lock (&broker->cancel_mutex);
+    if (broker->in_flight != NULL) {
+        in_flight_connection = tpm2_command_get_connection (broker->in_flight);
+    }
+    if (in_flight_connection != NULL && in_flight_connection == connection) {
+        g_debug ("%s: canceling Tpm2Command 0x%" PRIxPTR " for Connection "
+                 "0x%" PRIxPTR, __func__, (uintptr_t)broker->in_flight,
+                 (uintptr_t)connection);
+        rc = tcti_cancel (broker->tcti);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_debug ("%s: TCTI cancel failed with RC 0x%" PRIx32
+                     ", command will run to completion", __func__, rc);
+        }
+    }
+    pthread_mutex_unlock (&broker->cancel_mutex);
+    g_clear_object (&in_flight_connection);
 
     return rc;
 }
@@ -414,7 +620,10 @@ access_broker_get_response (AccessBroker *broker,
  * In the most simple case the caller will want to send just a single
  * command represented by a Tpm2Command object. The response is passed
  * back as the return value. The resonse code is returend through the
- * 'rc' out parameter.
+ * 'rc' out parameter. This is just access_broker_submit followed by a
+ * blocking access_broker_complete, sending the command again for as long
+ * as access_broker_should_retry says to. The lock isn't held while we back
+ * off.
  * The caller MUST NOT hold the lock when calling. This function will take
  * the lock for itself.
  * Additionally this function *WILL ONLY* return a NULL Tpm2Response
@@ -429,41 +638,29 @@ access_broker_send_command (AccessBroker  *broker,
 {
     Tpm2Response   *response = NULL;
     Connection     *connection = NULL;
-    guint8         *buffer = NULL;
-    size_t          buffer_size = 0;
+    gint64          delay;
 
     g_debug ("access_broker_send_command: AccessBroker: 0x%" PRIxPTR
              " Tpm2Command: 0x%" PRIxPTR, (uintptr_t)broker,
              (uintptr_t)command);
-    access_broker_lock (broker);
-    *rc = access_broker_send_cmd (broker, command);
-    if (*rc != TSS2_RC_SUCCESS)
-        goto unlock_out;
-    *rc = access_broker_get_response (broker, &buffer, &buffer_size);
-    if (*rc != TSS2_RC_SUCCESS) {
-        if (buffer != NULL)
-            free (buffer);
-        goto unlock_out;
+    for (;;) {
+        *rc = access_broker_submit (broker, command);
+        if (*rc != TSS2_RC_SUCCESS) {
+            connection = tpm2_command_get_connection (command);
+            response = tpm2_response_new_rc (connection, *rc);
+            g_object_unref (connection);
+            return response;
+        }
+        response = access_broker_complete (broker, rc);
+        if (!access_broker_should_retry (broker, command, response)) {
+            return response;
+        }
+        g_object_unref (response);
+        delay = tpm2_command_get_not_before (command) - g_get_monotonic_time ();
+        if (delay > 0) {
+            g_usleep (delay);
+        }
     }
-    access_broker_unlock (broker);
-    connection = tpm2_command_get_connection (command);
-    response = tpm2_response_new (connection,
-                                  buffer,
-                                  buffer_size,
-                                  tpm2_command_get_attributes (command));
-    g_debug ("access_broker_send_command: AccessBroker: 0x%" PRIxPTR
-             " Tpm2Response: 0x%" PRIxPTR " RC: 0x%" PRIx32, (uintptr_t)broker,
-             (uintptr_t)response, tpm2_response_get_code (response));
-    g_object_unref (connection);
-    return response;
-
-unlock_out:
-    access_broker_unlock (broker);
-    if (!connection)
-        connection = tpm2_command_get_connection (command);
-    response = tpm2_response_new_rc (connection, *rc);
-    g_object_unref (connection);
-    return response;
 }
 /**
  * Create new TPM access broker (ACCESS_BROKER) object. This includes
@@ -503,6 +700,7 @@ access_broker_init_tpm (AccessBroker *broker)
     if (broker->initialized)
         return TSS2_RC_SUCCESS;
     pthread_mutex_init (&broker->sapi_mutex, NULL);
+    pthread_mutex_init (&broker->cancel_mutex, NULL);
     rc = access_broker_send_tpm_startup (broker);
     if (rc != TSS2_RC_SUCCESS) {
         g_warning ("access_broker_sent_tpm_startup failed: 0x%x", rc);
@@ -552,6 +750,70 @@ out:
     access_broker_unlock (broker);
     return rc;
 }
+/*
+ * Query the TPM for the current value of a single variable (TPM2_PT_VAR)
+ * TPM property. Unlike the fixed properties these change as the TPM is used
+ * so they're never cached.
+ */
+static TSS2_RC
+access_broker_get_variable_property (AccessBroker *broker,
+                                     TPM2_PT        property,
+                                     guint32      *value)
+{
+    TSS2_RC rc;
+    TSS2_SYS_CONTEXT *sapi_context;
+    TPMI_YES_NO more_data;
+    TPMS_CAPABILITY_DATA capability_data = { 0, };
+
+    g_assert_nonnull (broker);
+    g_assert_nonnull (value);
+    sapi_context = access_broker_lock_sapi (broker);
+    rc = Tss2_Sys_GetCapability (sapi_context,
+                                 NULL,
+                                 TPM2_CAP_TPM_PROPERTIES,
+                                 property,
+                                 1,
+                                 &more_data,
+                                 &capability_data,
+                                 NULL);
+    access_broker_unlock (broker);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("Failed to GetCapability: TPM2_CAP_TPM_PROPERTIES, "
+                   "property 0x%" PRIx32 ": 0x%" PRIx32, property, rc);
+        return rc;
+    }
+    if (capability_data.data.tpmProperties.count < 1 ||
+        capability_data.data.tpmProperties.tpmProperty[0].property != property)
+    {
+        return TSS2_RESMGR_RC_BAD_VALUE;
+    }
+    *value = capability_data.data.tpmProperties.tpmProperty[0].value;
+    return rc;
+}
+/*
+ * Query the TPM for the number of additional transient objects that can
+ * be loaded (TPM2_PT_HR_TRANSIENT_AVAIL).
+ */
+TSS2_RC
+access_broker_get_trans_avail (AccessBroker *broker,
+                               guint32      *value)
+{
+    return access_broker_get_variable_property (broker,
+                                                TPM2_PT_HR_TRANSIENT_AVAIL,
+                                                value);
+}
+/*
+ * Query the TPM for the number of additional sessions that can be loaded
+ * (TPM2_PT_HR_LOADED_AVAIL).
+ */
+TSS2_RC
+access_broker_get_loaded_avail (AccessBroker *broker,
+                                guint32      *value)
+{
+    return access_broker_get_variable_property (broker,
+                                                TPM2_PT_HR_LOADED_AVAIL,
+                                                value);
+}
 TSS2_RC
 access_broker_context_load (AccessBroker *broker,
                             TPMS_CONTEXT *context,
@@ -714,3 +976,84 @@ access_broker_flush_all_context (AccessBroker *broker)
                                       TPM2_TRANSIENT_LAST);
     access_broker_unlock (broker);
 }
+/*
+ * Report the number of times a command has been sent again because of a
+ * response code with a retry policy, and the total time in microseconds
+ * spent retrying.
+ */
+void
+access_broker_get_retry_stats (AccessBroker *broker,
+                               guint64      *count,
+                               guint64      *time)
+{
+    access_broker_lock (broker);
+    *count = broker->retry_count;
+    *time  = broker->retry_time;
+    access_broker_unlock (broker);
+}
+/*
+ * Drive the TPM through the self tests for all of the algorithms that it
+ * hasn't tested yet. We get the list of untested algorithms by sending
+ * TPM2_IncrementalSelfTest with an empty list, then test them one at a
+ * time. The lock is released between algorithms so that client commands
+ * preempt this work: a client command waits on at most one algorithm
+ * being tested. When done the result is checked with TPM2_GetTestResult.
+ */
+TSS2_RC
+access_broker_self_test (AccessBroker *broker)
+{
+    TSS2_SYS_CONTEXT *sapi_context;
+    TPML_ALG          to_test = { 0, }, to_do = { 0, }, remaining;
+    TPM2B_MAX_BUFFER  out_data = { .size = sizeof (TPM2B_MAX_BUFFER) - 2, };
+    TPM2_RC           test_result = TPM2_RC_SUCCESS;
+    TSS2_RC           rc;
+    guint32           i;
+
+    g_assert_nonnull (broker);
+    sapi_context = access_broker_lock_sapi (broker);
+    rc = Tss2_Sys_IncrementalSelfTest (sapi_context,
+                                       NULL,
+                                       &to_test,
+                                       &to_do,
+                                       NULL);
+    access_broker_unlock (broker);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to get list of untested algorithms: 0x%"
+                   PRIx32, __func__, rc);
+        return rc;
+    }
+    g_info ("%s: %" PRIu32 " algorithms left to test", __func__,
+            to_do.count);
+    for (i = 0; i < to_do.count; ++i) {
+        to_test.count = 1;
+        to_test.algorithms [0] = to_do.algorithms [i];
+        remaining.count = 0;
+        sapi_context = access_broker_lock_sapi (broker);
+        rc = Tss2_Sys_IncrementalSelfTest (sapi_context,
+                                           NULL,
+                                           &to_test,
+                                           &remaining,
+                                           NULL);
+        access_broker_unlock (broker);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: self test for algorithm 0x%04" PRIx16 " "
+                       "returned: 0x%" PRIx32, __func__,
+                       to_test.algorithms [0], rc);
+        }
+        g_thread_yield ();
+    }
+    sapi_context = access_broker_lock_sapi (broker);
+    rc = Tss2_Sys_GetTestResult (sapi_context,
+                                 NULL,
+                                 &out_data,
+                                 &test_result,
+                                 NULL);
+    access_broker_unlock (broker);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: TPM2_GetTestResult failed: 0x%" PRIx32, __func__, rc);
+        return rc;
+    }
+    g_info ("%s: self test done with result: 0x%" PRIx32, __func__,
+            test_result);
+    return test_result;
+}
@@ -44,10 +44,14 @@ typedef struct _AccessBrokerClass {
 typedef struct _AccessBroker {
     GObject                 parent_instance;
     pthread_mutex_t         sapi_mutex;
+    pthread_mutex_t         cancel_mutex;
     TSS2_SYS_CONTEXT       *sapi_context;
     Tcti                   *tcti;
     TPMS_CAPABILITY_DATA    properties_fixed;
     gboolean                initialized;
+    guint64                 retry_count;
+    guint64                 retry_time;
+    struct _Tpm2Command    *in_flight;
 } AccessBroker;
 
 #include "tpm2-command.h"
@@ -67,15 +71,28 @@ void               access_broker_unlock         (AccessBroker    *broker);
 Tpm2Response*      access_broker_send_command   (AccessBroker    *broker,
                                                  Tpm2Command     *command,
                                                  TSS2_RC         *rc);
+TSS2_RC            access_broker_submit         (AccessBroker    *broker,
+                                                 Tpm2Command     *command);
+Tpm2Response*      access_broker_complete       (AccessBroker    *broker,
+                                                 TSS2_RC         *rc);
+gboolean           access_broker_should_retry   (AccessBroker    *broker,
+                                                 Tpm2Command     *command,
+                                                 Tpm2Response    *response);
 TSS2_RC            access_broker_get_max_command    (AccessBroker   *broker,
                                                      guint32        *value);
 TSS2_RC            access_broker_get_max_response   (AccessBroker   *broker,
                                                      guint32        *value);
 TSS2_RC            access_broker_get_total_commands (AccessBroker   *broker,
                                                      guint          *value);
+TSS2_RC            access_broker_get_context_gap_max (AccessBroker  *broker,
+                                                      guint32       *value);
 TSS2_SYS_CONTEXT*  access_broker_lock_sapi          (AccessBroker   *broker);
 TSS2_RC            access_broker_get_trans_object_count (AccessBroker *broker,
                                                          uint32_t     *count);
+TSS2_RC            access_broker_get_trans_avail        (AccessBroker *broker,
+                                                         guint32      *value);
+TSS2_RC            access_broker_get_loaded_avail       (AccessBroker *broker,
+                                                         guint32      *value);
 TSS2_RC            access_broker_context_load           (AccessBroker *broker,
                                                          TPMS_CONTEXT *context,
                                                          TPM2_HANDLE   *handle);
@@ -88,6 +105,12 @@ TSS2_RC            access_broker_context_save           (AccessBroker *broker,
                                                          TPM2_HANDLE    handle,
                                                          TPMS_CONTEXT *context);
 void               access_broker_flush_all_context      (AccessBroker *broker);
+TSS2_RC            access_broker_self_test              (AccessBroker *broker);
+void               access_broker_get_retry_stats        (AccessBroker *broker,
+                                                         guint64      *count,
+                                                         guint64      *time);
+TSS2_RC            access_broker_cancel                 (AccessBroker *broker,
+                                                         Connection   *connection);
 
 G_END_DECLS
 
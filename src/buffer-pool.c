@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "buffer-pool.h"
+#include "tpm2-header.h"
+
+/* free buffers cached by a single thread */
+typedef struct _BufferCache {
+    guint    count;
+    guint8  *buffers [BUFFER_POOL_CACHE_SIZE];
+} BufferCache;
+
+static void buffer_cache_free (gpointer data);
+
+/*
+ * The arena, buffer size and count are set by buffer_pool_init before the
+ * threads that use the pool are started and don't change until
+ * buffer_pool_fini, after those threads are gone. Only the shared free list
+ * and the miss count need the mutex.
+ */
+static pthread_mutex_t buffer_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static guint8   *buffer_pool_arena = NULL;
+static size_t    buffer_pool_buffer_size = 0;
+static guint     buffer_pool_count = 0;
+static guint8  **buffer_pool_free_list = NULL;
+static guint     buffer_pool_free_count = 0;
+static guint64   buffer_pool_misses = 0;
+static GPrivate  buffer_cache_key = G_PRIVATE_INIT (buffer_cache_free);
+
+/*
+ * Move buffers from the cache to the shared free list until 'keep' are
+ * left in the cache. The caller must hold the buffer_pool_mutex.
+ */
+static void
+buffer_cache_drain (BufferCache *cache,
+                    guint        keep)
+{
+    while (cache->count > keep) {
+        buffer_pool_free_list [buffer_pool_free_count++] =
+            cache->buffers [--cache->count];
+    }
+}
+/*
+ * GDestroyNotify for the per-thread cache: return the cached buffers to
+ * the shared free list when the thread exits.
+ */
+static void
+buffer_cache_free (gpointer data)
+{
+    BufferCache *cache = (BufferCache*)data;
+
+    pthread_mutex_lock (&buffer_pool_mutex);
+    buffer_cache_drain (cache, 0);
+    pthread_mutex_unlock (&buffer_pool_mutex);
+    g_free (cache);
+}
+static BufferCache*
+buffer_cache_get (void)
+{
+    BufferCache *cache;
+
+    cache = g_private_get (&buffer_cache_key);
+    if (cache == NULL) {
+        cache = g_new0 (BufferCache, 1);
+        g_private_set (&buffer_cache_key, cache);
+    }
+
+    return cache;
+}
+static gboolean
+buffer_pool_contains (guint8 *buffer)
+{
+    return buffer_pool_arena != NULL &&
+        buffer >= buffer_pool_arena &&
+        buffer < buffer_pool_arena + buffer_pool_buffer_size * buffer_pool_count;
+}
+/*
+ * Allocate the pool: 'count' buffers of 'buffer_size' bytes, rounded up to
+ * keep each buffer aligned. This must be called before any thread
+ * allocates from the pool.
+ */
+void
+buffer_pool_init (size_t buffer_size,
+                  guint  count)
+{
+    guint i;
+
+    if (buffer_pool_arena != NULL) {
+        g_warning ("%s: buffer pool already initialized", __func__);
+        return;
+    }
+    if (buffer_size < TPM_HEADER_SIZE || count == 0) {
+        g_warning ("%s: invalid buffer pool size: %u buffers of %zu bytes",
+                   __func__, count, buffer_size);
+        return;
+    }
+    buffer_size = (buffer_size + sizeof (gpointer) * 2 - 1) &
+        ~(sizeof (gpointer) * 2 - 1);
+    count = MIN (count, BUFFER_POOL_COUNT_MAX);
+    buffer_pool_arena = g_malloc (buffer_size * count);
+    buffer_pool_free_list = g_new (guint8*, count);
+    for (i = 0; i < count; ++i) {
+        buffer_pool_free_list [i] =
+            &buffer_pool_arena [(count - i - 1) * buffer_size];
+    }
+    buffer_pool_free_count = count;
+    buffer_pool_buffer_size = buffer_size;
+    buffer_pool_count = count;
+    buffer_pool_misses = 0;
+    g_info ("%s: %u buffers of %zu bytes at 0x%" PRIxPTR, __func__, count,
+            buffer_size, (uintptr_t)buffer_pool_arena);
+}
+/*
+ * Free the pool. This is only safe once every buffer has been returned,
+ * if any are still out the pool is left in place and they're freed with
+ * the process.
+ */
+void
+buffer_pool_fini (void)
+{
+    BufferCache *cache;
+
+    if (buffer_pool_arena == NULL) {
+        return;
+    }
+    pthread_mutex_lock (&buffer_pool_mutex);
+    cache = g_private_get (&buffer_cache_key);
+    if (cache != NULL) {
+        buffer_cache_drain (cache, 0);
+    }
+    g_info ("%s: %" PRIu64 " allocations missed the buffer pool",
+            __func__, buffer_pool_misses);
+    if (buffer_pool_free_count != buffer_pool_count) {
+        g_warning ("%s: %u of %u buffers are still in use, not freeing pool",
+                   __func__, buffer_pool_count - buffer_pool_free_count,
+                   buffer_pool_count);
+        pthread_mutex_unlock (&buffer_pool_mutex);
+        return;
+    }
+    g_clear_pointer (&buffer_pool_free_list, g_free);
+    g_clear_pointer (&buffer_pool_arena, g_free);
+    buffer_pool_free_count = 0;
+    buffer_pool_buffer_size = 0;
+    buffer_pool_count = 0;
+    pthread_mutex_unlock (&buffer_pool_mutex);
+}
+/*
+ * The size of the buffers in the pool, 0 if the pool hasn't been
+ * initialized.
+ */
+size_t
+buffer_pool_get_buffer_size (void)
+{
+    return buffer_pool_buffer_size;
+}
+/*
+ * Get a buffer of at least 'size' bytes. The buffer comes from the
+ * calling thread's cache, refilled from the shared free list when empty.
+ * If the pool can't satisfy the request the buffer is allocated with
+ * g_malloc. Either way it must be released with buffer_pool_free. The
+ * contents of the buffer are undefined.
+ */
+guint8*
+buffer_pool_alloc (size_t size)
+{
+    BufferCache *cache;
+
+    if (buffer_pool_arena == NULL || size > buffer_pool_buffer_size) {
+        return g_malloc (size);
+    }
+    cache = buffer_cache_get ();
+    if (cache->count == 0) {
+        pthread_mutex_lock (&buffer_pool_mutex);
+        while (cache->count < BUFFER_POOL_CACHE_SIZE / 2 &&
+               buffer_pool_free_count > 0)
+        {
+            cache->buffers [cache->count++] =
+                buffer_pool_free_list [--buffer_pool_free_count];
+        }
+        if (cache->count == 0) {
+            ++buffer_pool_misses;
+        }
+        pthread_mutex_unlock (&buffer_pool_mutex);
+    }
+    if (cache->count == 0) {
+        g_debug ("%s: buffer pool is empty, allocating %zu bytes",
+                 __func__, size);
+        return g_malloc (size);
+    }
+
+    return cache->buffers [--cache->count];
+}
+/*
+ * Return a buffer to the calling thread's cache. When the cache is full
+ * half of it goes back to the shared free list. Buffers that didn't come
+ * from the pool are freed.
+ */
+void
+buffer_pool_free (gpointer buffer)
+{
+    BufferCache *cache;
+
+    if (buffer == NULL) {
+        return;
+    }
+    if (!buffer_pool_contains ((guint8*)buffer)) {
+        g_free (buffer);
+        return;
+    }
+    cache = buffer_cache_get ();
+    if (cache->count == BUFFER_POOL_CACHE_SIZE) {
+        pthread_mutex_lock (&buffer_pool_mutex);
+        buffer_cache_drain (cache, BUFFER_POOL_CACHE_SIZE / 2);
+        pthread_mutex_unlock (&buffer_pool_mutex);
+    }
+    cache->buffers [cache->count++] = (guint8*)buffer;
+}
+/*
+ * The number of times buffer_pool_alloc found the pool empty and fell
+ * back to g_malloc.
+ */
+guint64
+buffer_pool_get_miss_count (void)
+{
+    guint64 misses;
+
+    pthread_mutex_lock (&buffer_pool_mutex);
+    misses = buffer_pool_misses;
+    pthread_mutex_unlock (&buffer_pool_mutex);
+
+    return misses;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* upper bound on the number of buffers in the pool */
+#define BUFFER_POOL_COUNT_MAX  1024
+/* number of free buffers each thread keeps for itself */
+#define BUFFER_POOL_CACHE_SIZE 16
+
+/*
+ * A pool of fixed size buffers for TPM command and response buffers. The
+ * buffer size is the larger of TPM2_PT_MAX_COMMAND_SIZE and
+ * TPM2_PT_MAX_RESPONSE_SIZE so every buffer can hold any command or
+ * response the TPM accepts. The buffers are carved from one allocation
+ * made by buffer_pool_init, after that getting and returning a buffer
+ * doesn't touch the heap.
+ *
+ * Each thread keeps a small cache of free buffers and only takes the pool
+ * lock to move a batch of buffers between its cache and the shared free
+ * list. Buffers move between threads with the Tpm2Command / Tpm2Response
+ * that owns them: the thread that reads a command allocates its buffer, the
+ * one that drops the last reference to the command returns it.
+ *
+ * buffer_pool_free accepts any buffer from g_malloc as well. Buffers from
+ * outside the pool are released with g_free. This is what
+ * buffer_pool_alloc falls back to when the pool is empty, not yet
+ * initialized or the requested size is larger than the pool buffers.
+ */
+void           buffer_pool_init               (size_t            buffer_size,
+                                               guint             count);
+void           buffer_pool_fini               (void);
+size_t         buffer_pool_get_buffer_size    (void);
+guint8*        buffer_pool_alloc              (size_t            size);
+void           buffer_pool_free               (gpointer          buffer);
+guint64        buffer_pool_get_miss_count     (void);
+
+G_END_DECLS
+#endif /* BUFFER_POOL_H */
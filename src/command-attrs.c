@@ -24,10 +24,8 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
  * THE POSSIBILITY OF SUCH DAMAGE.
  */
-#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
-#include <string.h>
 
 #include "command-attrs.h"
 
@@ -47,6 +45,8 @@ command_attrs_finalize (GObject *obj)
 
     g_debug ("command_attrs_finalize: 0x%" PRIxPTR, (uintptr_t)attrs);
     g_clear_pointer (&attrs->command_attrs, g_free);
+    g_clear_pointer (&attrs->spec_table.attrs, g_free);
+    g_clear_pointer (&attrs->vendor_table.attrs, g_free);
     G_OBJECT_CLASS (command_attrs_parent_class)->finalize (obj);
 }
 
@@ -73,6 +73,48 @@ command_attrs_new (void)
     return COMMAND_ATTRS (g_object_new (TYPE_COMMAND_ATTRS, NULL));
 }
 /*
+ * Populate 'table' with the TPMA_CCs from 'attrs_list' that have the V bit
+ * set if 'vendor' is TRUE, or clear if it's FALSE. The table spans the
+ * lowest to the highest commandIndex of these TPMA_CCs.
+ */
+#define TPMA_CC_IS_VENDOR(attrs) ((attrs & TPMA_CC_V) ? TRUE : FALSE)
+static void
+command_attrs_table_init (CommandAttrsTable *table,
+                          TPMA_CC           *attrs_list,
+                          UINT32             count,
+                          gboolean           vendor)
+{
+    UINT16 index, first = G_MAXUINT16, last = 0;
+    UINT32 i;
+
+    g_clear_pointer (&table->attrs, g_free);
+    table->first = 0;
+    table->size = 0;
+    for (i = 0; i < count; ++i) {
+        if (TPMA_CC_IS_VENDOR (attrs_list [i]) != vendor)
+            continue;
+        index = attrs_list [i] & TPMA_CC_COMMANDINDEX;
+        first = MIN (first, index);
+        last = MAX (last, index);
+    }
+    if (first > last)
+        return;
+    table->first = first;
+    table->size = last - first + 1;
+    table->attrs = g_new0 (TPMA_CC, table->size);
+    for (i = 0; i < count; ++i) {
+        if (TPMA_CC_IS_VENDOR (attrs_list [i]) != vendor)
+            continue;
+        index = attrs_list [i] & TPMA_CC_COMMANDINDEX;
+        table->attrs [index - first] = attrs_list [i];
+    }
+    g_debug ("%s: %u %s command attribute slots from commandIndex 0x%"
+             PRIx16, __func__, table->size, vendor ? "vendor" : "spec",
+             first);
+}
+/*
+ * Query the TPM for the TPMA_CC of each command it implements and build
+ * the tables used by command_attrs_from_cc.
  */
 gint
 command_attrs_init_tpm (CommandAttrs *attrs,
@@ -113,28 +155,44 @@ command_attrs_init_tpm (CommandAttrs *attrs,
 
     attrs->count = capability_data.data.command.count;
     g_debug ("got attributes for 0x%" PRIx32 " commands", attrs->count);
-    attrs->command_attrs = (TPMA_CC*) calloc (1, sizeof (TPMA_CC) * attrs->count);
-    if (attrs->command_attrs == NULL) {
-        g_warning ("Failed to allocate memory for TPMA_CC: %s\n",
-                   strerror (errno));
-        return -1;
-    }
+    g_clear_pointer (&attrs->command_attrs, g_free);
+    attrs->command_attrs = g_new0 (TPMA_CC, attrs->count);
     for (i = 0; i < attrs->count; ++i)
         attrs->command_attrs[i] = capability_data.data.command.commandAttributes[i];
+    command_attrs_table_init (&attrs->spec_table,
+                              attrs->command_attrs,
+                              attrs->count,
+                              FALSE);
+    command_attrs_table_init (&attrs->vendor_table,
+                              attrs->command_attrs,
+                              attrs->count,
+                              TRUE);
 
     return 0;
 }
-
-/* TPM2_CC is in the lower 15 bits of the TPMA_CC */
-#define TPM2_CC_FROM_TPMA_CC(attrs) (attrs & 0x7fff)
+/*
+ * Get the TPMA_CC for the command with the given TPM2_CC. Vendor commands
+ * have the V bit set in their TPM2_CC as in their TPMA_CC. A TPM2_CC with
+ * any other bit set outside of the commandIndex isn't a valid command.
+ * Returns 0 for commands the TPM doesn't implement.
+ */
 TPMA_CC
 command_attrs_from_cc (CommandAttrs *attrs,
                        TPM2_CC        command_code)
 {
-    int i;
+    CommandAttrsTable *table;
+    UINT32 index;
 
-    for (i = 0; i < attrs->count; ++i)
-        if (TPM2_CC_FROM_TPMA_CC (attrs->command_attrs[i]) == command_code)
-            return attrs->command_attrs[i];
+    if (command_code & ~(TPM2_CC)(TPMA_CC_V | TPMA_CC_COMMANDINDEX))
+        return (TPMA_CC) { 0 };
+    if (command_code & TPMA_CC_V)
+        table = &attrs->vendor_table;
+    else
+        table = &attrs->spec_table;
+    /* commandIndex below 'first' wraps around to a large index */
+    index = (command_code & TPMA_CC_COMMANDINDEX) - table->first;
+    if (index >= table->size)
+        return (TPMA_CC) { 0 };
 
-    return (TPMA_CC) { 0 };}
+    return table->attrs [index];
+}
@@ -40,10 +40,23 @@ typedef struct _CommandAttrsClass {
     GObjectClass    parent;
 } CommandAttrsClass;
 
+/*
+ * TPMA_CCs indexed by their commandIndex less the lowest commandIndex in
+ * the table. Indexes in the range that the TPM doesn't implement hold 0.
+ */
+typedef struct {
+    TPMA_CC               *attrs;
+    UINT16                 first;
+    guint                  size;
+} CommandAttrsTable;
+
 typedef struct _CommandAttrs {
     GObject                parent_instance;
     TPMA_CC               *command_attrs;
     UINT32                 count;
+    /* commands defined by the spec and vendor commands (TPMA_CC V bit) */
+    CommandAttrsTable      spec_table;
+    CommandAttrsTable      vendor_table;
 } CommandAttrs;
 
 #include "access-broker.h"
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <glib.h>
+#include <inttypes.h>
+
+#include "command-parser.h"
+#include "connection.h"
+#include "tpm2-command.h"
+#include "tpm2-response.h"
+
+G_DEFINE_TYPE (CommandParser, command_parser, TYPE_PARALLEL_STAGE);
+
+static void
+command_parser_init (CommandParser *parser)
+{ /* noop */ }
+/*
+ * Implement the ParallelStage 'process' function. Each Tpm2Command is
+ * parsed and checked before it reaches the ResourceManager. Commands that
+ * are malformed are answered here with a Tpm2Response carrying the RC the
+ * TPM would have returned. The ResourceManager passes these responses
+ * straight through to the client.
+ */
+GObject*
+command_parser_process (ParallelStage *stage,
+                        GObject       *obj)
+{
+    Tpm2Command *command;
+    Connection *connection;
+    Tpm2Response *response;
+    TSS2_RC rc;
+
+    if (!IS_TPM2_COMMAND (obj)) {
+        return g_object_ref (obj);
+    }
+    command = TPM2_COMMAND (obj);
+    rc = tpm2_command_parse (command);
+    if (rc == TSS2_RC_SUCCESS) {
+        return g_object_ref (obj);
+    }
+    g_info ("%s: Tpm2Command 0x%" PRIxPTR " is malformed: 0x%" PRIx32,
+            __func__, (uintptr_t)command, rc);
+    connection = tpm2_command_get_connection (command);
+    response = tpm2_response_new_rc (connection, rc);
+    g_object_unref (connection);
+
+    return G_OBJECT (response);
+}
+/**
+ * GObject class initialization function.
+ */
+static void
+command_parser_class_init (CommandParserClass *klass)
+{
+    ParallelStageClass *stage_class = PARALLEL_STAGE_CLASS (klass);
+
+    if (command_parser_parent_class == NULL)
+        command_parser_parent_class = g_type_class_peek_parent (klass);
+    stage_class->process = command_parser_process;
+}
+/**
+ * Create a new CommandParser checking commands with 'workers' threads.
+ */
+CommandParser*
+command_parser_new (guint workers)
+{
+    return COMMAND_PARSER (g_object_new (TYPE_COMMAND_PARSER,
+                                         "workers", workers,
+                                         NULL));
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "parallel-stage.h"
+
+G_BEGIN_DECLS
+
+typedef struct _CommandParserClass {
+    ParallelStageClass parent;
+} CommandParserClass;
+
+typedef struct _CommandParser {
+    ParallelStage      parent_instance;
+} CommandParser;
+
+#define TYPE_COMMAND_PARSER              (command_parser_get_type ())
+#define COMMAND_PARSER(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_COMMAND_PARSER, CommandParser))
+#define COMMAND_PARSER_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_COMMAND_PARSER, CommandParserClass))
+#define IS_COMMAND_PARSER(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_COMMAND_PARSER))
+#define IS_COMMAND_PARSER_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_COMMAND_PARSER))
+#define COMMAND_PARSER_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_COMMAND_PARSER, CommandParserClass))
+
+GType           command_parser_get_type      (void);
+CommandParser*  command_parser_new           (guint           workers);
+GObject*        command_parser_process       (ParallelStage  *stage,
+                                              GObject        *obj);
+
+G_END_DECLS
+#endif /* COMMAND_PARSER_H */
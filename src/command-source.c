@@ -32,12 +32,15 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "buffer-pool.h"
 #include "connection.h"
 #include "connection-manager.h"
 #include "command-source.h"
 #include "source-interface.h"
+#include "tabrmd.h"
 #include "tpm2-command.h"
 #include "tpm2-header.h"
+#include "tpm2-response.h"
 #include "util.h"
 
 enum {
@@ -86,6 +89,12 @@ static void
 source_data_free (gpointer data)
 {
     source_data_t *source_data = (source_data_t*)data;
+
+    if (source_data->paused) {
+        g_queue_unlink (&source_data->self->paused_queue,
+                        &source_data->paused_link);
+    }
+    g_object_unref (source_data->connection);
     g_object_unref (source_data->cancellable);
     g_source_unref (source_data->source);
     g_free (source_data);
@@ -112,6 +121,7 @@ command_source_init (CommandSource *source)
                                g_direct_equal,
                                g_object_unref,
                                source_data_free);
+    g_queue_init (&source->paused_queue);
 }
 
 G_DEFINE_TYPE_WITH_CODE (
@@ -179,6 +189,145 @@ command_source_get_property (GObject      *object,
         break;
     }
 }
+/*
+ * Create a GSource to watch 'istream' for input and attach it to our
+ * GMainContext. The source is kept in the source_data_t structure.
+ */
+static void
+command_source_watch (CommandSource        *self,
+                      GPollableInputStream *istream,
+                      source_data_t        *data)
+{
+    data->source = g_pollable_input_stream_create_source (istream,
+                                                          data->cancellable);
+    g_source_set_callback (data->source,
+                           (GSourceFunc)command_source_on_input_ready,
+                           data,
+                           NULL);
+    /* we ignore the ID returned since we keep a reference to the source around */
+    g_source_attach (data->source, self->main_context);
+}
+/*
+ * Returns TRUE if the connection, or all connections together, have as
+ * many commands in flight as we allow. A limit of 0 means no limit.
+ */
+static gboolean
+command_source_over_limit (CommandSource *self,
+                           Connection    *connection)
+{
+    if (self->in_flight_max > 0 &&
+        connection_get_in_flight (connection) >= self->in_flight_max)
+    {
+        return TRUE;
+    }
+    if (self->in_flight_total_max > 0 &&
+        (guint)g_atomic_int_get (&self->in_flight) >= self->in_flight_total_max)
+    {
+        return TRUE;
+    }
+    return FALSE;
+}
+/*
+ * Invoked on the GMainLoop thread after responses have been sent while
+ * connections were paused. Start watching each paused connection that's
+ * back under its limits. Only the paused connections are visited, not
+ * every connection we're watching. A connection is only removed from the
+ * ConnectionManager once we've read EOF from it, which can't happen while
+ * it's paused.
+ */
+static gboolean
+command_source_resume (gpointer user_data)
+{
+    CommandSource *self = COMMAND_SOURCE (user_data);
+    source_data_t *data;
+    GList *link, *next;
+
+    g_atomic_int_set (&self->resume_pending, 0);
+    for (link = self->paused_queue.head; link != NULL; link = next) {
+        next = link->next;
+        data = (source_data_t*)link->data;
+        if (command_source_over_limit (self, data->connection)) {
+            continue;
+        }
+        g_debug ("%s: resuming Connection 0x%" PRIxPTR, __func__,
+                 (uintptr_t)data->connection);
+        g_queue_unlink (&self->paused_queue, link);
+        g_source_unref (data->source);
+        command_source_watch (self,
+                              G_POLLABLE_INPUT_STREAM (connection_key_istream (data->connection)),
+                              data);
+        data->paused = FALSE;
+        g_atomic_int_add (&self->paused, -1);
+    }
+    return G_SOURCE_REMOVE;
+}
+/*
+ * Connected to the ResponseSink 'response-sent' signal. The command the
+ * response answers is no longer in flight. If connections are paused we
+ * have the GMainLoop thread check whether they can be resumed.
+ */
+void
+command_source_on_response_sent (Sink          *sink,
+                                 Connection    *connection,
+                                 CommandSource *source)
+{
+    connection_in_flight_dec (connection);
+    g_atomic_int_add (&source->in_flight, -1);
+    if (g_atomic_int_get (&source->paused) > 0 &&
+        g_atomic_int_compare_and_exchange (&source->resume_pending, 0, 1))
+    {
+        g_main_context_invoke (source->main_context,
+                               command_source_resume,
+                               source);
+    }
+}
+/*
+ * Limit the number of commands read from a single connection, and from
+ * all connections, that haven't been answered yet. Once a limit is reached
+ * we stop reading from the connection so the socket buffers fill and the
+ * client blocks. 0 disables a limit.
+ */
+void
+command_source_set_in_flight_max (CommandSource *source,
+                                  guint          per_connection,
+                                  guint          total)
+{
+    source->in_flight_max = per_connection;
+    source->in_flight_total_max = total;
+}
+/*
+ * Handle the commands with TCTI_TABRMD_CC_* codes that the daemon handles
+ * itself. These are handled on the GMainLoop thread as soon as they're
+ * read so that a cancel overtakes the commands it's canceling. Returns the
+ * response to send to the client or NULL if there's none.
+ */
+static Tpm2Response*
+command_source_control (CommandSource *self,
+                        Connection    *connection,
+                        guint8        *buf,
+                        size_t         buf_size)
+{
+    switch (get_command_code (buf)) {
+    case TCTI_TABRMD_CC_CANCEL:
+        g_debug ("%s: canceling commands from Connection 0x%" PRIxPTR,
+                 __func__, (uintptr_t)connection);
+        connection_manager_cancel (self->connection_manager, connection);
+        return NULL;
+    case TCTI_TABRMD_CC_SET_TIMEOUT:
+        if (buf_size != TPM_HEADER_SIZE + sizeof (UINT32)) {
+            return tpm2_response_new_rc (connection,
+                                         TSS2_RESMGR_RC_BAD_VALUE);
+        }
+        connection_set_timeout (connection,
+                                be32toh (*(UINT32*)&buf [TPM_HEADER_SIZE]));
+        g_debug ("%s: Connection 0x%" PRIxPTR " command timeout set to "
+                 "%ums", __func__, (uintptr_t)connection,
+                 connection_get_timeout (connection));
+        return tpm2_response_new_rc (connection, TSS2_RC_SUCCESS);
+    default:
+        g_assert_not_reached ();
+    }
+}
 /*
  * This function is invoked by the GMainLoop thread when a client GSocket has
  * data ready. This is what makes the CommandSource a source (of Tpm2Commands).
@@ -196,61 +345,81 @@ command_source_on_input_ready (GInputStream *istream,
                                gpointer      user_data)
 {
     source_data_t *data = (source_data_t*)user_data;
-    Connection    *connection;
-    Tpm2Command   *command;
+    Connection    *connection = data->connection;
+    GObject       *obj;
     TPMA_CC        attributes = { 0 };
     uint8_t       *buf;
     size_t         buf_size;
 
     g_debug ("%s: GInputStream: 0x%" PRIxPTR ", CommandSource: 0x%" PRIxPTR,
              __func__, (uintptr_t)istream, (uintptr_t)data->self);
-    connection =
-        connection_manager_lookup_istream (data->self->connection_manager,
-                                           istream);
-    if (connection == NULL) {
-        g_error ("failed to get connection associated with istream: 0x%"
-                 PRIxPTR, (uintptr_t)istream);
-    } else {
-        g_debug ("connection_manager_lookup_socket for socket: 0x%" PRIxPTR
-                 ", connection: 0x%" PRIxPTR, (uintptr_t)istream,
-                 (uintptr_t)connection);
-    }
     buf = read_tpm_buffer_alloc (istream, &buf_size);
     if (buf == NULL) {
         goto fail_out;
     }
-    attributes = command_attrs_from_cc (data->self->command_attrs,
-                                        get_command_code (buf));
-    command = tpm2_command_new (connection, buf, buf_size, attributes);
-    if (command != NULL) {
-        sink_enqueue (data->self->sink, G_OBJECT (command));
+    switch (get_command_code (buf)) {
+    case TCTI_TABRMD_CC_CANCEL:
+    case TCTI_TABRMD_CC_SET_TIMEOUT:
+        obj = (GObject*)command_source_control (data->self,
+                                                connection,
+                                                buf,
+                                                buf_size);
+        buffer_pool_free (buf);
+        break;
+    default:
+        attributes = command_attrs_from_cc (data->self->command_attrs,
+                                            get_command_code (buf));
+        obj = (GObject*)tpm2_command_new (connection,
+                                          buf,
+                                          buf_size,
+                                          attributes);
+        break;
+    }
+    if (obj != NULL) {
+        /* count before enqueuing, the response may be sent before it returns */
+        connection_in_flight_inc (connection);
+        g_atomic_int_inc (&data->self->in_flight);
+        sink_enqueue (data->self->sink, obj);
         /* the sink now owns this message */
-        g_object_unref (command);
-    } else {
-        goto fail_out;
+        g_object_unref (obj);
+    }
+    if (command_source_over_limit (data->self, connection)) {
+        /*
+         * Mark the connection paused before checking the limit again. A
+         * response sent in between either sees it paused and schedules a
+         * resume or we see the lower count here.
+         */
+        data->paused = TRUE;
+        g_queue_push_tail_link (&data->self->paused_queue, &data->paused_link);
+        g_atomic_int_inc (&data->self->paused);
+        if (command_source_over_limit (data->self, connection)) {
+            g_debug ("%s: pausing Connection 0x%" PRIxPTR " with %u "
+                     "commands in flight", __func__, (uintptr_t)connection,
+                     connection_get_in_flight (connection));
+            return G_SOURCE_REMOVE;
+        }
+        data->paused = FALSE;
+        g_queue_unlink (&data->self->paused_queue, &data->paused_link);
+        g_atomic_int_add (&data->self->paused, -1);
     }
-    g_object_unref (connection);
     return G_SOURCE_CONTINUE;
 fail_out:
-    if (buf != NULL) {
-        g_free (buf);
-    }
     g_debug ("removing connection 0x%" PRIxPTR " from connection_manager "
              "0x%" PRIxPTR,
              (uintptr_t)connection,
              (uintptr_t)data->self->connection_manager);
     connection_manager_remove (data->self->connection_manager,
                                connection);
-    g_debug ("%s: unref Connection: 0x%" PRIxPTR, __func__, (uintptr_t)connection);
-    g_object_unref (connection);
     /*
      * Remove data from hash table which includes the GCancellable associated
-     * with the G_IN_IO condition source. Don't call the cancellable though
+     * with the G_IN_IO condition source and our reference to the
+     * Connection. Don't call the cancellable though
      * since we're letting this source die at the end of this function
      * (returning FALSE).
      */
     g_debug ("%s: reomvingunref GCancellable: 0x%" PRIxPTR, __func__, (uintptr_t)data->cancellable);
-    g_hash_table_remove (data->self->istream_to_source_data_map, istream);
+    g_hash_table_remove (data->self->istream_to_source_data_map,
+                         connection_key_istream (connection));
     return G_SOURCE_REMOVE;
 }
 /*
@@ -277,15 +446,10 @@ command_source_on_new_connection (ConnectionManager   *connection_manager,
     g_object_ref (istream);
     data = g_malloc0 (sizeof (source_data_t));
     data->cancellable = g_cancellable_new ();
-    data->source = g_pollable_input_stream_create_source (istream,
-                                                          data->cancellable);
-    /* we ignore the ID returned since we keep a reference to the source around */
-    g_source_attach (data->source, self->main_context);
     data->self = self;
-    g_source_set_callback (data->source,
-                           (GSourceFunc)command_source_on_input_ready,
-                           data,
-                           NULL);
+    data->connection = g_object_ref (connection);
+    data->paused_link.data = data;
+    command_source_watch (self, istream, data);
     /*
      * To stop watching this socket for G_IO_IN condition use this GHashTable
      * to look up the GCancellable object. The hash table takes ownership of
@@ -54,7 +54,13 @@ typedef struct _CommandSource {
     GMainContext      *main_context;
     GMainLoop         *main_loop;
     GHashTable        *istream_to_source_data_map;
+    GQueue             paused_queue;
     Sink              *sink;
+    guint              in_flight_max;
+    guint              in_flight_total_max;
+    gint               in_flight;
+    gint               paused;
+    gint               resume_pending;
 } CommandSource;
 
 #define TYPE_COMMAND_SOURCE              (command_source_get_type   ())
@@ -70,6 +76,12 @@ CommandSource*  command_source_new               (ConnectionManager  *connection
 gint            command_source_on_new_connection (ConnectionManager  *connection_manager,
                                                   Connection         *connection,
                                                   CommandSource      *command_source);
+void            command_source_set_in_flight_max (CommandSource      *source,
+                                                  guint               per_connection,
+                                                  guint               total);
+void            command_source_on_response_sent  (Sink               *sink,
+                                                  Connection         *connection,
+                                                  CommandSource      *source);
 /*
  * The following are private functions. They are exposed here for unit
  * testing. Do not call these from anywhere else.
@@ -92,11 +104,20 @@ gboolean        command_source_on_input_ready    (GInputStream       *socket,
  *   around.
  * - When the CommandSource is destroyed all of the GSources registered with
  *   the GMainContext/Loop must be canceled and freed (see dispose function).
+ * - The structure holds a reference to the Connection so reading from it
+ *   needs no lookup in the ConnectionManager.
+ * - When a connection has too many commands in flight its GSource is
+ *   destroyed, 'paused' is set and 'paused_link' is put on the
+ *   CommandSource 'paused_queue'. A new GSource is created when enough
+ *   responses have been sent.
  */
 typedef struct {
     CommandSource *self;
+    Connection    *connection;
     GCancellable  *cancellable;
     GSource       *source;
+    gboolean       paused;
+    GList          paused_link;
 } source_data_t;
 
 
@@ -35,7 +35,6 @@
 
 #include "connection-manager.h"
 
-#define MAX_CONNECTIONS 100
 #define MAX_CONNECTIONS_DEFAULT 27
 
 G_DEFINE_TYPE (ConnectionManager, connection_manager, G_TYPE_OBJECT);
@@ -44,6 +43,7 @@ enum {
     SIGNAL_0,
     SIGNAL_NEW_CONNECTION,
     SIGNAL_CONNECTION_REMOVED,
+    SIGNAL_CONNECTION_CANCELED,
     N_SIGNALS,
 };
 
@@ -109,49 +109,113 @@ connection_manager_new (guint max_connections)
                                              "max-connections", max_connections,
                                              NULL));
 }
+/*
+ * Select the shard for a key from its hash. The hash of a pointer or of a
+ * random ID may not vary in the low bits so the shard is taken from the
+ * high bits of a multiplicative hash.
+ */
+static ConnectionManagerShard*
+connection_manager_shard (ConnectionManagerShard *shards,
+                          guint                   hash)
+{
+    return &shards [(hash * 2654435761u) >> (32 - CONNECTION_MANAGER_SHARD_BITS)];
+}
+static ConnectionManagerShard*
+connection_manager_istream_shard (ConnectionManager *manager,
+                                  gconstpointer      istream)
+{
+    return connection_manager_shard (manager->istream_shards,
+                                     g_direct_hash (istream));
+}
+static ConnectionManagerShard*
+connection_manager_id_shard (ConnectionManager *manager,
+                             gconstpointer      id)
+{
+    return connection_manager_shard (manager->id_shards,
+                                     g_int64_hash (id));
+}
+static void
+connection_manager_shard_init (ConnectionManagerShard *shard,
+                               GHashTable             *table)
+{
+    gint ret;
+
+    ret = pthread_rwlock_init (&shard->lock, NULL);
+    if (ret != 0)
+        g_error ("Failed to initialize connection_manager lock: %s",
+                 strerror (ret));
+    shard->table = table;
+}
+static void
+connection_manager_shard_rdlock (ConnectionManagerShard *shard)
+{
+    gint ret;
+
+    ret = pthread_rwlock_rdlock (&shard->lock);
+    if (ret != 0)
+        g_error ("Error locking connection_manager shard: %s",
+                 strerror (ret));
+}
+static void
+connection_manager_shard_wrlock (ConnectionManagerShard *shard)
+{
+    gint ret;
+
+    ret = pthread_rwlock_wrlock (&shard->lock);
+    if (ret != 0)
+        g_error ("Error locking connection_manager shard: %s",
+                 strerror (ret));
+}
+static void
+connection_manager_shard_unlock (ConnectionManagerShard *shard)
+{
+    gint ret;
+
+    ret = pthread_rwlock_unlock (&shard->lock);
+    if (ret != 0)
+        g_error ("Error unlocking connection_manager shard: %s",
+                 strerror (ret));
+}
 /*
  * Initialization function: instantiate all internal data / objects.
  */
 static void
 connection_manager_init (ConnectionManager *mgr)
 {
-    if (pthread_mutex_init (&mgr->mutex, NULL) != 0)
-        g_error ("Failed to initialize connection _manager mutex: %s",
-                 strerror (errno));
-    /* These two data structures must be kept in sync. When the
+    guint i;
+
+    /* These two sets of tables must be kept in sync. When the
      * connection-manager object is destoryed the Connection objects in these
      * hash tables will be free'd by the g_object_unref function. We only
-     * set this for one of the hash tables because we only want to free
-     * each Connection object once.
+     * set this for the ID tables because we only want to free each
+     * Connection object once.
      */
-    mgr->connection_from_istream_table =
-        g_hash_table_new_full (g_direct_hash,
-                               g_direct_equal,
-                               NULL,
-                               NULL);
-    mgr->connection_from_id_table =
-        g_hash_table_new_full (g_int64_hash,
-                               g_int64_equal,
-                               NULL,
-                               (GDestroyNotify)g_object_unref);
+    for (i = 0; i < CONNECTION_MANAGER_SHARDS; ++i) {
+        connection_manager_shard_init (&mgr->istream_shards [i],
+                                       g_hash_table_new (g_direct_hash,
+                                                         g_direct_equal));
+        connection_manager_shard_init (&mgr->id_shards [i],
+                                       g_hash_table_new_full (g_int64_hash,
+                                                              g_int64_equal,
+                                                              NULL,
+                                                              (GDestroyNotify)g_object_unref));
+    }
 }
 
 static void
 connection_manager_dispose (GObject *obj)
 {
     ConnectionManager *self = CONNECTION_MANAGER (obj);
-    gint ret;
+    guint i;
 
-    ret = pthread_mutex_lock (&self->mutex);
-    if (ret != 0)
-        g_warning ("Error locking connection_manager mutex: %s",
-                   strerror (errno));
-    g_hash_table_unref (self->connection_from_istream_table);
-    g_hash_table_unref (self->connection_from_id_table);
-    ret = pthread_mutex_unlock (&self->mutex);
-    if (ret != 0)
-        g_error ("Error unlocking connection_manager mutex: %s",
-                 strerror (errno));
+    for (i = 0; i < CONNECTION_MANAGER_SHARDS; ++i) {
+        connection_manager_shard_wrlock (&self->istream_shards [i]);
+        g_clear_pointer (&self->istream_shards [i].table, g_hash_table_unref);
+        connection_manager_shard_unlock (&self->istream_shards [i]);
+        connection_manager_shard_wrlock (&self->id_shards [i]);
+        g_clear_pointer (&self->id_shards [i].table, g_hash_table_unref);
+        connection_manager_shard_unlock (&self->id_shards [i]);
+    }
     G_OBJECT_CLASS (connection_manager_parent_class)->dispose (obj);
 }
 
@@ -159,10 +223,17 @@ static void
 connection_manager_finalize (GObject *obj)
 {
     ConnectionManager *manager = CONNECTION_MANAGER (obj);
+    guint i;
+    gint ret;
 
-    if (pthread_mutex_destroy (&manager->mutex) != 0)
-        g_error ("Error destroying connection_manager mutex: %s",
-                 strerror (errno));
+    for (i = 0; i < CONNECTION_MANAGER_SHARDS; ++i) {
+        ret = pthread_rwlock_destroy (&manager->istream_shards [i].lock);
+        if (ret == 0)
+            ret = pthread_rwlock_destroy (&manager->id_shards [i].lock);
+        if (ret != 0)
+            g_error ("Error destroying connection_manager lock: %s",
+                     strerror (ret));
+    }
     G_OBJECT_CLASS (connection_manager_parent_class)->finalize (obj);
 }
 /**
@@ -211,12 +282,28 @@ connection_manager_class_init (ConnectionManagerClass *klass)
                       G_TYPE_NONE,
                       1,
                       TYPE_CONNECTION);
+    /*
+     * This signal is emitted when a client cancels its outstanding
+     * commands. Commands still queued are dropped when they're dequeued,
+     * subscribers deal with the one the TPM may be running.
+     */
+    signals [SIGNAL_CONNECTION_CANCELED] =
+        g_signal_new ("connection-canceled",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      NULL,
+                      NULL,
+                      NULL,
+                      G_TYPE_NONE,
+                      1,
+                      TYPE_CONNECTION);
     obj_properties [PROP_MAX_CONNECTIONS] =
         g_param_spec_uint ("max-connections",
                            "max connections",
                            "Maximum nunmber of concurrent client connections",
                            0,
-                           MAX_CONNECTIONS,
+                           G_MAXINT,
                            MAX_CONNECTIONS_DEFAULT,
                            G_PARAM_READWRITE);
     g_object_class_install_properties (object_class,
@@ -224,38 +311,57 @@ connection_manager_class_init (ConnectionManagerClass *klass)
                                        obj_properties);
 }
 
+/*
+ * Count a new connection against 'max_connections'. Returns FALSE if the
+ * manager is full.
+ */
+static gboolean
+connection_manager_reserve (ConnectionManager *manager)
+{
+    gint size;
+
+    do {
+        size = g_atomic_int_get (&manager->size);
+        if ((guint)size >= manager->max_connections) {
+            return FALSE;
+        }
+    } while (!g_atomic_int_compare_and_exchange (&manager->size,
+                                                 size,
+                                                 size + 1));
+    return TRUE;
+}
 gint
 connection_manager_insert (ConnectionManager    *manager,
                            Connection        *connection)
 {
+    ConnectionManagerShard *shard;
     gint ret;
 
-    ret = pthread_mutex_lock (&manager->mutex);
-    if (ret != 0)
-        g_error ("Error locking connection_manager mutex: %s",
-                 strerror (errno));
-    if (connection_manager_is_full (manager)) {
+    if (!connection_manager_reserve (manager)) {
         g_warning ("connection_manager: 0x%" PRIxPTR " max_connections of %u exceeded",
                    (uintptr_t)manager, manager->max_connections);
-        pthread_mutex_unlock (&manager->mutex);
         return -1;
     }
     /*
      * Increase reference count on Connection object on insert. The
-     * corresponding call to g_hash_table_remove will cause the reference
-     * count to be decreased (see g_hash_table_new_full).
+     * corresponding call to g_hash_table_remove on the ID table will cause
+     * the reference count to be decreased (see g_hash_table_new_full).
      */
     g_object_ref (connection);
-    g_hash_table_insert (manager->connection_from_istream_table,
+    shard = connection_manager_istream_shard (manager,
+                                              connection_key_istream (connection));
+    connection_manager_shard_wrlock (shard);
+    g_hash_table_insert (shard->table,
                          connection_key_istream (connection),
                          connection);
-    g_hash_table_insert (manager->connection_from_id_table,
+    connection_manager_shard_unlock (shard);
+    shard = connection_manager_id_shard (manager,
+                                         connection_key_id (connection));
+    connection_manager_shard_wrlock (shard);
+    g_hash_table_insert (shard->table,
                          connection_key_id (connection),
                          connection);
-    ret = pthread_mutex_unlock (&manager->mutex);
-    if (ret != 0)
-        g_error ("Error unlocking connection_manager mutex: %s",
-                 strerror (errno));
+    connection_manager_shard_unlock (shard);
     /* not sure what to do about reference count on SEssionData obj */
     g_signal_emit (manager,
                    signals [SIGNAL_NEW_CONNECTION],
@@ -274,17 +380,18 @@ Connection*
 connection_manager_lookup_istream (ConnectionManager *manager,
                                    GInputStream      *istream)
 {
+    ConnectionManagerShard *shard;
     Connection *connection;
 
-    pthread_mutex_lock (&manager->mutex);
-    connection = g_hash_table_lookup (manager->connection_from_istream_table,
-                                      istream);
+    shard = connection_manager_istream_shard (manager, istream);
+    connection_manager_shard_rdlock (shard);
+    connection = g_hash_table_lookup (shard->table, istream);
     if (connection != NULL) {
         g_object_ref (connection);
     } else {
         g_warning ("%s returned NULL connection", __func__);
     }
-    pthread_mutex_unlock (&manager->mutex);
+    connection_manager_shard_unlock (shard);
 
     return connection;
 }
@@ -298,20 +405,18 @@ Connection*
 connection_manager_lookup_id (ConnectionManager   *manager,
                               gint64               id)
 {
+    ConnectionManagerShard *shard;
     Connection *connection;
 
-    g_debug ("locking manager mutex");
-    pthread_mutex_lock (&manager->mutex);
-    g_debug ("g_hash_table_lookup: connection_from_id_table");
-    connection = g_hash_table_lookup (manager->connection_from_id_table,
-                                      &id);
+    shard = connection_manager_id_shard (manager, &id);
+    connection_manager_shard_rdlock (shard);
+    connection = g_hash_table_lookup (shard->table, &id);
     if (connection != NULL) {
         g_object_ref (connection);
     } else {
         g_warning ("connection_manager_lookup_id returned NULL connection");
     }
-    g_debug ("unlocking manager mutex");
-    pthread_mutex_unlock (&manager->mutex);
+    connection_manager_shard_unlock (shard);
 
     return connection;
 }
@@ -320,57 +425,87 @@ gboolean
 connection_manager_contains_id (ConnectionManager *manager,
                                 gint64             id)
 {
-    return g_hash_table_contains (manager->connection_from_id_table, &id);
+    ConnectionManagerShard *shard;
+    gboolean ret;
+
+    shard = connection_manager_id_shard (manager, &id);
+    connection_manager_shard_rdlock (shard);
+    ret = g_hash_table_contains (shard->table, &id);
+    connection_manager_shard_unlock (shard);
+
+    return ret;
 }
 
 gboolean
 connection_manager_remove (ConnectionManager   *manager,
                            Connection          *connection)
 {
+    ConnectionManagerShard *shard;
     gboolean ret;
 
     g_debug ("connection_manager 0x%" PRIxPTR " removing Connection 0x%" PRIxPTR,
              (uintptr_t)manager, (uintptr_t)connection);
-    pthread_mutex_lock (&manager->mutex);
-    ret = g_hash_table_remove (manager->connection_from_istream_table,
+    /* the ID table holds the reference, keep it until we're done */
+    g_object_ref (connection);
+    shard = connection_manager_istream_shard (manager,
+                                              connection_key_istream (connection));
+    connection_manager_shard_wrlock (shard);
+    ret = g_hash_table_remove (shard->table,
                                connection_key_istream (connection));
+    connection_manager_shard_unlock (shard);
     if (ret != TRUE)
         g_error ("failed to remove Connection 0x%" PRIxPTR " from g_hash_table "
                  "0x%" PRIxPTR "using key 0x%" PRIxPTR, (uintptr_t)connection,
-                 (uintptr_t)manager->connection_from_istream_table,
+                 (uintptr_t)shard->table,
                  (uintptr_t)connection_key_istream (connection));
-    ret = g_hash_table_remove (manager->connection_from_id_table,
+    shard = connection_manager_id_shard (manager,
+                                         connection_key_id (connection));
+    connection_manager_shard_wrlock (shard);
+    ret = g_hash_table_remove (shard->table,
                                connection_key_id (connection));
+    connection_manager_shard_unlock (shard);
     if (ret != TRUE)
         g_error ("failed to remove Connection 0x%" PRIxPTR " from g_hash_table "
                  "0x%" PRIxPTR " using key %" PRIxPTR, (uintptr_t)connection,
-                 (uintptr_t)manager->connection_from_istream_table,
+                 (uintptr_t)shard->table,
                  (uintptr_t)connection_key_id (connection));
-    pthread_mutex_unlock (&manager->mutex);
+    g_atomic_int_add (&manager->size, -1);
     g_signal_emit (manager,
                    signals [SIGNAL_CONNECTION_REMOVED],
                    0,
                    connection,
                    NULL);
+    g_object_unref (connection);
 
     return ret;
 }
+/*
+ * Cancel the commands from 'connection' that have been read but not yet
+ * answered (see connection_cancel) and let subscribers know so that a
+ * command already running on the TPM can be aborted too.
+ */
+void
+connection_manager_cancel (ConnectionManager   *manager,
+                           Connection          *connection)
+{
+    g_debug ("connection_manager 0x%" PRIxPTR " canceling Connection 0x%"
+             PRIxPTR, (uintptr_t)manager, (uintptr_t)connection);
+    connection_cancel (connection);
+    g_signal_emit (manager,
+                   signals [SIGNAL_CONNECTION_CANCELED],
+                   0,
+                   connection,
+                   NULL);
+}
 
 guint
 connection_manager_size (ConnectionManager   *manager)
 {
-    return g_hash_table_size (manager->connection_from_istream_table);
+    return (guint)g_atomic_int_get (&manager->size);
 }
 
 gboolean
 connection_manager_is_full (ConnectionManager *manager)
 {
-    guint table_size;
-
-    table_size = g_hash_table_size (manager->connection_from_istream_table);
-    if (table_size < manager->max_connections) {
-        return FALSE;
-    } else {
-        return TRUE;
-    }
+    return connection_manager_size (manager) >= manager->max_connections;
 }
@@ -34,17 +34,27 @@
 
 G_BEGIN_DECLS
 
-#define CONNECTION_MANAGER_MAX 100
+/*
+ * Connections are spread over 2^CONNECTION_MANAGER_SHARD_BITS tables per
+ * key so that lookups of different connections rarely take the same lock.
+ */
+#define CONNECTION_MANAGER_SHARD_BITS 4
+#define CONNECTION_MANAGER_SHARDS     (1 << CONNECTION_MANAGER_SHARD_BITS)
 
 typedef struct _ConnectionManagerClass {
     GObjectClass      parent;
 } ConnectionManagerClass;
 
+typedef struct {
+    pthread_rwlock_t  lock;
+    GHashTable       *table;
+} ConnectionManagerShard;
+
 typedef struct _ConnectionManager {
     GObject           parent_instance;
-    pthread_mutex_t   mutex;
-    GHashTable       *connection_from_istream_table;
-    GHashTable       *connection_from_id_table;
+    ConnectionManagerShard istream_shards [CONNECTION_MANAGER_SHARDS];
+    ConnectionManagerShard id_shards [CONNECTION_MANAGER_SHARDS];
+    gint              size;
     guint             max_connections;
 } ConnectionManager;
 
@@ -66,6 +76,8 @@ gint           connection_manager_insert      (ConnectionManager  *manager,
                                                Connection         *connection);
 gint           connection_manager_remove      (ConnectionManager  *manager,
                                                Connection         *connection);
+void           connection_manager_cancel      (ConnectionManager  *manager,
+                                               Connection         *connection);
 Connection*    connection_manager_lookup_istream (ConnectionManager  *manager,
                                                   GInputStream       *istream);
 Connection*    connection_manager_lookup_id   (ConnectionManager  *manager,
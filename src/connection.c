@@ -42,6 +42,7 @@ enum {
     PROP_ID,
     PROP_IO_STREAM,
     PROP_TRANSIENT_HANDLE_MAP,
+    PROP_IDENTITY,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
@@ -73,6 +74,12 @@ connection_set_property (GObject       *object,
                   PRIxPTR, (uintptr_t)self,
                   (uintptr_t)self->transient_handle_map);
         break;
+    case PROP_IDENTITY:
+        g_free (self->identity);
+        self->identity = g_value_dup_string (value);
+        g_debug ("Connection 0x%" PRIxPTR " set identity to %s",
+                 (uintptr_t)self, self->identity);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -97,6 +104,9 @@ connection_get_property (GObject     *object,
     case PROP_TRANSIENT_HANDLE_MAP:
         g_value_set_object (value, self->transient_handle_map);
         break;
+    case PROP_IDENTITY:
+        g_value_set_string (value, self->identity);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -121,6 +131,15 @@ connection_dispose (GObject *obj)
     G_OBJECT_CLASS (connection_parent_class)->dispose (obj);
 }
 
+static void
+connection_finalize (GObject *obj)
+{
+    Connection *connection = CONNECTION (obj);
+
+    g_clear_pointer (&connection->identity, g_free);
+    G_OBJECT_CLASS (connection_parent_class)->finalize (obj);
+}
+
 static void
 connection_class_init (ConnectionClass *klass)
 {
@@ -131,6 +150,7 @@ connection_class_init (ConnectionClass *klass)
         connection_parent_class = g_type_class_peek_parent (klass);
 
     object_class->dispose      = connection_dispose;
+    object_class->finalize     = connection_finalize;
     object_class->get_property = connection_get_property;
     object_class->set_property = connection_set_property;
 
@@ -154,6 +174,14 @@ connection_class_init (ConnectionClass *klass)
                              "HandleMap object to map handles to transient object contexts",
                              G_TYPE_OBJECT,
                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_IDENTITY] =
+        g_param_spec_string ("identity",
+                             "client identity",
+                             "Identity of the client on the other end of the "
+                             "connection, used to look up its scheduling "
+                             "weight",
+                             NULL,
+                             G_PARAM_READWRITE);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
@@ -204,3 +232,100 @@ connection_get_trans_map (Connection *connection)
     g_object_ref (connection->transient_handle_map);
     return connection->transient_handle_map;
 }
+/*
+ * The identity of the client is a string like "pid:1234" for connections
+ * from the D-Bus frontend or "tls:127.0.0.1" for the TLS frontend. It's
+ * NULL until the frontend sets it.
+ */
+const gchar*
+connection_get_identity (Connection *connection)
+{
+    return connection->identity;
+}
+
+void
+connection_set_identity (Connection  *connection,
+                         const gchar *identity)
+{
+    g_object_set (G_OBJECT (connection), "identity", identity, NULL);
+}
+/*
+ * Count the commands from this connection that have been read but not yet
+ * answered. These may be called from any thread. Both return the new
+ * count.
+ */
+guint
+connection_in_flight_inc (Connection *connection)
+{
+    return (guint)g_atomic_int_add (&connection->in_flight, 1) + 1;
+}
+
+guint
+connection_in_flight_dec (Connection *connection)
+{
+    return (guint)g_atomic_int_add (&connection->in_flight, -1) - 1;
+}
+
+guint
+connection_get_in_flight (Connection *connection)
+{
+    return (guint)g_atomic_int_get (&connection->in_flight);
+}
+/*
+ * Count the transient objects and sessions belonging to this connection
+ * that the ResourceManager keeps loaded in the TPM. The RM updates it and
+ * the FairQueue reads it, so like the in flight count it's atomic rather
+ * than protected by either one's lock.
+ */
+guint
+connection_resident_inc (Connection *connection)
+{
+    return (guint)g_atomic_int_add (&connection->resident, 1) + 1;
+}
+
+guint
+connection_resident_dec (Connection *connection)
+{
+    return (guint)g_atomic_int_add (&connection->resident, -1) - 1;
+}
+
+guint
+connection_get_resident (Connection *connection)
+{
+    return (guint)g_atomic_int_get (&connection->resident);
+}
+/*
+ * Cancel every command from this connection that has been read but not
+ * yet answered. Each Tpm2Command records the cancel sequence number of its
+ * connection when it's created so bumping the counter is all it takes:
+ * commands created before the bump are canceled, those read after it
+ * aren't. These may be called from any thread.
+ */
+void
+connection_cancel (Connection *connection)
+{
+    g_atomic_int_inc (&connection->cancel_seq);
+}
+
+gint
+connection_get_cancel_seq (Connection *connection)
+{
+    return g_atomic_int_get (&connection->cancel_seq);
+}
+/*
+ * The time in milliseconds that commands from this connection may spend
+ * in the daemon before they're abandoned. 0, the default, is no limit.
+ * The timeout applies to commands read after it's set.
+ */
+void
+connection_set_timeout (Connection *connection,
+                        guint       timeout)
+{
+    g_atomic_int_set (&connection->timeout, timeout);
+}
+
+guint
+connection_get_timeout (Connection *connection)
+{
+    return (guint)g_atomic_int_get (&connection->timeout);
+}
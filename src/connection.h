@@ -44,6 +44,11 @@ typedef struct _Connection {
     GIOStream          *iostream;
     guint64             id;
     HandleMap          *transient_handle_map;
+    gchar              *identity;
+    gint                in_flight;
+    gint                resident;
+    gint                cancel_seq;
+    guint               timeout;
 } Connection;
 
 #define TYPE_CONNECTION              (connection_get_type ())
@@ -61,4 +66,18 @@ gpointer         connection_key_istream  (Connection      *session);
 gpointer         connection_key_id       (Connection      *session);
 GIOStream*       connection_get_iostream (Connection      *connection);
 HandleMap*       connection_get_trans_map(Connection      *session);
+const gchar*     connection_get_identity (Connection      *connection);
+void             connection_set_identity (Connection      *connection,
+                                          const gchar     *identity);
+guint            connection_in_flight_inc (Connection     *connection);
+guint            connection_in_flight_dec (Connection     *connection);
+guint            connection_get_in_flight (Connection     *connection);
+guint            connection_resident_inc (Connection      *connection);
+guint            connection_resident_dec (Connection      *connection);
+guint            connection_get_resident (Connection      *connection);
+void             connection_cancel       (Connection      *connection);
+gint             connection_get_cancel_seq (Connection    *connection);
+void             connection_set_timeout  (Connection      *connection,
+                                          guint            timeout);
+guint            connection_get_timeout  (Connection      *connection);
 #endif /* CONNECTION_H */
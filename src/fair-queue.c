@@ -0,0 +1,673 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fair-queue.h"
+#include "tpm2-command.h"
+
+/*
+ * The cost of a command is its expected execution time in microseconds.
+ * Commands that haven't been timed yet cost a single quantum. Under DRR
+ * each flow is credited with 'weight' quanta each time it comes up in the
+ * round, so a client with weight N gets N times the TPM time of a client
+ * with weight 1.
+ */
+#define FAIR_QUEUE_QUANTUM 10000
+/*
+ * Under SEJF each microsecond a command has waited takes this many
+ * microseconds off its expected cost, so expensive commands can't be
+ * starved by a steady stream of cheap ones.
+ */
+#define FAIR_QUEUE_SEJF_AGING 1
+/*
+ * Under AFFINITY a Connection keeps being served until its batch has used
+ * this much expected TPM time per unit of weight, or until a command from
+ * another Connection has waited this long.
+ */
+#define FAIR_QUEUE_AFFINITY_WINDOW 50000
+
+typedef struct {
+    GObject  *obj;
+    gint64    enqueue_time;
+    guint64   cost;
+} fair_queue_entry_t;
+/*
+ * A flow is the FIFO of pending objects from a single Connection. Flows are
+ * created when the first object from a Connection is enqueued and freed
+ * once they've been drained.
+ */
+typedef struct {
+    Connection  *connection;
+    GQueue      *queue;
+    guint        weight;
+    guint64      deficit;
+    gboolean     in_turn;
+    gint64       not_before;
+} fair_queue_flow_t;
+
+G_DEFINE_TYPE (FairQueue, fair_queue, G_TYPE_OBJECT);
+
+static fair_queue_entry_t*
+fair_queue_entry_new (GObject *obj,
+                      guint64  cost)
+{
+    fair_queue_entry_t *entry;
+
+    entry = calloc (1, sizeof (fair_queue_entry_t));
+    if (entry == NULL)
+        g_error ("%s: failed to allocate entry: %s", __func__,
+                 strerror (errno));
+    entry->obj = g_object_ref (obj);
+    entry->enqueue_time = g_get_monotonic_time ();
+    entry->cost = cost;
+    return entry;
+}
+static void
+fair_queue_entry_free (gpointer data)
+{
+    fair_queue_entry_t *entry = (fair_queue_entry_t*)data;
+
+    g_clear_object (&entry->obj);
+    free (entry);
+}
+static void
+fair_queue_flow_free (gpointer data)
+{
+    fair_queue_flow_t *flow = (fair_queue_flow_t*)data;
+
+    g_queue_free_full (flow->queue, fair_queue_entry_free);
+    g_clear_object (&flow->connection);
+    free (flow);
+}
+static void
+fair_queue_init (FairQueue *self)
+{
+    pthread_condattr_t attr;
+
+    self->control_queue = g_queue_new ();
+    self->active_flows = g_queue_new ();
+    self->delayed_flows = g_queue_new ();
+    self->flow_table = g_hash_table_new_full (g_direct_hash,
+                                              g_direct_equal,
+                                              NULL,
+                                              fair_queue_flow_free);
+    self->weight_table = g_hash_table_new_full (g_str_hash,
+                                                g_str_equal,
+                                                g_free,
+                                                NULL);
+    if (pthread_mutex_init (&self->mutex, NULL) != 0)
+        g_error ("Failed to initialize FairQueue mutex: %s",
+                 strerror (errno));
+    /* fair_queue_timed_dequeue waits on the clock g_get_monotonic_time uses */
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    if (pthread_cond_init (&self->cond, &attr) != 0)
+        g_error ("Failed to initialize FairQueue condition: %s",
+                 strerror (errno));
+    pthread_condattr_destroy (&attr);
+}
+/*
+ * Drop all queued objects. The active_flows and delayed_flows queues only
+ * hold pointers to flows owned by the flow_table.
+ */
+static void
+fair_queue_dispose (GObject *obj)
+{
+    FairQueue *queue = FAIR_QUEUE (obj);
+
+    if (queue->control_queue != NULL) {
+        g_queue_free_full (queue->control_queue, fair_queue_entry_free);
+        queue->control_queue = NULL;
+    }
+    g_clear_pointer (&queue->active_flows, g_queue_free);
+    g_clear_pointer (&queue->delayed_flows, g_queue_free);
+    g_clear_pointer (&queue->flow_table, g_hash_table_unref);
+    g_clear_pointer (&queue->weight_table, g_hash_table_unref);
+    g_clear_object (&queue->latency_table);
+    G_OBJECT_CLASS (fair_queue_parent_class)->dispose (obj);
+}
+static void
+fair_queue_finalize (GObject *obj)
+{
+    FairQueue *queue = FAIR_QUEUE (obj);
+
+    pthread_cond_destroy (&queue->cond);
+    pthread_mutex_destroy (&queue->mutex);
+    G_OBJECT_CLASS (fair_queue_parent_class)->finalize (obj);
+}
+static void
+fair_queue_class_init (FairQueueClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    object_class->dispose  = fair_queue_dispose;
+    object_class->finalize = fair_queue_finalize;
+}
+/*
+ * Allocate a new FairQueue using DRR. The LatencyTable may be NULL in
+ * which case all commands have the same cost. The caller owns the returned
+ * reference.
+ */
+FairQueue*
+fair_queue_new (LatencyTable *latency_table)
+{
+    FairQueue *queue;
+
+    queue = FAIR_QUEUE (g_object_new (TYPE_FAIR_QUEUE, NULL));
+    if (latency_table != NULL)
+        queue->latency_table = g_object_ref (latency_table);
+    return queue;
+}
+/*
+ * Select the scheduling discipline used to pick the next flow.
+ */
+void
+fair_queue_set_scheduler (FairQueue          *queue,
+                          FairQueueScheduler  scheduler)
+{
+    g_assert_nonnull (queue);
+    g_debug ("%s: scheduler %d", __func__, scheduler);
+    pthread_mutex_lock (&queue->mutex);
+    queue->scheduler = scheduler;
+    pthread_mutex_unlock (&queue->mutex);
+}
+/*
+ * Expected cost of executing a command in microseconds.
+ */
+static guint64
+fair_queue_command_cost (FairQueue   *queue,
+                         Tpm2Command *command)
+{
+    guint64 cost = 0;
+
+    if (queue->latency_table != NULL)
+        cost = latency_table_estimate (queue->latency_table,
+                                       tpm2_command_get_code (command));
+    return cost > 0 ? cost : FAIR_QUEUE_QUANTUM;
+}
+/*
+ * Set the weight for all connections from the client with the given
+ * identity. This only affects flows created after the call.
+ */
+void
+fair_queue_set_weight (FairQueue   *queue,
+                       const gchar *identity,
+                       guint        weight)
+{
+    g_assert_nonnull (queue);
+    g_assert_nonnull (identity);
+    if (weight < 1 || weight > FAIR_QUEUE_WEIGHT_MAX)
+        g_error ("%s: weight must be between 1 and %d", __func__,
+                 FAIR_QUEUE_WEIGHT_MAX);
+    g_debug ("%s: identity \"%s\" weight %u", __func__, identity, weight);
+    pthread_mutex_lock (&queue->mutex);
+    g_hash_table_replace (queue->weight_table,
+                          g_strdup (identity),
+                          GUINT_TO_POINTER (weight));
+    pthread_mutex_unlock (&queue->mutex);
+}
+/*
+ * Caller must hold the FairQueue mutex.
+ */
+static guint
+fair_queue_lookup_weight (FairQueue   *queue,
+                          const gchar *identity)
+{
+    gpointer weight;
+
+    if (identity == NULL)
+        return FAIR_QUEUE_WEIGHT_DEFAULT;
+    weight = g_hash_table_lookup (queue->weight_table, identity);
+    return weight != NULL ? GPOINTER_TO_UINT (weight) :
+                            FAIR_QUEUE_WEIGHT_DEFAULT;
+}
+guint
+fair_queue_get_weight (FairQueue   *queue,
+                       const gchar *identity)
+{
+    guint weight;
+
+    g_assert_nonnull (queue);
+    pthread_mutex_lock (&queue->mutex);
+    weight = fair_queue_lookup_weight (queue, identity);
+    pthread_mutex_unlock (&queue->mutex);
+    return weight;
+}
+/*
+ * Find the flow for the given Connection, creating it and adding it to the
+ * end of the round if it doesn't exist. Caller must hold the mutex.
+ */
+static fair_queue_flow_t*
+fair_queue_get_flow (FairQueue  *queue,
+                     Connection *connection)
+{
+    fair_queue_flow_t *flow;
+
+    flow = g_hash_table_lookup (queue->flow_table, connection);
+    if (flow != NULL)
+        return flow;
+    flow = calloc (1, sizeof (fair_queue_flow_t));
+    if (flow == NULL)
+        g_error ("%s: failed to allocate flow: %s", __func__,
+                 strerror (errno));
+    flow->connection = g_object_ref (connection);
+    flow->queue = g_queue_new ();
+    flow->weight = fair_queue_lookup_weight (queue,
+                                             connection_get_identity (connection));
+    g_debug ("%s: new flow for Connection 0x%" PRIxPTR " with weight %u",
+             __func__, (uintptr_t)connection, flow->weight);
+    g_hash_table_insert (queue->flow_table, connection, flow);
+    g_queue_push_tail (queue->active_flows, flow);
+    return flow;
+}
+/*
+ * Enqueue an object. Tpm2Commands are queued behind the other commands
+ * from the same Connection, anything else goes to the control queue.
+ * The FairQueue takes a reference to the object.
+ * Unlike the MessageQueue this takes the mutex: a command must land in
+ * its Connection's flow, and the flows are created, weighted and retired
+ * by the scheduler under the same lock. The consumer also needs a timed
+ * wait and producers must never block on a full queue, which the
+ * MessageQueue ring doesn't offer.
+ */
+void
+fair_queue_enqueue (FairQueue *queue,
+                    GObject   *obj)
+{
+    fair_queue_flow_t *flow;
+    Connection *connection;
+    guint64 cost;
+
+    g_assert_nonnull (queue);
+    g_debug ("%s: FairQueue 0x%" PRIxPTR " : obj 0x%" PRIxPTR, __func__,
+             (uintptr_t)queue, (uintptr_t)obj);
+    if (IS_TPM2_COMMAND (obj)) {
+        cost = fair_queue_command_cost (queue, TPM2_COMMAND (obj));
+        connection = tpm2_command_get_connection (TPM2_COMMAND (obj));
+        pthread_mutex_lock (&queue->mutex);
+        flow = fair_queue_get_flow (queue, connection);
+        g_queue_push_tail (flow->queue, fair_queue_entry_new (obj, cost));
+        g_object_unref (connection);
+    } else {
+        pthread_mutex_lock (&queue->mutex);
+        g_queue_push_tail (queue->control_queue,
+                           fair_queue_entry_new (obj, 0));
+    }
+    pthread_cond_signal (&queue->cond);
+    pthread_mutex_unlock (&queue->mutex);
+}
+/*
+ * Put a command that is to be sent to the TPM again back at the head of
+ * its Connection's flow. The flow is taken out of the round until
+ * tpm2_command_get_not_before has passed: the commands queued behind the
+ * retried one wait with it so responses go back to the client in order,
+ * and the other Connections are served in the meantime.
+ * The FairQueue takes a reference to the command.
+ */
+void
+fair_queue_requeue (FairQueue   *queue,
+                    Tpm2Command *command)
+{
+    fair_queue_flow_t *flow;
+    Connection *connection;
+    guint64 cost;
+
+    g_assert_nonnull (queue);
+    g_debug ("%s: FairQueue 0x%" PRIxPTR " : Tpm2Command 0x%" PRIxPTR
+             " not before %" PRId64, __func__, (uintptr_t)queue,
+             (uintptr_t)command, tpm2_command_get_not_before (command));
+    cost = fair_queue_command_cost (queue, command);
+    connection = tpm2_command_get_connection (command);
+    pthread_mutex_lock (&queue->mutex);
+    flow = fair_queue_get_flow (queue, connection);
+    g_queue_push_head (flow->queue,
+                       fair_queue_entry_new (G_OBJECT (command), cost));
+    if (flow->not_before == 0) {
+        if (queue->batch_flow == flow)
+            queue->batch_flow = NULL;
+        g_queue_remove (queue->active_flows, flow);
+        g_queue_push_tail (queue->delayed_flows, flow);
+        flow->in_turn = FALSE;
+    }
+    flow->not_before = tpm2_command_get_not_before (command);
+    g_object_unref (connection);
+    pthread_cond_signal (&queue->cond);
+    pthread_mutex_unlock (&queue->mutex);
+}
+/*
+ * Return the delayed flows that are due to the end of the round. Returns
+ * TRUE if there's an object to dequeue. Otherwise 'wake_time' is set to
+ * the monotonic time the next delayed flow is due, or 0 if there are no
+ * delayed flows. Caller must hold the mutex.
+ */
+static gboolean
+fair_queue_ready (FairQueue *queue,
+                  gint64    *wake_time)
+{
+    fair_queue_flow_t *flow;
+    GList *link, *next;
+    gint64 now;
+
+    *wake_time = 0;
+    now = g_get_monotonic_time ();
+    for (link = queue->delayed_flows->head; link != NULL; link = next) {
+        next = link->next;
+        flow = link->data;
+        if (flow->not_before <= now) {
+            flow->not_before = 0;
+            g_queue_delete_link (queue->delayed_flows, link);
+            g_queue_push_tail (queue->active_flows, flow);
+        } else if (*wake_time == 0 || flow->not_before < *wake_time) {
+            *wake_time = flow->not_before;
+        }
+    }
+    return !g_queue_is_empty (queue->control_queue) ||
+           !g_queue_is_empty (queue->active_flows);
+}
+/*
+ * Wait for the queue to be signaled or for the monotonic time to reach
+ * 'end_time'. Caller must hold the mutex.
+ */
+static void
+fair_queue_wait_until (FairQueue *queue,
+                       gint64     end_time)
+{
+    struct timespec ts = {
+        .tv_sec  = end_time / G_USEC_PER_SEC,
+        .tv_nsec = (end_time % G_USEC_PER_SEC) * 1000,
+    };
+
+    pthread_cond_timedwait (&queue->cond, &queue->mutex, &ts);
+}
+/*
+ * Remove the flow from the round and free it once it's been drained.
+ * Caller must hold the mutex.
+ */
+static void
+fair_queue_flow_drained (FairQueue         *queue,
+                         fair_queue_flow_t *flow)
+{
+    if (g_queue_is_empty (flow->queue)) {
+        if (queue->batch_flow == flow)
+            queue->batch_flow = NULL;
+        g_queue_remove (queue->active_flows, flow);
+        g_hash_table_remove (queue->flow_table, flow->connection);
+    }
+}
+/*
+ * Deficit round robin: the flow at the head of the round is credited with
+ * its quantum once per turn and keeps the turn while its deficit covers
+ * the cost of its next command. Caller must hold the mutex and there must
+ * be at least one active flow.
+ */
+static fair_queue_entry_t*
+fair_queue_pop_drr (FairQueue *queue)
+{
+    fair_queue_flow_t  *flow;
+    fair_queue_entry_t *entry;
+
+    while (TRUE) {
+        flow = g_queue_peek_head (queue->active_flows);
+        entry = g_queue_peek_head (flow->queue);
+        if (!flow->in_turn) {
+            flow->deficit += flow->weight * FAIR_QUEUE_QUANTUM;
+            flow->in_turn = TRUE;
+        }
+        if (entry->cost <= flow->deficit) {
+            break;
+        }
+        flow->in_turn = FALSE;
+        g_queue_push_tail (queue->active_flows,
+                           g_queue_pop_head (queue->active_flows));
+    }
+    g_queue_pop_head (flow->queue);
+    flow->deficit -= entry->cost;
+    fair_queue_flow_drained (queue, flow);
+    return entry;
+}
+/*
+ * Shortest expected job first with aging: of the commands at the head of
+ * each flow take the one with the lowest expected cost, scaled down by the
+ * weight of its client, less the time it has already waited. Commands from
+ * the same Connection are still served in order. Caller must hold the
+ * mutex and there must be at least one active flow.
+ */
+static fair_queue_entry_t*
+fair_queue_pop_sejf (FairQueue *queue)
+{
+    fair_queue_flow_t  *flow, *best_flow = NULL;
+    fair_queue_entry_t *entry;
+    gint64 now, score, best_score = G_MAXINT64;
+    GList *link;
+
+    now = g_get_monotonic_time ();
+    for (link = queue->active_flows->head; link != NULL; link = link->next) {
+        flow = link->data;
+        entry = g_queue_peek_head (flow->queue);
+        score = (gint64)(entry->cost / flow->weight) -
+                (now - entry->enqueue_time) * FAIR_QUEUE_SEJF_AGING;
+        if (best_flow == NULL || score < best_score) {
+            best_flow = flow;
+            best_score = score;
+        }
+    }
+    entry = g_queue_pop_head (best_flow->queue);
+    fair_queue_flow_drained (queue, best_flow);
+    return entry;
+}
+/*
+ * Connection affinity: keep serving the Connection we served last while
+ * its batch is within the fairness window, saving the context loads and
+ * saves that switching Connections costs. When the batch ends pick another
+ * Connection with the most contexts already loaded in the TPM, the one
+ * waiting longest breaking ties. The count of loaded contexts is read from
+ * the Connection without taking any ResourceManager lock. A command that
+ * has waited longer than the window ends the current batch and is served
+ * first. Caller must hold the mutex and there must be at least one active
+ * flow.
+ */
+static fair_queue_entry_t*
+fair_queue_pop_affinity (FairQueue *queue)
+{
+    fair_queue_flow_t  *flow, *batch_flow, *best_flow = NULL;
+    fair_queue_entry_t *entry, *best_entry = NULL;
+    gint64 now, oldest = G_MAXINT64;
+    guint resident, best_resident = 0;
+    GList *link;
+
+    now = g_get_monotonic_time ();
+    batch_flow = queue->batch_flow;
+    /* find the command that has waited longest */
+    for (link = queue->active_flows->head; link != NULL; link = link->next) {
+        flow = link->data;
+        entry = g_queue_peek_head (flow->queue);
+        if (entry->enqueue_time < oldest) {
+            oldest = entry->enqueue_time;
+            best_flow = flow;
+        }
+    }
+    if (now - oldest > FAIR_QUEUE_AFFINITY_WINDOW) {
+        g_debug ("%s: command waited %" PRId64 "us, switching", __func__,
+                 now - oldest);
+    } else if (batch_flow != NULL &&
+               queue->batch_cost <
+                   (guint64)batch_flow->weight * FAIR_QUEUE_AFFINITY_WINDOW)
+    {
+        best_flow = batch_flow;
+    } else {
+        best_flow = NULL;
+        for (link = queue->active_flows->head;
+             link != NULL;
+             link = link->next)
+        {
+            flow = link->data;
+            /* the batch is over, give the others a turn */
+            if (flow == batch_flow && queue->active_flows->length > 1)
+                continue;
+            entry = g_queue_peek_head (flow->queue);
+            resident = connection_get_resident (flow->connection);
+            if (best_flow == NULL ||
+                resident > best_resident ||
+                (resident == best_resident &&
+                 entry->enqueue_time < best_entry->enqueue_time))
+            {
+                best_flow = flow;
+                best_entry = entry;
+                best_resident = resident;
+            }
+        }
+    }
+    if (best_flow != batch_flow) {
+        queue->batch_flow = best_flow;
+        queue->batch_cost = 0;
+    }
+    entry = g_queue_pop_head (best_flow->queue);
+    queue->batch_cost += entry->cost;
+    fair_queue_flow_drained (queue, best_flow);
+    return entry;
+}
+/*
+ * Take the next object off the queue and return it to the caller who owns
+ * the reference. Objects in the control queue are returned before any
+ * Tpm2Command. The caller must hold the mutex and the queue must not be
+ * empty. The mutex is released before returning.
+ */
+static GObject*
+fair_queue_pop_unlock (FairQueue *queue)
+{
+    fair_queue_entry_t *entry;
+    GObject *obj;
+    gint64 wait;
+
+    entry = g_queue_pop_head (queue->control_queue);
+    if (entry == NULL) {
+        switch (queue->scheduler) {
+        case FAIR_QUEUE_SCHEDULER_SEJF:
+            entry = fair_queue_pop_sejf (queue);
+            break;
+        case FAIR_QUEUE_SCHEDULER_AFFINITY:
+            entry = fair_queue_pop_affinity (queue);
+            break;
+        default:
+            entry = fair_queue_pop_drr (queue);
+            break;
+        }
+    }
+    wait = g_get_monotonic_time () - entry->enqueue_time;
+    ++queue->dequeue_count;
+    queue->wait_time += wait;
+    pthread_mutex_unlock (&queue->mutex);
+    obj = entry->obj;
+    entry->obj = NULL;
+    fair_queue_entry_free (entry);
+    g_debug ("%s: FairQueue 0x%" PRIxPTR " : obj 0x%" PRIxPTR " waited %"
+             PRId64 "us", __func__, (uintptr_t)queue, (uintptr_t)obj, wait);
+    return obj;
+}
+/*
+ * Dequeue the next object, blocking until one is available.
+ */
+GObject*
+fair_queue_dequeue (FairQueue *queue)
+{
+    gint64 wake_time;
+
+    g_assert_nonnull (queue);
+    pthread_mutex_lock (&queue->mutex);
+    while (!fair_queue_ready (queue, &wake_time)) {
+        if (wake_time == 0) {
+            pthread_cond_wait (&queue->cond, &queue->mutex);
+        } else {
+            fair_queue_wait_until (queue, wake_time);
+        }
+    }
+    return fair_queue_pop_unlock (queue);
+}
+/*
+ * Dequeue the next object, blocking until one is available or the
+ * monotonic time reaches 'end_time' (see g_get_monotonic_time). Returns
+ * NULL if the queue is still empty at 'end_time'.
+ */
+GObject*
+fair_queue_timed_dequeue (FairQueue *queue,
+                          gint64     end_time)
+{
+    gint64 wake_time;
+
+    g_assert_nonnull (queue);
+    pthread_mutex_lock (&queue->mutex);
+    while (!fair_queue_ready (queue, &wake_time)) {
+        if (g_get_monotonic_time () >= end_time) {
+            pthread_mutex_unlock (&queue->mutex);
+            return NULL;
+        }
+        if (wake_time == 0 || wake_time > end_time) {
+            wake_time = end_time;
+        }
+        fair_queue_wait_until (queue, wake_time);
+    }
+    return fair_queue_pop_unlock (queue);
+}
+/*
+ * Dequeue the next object if there is one. Returns NULL without blocking
+ * if the queue is empty or only holds commands that aren't due yet.
+ */
+GObject*
+fair_queue_try_dequeue (FairQueue *queue)
+{
+    gint64 wake_time;
+
+    g_assert_nonnull (queue);
+    pthread_mutex_lock (&queue->mutex);
+    if (!fair_queue_ready (queue, &wake_time)) {
+        pthread_mutex_unlock (&queue->mutex);
+        return NULL;
+    }
+    return fair_queue_pop_unlock (queue);
+}
+/*
+ * Get the number of objects dequeued and the total time they spent waiting
+ * in the queue, in microseconds.
+ */
+void
+fair_queue_get_wait_stats (FairQueue *queue,
+                           guint64   *count,
+                           guint64   *time)
+{
+    g_assert_nonnull (queue);
+    pthread_mutex_lock (&queue->mutex);
+    if (count != NULL)
+        *count = queue->dequeue_count;
+    if (time != NULL)
+        *time = queue->wait_time;
+    pthread_mutex_unlock (&queue->mutex);
+}
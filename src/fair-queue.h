@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef FAIR_QUEUE_H
+#define FAIR_QUEUE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <pthread.h>
+
+#include "connection.h"
+#include "latency-table.h"
+#include "tpm2-command.h"
+
+G_BEGIN_DECLS
+
+#define FAIR_QUEUE_WEIGHT_DEFAULT 1
+#define FAIR_QUEUE_WEIGHT_MAX     100
+
+typedef enum {
+    FAIR_QUEUE_SCHEDULER_DRR,
+    FAIR_QUEUE_SCHEDULER_SEJF,
+    FAIR_QUEUE_SCHEDULER_AFFINITY,
+} FairQueueScheduler;
+
+typedef struct _FairQueueClass {
+    GObjectClass parent;
+} FairQueueClass;
+
+/*
+ * A blocking queue that keeps a separate FIFO for each Connection and
+ * picks the next one to serve with either deficit round robin or shortest
+ * expected job first. The cost of a command is its expected execution time
+ * from the LatencyTable. Objects that aren't associated with a Connection
+ * (ControlMessages) are kept in their own queue and are always dequeued
+ * first. A flow whose head command is waiting to be retried is parked in
+ * 'delayed_flows' until it's due.
+ */
+typedef struct _FairQueue {
+    GObject          parent_instance;
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+    GQueue          *control_queue;
+    GHashTable      *flow_table;
+    GQueue          *active_flows;
+    GQueue          *delayed_flows;
+    GHashTable      *weight_table;
+    LatencyTable    *latency_table;
+    FairQueueScheduler scheduler;
+    gpointer         batch_flow;
+    guint64          batch_cost;
+    guint64          dequeue_count;
+    guint64          wait_time;
+} FairQueue;
+
+#define TYPE_FAIR_QUEUE           (fair_queue_get_type               ())
+#define FAIR_QUEUE(obj)           (G_TYPE_CHECK_INSTANCE_CAST ((obj), TYPE_FAIR_QUEUE, FairQueue))
+#define FAIR_QUEUE_CLASS(cls)     (G_TYPE_CHECK_CLASS_CAST    ((cls), TYPE_FAIR_QUEUE, FairQueueClass))
+#define IS_FAIR_QUEUE(obj)        (G_TYPE_CHECK_INSTANCE_TYPE ((obj), TYPE_FAIR_QUEUE))
+#define IS_FAIR_QUEUE_CLASS(cls)  (G_TYPE_CHECK_CLASS_TYPE    ((cls), TYPE_FAIR_QUEUE))
+#define FAIR_QUEUE_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS  ((obj), TYPE_FAIR_QUEUE, FairQueueClass))
+
+GType       fair_queue_get_type        (void);
+FairQueue*  fair_queue_new             (LatencyTable   *latency_table);
+void        fair_queue_enqueue         (FairQueue      *queue,
+                                        GObject        *obj);
+void        fair_queue_requeue         (FairQueue      *queue,
+                                        Tpm2Command    *command);
+GObject*    fair_queue_dequeue         (FairQueue      *queue);
+GObject*    fair_queue_try_dequeue     (FairQueue      *queue);
+GObject*    fair_queue_timed_dequeue   (FairQueue      *queue,
+                                        gint64          end_time);
+void        fair_queue_set_weight      (FairQueue      *queue,
+                                        const gchar    *identity,
+                                        guint           weight);
+guint       fair_queue_get_weight      (FairQueue      *queue,
+                                        const gchar    *identity);
+void        fair_queue_set_scheduler   (FairQueue      *queue,
+                                        FairQueueScheduler scheduler);
+void        fair_queue_get_wait_stats  (FairQueue      *queue,
+                                        guint64        *count,
+                                        guint64        *time);
+
+G_END_DECLS
+#endif /* FAIR_QUEUE_H */
@@ -25,8 +25,10 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <inttypes.h>
+#include <string.h>
 
 #include "handle-map-entry.h"
+#include "object-pool.h"
 
 G_DEFINE_TYPE (HandleMapEntry, handle_map_entry, G_TYPE_OBJECT);
 
@@ -38,6 +40,7 @@ enum {
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+static ObjectPool handle_map_entry_pool = OBJECT_POOL_INIT;
 /*
  * GObject property getter.
  */
@@ -94,6 +97,22 @@ handle_map_entry_set_property (GObject        *object,
 static void
 handle_map_entry_init (HandleMapEntry *entry)
 { /* noop */ }
+/*
+ * Reset the entry to the state of a new instance and offer it to the
+ * pool. If the pool takes it we're done: it's alive again.
+ */
+static void
+handle_map_entry_dispose (GObject *object)
+{
+    HandleMapEntry *entry = HANDLE_MAP_ENTRY (object);
+
+    memset ((guint8*)entry + sizeof (GObject), 0,
+            sizeof (HandleMapEntry) - sizeof (GObject));
+    if (object_pool_put (&handle_map_entry_pool, object)) {
+        return;
+    }
+    G_OBJECT_CLASS (handle_map_entry_parent_class)->dispose (object);
+}
 /*
  * Deallocate all associated resources. All are static so we just chain
  * up to the parent like a good GObject.
@@ -114,6 +133,7 @@ handle_map_entry_class_init (HandleMapEntryClass *klass)
 
     if (handle_map_entry_parent_class == NULL)
         handle_map_entry_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose      = handle_map_entry_dispose;
     object_class->finalize     = handle_map_entry_finalize;
     object_class->get_property = handle_map_entry_get_property;
     object_class->set_property = handle_map_entry_set_property;
@@ -144,7 +164,8 @@ handle_map_entry_class_init (HandleMapEntryClass *klass)
                                        obj_properties);
 }
 /*
- * Instance constructor.
+ * Instance constructor. Reuses an idle instance from the pool if there is
+ * one and sets the handles directly instead of through the properties.
  */
 HandleMapEntry*
 handle_map_entry_new (TPM2_HANDLE phandle,
@@ -152,10 +173,12 @@ handle_map_entry_new (TPM2_HANDLE phandle,
 {
     HandleMapEntry *entry;
 
-    entry = HANDLE_MAP_ENTRY (g_object_new (TYPE_HANDLE_MAP_ENTRY,
-                                            "phandle", (guint)phandle,
-                                            "vhandle", (guint)vhandle,
-                                            NULL));
+    entry = (HandleMapEntry*)object_pool_get (&handle_map_entry_pool);
+    if (entry == NULL) {
+        entry = HANDLE_MAP_ENTRY (g_object_new (TYPE_HANDLE_MAP_ENTRY, NULL));
+    }
+    entry->phandle = phandle;
+    entry->vhandle = vhandle;
     g_debug ("handle_map_entry_new: 0x%" PRIxPTR " with vhandle: 0x%" PRIx32
              " and phandle: 0x%" PRIx32, (uintptr_t)entry, vhandle, phandle);
     return entry;
@@ -194,3 +217,20 @@ handle_map_entry_set_phandle (HandleMapEntry *entry,
 {
     entry->phandle = phandle;
 }
+/*
+ * Accessor for the flag indicating whether the TPMS_CONTEXT member holds
+ * a saved context that can be used to reload the object. Transient object
+ * contexts don't change once the object is loaded so once saved the blob
+ * can be reused indefinitely.
+ */
+gboolean
+handle_map_entry_get_context_valid (HandleMapEntry *entry)
+{
+    return entry->context_valid;
+}
+void
+handle_map_entry_set_context_valid (HandleMapEntry *entry,
+                                    gboolean        valid)
+{
+    entry->context_valid = valid;
+}
@@ -42,6 +42,7 @@ typedef struct _HandleMapEntry {
     TPM2_HANDLE        phandle;
     TPM2_HANDLE        vhandle;
     TPMS_CONTEXT      context;
+    gboolean          context_valid;
 } HandleMapEntry;
 
 #define TYPE_HANDLE_MAP_ENTRY              (handle_map_entry_get_type   ())
@@ -59,6 +60,9 @@ TPM2_HANDLE       handle_map_entry_get_vhandle   (HandleMapEntry    *entry);
 TPMS_CONTEXT*    handle_map_entry_get_context   (HandleMapEntry    *entry);
 void             handle_map_entry_set_phandle   (HandleMapEntry    *entry,
                                                  TPM2_HANDLE         phandle);
+gboolean         handle_map_entry_get_context_valid (HandleMapEntry *entry);
+void             handle_map_entry_set_context_valid (HandleMapEntry *entry,
+                                                     gboolean        valid);
 
 G_END_DECLS
 #endif /* HANDLE_MAP_ENTRY_H */
@@ -52,7 +52,7 @@ handle_map_get_property (GObject    *object,
 
     switch (property_id) {
     case PROP_HANDLE_TYPE:
-        g_value_set_uint (value, map->handle_count);
+        g_value_set_uint (value, map->handle_type);
         break;
     case PROP_MAX_ENTRIES:
         g_value_set_uint (value, map->max_entries);
@@ -87,41 +87,34 @@ handle_map_set_property (GObject        *object,
     }
 }
 /*
- * Initialize object. This requires:
- * 1) initializing the mutex that mediate access to the hash tables
- * 2) creating the hash tables
- * 3) initializing the handle_count
- * The handle_count is currently initialized to start allocating handles
- * @ 0xff. This is an arbitrary way we differentiate them from the handles
- * allocated by the TPM.
+ * Initialize object. The slots are zeroed with the rest of the instance so
+ * they're all free and no slot has been used yet.
  */
 static void
 handle_map_init (HandleMap     *map)
 {
     g_debug ("handle_map_init");
     pthread_mutex_init (&map->mutex, NULL);
-    map->vhandle_to_entry_table =
-        g_hash_table_new_full (g_direct_hash,
-                               g_direct_equal,
-                               NULL,
-                               (GDestroyNotify)g_object_unref);
-    map->handle_count = 0xff;
 }
 /*
- * GObject dispose function: release all references to GObjects. Currently
- * this is only the GHashTable mapping vhandles to HandleMapEntry objects.
+ * GObject dispose function: release the references held on the
+ * HandleMapEntry objects in the slots.
  */
 static void
 handle_map_dispose (GObject *object)
 {
     HandleMap *self = HANDLE_MAP (object);
+    guint i;
 
-    g_clear_pointer (&self->vhandle_to_entry_table, g_hash_table_unref);
+    for (i = 0; i < self->slot_count; ++i) {
+        g_clear_object (&self->slots [i].entry);
+    }
+    self->size = 0;
     G_OBJECT_CLASS (handle_map_parent_class)->dispose (object);
 }
 /*
  * GObject finalize function: release all non-GObject resources. Currently
- * this is the mutex used to lock the GHashTable.
+ * this is the mutex used to lock the slots.
  */
 static void
 handle_map_finalize (GObject *object)
@@ -184,7 +177,7 @@ handle_map_new (TPM2_HT handle_type,
                                      NULL));
 }
 /*
- * Lock the mutex that protects the hash table object.
+ * Lock the mutex that protects the slots.
  */
 static inline void
 handle_map_lock (HandleMap *map)
@@ -193,7 +186,7 @@ handle_map_lock (HandleMap *map)
         g_error ("Error locking HandleMap: %s", strerror (errno));
 }
 /*
- * Unlock the mutex that protects the hash table object.
+ * Unlock the mutex that protects the slots.
  */
 static inline void
 handle_map_unlock (HandleMap *map)
@@ -202,25 +195,118 @@ handle_map_unlock (HandleMap *map)
         g_error ("Error unlocking HandleMap: %s", strerror (errno));
 }
 /*
- * Return false if the number of entries in the map is greater than or equal
- * to max_entries.
+ * Build the virtual handle for the slot at 'index' from its generation.
+ */
+static inline TPM2_HANDLE
+handle_map_slot_vhandle (HandleMap *map,
+                         guint      index)
+{
+    return ((TPM2_HANDLE)map->handle_type << TPM2_HR_SHIFT) |
+        ((TPM2_HANDLE)index << HANDLE_MAP_SLOT_SHIFT) |
+        map->slots [index].generation;
+}
+/*
+ * Find the slot that the virtual handle was issued for. Returns NULL if the
+ * handle isn't one of ours, or if it's stale: the slot has been freed or
+ * reused since.
+ * The caller must hold the lock.
+ */
+static HandleMapSlot*
+handle_map_slot_lookup (HandleMap   *map,
+                        TPM2_HANDLE  vhandle)
+{
+    guint index = (vhandle >> HANDLE_MAP_SLOT_SHIFT) & HANDLE_MAP_SLOT_MASK;
+
+    if (vhandle == 0 || index >= map->slot_count ||
+        map->slots [index].vhandle != vhandle)
+    {
+        return NULL;
+    }
+    return &map->slots [index];
+}
+/*
+ * Take a free slot, preferring those that have been used before so the
+ * used part of the array stays dense. Returns the index of the slot or -1
+ * if there are max_entries slots in use.
+ * The caller must hold the lock.
+ */
+static gint
+handle_map_slot_alloc (HandleMap *map)
+{
+    if (map->free_count > 0) {
+        return map->free_slots [--map->free_count];
+    }
+    if (map->slot_count < map->max_entries) {
+        return map->slot_count++;
+    }
+    return -1;
+}
+/*
+ * Take the slot at 'index' if it's free, whether or not it has been used
+ * before. This is how slots are taken for virtual handles that weren't
+ * issued by handle_map_next_vhandle. Returns FALSE if the slot is in use
+ * or not below max_entries.
+ * The caller must hold the lock.
+ */
+static gboolean
+handle_map_slot_claim (HandleMap *map,
+                       guint      index)
+{
+    guint i;
+
+    if (index >= map->max_entries) {
+        return FALSE;
+    }
+    if (index >= map->slot_count) {
+        for (i = map->slot_count; i < index; ++i) {
+            map->free_slots [map->free_count++] = i;
+        }
+        map->slot_count = index + 1;
+        return TRUE;
+    }
+    for (i = 0; i < map->free_count; ++i) {
+        if (map->free_slots [i] == index) {
+            map->free_slots [i] = map->free_slots [--map->free_count];
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+/*
+ * Return the slot to the free list, dropping the reference held on its
+ * entry if it has one.
+ * The caller must hold the lock.
+ */
+static void
+handle_map_slot_free (HandleMap     *map,
+                      HandleMapSlot *slot)
+{
+    if (slot->entry != NULL) {
+        g_clear_object (&slot->entry);
+        --map->size;
+    }
+    slot->vhandle = 0;
+    map->free_slots [map->free_count++] = slot - map->slots;
+}
+/*
+ * Return TRUE if max_entries slots are in use, either holding an entry or
+ * reserved for a virtual handle returned by handle_map_next_vhandle.
  */
 gboolean
 handle_map_is_full (HandleMap *map)
 {
-    guint table_size;
-
-    table_size = g_hash_table_size (map->vhandle_to_entry_table);
-    if (table_size < map->max_entries) {
+    if (map->slot_count - map->free_count < map->max_entries) {
         return FALSE;
     } else {
         return TRUE;
     }
 }
 /*
- * Insert GObject into the hash table with the key being the provided handle.
- * We take a reference to the object before we insert the object since when
- * it is removed or if the hash table is destroyed the object will be unref'd.
+ * Insert GObject into the slot for the provided virtual handle. We take a
+ * reference to the object before we insert the object since when it is
+ * removed or if the map is destroyed the object will be unref'd. The
+ * handle should come from handle_map_next_vhandle. Any other handle of the
+ * map's type is inserted in the slot it encodes if that slot is free.
  * If a handle provided is 0 we do not insert the entry in the corresponding
  * map.
  */
@@ -229,76 +315,90 @@ handle_map_insert (HandleMap      *map,
                    TPM2_HANDLE      vhandle,
                    HandleMapEntry *entry)
 {
+    HandleMapSlot *slot;
+    gboolean ret;
+    guint index;
+
     g_debug ("handle_map_insert: vhandle: 0x%" PRIx32 ", entry: 0x%" PRIxPTR,
              vhandle, (uintptr_t)entry);
     handle_map_lock (map);
-    if (handle_map_is_full (map)) {
-        g_warning ("HandleMap: 0x%" PRIxPTR " max_entries of %u exceeded",
-                   (uintptr_t)map, map->max_entries);
+    if (entry == NULL || vhandle == 0) {
+        ret = !handle_map_is_full (map);
         handle_map_unlock (map);
-        return FALSE;
+        return ret;
+    }
+    slot = handle_map_slot_lookup (map, vhandle);
+    if (slot == NULL) {
+        index = (vhandle >> HANDLE_MAP_SLOT_SHIFT) & HANDLE_MAP_SLOT_MASK;
+        if (vhandle >> TPM2_HR_SHIFT != map->handle_type ||
+            !handle_map_slot_claim (map, index))
+        {
+            g_warning ("HandleMap: 0x%" PRIxPTR " can't insert vhandle 0x%"
+                       PRIx32 ": map full or slot in use, max_entries: %u",
+                       (uintptr_t)map, vhandle, map->max_entries);
+            handle_map_unlock (map);
+            return FALSE;
+        }
+        slot = &map->slots [index];
+        slot->generation = vhandle & HANDLE_MAP_GENERATION_MASK;
+        slot->vhandle = vhandle;
     }
-    if (entry && vhandle != 0) {
-        g_object_ref (entry);
-        g_hash_table_insert (map->vhandle_to_entry_table,
-                             GINT_TO_POINTER (vhandle),
-                             entry);
+    g_object_ref (entry);
+    if (slot->entry != NULL) {
+        g_object_unref (slot->entry);
+    } else {
+        ++map->size;
     }
+    slot->entry = entry;
     handle_map_unlock (map);
     return TRUE;
 }
 /*
- * Remove the entry from the hash table associated with the provided handle.
+ * Remove the entry associated with the provided handle and free its slot.
  * Returns TRUE on success, FALSE on failure.
  */
 gboolean
 handle_map_remove (HandleMap *map,
                    TPM2_HANDLE vhandle)
 {
-    gboolean ret;
+    HandleMapSlot *slot;
+    gboolean ret = FALSE;
 
     handle_map_lock (map);
-    ret = g_hash_table_remove (map->vhandle_to_entry_table,
-                               GINT_TO_POINTER (vhandle));
+    slot = handle_map_slot_lookup (map, vhandle);
+    if (slot != NULL) {
+        ret = slot->entry != NULL ? TRUE : FALSE;
+        handle_map_slot_free (map, slot);
+    }
     handle_map_unlock (map);
 
     return ret;
 }
 /*
- * Generic lookup function to find an entry in a GHashTable for the given
- * handle.
+ * Look up the GObject associated with the virtual handle. The object is
+ * not removed from the map. The reference count for the object is
+ * incremented before it is returned to the caller. The caller must free
+ * this reference when they are done with it.
+ * NULL is returned if no entry matches the provided handle.
  */
-static HandleMapEntry*
-handle_map_lookup (HandleMap     *map,
-                   TPM2_HANDLE     handle,
-                   GHashTable    *table)
+HandleMapEntry*
+handle_map_vlookup (HandleMap    *map,
+                    TPM2_HANDLE    vhandle)
 {
-    HandleMapEntry *entry;
+    HandleMapSlot *slot;
+    HandleMapEntry *entry = NULL;
 
     handle_map_lock (map);
-    entry = g_hash_table_lookup (table, GINT_TO_POINTER (handle));
-    if (entry)
-        g_object_ref (entry);
+    slot = handle_map_slot_lookup (map, vhandle);
+    if (slot != NULL && slot->entry != NULL) {
+        entry = g_object_ref (slot->entry);
+    }
     handle_map_unlock (map);
 
     return entry;
 }
 /*
- * Look up the GObject associated with the virtual handle in the hash
- * table. The object is not removed from the hash table. The reference
- * count for the object is incremented before it is returned to the caller.
- * The caller must free this reference when they are done with it.
- * NULL is returned if no entry matches the provided handle.
- */
-HandleMapEntry*
-handle_map_vlookup (HandleMap    *map,
-                    TPM2_HANDLE    vhandle)
-{
-    return handle_map_lookup (map, vhandle, map->vhandle_to_entry_table);
-}
-/*
- * Simple wrapper around the function that reports the number of entries in
- * the hash table.
+ * Report the number of entries in the map.
  */
 guint
 handle_map_size (HandleMap *map)
@@ -306,46 +406,73 @@ handle_map_size (HandleMap *map)
     guint ret;
 
     handle_map_lock (map);
-    ret = g_hash_table_size (map->vhandle_to_entry_table);
+    ret = map->size;
     handle_map_unlock (map);
 
     return ret;
 }
 /*
- * Combine the handle_type and the handle_count to create a new handle.
- * The handle_count is advanced as part of this. If the handle_count has
- * a bit set in the upper byte (the handle_type bits) then it has rolled
- * over and we return an error.
- * NOTE: recycling handles is something we should be able to do for long
- * lived programs / daemons that may want to use the TPM.
+ * Reserve a free slot and return the virtual handle for it. The slot's
+ * generation is advanced so the handle differs from any handle previously
+ * issued for the slot. The entry for the handle is then added with
+ * handle_map_insert. Returns 0 if max_entries slots are in use.
  */
 TPM2_HANDLE
 handle_map_next_vhandle (HandleMap *map)
 {
-    TPM2_HANDLE handle;
+    HandleMapSlot *slot;
+    TPM2_HANDLE handle = 0;
+    gint index;
+
+    handle_map_lock (map);
+    index = handle_map_slot_alloc (map);
+    if (index >= 0) {
+        slot = &map->slots [index];
+        slot->generation = (slot->generation + 1) & HANDLE_MAP_GENERATION_MASK;
+        if (slot->generation == 0) {
+            slot->generation = 1;
+        }
+        handle = handle_map_slot_vhandle (map, index);
+        slot->vhandle = handle;
+    }
+    handle_map_unlock (map);
 
-    /* (2 ^ 24) - 1 handles max, return 0 if we roll over*/
-    if (map->handle_count & TPM2_HR_RANGE_MASK)
-        return 0;
-    handle = map->handle_count + (TPM2_HANDLE)(map->handle_type << TPM2_HR_SHIFT);
-    ++map->handle_count;
     return handle;
 }
+/*
+ * Invoke 'callback' with the virtual handle and HandleMapEntry of each
+ * entry in the map, in ascending virtual handle order.
+ */
 void
 handle_map_foreach (HandleMap *map,
                     GHFunc     callback,
                     gpointer   user_data)
 {
-    g_hash_table_foreach (map->vhandle_to_entry_table,
-                          callback,
-                          user_data);
+    guint i;
+
+    for (i = 0; i < map->slot_count; ++i) {
+        if (map->slots [i].entry != NULL) {
+            callback (GUINT_TO_POINTER (map->slots [i].vhandle),
+                      map->slots [i].entry,
+                      user_data);
+        }
+    }
 }
 /*
- * Get a GList containing all keys from the map. These will be returned in no
- * particular order so don't assume that it's sorted in any way.
+ * Get a GList containing the virtual handles of all entries in the map in
+ * ascending order.
  */
 GList*
 handle_map_get_keys (HandleMap *map)
 {
-    return g_hash_table_get_keys (map->vhandle_to_entry_table);
+    GList *keys = NULL;
+    guint i;
+
+    for (i = map->slot_count; i > 0; --i) {
+        if (map->slots [i - 1].entry != NULL) {
+            keys = g_list_prepend (keys,
+                                   GUINT_TO_POINTER (map->slots [i - 1].vhandle));
+        }
+    }
+    return keys;
 }
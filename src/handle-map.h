@@ -39,17 +39,47 @@ G_BEGIN_DECLS
 #define MAX_ENTRIES_DEFAULT 27
 #define MAX_ENTRIES_MAX     100
 
+/*
+ * Virtual handles are made up of the handle type in the upper byte, the
+ * index of the slot holding the entry and the generation of the slot:
+ * 0xTTSSGGGG. The generation is advanced each time the slot is reused so
+ * a stale handle doesn't find the entry that replaced it, and it's never
+ * 0 so neither is the lower 24 bits of a virtual handle.
+ */
+#define HANDLE_MAP_SLOT_SHIFT       16
+#define HANDLE_MAP_SLOT_MASK        0xff
+#define HANDLE_MAP_GENERATION_MASK  0xffff
+
 typedef struct _HandleMapClass {
     GObjectClass      parent;
 } HandleMapClass;
 
+/*
+ * A slot is free when 'vhandle' is 0 and reserved when it has a 'vhandle'
+ * from handle_map_next_vhandle but no 'entry' yet.
+ */
+typedef struct _HandleMapSlot {
+    HandleMapEntry     *entry;
+    TPM2_HANDLE         vhandle;
+    guint16             generation;
+} HandleMapSlot;
+
+/*
+ * Entries live in the dense 'slots' array. Slots below 'slot_count' have
+ * been used, and the indexes of those that have been freed since are kept
+ * on the 'free_slots' stack for reuse. Iterating over the slots visits the
+ * entries in ascending virtual handle order.
+ */
 typedef struct _HandleMap {
     GObject             parent_instance;
     pthread_mutex_t     mutex;
     TPM2_HT              handle_type;
-    TPM2_HANDLE          handle_count;
-    GHashTable         *vhandle_to_entry_table;
     guint               max_entries;
+    guint               size;
+    guint               slot_count;
+    guint               free_count;
+    guint8              free_slots [MAX_ENTRIES_MAX];
+    HandleMapSlot       slots [MAX_ENTRIES_MAX];
 } HandleMap;
 
 #define TYPE_HANDLE_MAP              (handle_map_get_type   ())
@@ -38,6 +38,23 @@ extern "C" {
 #define TCTI_TABRMD_DBUS_NAME_DEFAULT      "com.intel.tss2.Tabrmd"
 #define TCTI_TABRMD_DBUS_TYPE_DEFAULT      TCTI_TABRMD_DBUS_TYPE_SYSTEM
 
+/*
+ * Commands with these vendor specific command codes are handled by the
+ * daemon itself and never reach the TPM. They're sent with the transmit
+ * function of the TCTI like any other command and work over every
+ * transport the daemon supports.
+ * TCTI_TABRMD_CC_SET_TIMEOUT: takes a single UINT32 parameter, the time in
+ *   milliseconds that commands sent after it may spend in the daemon. A
+ *   command that reaches the front of the queue after that is answered
+ *   with TPM2_RC_CANCELED instead of being sent to the TPM. 0 (the
+ *   default) is no limit. The response is a bare 10 byte header.
+ * TCTI_TABRMD_CC_CANCEL: takes no parameters and has no response. It
+ *   cancels the commands sent on the connection that haven't been answered
+ *   yet and is meant to be sent while the client waits for one of them.
+ */
+#define TCTI_TABRMD_CC_SET_TIMEOUT ((TPM2_CC)0x20000101)
+#define TCTI_TABRMD_CC_CANCEL      ((TPM2_CC)0x20000102)
+
 typedef enum {
     TCTI_TABRMD_DBUS_TYPE_NONE,
     TCTI_TABRMD_DBUS_TYPE_SESSION,
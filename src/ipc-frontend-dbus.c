@@ -279,7 +279,8 @@ get_pid_from_dbus_invocation (GDBusProxy            *proxy,
  * Generate a random uint64 returned in the id out paramter.
  * Mix this random ID with the PID from the caller. This is obtained
  * through the invocation parameter. Mix the two together using xor and
- * return the result through the id_pid_mix out parameter.
+ * return the result through the id_pid_mix out parameter. The PID is
+ * returned through the pid out parameter.
  * NOTE: if an error occurs then a response is sent through the invocation
  * to the client and FALSE is returned to the caller.
  *
@@ -289,17 +290,17 @@ static gboolean
 generate_id_pid_mix_from_invocation (IpcFrontendDbus        *self,
                                      GDBusMethodInvocation  *invocation,
                                      guint64                *id,
-                                     guint64                *id_pid_mix)
+                                     guint64                *id_pid_mix,
+                                     guint32                *pid)
 {
     gboolean pid_ret = FALSE;
-    guint32  pid = 0;
 
     pid_ret = get_pid_from_dbus_invocation (self->dbus_daemon_proxy,
                                             invocation,
-                                            &pid);
+                                            pid);
     if (pid_ret == TRUE) {
         *id = random_get_uint64 (self->random);
-        *id_pid_mix = *id ^ pid;
+        *id_pid_mix = *id ^ *pid;
     } else {
         g_dbus_method_invocation_return_error (invocation,
                                                TABRMD_ERROR,
@@ -368,6 +369,8 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
     GVariant *response_variants[2], *response_tuple;
     GUnixFDList *fd_list = NULL;
     guint64 id = 0, id_pid_mix = 0;
+    guint32 pid = 0;
+    gchar *identity;
     gboolean id_ret = FALSE;
 
     self = IPC_FRONTEND_DBUS (user_data);
@@ -382,7 +385,8 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
     id_ret = generate_id_pid_mix_from_invocation (self,
                                                   invocation,
                                                   &id,
-                                                  &id_pid_mix);
+                                                  &id_pid_mix,
+                                                  &pid);
     /* error already returned to caller over dbus */
     if (id_ret == FALSE) {
         return TRUE;
@@ -407,6 +411,9 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
     g_object_unref (iostream);
     if (connection == NULL)
         g_error ("Failed to allocate new connection.");
+    identity = g_strdup_printf ("pid:%" PRIu32, pid);
+    connection_set_identity (connection, identity);
+    g_free (identity);
     g_debug ("Created connection with client FD: %d and id: 0x%" PRIx64,
              client_fd, id_pid_mix);
     /* prepare tuple variant for response message */
@@ -438,15 +445,14 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
  * Tpm2AcessBroker. It is invoked by a signal generated by a user
  * requesting that an outstanding TPM command should be canceled. It is
  * registered with the Tabrmd in response to acquiring a name
- * on the dbus (on_name_acquired). It does X things:
+ * on the dbus (on_name_acquired). It does 2 things:
  * - Locate the Connection object associted with the 'id' parameter in
  *   the ConnectionManager.
- * - If the connection has a command being processed by the tabrmd then it's
- *   removed from the processing queue.
- * - If the connection has a command being processed by the TPM then the
- *   request to cancel the command will be sent down to the TPM.
- * - If the connection has no commands outstanding then an error is
- *   returned.
+ * - Cancel the commands from the connection through the ConnectionManager.
+ *   Commands still being processed by the tabrmd are answered with
+ *   TPM2_RC_CANCELED instead of being sent to the TPM. If the TPM is
+ *   running one of them the request to cancel it is sent down to the TPM.
+ * Canceling a connection with no commands outstanding is not an error.
  */
 static gboolean
 on_handle_cancel (TctiTabrmd            *skeleton,
@@ -483,10 +489,10 @@ on_handle_cancel (TctiTabrmd            *skeleton,
     g_info ("canceling command for connection 0x%" PRIxPTR " with "
             "id_pid_mix: 0x%" PRIx64, (uintptr_t)connection, id_pid_mix);
     /* cancel any existing commands for the connection */
-    g_dbus_method_invocation_return_error (invocation,
-                                           TABRMD_ERROR,
-                                           TABRMD_ERROR_NOT_IMPLEMENTED,
-                                           "Cancel function not implemented.");
+    connection_manager_cancel (self->connection_manager, connection);
+    g_dbus_method_invocation_return_value (invocation,
+                                           g_variant_new ("(u)",
+                                                          TSS2_RC_SUCCESS));
     g_object_unref (connection);
 
     return TRUE;
@@ -26,6 +26,7 @@
  */
 
 #include <inttypes.h>
+#include <sys/socket.h>
 
 #include "ipc-frontend-tls.h"
 #include "tabrmd.h"
@@ -253,6 +254,35 @@ get_remote_name (GSocket *socket, gchar **name)
     return TRUE;
 }
 
+/*
+ * Get the identity of the remote client: its address without the port, so
+ * that all connections from the same host share a scheduling weight.
+ * Returns FALSE on error, TRUE otherwise.
+ */
+static gboolean
+get_remote_identity (GSocket *socket,
+                     gchar   *identity,
+                     gsize    size)
+{
+    GSocketAddress *address;
+    gchar *host;
+
+    address = g_socket_get_remote_address (socket, NULL);
+    if (address == NULL)
+        return FALSE;
+    if (!G_IS_INET_SOCKET_ADDRESS (address)) {
+        g_object_unref (address);
+        return FALSE;
+    }
+    host = g_inet_address_to_string (
+               g_inet_socket_address_get_address (
+                   G_INET_SOCKET_ADDRESS (address)));
+    g_snprintf (identity, size, "tls:%s", host);
+    g_free (host);
+    g_object_unref (address);
+
+    return TRUE;
+}
 /*
  * Generate an ID based on the ip address and port.
  * In fact the ID is only 32-bit length due to the
@@ -299,6 +329,7 @@ on_handle_create_connection (GPollableInputStream *istream,
     Connection *connection = NULL;
     GCancellable *cancellable = NULL;
     gchar *remote_name;
+    gchar identity [IPC_FRONTEND_TLS_IDENTITY_MAX] = { 0, };
     GIOStream *stream, *tls_stream;
     GError *error = NULL;
     guint64 id = 0;
@@ -328,6 +359,11 @@ on_handle_create_connection (GPollableInputStream *istream,
     }
     g_debug ("Get a new connection from %s", remote_name);
     g_free (remote_name);
+    if (!get_remote_identity (socket, identity, sizeof (identity))) {
+        g_warning ("Error getting remote identity");
+        g_object_unref (socket);
+        return FALSE;
+    }
 
     stream = G_IO_STREAM (g_socket_connection_factory_create_connection (socket));
     if (!stream) {
@@ -383,6 +419,7 @@ on_handle_create_connection (GPollableInputStream *istream,
         g_object_unref (stream);
         return FALSE;
     }
+    connection_set_identity (connection, identity);
     g_object_unref (handle_map);
     g_object_unref (stream);
     /*
@@ -434,6 +471,8 @@ create_listen_socket(gchar *ip, guint port)
     }
     g_object_unref (address);
 
+    /* the GSocket default of 10 drops bursts of clients connecting at once */
+    g_socket_set_listen_backlog (socket, SOMAXCONN);
     if (!g_socket_listen (socket, &error)) {
         g_warning ("Can't listen on socket: %s", error->message);
         g_error_free (error);
@@ -41,6 +41,8 @@ G_BEGIN_DECLS
 #define IPC_FRONTEND_SOCKET_PORT_DEFAULT 4433
 #define IPC_FRONTEND_SOCKET_FAMILY_DEFAULT G_SOCKET_FAMILY_IPV4
 #define IPC_FRONTEND_SOCKET_TIME_OUT_DEFAULT 300 /* second */
+/* "tls:" prefix + longest IPv6 address string + NUL */
+#define IPC_FRONTEND_TLS_IDENTITY_MAX (4 + 46 + 1)
 
 typedef struct _IpcFrontendTlsClass {
    IpcFrontendClass     parent;
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency-table.h"
+
+typedef struct {
+    guint64  estimate;
+    guint64  count;
+} latency_table_entry_t;
+
+G_DEFINE_TYPE (LatencyTable, latency_table, G_TYPE_OBJECT);
+
+static void
+latency_table_init (LatencyTable *self)
+{
+    self->table = g_hash_table_new_full (g_direct_hash,
+                                         g_direct_equal,
+                                         NULL,
+                                         free);
+    if (pthread_mutex_init (&self->mutex, NULL) != 0)
+        g_error ("Failed to initialize LatencyTable mutex: %s",
+                 strerror (errno));
+}
+static void
+latency_table_finalize (GObject *obj)
+{
+    LatencyTable *table = LATENCY_TABLE (obj);
+
+    g_clear_pointer (&table->table, g_hash_table_unref);
+    pthread_mutex_destroy (&table->mutex);
+    G_OBJECT_CLASS (latency_table_parent_class)->finalize (obj);
+}
+static void
+latency_table_class_init (LatencyTableClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    object_class->finalize = latency_table_finalize;
+}
+/*
+ * Allocate a new, empty LatencyTable. The caller owns the returned
+ * reference.
+ */
+LatencyTable*
+latency_table_new (void)
+{
+    return LATENCY_TABLE (g_object_new (TYPE_LATENCY_TABLE, NULL));
+}
+/*
+ * Fold the execution time of a command, in microseconds, into the
+ * estimate for its command code. The first sample becomes the estimate.
+ */
+void
+latency_table_update (LatencyTable *table,
+                      TPM2_CC       command_code,
+                      guint64       latency)
+{
+    latency_table_entry_t *entry;
+
+    g_assert_nonnull (table);
+    pthread_mutex_lock (&table->mutex);
+    entry = g_hash_table_lookup (table->table,
+                                 GUINT_TO_POINTER (command_code));
+    if (entry == NULL) {
+        entry = calloc (1, sizeof (latency_table_entry_t));
+        if (entry == NULL)
+            g_error ("%s: failed to allocate entry: %s", __func__,
+                     strerror (errno));
+        entry->estimate = latency;
+        g_hash_table_insert (table->table,
+                             GUINT_TO_POINTER (command_code),
+                             entry);
+    } else if (latency > entry->estimate) {
+        entry->estimate += (latency - entry->estimate) >>
+                           LATENCY_TABLE_EWMA_SHIFT;
+    } else {
+        entry->estimate -= (entry->estimate - latency) >>
+                           LATENCY_TABLE_EWMA_SHIFT;
+    }
+    ++entry->count;
+    g_debug ("%s: TPM2_CC 0x%" PRIx32 " took %" PRIu64 "us, estimate %"
+             PRIu64 "us from %" PRIu64 " samples", __func__, command_code,
+             latency, entry->estimate, entry->count);
+    pthread_mutex_unlock (&table->mutex);
+}
+/*
+ * Get the expected execution time of a command code in microseconds.
+ * Returns 0 if the command code hasn't been seen yet.
+ */
+guint64
+latency_table_estimate (LatencyTable *table,
+                        TPM2_CC       command_code)
+{
+    latency_table_entry_t *entry;
+    guint64 estimate = 0;
+
+    g_assert_nonnull (table);
+    pthread_mutex_lock (&table->mutex);
+    entry = g_hash_table_lookup (table->table,
+                                 GUINT_TO_POINTER (command_code));
+    if (entry != NULL)
+        estimate = entry->estimate;
+    pthread_mutex_unlock (&table->mutex);
+    return estimate;
+}
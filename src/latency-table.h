@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef LATENCY_TABLE_H
+#define LATENCY_TABLE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <pthread.h>
+#include <sapi/tpm20.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Each new sample moves the estimate 1/2^LATENCY_TABLE_EWMA_SHIFT of the
+ * way towards it.
+ */
+#define LATENCY_TABLE_EWMA_SHIFT 3
+
+typedef struct _LatencyTableClass {
+    GObjectClass parent;
+} LatencyTableClass;
+
+/*
+ * Online estimate of the time the TPM takes to execute each command code,
+ * kept as an exponentially weighted moving average of observed execution
+ * times in microseconds.
+ */
+typedef struct _LatencyTable {
+    GObject          parent_instance;
+    pthread_mutex_t  mutex;
+    GHashTable      *table;
+} LatencyTable;
+
+#define TYPE_LATENCY_TABLE           (latency_table_get_type               ())
+#define LATENCY_TABLE(obj)           (G_TYPE_CHECK_INSTANCE_CAST ((obj), TYPE_LATENCY_TABLE, LatencyTable))
+#define LATENCY_TABLE_CLASS(cls)     (G_TYPE_CHECK_CLASS_CAST    ((cls), TYPE_LATENCY_TABLE, LatencyTableClass))
+#define IS_LATENCY_TABLE(obj)        (G_TYPE_CHECK_INSTANCE_TYPE ((obj), TYPE_LATENCY_TABLE))
+#define IS_LATENCY_TABLE_CLASS(cls)  (G_TYPE_CHECK_CLASS_TYPE    ((cls), TYPE_LATENCY_TABLE))
+#define LATENCY_TABLE_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS  ((obj), TYPE_LATENCY_TABLE, LatencyTableClass))
+
+GType          latency_table_get_type   (void);
+LatencyTable*  latency_table_new        (void);
+void           latency_table_update     (LatencyTable   *table,
+                                         TPM2_CC         command_code,
+                                         guint64         latency);
+guint64        latency_table_estimate   (LatencyTable   *table,
+                                         TPM2_CC         command_code);
+
+G_END_DECLS
+#endif /* LATENCY_TABLE_H */
@@ -27,36 +27,136 @@
 #include <errno.h>
 #include <glib.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "message-queue.h"
 
+#define MESSAGE_QUEUE_MASK (MESSAGE_QUEUE_CAPACITY - 1)
+
 G_DEFINE_TYPE (MessageQueue, message_queue, G_TYPE_OBJECT);
 
+/*
+ * Block while the futex word at 'addr' holds 'value'. Spurious wakeups
+ * are fine, callers recheck their condition.
+ */
+static void
+message_queue_futex_wait (gint *addr,
+                          gint  value)
+{
+    if (syscall (SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0)
+        == -1 && errno != EAGAIN && errno != EINTR)
+    {
+        g_error ("%s: futex wait failed: %s", __func__, strerror (errno));
+    }
+}
+/*
+ * Wake up to 'count' threads waiting on the futex word at 'addr'.
+ */
+static void
+message_queue_futex_wake (gint *addr,
+                          gint  count)
+{
+    if (syscall (SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0)
+        == -1)
+    {
+        g_error ("%s: futex wake failed: %s", __func__, strerror (errno));
+    }
+}
 /**
- * The init function is a noop but it's required by the G_DEFINE_TYPE
- * macro.
+ * Initialize the ring. Each slot starts out free for the position that
+ * maps to it on the first pass.
  */
 static void
 message_queue_init (MessageQueue *self)
 {
-    self->queue = g_async_queue_new_full (g_object_unref);
+    guint i;
+
+    self->slots = g_new0 (MessageQueueSlot, MESSAGE_QUEUE_CAPACITY);
+    for (i = 0; i < MESSAGE_QUEUE_CAPACITY; ++i) {
+        self->slots [i].sequence = i;
+    }
 }
 /*
- * To finalize the MessageQueue we need only to unref the internal
- * GAsyncQueue object.
+ * Take the object at the tail of the ring if there is one. Only the
+ * consumer calls this. Producers blocked on a full ring are woken once
+ * the slot has been released.
+ */
+static GObject*
+message_queue_try_pop (MessageQueue *message_queue)
+{
+    MessageQueueSlot *slot;
+    GObject *obj;
+    guint pos = message_queue->tail;
+
+    slot = &message_queue->slots [pos & MESSAGE_QUEUE_MASK];
+    if ((guint)g_atomic_int_get (&slot->sequence) != pos + 1) {
+        return NULL;
+    }
+    obj = slot->obj;
+    slot->obj = NULL;
+    g_atomic_int_set (&slot->sequence, pos + MESSAGE_QUEUE_CAPACITY);
+    message_queue->tail = pos + 1;
+    if (g_atomic_int_get (&message_queue->producers_waiting) > 0) {
+        g_atomic_int_inc (&message_queue->space);
+        message_queue_futex_wake (&message_queue->space, INT_MAX);
+    }
+    return obj;
+}
+/*
+ * Called by a producer that found the slot for position 'pos' still
+ * occupied. Sleep until the consumer releases a slot. We register as a
+ * waiter before checking the slot again so the consumer either sees us
+ * waiting or we see the free slot.
+ */
+static void
+message_queue_wait_space (MessageQueue *message_queue,
+                          guint         pos)
+{
+    MessageQueueSlot *slot = &message_queue->slots [pos & MESSAGE_QUEUE_MASK];
+    gint space;
+
+    g_atomic_int_inc (&message_queue->producers_waiting);
+    space = g_atomic_int_get (&message_queue->space);
+    if ((gint)((guint)g_atomic_int_get (&slot->sequence) - pos) < 0) {
+        g_debug ("%s: MessageQueue 0x%" PRIxPTR " full", __func__,
+                 (uintptr_t)message_queue);
+        message_queue_futex_wait (&message_queue->space, space);
+    }
+    g_atomic_int_add (&message_queue->producers_waiting, -1);
+}
+/*
+ * Unref any objects still in the ring.
  */
 static void
 message_queue_dispose (GObject *obj)
 {
     MessageQueue *message_queue = MESSAGE_QUEUE (obj);
+    GObject *msg;
 
-    g_clear_pointer (&message_queue->queue, g_async_queue_unref);
+    while ((msg = message_queue_try_pop (message_queue)) != NULL) {
+        g_object_unref (msg);
+    }
     G_OBJECT_CLASS (message_queue_parent_class)->dispose (obj);
 }
+/*
+ * Free the ring itself.
+ */
+static void
+message_queue_finalize (GObject *obj)
+{
+    MessageQueue *message_queue = MESSAGE_QUEUE (obj);
+
+    g_clear_pointer (&message_queue->slots, g_free);
+    G_OBJECT_CLASS (message_queue_parent_class)->finalize (obj);
+}
 /**
- * Boilerplate GObject class init with custom dispose function.
+ * Boilerplate GObject class init with custom dispose and finalize
+ * functions.
  */
 static void
 message_queue_class_init (MessageQueueClass *klass)
@@ -64,6 +164,7 @@ message_queue_class_init (MessageQueueClass *klass)
     GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
     object_class->dispose = message_queue_dispose;
+    object_class->finalize = message_queue_finalize;
 }
 /**
  * Allocate a new message_queue_t object.
@@ -77,24 +178,48 @@ message_queue_new ()
     return MESSAGE_QUEUE (g_object_new (TYPE_MESSAGE_QUEUE, NULL));
 }
 /**
- * Enqueue a blob in the blob_queue_t.
- * This function is a thin wrapper around the GQueue. When we enqueue blobs
- * we push them to the head of the queue.
+ * Enqueue an object in the MessageQueue. Any number of threads may
+ * enqueue concurrently. The queue takes a reference to the object. If the
+ * ring is full the caller blocks until the consumer makes room.
  */
 void
 message_queue_enqueue (MessageQueue  *message_queue,
                        GObject       *object)
 {
+    MessageQueueSlot *slot;
+    guint pos;
+    gint diff;
+
     g_assert (message_queue != NULL);
     g_debug ("message_queue_enqueue 0x%" PRIxPTR " : message 0x%" PRIxPTR,
              (uintptr_t)message_queue, (uintptr_t)object);
     g_object_ref (object);
-    g_async_queue_push (message_queue->queue, object);
+    while (TRUE) {
+        pos = (guint)g_atomic_int_get (&message_queue->head);
+        slot = &message_queue->slots [pos & MESSAGE_QUEUE_MASK];
+        diff = (gint)((guint)g_atomic_int_get (&slot->sequence) - pos);
+        if (diff == 0) {
+            if (g_atomic_int_compare_and_exchange (&message_queue->head,
+                                                   pos,
+                                                   pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            message_queue_wait_space (message_queue, pos);
+        }
+        /* diff > 0: another producer took this slot, try the next one */
+    }
+    slot->obj = object;
+    g_atomic_int_set (&slot->sequence, pos + 1);
+    if (g_atomic_int_get (&message_queue->consumer_waiting)) {
+        g_atomic_int_set (&message_queue->consumer_waiting, 0);
+        message_queue_futex_wake (&message_queue->consumer_waiting, 1);
+    }
 }
 /**
- * Dequeue a blob from the blob_queue_t.
- * This function is a thin wrapper around the GQueue. When we dequeue blobs
- * we pop them from the tail of the queue.
+ * Dequeue an object from the MessageQueue, blocking until one is
+ * available. Only a single thread may dequeue from a MessageQueue. The
+ * caller owns the reference to the returned object.
  */
 GObject*
 message_queue_dequeue (MessageQueue *message_queue)
@@ -103,7 +228,20 @@ message_queue_dequeue (MessageQueue *message_queue)
 
     g_assert (message_queue != NULL);
     g_debug ("message_queue_dequeue 0x%" PRIxPTR, (uintptr_t)message_queue);
-    obj = g_async_queue_pop (message_queue->queue);
+    while ((obj = message_queue_try_pop (message_queue)) == NULL) {
+        /*
+         * Announce that we're going to sleep before looking at the ring a
+         * second time: a producer that publishes after this either sees
+         * the flag and wakes us or we see its object.
+         */
+        g_atomic_int_set (&message_queue->consumer_waiting, 1);
+        obj = message_queue_try_pop (message_queue);
+        if (obj != NULL) {
+            g_atomic_int_set (&message_queue->consumer_waiting, 0);
+            break;
+        }
+        message_queue_futex_wait (&message_queue->consumer_waiting, 1);
+    }
     g_debug ("  got obj: 0x%" PRIxPTR, (uintptr_t)obj);
     return obj;
 }
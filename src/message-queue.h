@@ -32,13 +32,34 @@
 
 G_BEGIN_DECLS
 
+/* number of slots in the ring, must be a power of 2 */
+#define MESSAGE_QUEUE_CAPACITY 1024
+
 typedef struct _MessageQueueClass {
     GObjectClass parent;
 } MessageQueueClass;
-
+/*
+ * A slot in the ring. The sequence number tells producers and the
+ * consumer whose turn it is: a slot at position 'pos' is free when its
+ * sequence is 'pos' and holds an object when it's 'pos + 1'.
+ */
+typedef struct {
+    guint         sequence;
+    GObject      *obj;
+} MessageQueueSlot;
+/*
+ * A bounded multi-producer / single-consumer queue. Producers claim slots
+ * by advancing 'head' with a CAS, the consumer owns 'tail'. Threads only
+ * sleep (on a futex) when the ring is empty or full.
+ */
 typedef struct _MessageQueue {
-    GObject       parent_instance;
-    GAsyncQueue  *queue;
+    GObject           parent_instance;
+    MessageQueueSlot *slots;
+    guint             head;
+    guint             tail;
+    gint              consumer_waiting;
+    gint              producers_waiting;
+    gint              space;
 } MessageQueue;
 
 #define TYPE_MESSAGE_QUEUE           (message_queue_get_type             ())
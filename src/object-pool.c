@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <glib.h>
+#include <inttypes.h>
+
+#include "object-pool.h"
+
+static gint object_pool_disabled = FALSE;
+/*
+ * Take an idle instance from the pool. Returns NULL if the pool is empty,
+ * the caller then creates a new instance with g_object_new.
+ */
+GObject*
+object_pool_get (ObjectPool *pool)
+{
+    GObject *obj = NULL;
+
+    pthread_mutex_lock (&pool->mutex);
+    if (pool->count > 0) {
+        obj = pool->objects [--pool->count];
+        pool->objects [pool->count] = NULL;
+    }
+    pthread_mutex_unlock (&pool->mutex);
+
+    return obj;
+}
+/*
+ * Offer an instance being disposed to the pool. Only instances on their
+ * way to being finalized, with the one reference being dropped left, are
+ * taken. Returns FALSE if the instance wasn't taken because it's still
+ * referenced elsewhere, the pool is full or pooling is disabled.
+ */
+gboolean
+object_pool_put (ObjectPool *pool,
+                 GObject    *obj)
+{
+    gboolean ret = FALSE;
+
+    if (g_atomic_int_get (&object_pool_disabled) ||
+        g_atomic_int_get ((gint*)&obj->ref_count) != 1)
+    {
+        return FALSE;
+    }
+    pthread_mutex_lock (&pool->mutex);
+    if (pool->count < OBJECT_POOL_SIZE) {
+        pool->objects [pool->count++] = g_object_ref (obj);
+        ret = TRUE;
+    }
+    pthread_mutex_unlock (&pool->mutex);
+    g_debug ("%s: GObject 0x%" PRIxPTR " %s", __func__, (uintptr_t)obj,
+             ret ? "pooled" : "not pooled, pool is full");
+
+    return ret;
+}
+/*
+ * Pooling is enabled by default. Disabling it stops instances from being
+ * returned to any pool, those already pooled are still handed out. This
+ * is for the benchmark and for chasing leaks with valgrind, where pooled
+ * instances would show up as still reachable.
+ */
+void
+object_pool_set_enabled (gboolean enabled)
+{
+    g_atomic_int_set (&object_pool_disabled, !enabled);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <pthread.h>
+
+G_BEGIN_DECLS
+
+/* maximum number of idle instances kept per pool */
+#define OBJECT_POOL_SIZE 64
+
+/*
+ * A free list of idle instances of a single GObject type. Instead of being
+ * finalized when their last reference is dropped, instances are kept here
+ * and handed out again by the _new function of the type. This saves the
+ * g_object_new and the malloc / free for each message on the hot path.
+ *
+ * The dispose function of the type resets the instance and offers it to
+ * the pool with object_pool_put. If that returns TRUE the pool has taken a
+ * reference, which keeps the instance alive, and dispose must return
+ * without chaining up. An instance from object_pool_get comes with that
+ * reference, the caller owns it.
+ */
+typedef struct _ObjectPool {
+    pthread_mutex_t  mutex;
+    guint            count;
+    GObject         *objects [OBJECT_POOL_SIZE];
+} ObjectPool;
+
+#define OBJECT_POOL_INIT { PTHREAD_MUTEX_INITIALIZER, 0, { NULL, } }
+
+GObject*       object_pool_get                (ObjectPool       *pool);
+gboolean       object_pool_put                (ObjectPool       *pool,
+                                               GObject          *obj);
+void           object_pool_set_enabled        (gboolean          enabled);
+
+G_END_DECLS
+#endif /* OBJECT_POOL_H */
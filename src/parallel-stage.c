@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "connection.h"
+#include "control-message.h"
+#include "parallel-stage.h"
+#include "sink-interface.h"
+#include "source-interface.h"
+#include "tpm2-command.h"
+#include "tpm2-response.h"
+
+static void parallel_stage_sink_interface_init   (gpointer g_iface);
+static void parallel_stage_source_interface_init (gpointer g_iface);
+
+G_DEFINE_ABSTRACT_TYPE_WITH_CODE (
+    ParallelStage,
+    parallel_stage,
+    TYPE_THREAD,
+    G_IMPLEMENT_INTERFACE (TYPE_SINK,
+                           parallel_stage_sink_interface_init);
+    G_IMPLEMENT_INTERFACE (TYPE_SOURCE,
+                           parallel_stage_source_interface_init);
+    );
+
+enum {
+    PROP_0,
+    PROP_WORKERS,
+    PROP_SINK,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * Data passed to each worker thread.
+ */
+typedef struct {
+    ParallelStage *stage;
+    MessageQueue  *queue;
+} parallel_stage_worker_t;
+/*
+ * Select the worker that processes the provided object. Objects belonging
+ * to the same Connection always go to the same worker so they're
+ * processed in the order they arrived.
+ */
+guint
+parallel_stage_get_worker (ParallelStage *stage,
+                           GObject       *obj)
+{
+    Connection *connection = NULL;
+    guint worker = 0;
+
+    if (IS_TPM2_COMMAND (obj)) {
+        connection = tpm2_command_get_connection (TPM2_COMMAND (obj));
+    } else if (IS_TPM2_RESPONSE (obj)) {
+        connection = tpm2_response_get_connection (TPM2_RESPONSE (obj));
+    }
+    if (connection != NULL && stage->workers > 0) {
+        worker = connection->id % stage->workers;
+        g_object_unref (connection);
+    }
+    return worker;
+}
+/*
+ * Process a single object and pass the result on to the Sink.
+ */
+static void
+parallel_stage_process (ParallelStage *stage,
+                        GObject       *obj)
+{
+    GObject *out;
+
+    out = PARALLEL_STAGE_GET_CLASS (stage)->process (stage, obj);
+    if (out == NULL) {
+        return;
+    }
+    if (stage->sink != NULL) {
+        sink_enqueue (stage->sink, out);
+    } else {
+        g_warning ("%s: ParallelStage 0x%" PRIxPTR " has no Sink, dropping "
+                   "obj 0x%" PRIxPTR, __func__, (uintptr_t)stage,
+                   (uintptr_t)out);
+    }
+    g_object_unref (out);
+}
+/*
+ * Implement the 'enqueue' function from the Sink interface. A stage with
+ * no workers runs to completion: the object is processed on the thread
+ * that enqueued it.
+ */
+void
+parallel_stage_enqueue (Sink    *sink,
+                        GObject *obj)
+{
+    ParallelStage *stage = PARALLEL_STAGE (sink);
+    guint worker;
+
+    if (obj == NULL)
+        g_error ("%s: passed NULL object", __func__);
+    if (stage->workers == 0) {
+        parallel_stage_process (stage, obj);
+        return;
+    }
+    worker = parallel_stage_get_worker (stage, obj);
+    g_debug ("%s: ParallelStage 0x%" PRIxPTR " obj 0x%" PRIxPTR " to worker "
+             "%u", __func__, (uintptr_t)stage, (uintptr_t)obj, worker);
+    message_queue_enqueue (stage->queues [worker], obj);
+}
+/*
+ * Implement the 'add_sink' function from the Source interface.
+ */
+static void
+parallel_stage_add_sink (Source *self,
+                         Sink   *sink)
+{
+    ParallelStage *stage = PARALLEL_STAGE (self);
+    GValue value = G_VALUE_INIT;
+
+    g_debug ("%s: ParallelStage 0x%" PRIxPTR ", Sink 0x%" PRIxPTR,
+             __func__, (uintptr_t)stage, (uintptr_t)sink);
+    g_value_init (&value, G_TYPE_OBJECT);
+    g_value_set_object (&value, sink);
+    g_object_set_property (G_OBJECT (stage), "sink", &value);
+    g_value_unset (&value);
+}
+/*
+ * Process objects from one input queue until a ControlMessage arrives.
+ */
+static void
+parallel_stage_work (ParallelStage *stage,
+                     MessageQueue  *queue)
+{
+    GObject *obj;
+
+    while (TRUE) {
+        obj = message_queue_dequeue (queue);
+        g_debug ("%s: ParallelStage 0x%" PRIxPTR " got obj 0x%" PRIxPTR,
+                 __func__, (uintptr_t)stage, (uintptr_t)obj);
+        if (IS_CONTROL_MESSAGE (obj)) {
+            g_object_unref (obj);
+            break;
+        }
+        parallel_stage_process (stage, obj);
+        g_object_unref (obj);
+    }
+}
+static void*
+parallel_stage_worker (void *data)
+{
+    parallel_stage_worker_t *worker = (parallel_stage_worker_t*)data;
+
+    parallel_stage_work (worker->stage, worker->queue);
+    return NULL;
+}
+/*
+ * The thread started by thread_start. It starts the additional workers,
+ * serves the first queue itself and joins the other workers once it's
+ * been cancelled. Without workers there's nothing to do.
+ */
+static void*
+parallel_stage_thread (void *data)
+{
+    ParallelStage *stage = PARALLEL_STAGE (data);
+    parallel_stage_worker_t *workers;
+    guint i;
+    gint ret;
+
+    if (stage->workers == 0) {
+        return NULL;
+    }
+    workers = g_new0 (parallel_stage_worker_t, stage->workers);
+    for (i = 1; i < stage->workers; ++i) {
+        workers [i].stage = stage;
+        workers [i].queue = stage->queues [i];
+        ret = pthread_create (&stage->worker_ids [i],
+                              NULL,
+                              parallel_stage_worker,
+                              &workers [i]);
+        if (ret != 0)
+            g_error ("%s: failed to start worker %u: %d", __func__, i, ret);
+    }
+    parallel_stage_work (stage, stage->queues [0]);
+    for (i = 1; i < stage->workers; ++i) {
+        pthread_join (stage->worker_ids [i], NULL);
+        stage->worker_ids [i] = 0;
+    }
+    g_free (workers);
+    return NULL;
+}
+/*
+ * Send a ControlMessage to each worker so they all exit.
+ */
+static void
+parallel_stage_unblock (Thread *self)
+{
+    ParallelStage *stage = PARALLEL_STAGE (self);
+    ControlMessage *msg;
+    guint i;
+
+    for (i = 0; i < stage->workers; ++i) {
+        msg = control_message_new (CHECK_CANCEL);
+        g_debug ("%s: enqueuing ControlMessage 0x%" PRIxPTR " for worker %u",
+                 __func__, (uintptr_t)msg, i);
+        message_queue_enqueue (stage->queues [i], G_OBJECT (msg));
+        g_object_unref (msg);
+    }
+}
+/**
+ * GObject property setter.
+ */
+static void
+parallel_stage_set_property (GObject        *object,
+                             guint           property_id,
+                             GValue const   *value,
+                             GParamSpec     *pspec)
+{
+    ParallelStage *self = PARALLEL_STAGE (object);
+    guint i;
+
+    switch (property_id) {
+    case PROP_WORKERS:
+        self->workers = g_value_get_uint (value);
+        self->queues = g_new0 (MessageQueue*, self->workers);
+        for (i = 0; i < self->workers; ++i) {
+            self->queues [i] = message_queue_new ();
+        }
+        self->worker_ids = g_new0 (pthread_t, self->workers);
+        g_debug ("%s: ParallelStage 0x%" PRIxPTR " workers: %u", __func__,
+                 (uintptr_t)self, self->workers);
+        break;
+    case PROP_SINK:
+        if (self->sink != NULL) {
+            g_warning ("  sink already set");
+            break;
+        }
+        self->sink = SINK (g_value_get_object (value));
+        g_object_ref (self->sink);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+/**
+ * GObject property getter.
+ */
+static void
+parallel_stage_get_property (GObject     *object,
+                             guint        property_id,
+                             GValue      *value,
+                             GParamSpec  *pspec)
+{
+    ParallelStage *self = PARALLEL_STAGE (object);
+
+    switch (property_id) {
+    case PROP_WORKERS:
+        g_value_set_uint (value, self->workers);
+        break;
+    case PROP_SINK:
+        g_value_set_object (value, self->sink);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+parallel_stage_dispose (GObject *obj)
+{
+    ParallelStage *stage = PARALLEL_STAGE (obj);
+    Thread *thread = THREAD (obj);
+    guint i;
+
+    g_debug ("%s: 0x%" PRIxPTR, __func__, (uintptr_t)obj);
+    if (thread->thread_id != 0)
+        g_error ("%s: thread running, cancel first", __func__);
+    if (stage->queues != NULL) {
+        for (i = 0; i < stage->workers; ++i) {
+            g_clear_object (&stage->queues [i]);
+        }
+        g_clear_pointer (&stage->queues, g_free);
+    }
+    g_clear_pointer (&stage->worker_ids, g_free);
+    g_clear_object (&stage->sink);
+    G_OBJECT_CLASS (parallel_stage_parent_class)->dispose (obj);
+}
+static void
+parallel_stage_init (ParallelStage *stage)
+{ /* noop */ }
+/**
+ * GObject class initialization function. This function boils down to:
+ * - Setting up the parent class.
+ * - Set dispose, property get/set.
+ * - Install properties.
+ */
+static void
+parallel_stage_class_init (ParallelStageClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    ThreadClass  *thread_class = THREAD_CLASS (klass);
+
+    if (parallel_stage_parent_class == NULL)
+        parallel_stage_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose      = parallel_stage_dispose;
+    object_class->get_property = parallel_stage_get_property;
+    object_class->set_property = parallel_stage_set_property;
+    thread_class->thread_run     = parallel_stage_thread;
+    thread_class->thread_unblock = parallel_stage_unblock;
+    klass->process = NULL;
+
+    obj_properties [PROP_WORKERS] =
+        g_param_spec_uint ("workers",
+                           "worker threads",
+                           "Number of threads processing input in parallel. "
+                           "0 processes input on the caller's thread.",
+                           0,
+                           PARALLEL_STAGE_WORKERS_MAX,
+                           PARALLEL_STAGE_WORKERS_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_SINK] =
+        g_param_spec_object ("sink",
+                             "Sink",
+                             "Reference to a Sink object.",
+                             G_TYPE_OBJECT,
+                             G_PARAM_READWRITE);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+/**
+ * Boilerplate code to register functions with the SinkInterface.
+ */
+static void
+parallel_stage_sink_interface_init (gpointer g_iface)
+{
+    SinkInterface *sink = (SinkInterface*)g_iface;
+    sink->enqueue = parallel_stage_enqueue;
+}
+/**
+ * Boilerplate code to register functions with the SourceInterface.
+ */
+static void
+parallel_stage_source_interface_init (gpointer g_iface)
+{
+    SourceInterface *source = (SourceInterface*)g_iface;
+    source->add_sink = parallel_stage_add_sink;
+}
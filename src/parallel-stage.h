@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef PARALLEL_STAGE_H
+#define PARALLEL_STAGE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <pthread.h>
+
+#include "message-queue.h"
+#include "sink-interface.h"
+#include "thread.h"
+
+G_BEGIN_DECLS
+
+#define PARALLEL_STAGE_WORKERS_DEFAULT 1
+#define PARALLEL_STAGE_WORKERS_MAX     64
+
+typedef struct _ParallelStage      ParallelStage;
+typedef struct _ParallelStageClass ParallelStageClass;
+
+/*
+ * Process an object taken from the input of the stage. This is called on
+ * one of the worker threads. The returned object, if not NULL, is passed
+ * on to the Sink of the stage and the caller takes ownership of the
+ * reference.
+ */
+typedef GObject* (*ParallelStageProcessFunc) (ParallelStage *self,
+                                              GObject       *obj);
+
+struct _ParallelStageClass {
+    ThreadClass              parent;
+    ParallelStageProcessFunc process;
+};
+
+/*
+ * A ParallelStage with 'workers' set to 0 has no queues or threads: objects
+ * are processed by the thread calling sink_enqueue.
+ */
+struct _ParallelStage {
+    Thread             parent_instance;
+    guint              workers;
+    MessageQueue     **queues;
+    pthread_t         *worker_ids;
+    Sink              *sink;
+};
+
+#define TYPE_PARALLEL_STAGE              (parallel_stage_get_type ())
+#define PARALLEL_STAGE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_PARALLEL_STAGE, ParallelStage))
+#define PARALLEL_STAGE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_PARALLEL_STAGE, ParallelStageClass))
+#define IS_PARALLEL_STAGE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_PARALLEL_STAGE))
+#define IS_PARALLEL_STAGE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_PARALLEL_STAGE))
+#define PARALLEL_STAGE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_PARALLEL_STAGE, ParallelStageClass))
+
+GType           parallel_stage_get_type      (void);
+void            parallel_stage_enqueue       (Sink           *sink,
+                                              GObject        *obj);
+guint           parallel_stage_get_worker    (ParallelStage  *stage,
+                                              GObject        *obj);
+
+G_END_DECLS
+#endif /* PARALLEL_STAGE_H */
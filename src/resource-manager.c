@@ -26,14 +26,16 @@
  */
 #include <errno.h>
 #include <inttypes.h>
+#include <string.h>
 
 #include <glib.h>
 
+#include "buffer-pool.h"
 #include "connection.h"
 #include "connection-manager.h"
 #include "control-message.h"
 #include "logging.h"
-#include "message-queue.h"
+#include "fair-queue.h"
 #include "resource-manager.h"
 #include "sink-interface.h"
 #include "source-interface.h"
@@ -43,7 +45,12 @@
 #include "tpm2-response.h"
 #include "util.h"
 
-#define MAX_ABANDONED 4
+/* abandoned sessions flushed at a time when the ResourceManager is idle */
+#define ABANDONED_EXPIRE_BATCH 8
+#define MAX_REGAP 4
+#define MAX_COMMAND_RETRY 2
+/* weight of a new sample in the queueing delay average is 1/N */
+#define QUEUE_DELAY_EWMA_WEIGHT 8
 
 static void resource_manager_sink_interface_init   (gpointer g_iface);
 static void resource_manager_source_interface_init (gpointer g_iface);
@@ -65,6 +72,8 @@ enum {
     PROP_SINK,
     PROP_ACCESS_BROKER,
     PROP_SESSION_LIST,
+    PROP_RESIDENT_MAX,
+    PROP_SESSION_RESIDENT_MAX,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
@@ -97,6 +106,345 @@ resource_manager_virt_to_phys (ResourceManager *resmgr,
     }
     return rc;
 }
+/*
+ * Lock the mutex that protects the queue of resident transient objects.
+ */
+static inline void
+resource_manager_resident_lock (ResourceManager *resmgr)
+{
+    if (pthread_mutex_lock (&resmgr->resident_mutex) != 0)
+        g_error ("Error locking ResourceManager resident_mutex: %s",
+                 strerror (errno));
+}
+/*
+ * Unlock the mutex that protects the queue of resident transient objects.
+ */
+static inline void
+resource_manager_resident_unlock (ResourceManager *resmgr)
+{
+    if (pthread_mutex_unlock (&resmgr->resident_mutex) != 0)
+        g_error ("Error unlocking ResourceManager resident_mutex: %s",
+                 strerror (errno));
+}
+/*
+ * Charge a HandleMapEntry or SessionEntry that was just added to one of
+ * the resident queues to the Connection it belongs to. The Connection is
+ * kept in the resident_owner table so the charge can be dropped when the
+ * entry leaves the queue. The count on the Connection is what the
+ * AFFINITY scheduler reads.
+ * The caller must hold the resident_mutex.
+ */
+static void
+resource_manager_resident_charge (ResourceManager *resmgr,
+                                  gpointer         entry,
+                                  Connection      *connection)
+{
+    connection_resident_inc (connection);
+    g_hash_table_insert (resmgr->resident_owner,
+                         entry,
+                         g_object_ref (connection));
+}
+/*
+ * Drop the charge for an entry that was removed from one of the resident
+ * queues. Entries that were never charged are ignored.
+ * The caller must hold the resident_mutex.
+ */
+static void
+resource_manager_resident_discharge (ResourceManager *resmgr,
+                                     gpointer         entry)
+{
+    Connection *connection;
+
+    connection = g_hash_table_lookup (resmgr->resident_owner, entry);
+    if (connection != NULL) {
+        connection_resident_dec (connection);
+        g_hash_table_remove (resmgr->resident_owner, entry);
+    }
+}
+/*
+ * The resident_queue holds a reference to each HandleMapEntry whose
+ * transient object is currently loaded in the TPM. The queue is kept in
+ * LRU order: the head is the most recently used entry, the tail is the
+ * next to be evicted. This function moves the provided entry to the head
+ * of the queue, adding it and charging it to 'connection' if it isn't
+ * already there. Entries that aren't loaded (phandle of 0) are ignored.
+ * The caller must hold the resident_mutex.
+ */
+static void
+resource_manager_resident_touch (ResourceManager *resmgr,
+                                 HandleMapEntry  *entry,
+                                 Connection      *connection)
+{
+    TPM2_HANDLE      phandle;
+
+    phandle = handle_map_entry_get_phandle (entry);
+    if (phandle >> TPM2_HR_SHIFT != TPM2_HT_TRANSIENT) {
+        return;
+    }
+    if (g_queue_remove (resmgr->resident_queue, entry)) {
+        g_queue_push_head (resmgr->resident_queue, entry);
+    } else {
+        g_debug ("%s: HandleMapEntry 0x%" PRIxPTR " with phandle 0x%08"
+                 PRIx32 " is now resident", __func__, (uintptr_t)entry,
+                 phandle);
+        g_queue_push_head (resmgr->resident_queue, g_object_ref (entry));
+        resource_manager_resident_charge (resmgr, entry, connection);
+    }
+}
+/*
+ * Drop the provided HandleMapEntry from the resident_queue. This is a GFunc
+ * used when the associated object has been flushed from the TPM by some
+ * means other than eviction.
+ * The caller must hold the resident_mutex.
+ */
+static void
+resource_manager_resident_remove (gpointer data_entry,
+                                  gpointer data_resmgr)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (data_resmgr);
+    HandleMapEntry  *entry  = HANDLE_MAP_ENTRY (data_entry);
+
+    if (g_queue_remove (resmgr->resident_queue, entry)) {
+        resource_manager_resident_discharge (resmgr, entry);
+        g_object_unref (entry);
+    }
+}
+/*
+ * Evict least recently used transient objects from the TPM until there is
+ * room to load 'needed' more without exceeding resident_max. Entries in
+ * the 'pinned' list are in use by the command being processed and are
+ * never evicted. Evicted objects have their context saved to the
+ * HandleMapEntry so they can be loaded again when next used.
+ * The caller must hold the resident_mutex.
+ */
+static void
+resource_manager_resident_evict (ResourceManager *resmgr,
+                                 GSList          *pinned,
+                                 guint            needed)
+{
+    GList          *link, *prev;
+    HandleMapEntry *entry;
+
+    for (link = resmgr->resident_queue->tail;
+         link != NULL &&
+         g_queue_get_length (resmgr->resident_queue) + needed >
+             resmgr->resident_max;
+         link = prev)
+    {
+        prev = link->prev;
+        entry = HANDLE_MAP_ENTRY (link->data);
+        if (g_slist_find (pinned, entry) != NULL) {
+            continue;
+        }
+        g_debug ("%s: evicting HandleMapEntry 0x%" PRIxPTR, __func__,
+                 (uintptr_t)entry);
+        resource_manager_flushsave_context (entry, resmgr);
+        if (handle_map_entry_get_phandle (entry) != 0) {
+            /* still loaded, leave it in the queue */
+            continue;
+        }
+        g_queue_delete_link (resmgr->resident_queue, link);
+        resource_manager_resident_discharge (resmgr, entry);
+        g_object_unref (entry);
+    }
+}
+/*
+ * This is a GHFunc used to flush the transient object associated with
+ * each HandleMapEntry in a HandleMap from the TPM if it's resident. This
+ * is used when the Connection owning the HandleMap goes away: the objects
+ * will never be used again so there's no need to save them.
+ * The caller must hold the resident_mutex.
+ */
+static void
+resource_manager_resident_flush (gpointer key,
+                                 gpointer value,
+                                 gpointer user_data)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (user_data);
+    HandleMapEntry  *entry  = HANDLE_MAP_ENTRY (value);
+    TPM2_HANDLE      phandle;
+
+    phandle = handle_map_entry_get_phandle (entry);
+    if (phandle >> TPM2_HR_SHIFT != TPM2_HT_TRANSIENT) {
+        return;
+    }
+    g_debug ("%s: flushing resident HandleMapEntry 0x%" PRIxPTR " with "
+             "phandle 0x%08" PRIx32, __func__, (uintptr_t)entry, phandle);
+    access_broker_context_flush (resmgr->access_broker, phandle);
+    handle_map_entry_set_phandle (entry, 0);
+    resource_manager_resident_remove (entry, resmgr);
+}
+/*
+ * The session_resident_queue holds a reference to each SessionEntry that's
+ * currently loaded in the TPM. Like the resident_queue it's kept in LRU
+ * order. This is a GFunc that marks the provided SessionEntry as loaded and
+ * moves it to the head of the queue. Sessions last saved by the client
+ * aren't loaded and are ignored.
+ * The caller must hold the resident_mutex.
+ */
+static void
+resource_manager_session_touch (gpointer data_entry,
+                                gpointer data_resmgr)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (data_resmgr);
+    SessionEntry    *entry  = SESSION_ENTRY (data_entry);
+    Connection      *connection;
+
+    if (session_entry_get_state (entry) != SESSION_ENTRY_SAVED_RM) {
+        return;
+    }
+    session_entry_set_loaded (entry, TRUE);
+    if (g_queue_remove (resmgr->session_resident_queue, entry)) {
+        g_queue_push_head (resmgr->session_resident_queue, entry);
+    } else {
+        g_debug ("%s: SessionEntry 0x%" PRIxPTR " with handle 0x%08" PRIx32
+                 " is now resident", __func__, (uintptr_t)entry,
+                 session_entry_get_handle (entry));
+        g_queue_push_head (resmgr->session_resident_queue,
+                           g_object_ref (entry));
+        connection = session_entry_get_connection (entry);
+        resource_manager_resident_charge (resmgr, entry, connection);
+        g_object_unref (connection);
+    }
+}
+/*
+ * Mark the provided SessionEntry as no longer loaded and drop it from the
+ * session_resident_queue. This is a GFunc used when the session has been
+ * saved or flushed by some means other than eviction.
+ * The caller must hold the resident_mutex.
+ */
+static void
+resource_manager_session_remove (gpointer data_entry,
+                                 gpointer data_resmgr)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (data_resmgr);
+    SessionEntry    *entry  = SESSION_ENTRY (data_entry);
+
+    session_entry_set_loaded (entry, FALSE);
+    if (g_queue_remove (resmgr->session_resident_queue, entry)) {
+        resource_manager_resident_discharge (resmgr, entry);
+        g_object_unref (entry);
+    }
+}
+/*
+ * Track the TPM's session context counter. Each session context saved
+ * gets the next sequence number so the most recent one we've seen is a
+ * good approximation of the current counter value.
+ */
+static void
+resource_manager_note_context_save (ResourceManager *resmgr,
+                                    TPMS_CONTEXT    *context)
+{
+    if (context->sequence > resmgr->context_counter) {
+        resmgr->context_counter = context->sequence;
+    }
+}
+/*
+ * Add a SessionEntry to the sessions loaded for the command being
+ * processed. A session used in more than one handle or auth of the command
+ * is only added once.
+ */
+static void
+loaded_sessions_insert (LoadedSessions *loaded_sessions,
+                        SessionEntry   *entry)
+{
+    guint i;
+
+    for (i = 0; i < loaded_sessions->count; ++i) {
+        if (loaded_sessions->entries [i] == entry) {
+            return;
+        }
+    }
+    if (loaded_sessions->count == LOADED_SESSIONS_MAX) {
+        g_warning ("%s: more than %u sessions loaded for one command",
+                   __func__, LOADED_SESSIONS_MAX);
+        return;
+    }
+    loaded_sessions->entries [loaded_sessions->count++] =
+        g_object_ref (entry);
+}
+static gboolean
+loaded_sessions_contains (LoadedSessions *loaded_sessions,
+                          TPM2_HANDLE     handle)
+{
+    guint i;
+
+    for (i = 0; i < loaded_sessions->count; ++i) {
+        if (session_entry_get_handle (loaded_sessions->entries [i]) ==
+            handle)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+static void
+loaded_sessions_foreach (LoadedSessions *loaded_sessions,
+                         GFunc           func,
+                         gpointer        user_data)
+{
+    guint i;
+
+    for (i = 0; i < loaded_sessions->count; ++i) {
+        func (loaded_sessions->entries [i], user_data);
+    }
+}
+/*
+ * Drop the references held on the loaded sessions and empty the list.
+ */
+void
+loaded_sessions_clear (LoadedSessions *loaded_sessions)
+{
+    while (loaded_sessions->count > 0) {
+        g_clear_object (&loaded_sessions->entries [--loaded_sessions->count]);
+    }
+}
+/*
+ * Save least recently used sessions until there is room to load 'needed'
+ * more without exceeding session_resident_max. Sessions in the 'pinned'
+ * list are in use by the command being processed and are never evicted.
+ * The caller must hold the resident_mutex.
+ */
+static void
+resource_manager_session_evict (ResourceManager *resmgr,
+                                LoadedSessions  *pinned,
+                                guint            needed)
+{
+    GList        *link, *prev;
+    SessionEntry *entry;
+    TPM2_HANDLE   handle;
+    TSS2_RC       rc;
+
+    for (link = resmgr->session_resident_queue->tail;
+         link != NULL &&
+         g_queue_get_length (resmgr->session_resident_queue) + needed >
+             resmgr->session_resident_max;
+         link = prev)
+    {
+        prev = link->prev;
+        entry = SESSION_ENTRY (link->data);
+        handle = session_entry_get_handle (entry);
+        if (pinned != NULL && loaded_sessions_contains (pinned, handle)) {
+            continue;
+        }
+        g_debug ("%s: evicting SessionEntry 0x%" PRIxPTR " with handle 0x%08"
+                 PRIx32, __func__, (uintptr_t)entry, handle);
+        rc = access_broker_context_save (resmgr->access_broker,
+                                         handle,
+                                         session_entry_get_context (entry));
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: failed to save session with handle 0x%08" PRIx32
+                       ": 0x%" PRIx32, __func__, handle, rc);
+            continue;
+        }
+        resource_manager_note_context_save (resmgr,
+                                            session_entry_get_context (entry));
+        session_entry_set_loaded (entry, FALSE);
+        g_queue_delete_link (resmgr->session_resident_queue, link);
+        resource_manager_resident_discharge (resmgr, entry);
+        g_object_unref (entry);
+    }
+}
 TSS2_RC
 resource_manager_load_transient (ResourceManager  *resmgr,
                                  Tpm2Command      *command,
@@ -124,6 +472,25 @@ resource_manager_load_transient (ResourceManager  *resmgr,
         g_warning ("No HandleMapEntry for vhandle: 0x%" PRIx32, handle);
         goto out;
     }
+    if (resmgr->resident_max > 0) {
+        resource_manager_resident_lock (resmgr);
+        if (handle_map_entry_get_phandle (entry) != 0) {
+            g_debug ("HandleMapEntry 0x%" PRIxPTR " is resident, no need to "
+                     "load context", (uintptr_t)entry);
+            ++resmgr->loads_avoided;
+            if (!handle_map_entry_get_context_valid (entry)) {
+                ++resmgr->saves_avoided;
+            }
+            tpm2_command_set_handle (command,
+                                     handle_map_entry_get_phandle (entry),
+                                     handle_index);
+            resource_manager_resident_unlock (resmgr);
+            *entry_slist = g_slist_prepend (*entry_slist, entry);
+            goto out;
+        }
+        resource_manager_resident_evict (resmgr, *entry_slist, 1);
+        resource_manager_resident_unlock (resmgr);
+    }
     rc = resource_manager_virt_to_phys (resmgr, command, entry, handle_index);
     if (rc != TSS2_RC_SUCCESS) {
         goto out;
@@ -136,7 +503,7 @@ out:
 TSS2_RC
 resource_manager_load_session (ResourceManager *resmgr,
                                Tpm2Command     *command,
-                               SessionList     *loaded_sessions,
+                               LoadedSessions  *loaded_sessions,
                                TPM2_HANDLE       handle,
                                gboolean         will_flush)
 {
@@ -163,7 +530,9 @@ resource_manager_load_session (ResourceManager *resmgr,
     case SESSION_ENTRY_SAVED_CLIENT:
     case SESSION_ENTRY_SAVED_CLIENT_CLOSED:
         connection = tpm2_command_get_connection (command);
-        session_entry_set_connection (session_entry, connection);
+        session_list_set_connection (resmgr->session_list,
+                                     session_entry,
+                                     connection);
         g_debug ("%s: Connection 0x%" PRIxPTR " is claiming SessionEntry "
                  "0x%" PRIxPTR, __func__, (uintptr_t)connection,
                  (uintptr_t)session_entry);
@@ -181,6 +550,19 @@ resource_manager_load_session (ResourceManager *resmgr,
              (uintptr_t)session_entry);
     session_entry_prettyprint (session_entry);
 
+    if (resmgr->session_resident_max > 0) {
+        resource_manager_resident_lock (resmgr);
+        if (session_entry_get_loaded (session_entry)) {
+            g_debug ("session with handle 0x%08" PRIx32 " is resident, no "
+                     "need to load context", handle);
+            ++resmgr->loads_avoided;
+            ++resmgr->saves_avoided;
+            resource_manager_resident_unlock (resmgr);
+            goto loaded;
+        }
+        resource_manager_session_evict (resmgr, loaded_sessions, 1);
+        resource_manager_resident_unlock (resmgr);
+    }
     context = session_entry_get_context (session_entry);
     rc = access_broker_context_load (resmgr->access_broker,
                                      context,
@@ -194,10 +576,17 @@ resource_manager_load_session (ResourceManager *resmgr,
                    "0x%08" PRIx32 " RC: 0x%" PRIx32, handle, rc);
         goto out_unref_entry;
     }
+loaded:
     if (will_flush == FALSE) {
-        session_list_insert (loaded_sessions, session_entry);
+        loaded_sessions_insert (loaded_sessions, session_entry);
     } else {
+        /* the TPM flushes the session once the command completes */
+        resource_manager_resident_lock (resmgr);
+        resource_manager_session_remove (session_entry, resmgr);
+        resource_manager_resident_unlock (resmgr);
+        session_list_lock (resmgr->session_list);
         session_list_remove (resmgr->session_list, session_entry);
+        session_list_unlock (resmgr->session_list);
     }
 out_unref_entry:
     g_object_unref (session_entry);
@@ -208,7 +597,7 @@ out:
 typedef struct {
     ResourceManager *resmgr;
     Tpm2Command     *command;
-    SessionList     *loaded_sessions;
+    LoadedSessions  *loaded_sessions;
 } auth_callback_data_t;
 void
 resource_manager_load_auth_callback (gpointer auth_offset_ptr,
@@ -248,7 +637,7 @@ TSS2_RC
 resource_manager_load_contexts (ResourceManager *resmgr,
                                 Tpm2Command     *command,
                                 GSList         **entry_slist,
-                                SessionList     *loaded_sessions)
+                                LoadedSessions  *loaded_sessions)
 {
     TSS2_RC       rc = TSS2_RC_SUCCESS;
     TPM2_HANDLE    handles[TPM2_COMMAND_MAX_HANDLES] = { 0, };
@@ -310,7 +699,9 @@ resource_manager_load_contexts (ResourceManager *resmgr,
  * Remove the context associated with the provided HandleMapEntry
  * from the TPM. Only handles in the TRANSIENT range will be flushed.
  * Any entry with a context that's flushed will have the physical handle
- * to 0.
+ * to 0. The context of a transient object doesn't change once loaded so
+ * if the entry already holds a valid saved context we skip the
+ * ContextSave and only flush the object.
  */
 void
 resource_manager_flushsave_context (gpointer data_entry,
@@ -330,11 +721,20 @@ resource_manager_flushsave_context (gpointer data_entry,
     g_debug ("resource_manager_save_context phandle: 0x%" PRIx32, phandle);
     switch (phandle >> TPM2_HR_SHIFT) {
     case TPM2_HT_TRANSIENT:
-        g_debug ("handle is transient, saving context");
-        context = handle_map_entry_get_context (entry);
-        rc = access_broker_context_saveflush (resmgr->access_broker,
-                                              phandle,
-                                              context);
+        if (handle_map_entry_get_context_valid (entry)) {
+            g_debug ("handle is transient, saved context valid, flushing");
+            rc = access_broker_context_flush (resmgr->access_broker,
+                                              phandle);
+        } else {
+            g_debug ("handle is transient, saving context");
+            context = handle_map_entry_get_context (entry);
+            rc = access_broker_context_saveflush (resmgr->access_broker,
+                                                  phandle,
+                                                  context);
+            if (rc == TSS2_RC_SUCCESS) {
+                handle_map_entry_set_context_valid (entry, TRUE);
+            }
+        }
         if (rc == TSS2_RC_SUCCESS) {
             handle_map_entry_set_phandle (entry, 0);
         } else {
@@ -372,6 +772,91 @@ resource_manager_save_session_context (gpointer data_entry,
                                      context);
     if (rc != TSS2_RC_SUCCESS) {
         g_warning ("access_broker_context_save returned an error: 0x%" PRIx32, rc);
+    } else {
+        resource_manager_note_context_save (resmgr, context);
+    }
+}
+/*
+ * The TPM limits how far its session context counter may advance past the
+ * oldest saved session (TPM2_PT_CONTEXT_GAP_MAX). Once that limit is
+ * reached no other session can be saved and the TPM returns
+ * TPM_RC_CONTEXT_GAP. To keep long lived sessions from blocking everyone
+ * else we reload and re-save the oldest session saved by the RM once it
+ * falls more than half the gap behind, giving it a fresh sequence number.
+ * This does at most MAX_REGAP sessions per call to bound the extra work
+ * done for any one command.
+ */
+void
+resource_manager_regap_sessions (ResourceManager *resmgr)
+{
+    SessionEntry *entry;
+    TPMS_CONTEXT *context;
+    TPM2_HANDLE   handle;
+    TSS2_RC       rc;
+    guint         i;
+
+    if (resmgr->context_gap_max == 0) {
+        return;
+    }
+    for (i = 0; i < MAX_REGAP; ++i) {
+        session_list_lock (resmgr->session_list);
+        entry = session_list_oldest_saved (resmgr->session_list);
+        session_list_unlock (resmgr->session_list);
+        if (entry == NULL) {
+            return;
+        }
+        context = session_entry_get_context (entry);
+        if (context->sequence >= resmgr->context_counter ||
+            resmgr->context_counter - context->sequence <
+                resmgr->context_gap_max / 2)
+        {
+            g_object_unref (entry);
+            return;
+        }
+        g_debug ("%s: SessionEntry 0x%" PRIxPTR " with sequence %" PRIu64
+                 " is %" PRIu64 " behind the context counter, re-saving",
+                 __func__, (uintptr_t)entry, context->sequence,
+                 resmgr->context_counter - context->sequence);
+        if (resmgr->session_resident_max > 0) {
+            resource_manager_resident_lock (resmgr);
+            resource_manager_session_evict (resmgr, NULL, 1);
+            resource_manager_resident_unlock (resmgr);
+        }
+        rc = access_broker_context_load (resmgr->access_broker,
+                                         context,
+                                         &handle);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: failed to load session context: 0x%" PRIx32,
+                       __func__, rc);
+            g_object_unref (entry);
+            return;
+        }
+        rc = access_broker_context_save (resmgr->access_broker,
+                                         handle,
+                                         context);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: failed to save session context: 0x%" PRIx32,
+                       __func__, rc);
+            /*
+             * The session is loaded now. Keep it resident if we track
+             * resident sessions, otherwise nothing would ever save or
+             * flush it so we flush it and forget about it.
+             */
+            if (resmgr->session_resident_max > 0) {
+                resource_manager_resident_lock (resmgr);
+                resource_manager_session_touch (entry, resmgr);
+                resource_manager_resident_unlock (resmgr);
+            } else {
+                access_broker_context_flush (resmgr->access_broker, handle);
+                session_list_lock (resmgr->session_list);
+                session_list_remove (resmgr->session_list, entry);
+                session_list_unlock (resmgr->session_list);
+            }
+            g_object_unref (entry);
+            return;
+        }
+        resource_manager_note_context_save (resmgr, context);
+        g_object_unref (entry);
     }
 }
 static void
@@ -433,9 +918,14 @@ resource_manager_save_context (ResourceManager *resmgr,
     case TPM2_HT_HMAC_SESSION:
     case TPM2_HT_POLICY_SESSION:
         g_debug ("save_context for session handle: 0x%" PRIx32, handle);
+        session_list_lock (resmgr->session_list);
         entry = session_list_lookup_handle (resmgr->session_list, handle);
+        session_list_unlock (resmgr->session_list);
         if (entry != NULL) {
             session_entry_set_state (entry, SESSION_ENTRY_SAVED_CLIENT);
+            resource_manager_resident_lock (resmgr);
+            resource_manager_session_remove (entry, resmgr);
+            resource_manager_resident_unlock (resmgr);
             g_object_unref (entry);
         } else {
             g_warning ("Client attempting to save unkonwn session.");
@@ -456,9 +946,10 @@ resource_manager_save_context (ResourceManager *resmgr,
  *
  * Transient objects that are tracked by the RM (stored in the transient
  * HandleMap in the Connection object) then we can simply delete the mapping
- * since transient objects are always saved / flushed after each command is
- * processed. So for this handle type we just delete the mapping, create a
- * Tpm2Response object and return it to the caller.
+ * since transient objects are saved / flushed by the RM. If the object is
+ * currently resident in the TPM we flush it and drop it from the
+ * resident_queue. So for this handle type we just delete the mapping, create
+ * a Tpm2Response object and return it to the caller.
  *
  * Session objects are not so simple. Sessions cannot be flushed after each
  * use. The TPM will only allow us to save the context as it must maintain
@@ -475,6 +966,7 @@ resource_manager_flush_context (ResourceManager *resmgr,
     Connection     *connection;
     HandleMap      *map;
     HandleMapEntry *entry;
+    SessionEntry   *session_entry;
     Tpm2Response   *response = NULL;
     TPM2_HANDLE      handle;
     TPM2_HT          handle_type;
@@ -500,6 +992,9 @@ resource_manager_flush_context (ResourceManager *resmgr,
         map = connection_get_trans_map (connection);
         entry = handle_map_vlookup (map, handle);
         if (entry != NULL) {
+            resource_manager_resident_lock (resmgr);
+            resource_manager_resident_flush (NULL, entry, resmgr);
+            resource_manager_resident_unlock (resmgr);
             handle_map_remove (map, handle);
             g_object_unref (entry);
             rc = TSS2_RC_SUCCESS;
@@ -520,6 +1015,16 @@ resource_manager_flush_context (ResourceManager *resmgr,
     case TPM2_HT_POLICY_SESSION:
         g_debug ("handle is TPM2_HT_HMAC_SESSION or TPM2_HT_POLICY_SESSION");
         g_info ("f");
+        session_list_lock (resmgr->session_list);
+        session_entry = session_list_lookup_handle (resmgr->session_list,
+                                                    handle);
+        session_list_unlock (resmgr->session_list);
+        if (session_entry != NULL) {
+            resource_manager_resident_lock (resmgr);
+            resource_manager_session_remove (session_entry, resmgr);
+            resource_manager_resident_unlock (resmgr);
+            g_object_unref (session_entry);
+        }
         session_list_remove_handle (resmgr->session_list, handle);
         /*
         response = access_broker_send_command (resmgr->access_broker,
@@ -532,10 +1037,34 @@ resource_manager_flush_context (ResourceManager *resmgr,
 out:
     return response;
 }
+/*
+ * Offset of the savedHandle member of the TPMS_CONTEXT parameter to
+ * TPM2_ContextLoad: it follows the 64 bit sequence number.
+ */
+#define CONTEXT_LOAD_SAVED_HANDLE_OFFSET (TPM_HEADER_SIZE + sizeof (UINT64))
+/*
+ * Returns TRUE if the command is a TPM2_ContextLoad of a transient object.
+ */
+static gboolean
+context_load_is_transient (Tpm2Command *command)
+{
+    guint8 *buffer = tpm2_command_get_buffer (command);
+    TPM2_HANDLE handle;
+
+    if (tpm2_command_get_size (command) <
+        CONTEXT_LOAD_SAVED_HANDLE_OFFSET + sizeof (TPM2_HANDLE))
+    {
+        return FALSE;
+    }
+    handle = be32toh (*(TPM2_HANDLE*)&buffer [CONTEXT_LOAD_SAVED_HANDLE_OFFSET]);
+    return handle >> TPM2_HR_SHIFT == TPM2_HT_TRANSIENT ? TRUE : FALSE;
+}
 /*
  * Ensure that executing the provided command will not exceed any of the
  * per-connection quotas enforced by the RM. This is currently limited to
- * transient objects and sessions.
+ * transient objects and sessions. Any command that returns a handle other
+ * than a session (TPMA_CC rHandle set) is assumed to create a transient
+ * object, this includes sequence objects and vendor commands.
  */
 TSS2_RC
 resource_manager_quota_check (ResourceManager *resmgr,
@@ -546,18 +1075,6 @@ resource_manager_quota_check (ResourceManager *resmgr,
     TSS2_RC      rc = TSS2_RC_SUCCESS;
 
     switch (tpm2_command_get_code (command)) {
-    /* These commands load transient objects. */
-    case TPM2_CC_CreatePrimary:
-    case TPM2_CC_Load:
-    case TPM2_CC_LoadExternal:
-        connection = tpm2_command_get_connection (command);
-        handle_map = connection_get_trans_map (connection);
-        if (handle_map_is_full (handle_map)) {
-            g_info ("Connection 0x%" PRIxPTR " has exceeded transient object "
-                    "limit", (uintptr_t)connection);
-            rc = TSS2_RESMGR_RC_OBJECT_MEMORY;
-        }
-        break;
     /* These commands create sessions. */
     case TPM2_CC_StartAuthSession:
         connection = tpm2_command_get_connection (command);
@@ -567,12 +1084,91 @@ resource_manager_quota_check (ResourceManager *resmgr,
             rc = TSS2_RESMGR_RC_SESSION_MEMORY;
         }
         break;
+    case TPM2_CC_ContextLoad:
+        if (!context_load_is_transient (command)) {
+            break;
+        }
+        /* fallthrough */
+    default:
+        if (!(tpm2_command_get_attributes (command) & TPMA_CC_RHANDLE)) {
+            break;
+        }
+        connection = tpm2_command_get_connection (command);
+        handle_map = connection_get_trans_map (connection);
+        if (handle_map_is_full (handle_map)) {
+            g_info ("Connection 0x%" PRIxPTR " has exceeded transient object "
+                    "limit", (uintptr_t)connection);
+            rc = TSS2_RESMGR_RC_OBJECT_MEMORY;
+        }
+        break;
     }
     g_clear_object (&connection);
     g_clear_object (&handle_map);
 
     return rc;
 }
+/*
+ * Check whether the client has given up on a command: either it canceled
+ * the command or the command is past its deadline. There's no point in
+ * spending TPM time on these so they're answered with TPM2_RC_CANCELED.
+ */
+static TSS2_RC
+resource_manager_abandon_check (ResourceManager *resmgr,
+                                Tpm2Command     *command)
+{
+    gint64 deadline;
+
+    deadline = tpm2_command_get_deadline (command);
+    if (tpm2_command_is_canceled (command) ||
+        (deadline != 0 && g_get_monotonic_time () > deadline))
+    {
+        g_debug ("%s: Tpm2Command 0x%" PRIxPTR " canceled or past deadline",
+                 __func__, (uintptr_t)command);
+        ++resmgr->abandon_count;
+        return TPM2_RC_CANCELED;
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Do the work for a command that doesn't require the TPM. This is
+ * currently the cancel / deadline check and the quota check. If the
+ * command must be rejected the error response is returned, otherwise NULL.
+ */
+static Tpm2Response*
+resource_manager_prepare_command (ResourceManager *resmgr,
+                                  Tpm2Command     *command)
+{
+    Connection   *connection;
+    Tpm2Response *response = NULL;
+    TSS2_RC       rc;
+
+    rc = resource_manager_abandon_check (resmgr, command);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = resource_manager_quota_check (resmgr, command);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        connection = tpm2_command_get_connection (command);
+        response = tpm2_response_new_rc (connection, rc);
+        g_object_unref (connection);
+    }
+    return response;
+}
+/*
+ * Fold the time a command spent between being read from the client and
+ * being taken off our queue into the average queueing delay. Only the
+ * ResourceManager thread updates it, the enqueuing threads read it.
+ */
+static void
+resource_manager_sample_delay (ResourceManager *resmgr,
+                               Tpm2Command     *command)
+{
+    gint64 sample, delay;
+
+    sample = g_get_monotonic_time () - tpm2_command_get_timestamp (command);
+    delay = g_atomic_int_get (&resmgr->queue_delay);
+    delay += (sample - delay) / QUEUE_DELAY_EWMA_WEIGHT;
+    g_atomic_int_set (&resmgr->queue_delay, MIN (delay, G_MAXINT));
+}
 /*
  * This is a callback function invoked by the GSList foreach function. It is
  * called when the object associated with a HandleMapEntry is no longer valid
@@ -602,10 +1198,22 @@ remove_entry_from_handle_map (gpointer data_entry,
         break;
     }
 }
+/*
+ * GFunc to mark the saved context in a HandleMapEntry as stale.
+ */
+static void
+invalidate_entry_context (gpointer data_entry,
+                          gpointer data_user)
+{
+    handle_map_entry_set_context_valid (HANDLE_MAP_ENTRY (data_entry), FALSE);
+}
 /*
  * This function handles the required post-processing on the HandleMapEntry
  * objects in the GSList that represent objects loaded into the TPM as part of
- * executing a command.
+ * executing a command. When resident objects are enabled the entries are
+ * left loaded and marked most recently used. Only once the number of
+ * resident objects exceeds resident_max are the least recently used ones
+ * saved and flushed.
  */
 void
 post_process_entry_list (ResourceManager  *resmgr,
@@ -613,8 +1221,25 @@ post_process_entry_list (ResourceManager  *resmgr,
                          Connection       *connection,
                          TPMA_CC           command_attrs)
 {
-    /* if flushed bit is clear we need to flush & save contexts */
-    if (!(command_attrs & TPMA_CC_FLUSHED)) {
+    GSList *link;
+
+    /* sequence objects are updated in place, any saved context is stale */
+    if ((command_attrs & TPMA_CC_COMMANDINDEX) == TPM2_CC_SequenceUpdate) {
+        g_slist_foreach (*entry_slist, invalidate_entry_context, NULL);
+    }
+    if (!(command_attrs & TPMA_CC_FLUSHED) && resmgr->resident_max > 0) {
+        g_debug ("keeping %" PRIu32 " entries resident",
+                 g_slist_length (*entry_slist));
+        resource_manager_resident_lock (resmgr);
+        for (link = *entry_slist; link != NULL; link = link->next) {
+            resource_manager_resident_touch (resmgr,
+                                             HANDLE_MAP_ENTRY (link->data),
+                                             connection);
+        }
+        resource_manager_resident_evict (resmgr, NULL, 0);
+        resource_manager_resident_unlock (resmgr);
+    } else if (!(command_attrs & TPMA_CC_FLUSHED)) {
+        /* if flushed bit is clear we need to flush & save contexts */
         g_debug ("flushsave_context for %" PRIu32 " entries",
                  g_slist_length (*entry_slist));
         g_slist_foreach (*entry_slist,
@@ -623,6 +1248,11 @@ post_process_entry_list (ResourceManager  *resmgr,
     } else {
         /* if flushed bit is set the entry has been flushed, remove it */
         g_debug ("TPMA_CC flushed bit set");
+        resource_manager_resident_lock (resmgr);
+        g_slist_foreach (*entry_slist,
+                         resource_manager_resident_remove,
+                         resmgr);
+        resource_manager_resident_unlock (resmgr);
         g_slist_foreach (*entry_slist,
                          remove_entry_from_handle_map,
                          connection);
@@ -630,22 +1260,36 @@ post_process_entry_list (ResourceManager  *resmgr,
     g_slist_free_full (*entry_slist, g_object_unref);
 }
 /*
- * This function handles the required post-processing of the session_entry_t
- * list representing all of the sessions currently loaded. This requires that
- * we save the loaded sessions.
+ * This function handles the required post-processing of the sessions
+ * loaded for the command. This requires that we save the loaded sessions.
+ * When resident sessions are enabled they're left loaded and only the
+ * least recently used are saved once the number loaded exceeds
+ * session_resident_max. The references held by 'loaded_sessions' are
+ * dropped.
  */
 void
 post_process_loaded_sessions (ResourceManager *resmgr,
-                              SessionList     *session_list)
+                              LoadedSessions  *loaded_sessions)
 {
     g_debug ("post_process_loaded_sessions");
-    if (session_list == NULL) {
-        g_warning ("post_process_session_slist passed NULL session_slist");
+    if (loaded_sessions == NULL) {
+        g_warning ("post_process_loaded_sessions passed NULL loaded_sessions");
         return;
     }
-    session_list_foreach (session_list,
-                          resource_manager_save_session_context,
-                          resmgr);
+    if (resmgr->session_resident_max > 0) {
+        resource_manager_resident_lock (resmgr);
+        loaded_sessions_foreach (loaded_sessions,
+                                 resource_manager_session_touch,
+                                 resmgr);
+        resource_manager_session_evict (resmgr, NULL, 0);
+        resource_manager_resident_unlock (resmgr);
+    } else {
+        loaded_sessions_foreach (loaded_sessions,
+                                 resource_manager_save_session_context,
+                                 resmgr);
+    }
+    loaded_sessions_clear (loaded_sessions);
+    resource_manager_regap_sessions (resmgr);
 }
 /*
  * This structure is used to keep state while iterating over a list of
@@ -666,18 +1310,19 @@ typedef struct {
     TPM2_HANDLE            start_handle;
 } vhandle_iterator_state_t;
 /*
- * This callback function is invoked as part of iterating over a list of
- * handles. The first parameter is an entry from the collection being
- * traversed. The second is a reference to a vhandle_iterator_state_t
- * structure.
+ * This callback function is invoked as part of iterating over the entries
+ * in a HandleMap in ascending vhandle order. The first parameter is the
+ * vhandle of the entry, the second the HandleMapEntry. The third is a
+ * reference to a vhandle_iterator_state_t structure.
  * This structure is used to maintain state while iterating over the
  * collection.
  */
 void
-vhandle_iterator_callback (gpointer entry,
+vhandle_iterator_callback (gpointer key,
+                           gpointer value,
                            gpointer data)
 {
-    TPM2_HANDLE                vhandle  = (uintptr_t)entry;
+    TPM2_HANDLE                vhandle  = GPOINTER_TO_UINT (key);
     vhandle_iterator_state_t *state    = (vhandle_iterator_state_t*)data;
     TPMS_CAPABILITY_DATA     *cap_data = state->cap_data;
 
@@ -695,24 +1340,6 @@ vhandle_iterator_callback (gpointer entry,
     cap_data->data.handles.handle [cap_data->data.handles.count] = vhandle;
     ++cap_data->data.handles.count;
 }
-/*
- * This is a GCompareFunc used to sort a list of TPM2_HANDLES.
- */
-int
-handle_compare (gconstpointer a,
-                gconstpointer b)
-{
-    TPM2_HANDLE handle_a = (uintptr_t)a;
-    TPM2_HANDLE handle_b = (uintptr_t)b;
-
-    if (handle_a < handle_b) {
-        return -1;
-    } else if (handle_a > handle_b) {
-        return 1;
-    } else {
-        return 0;
-    }
-}
 /*
  * The get_cap_transient function populates a TPMS_CAPABILITY_DATA structure
  * with the handles in the provided HandleMap 'map'. The 'prop' parameter
@@ -728,7 +1355,6 @@ get_cap_handles (HandleMap            *map,
                  UINT32                count,
                  TPMS_CAPABILITY_DATA *cap_data)
 {
-    GList *vhandle_list;
     vhandle_iterator_state_t state = {
         .cap_data     = cap_data,
         .max_count    = count,
@@ -739,11 +1365,9 @@ get_cap_handles (HandleMap            *map,
     cap_data->capability = TPM2_CAP_HANDLES;
     cap_data->data.handles.count = 0;
 
-    vhandle_list = handle_map_get_keys (map);
-    vhandle_list = g_list_sort (vhandle_list, handle_compare);
-    g_list_foreach (vhandle_list, vhandle_iterator_callback, &state);
+    handle_map_foreach (map, vhandle_iterator_callback, &state);
 
-    g_debug ("iterating over %" PRIu32 " vhandles from g_list_foreach",
+    g_debug ("iterating over %" PRIu32 " vhandles from handle_map_foreach",
              cap_data->data.handles.count);
     size_t i;
     for (i = 0; i < cap_data->data.handles.count; ++i) {
@@ -792,11 +1416,7 @@ build_cap_handles_response (TPMS_CAPABILITY_DATA *cap_data,
     size_t i;
     uint8_t *buf;
 
-    buf = calloc (1, CAP_RESP_SIZE (cap_data));
-    if (buf == NULL) {
-        tabrmd_critical ("failed to allocate buffer for handle capability "
-                         "response");
-    }
+    buf = buffer_pool_alloc (CAP_RESP_SIZE (cap_data));
     set_response_tag (buf, TPM2_ST_NO_SESSIONS);
     set_response_size (buf, CAP_RESP_SIZE (cap_data));
     set_response_code (buf, TSS2_RC_SUCCESS);
@@ -884,9 +1504,11 @@ command_special_processing (ResourceManager *resmgr,
  * This function creates a mapping from the transient physical to a virtual
  * handle in the provided response object. This mapping is then added to
  * the transient HandleMap for the associated connection, as well as the
- * list of currently loaded transient objects.
+ * list of currently loaded transient objects. If the HandleMap has no free
+ * slot the new object is flushed and TSS2_RESMGR_RC_OBJECT_MEMORY is
+ * returned for the caller to send to the client instead of the response.
  */
-void
+TSS2_RC
 create_context_mapping_transient (ResourceManager  *resmgr,
                                   Tpm2Response     *response,
                                   GSList          **loaded_transient_slist)
@@ -904,7 +1526,12 @@ create_context_mapping_transient (ResourceManager  *resmgr,
     g_object_unref (connection);
     vhandle = handle_map_next_vhandle (handle_map);
     if (vhandle == 0) {
-        g_error ("vhandle rolled over!");
+        g_info ("no free vhandle in HandleMap 0x%" PRIxPTR ", flushing "
+                "new transient object 0x%08" PRIx32, (uintptr_t)handle_map,
+                phandle);
+        access_broker_context_flush (resmgr->access_broker, phandle);
+        g_object_unref (handle_map);
+        return TSS2_RESMGR_RC_OBJECT_MEMORY;
     }
     g_debug ("  vhandle:0x%08" PRIx32, vhandle);
     handle_entry = handle_map_entry_new (phandle, vhandle);
@@ -921,39 +1548,158 @@ create_context_mapping_transient (ResourceManager  *resmgr,
     g_object_ref (handle_entry);
     *loaded_transient_slist = g_slist_prepend (*loaded_transient_slist,
                                                    handle_entry);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Flush the context of an abandoned session from the TPM and drop the
+ * reference held on it by the abandoned session store.
+ */
+static void
+resource_manager_flush_abandoned (ResourceManager *resmgr,
+                                  SessionEntry    *entry)
+{
+    TPM2_HANDLE handle = session_entry_get_handle (entry);
+    TSS2_RC rc;
+
+    g_debug ("%s: flushing abandoned SessionEntry: 0x%" PRIxPTR " with "
+             "handle: 0x%08" PRIx32, __func__, (uintptr_t)entry, handle);
+    rc = access_broker_context_flush (resmgr->access_broker, handle);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to flush abandoned session context with "
+                   "handle 0x%" PRIx32 ": 0x%" PRIx32, __func__, handle, rc);
+    }
+    g_object_unref (entry);
 }
 /*
- * GCompareFunc used to compare SessionEntry objects on their handle members.
- * This was taken directly from the SessionEntry code. My abstractions are
- * leaking and this is a sign that the objects involved in session handling
- * need to be refactored.
+ * Remove the oldest session from the abandoned session store. The
+ * reference held by the store is passed to the caller.
+ * The caller must hold the abandoned_mutex.
  */
-static gint
-session_entry_compare_on_handle (gconstpointer a,
-                                 gconstpointer b)
+static SessionEntry*
+resource_manager_pop_abandoned (ResourceManager *resmgr)
 {
-    if (a == NULL || b == NULL) {
-        g_error ("session_entry_compare_on_handle received NULL parameter");
+    SessionEntry *entry;
+
+    entry = g_queue_pop_tail (resmgr->abandoned_session_queue);
+    if (entry != NULL) {
+        g_hash_table_remove (resmgr->abandoned_session_table,
+                             GUINT_TO_POINTER (session_entry_get_handle (entry)));
     }
-    SessionEntry *entry_a = SESSION_ENTRY (a);
-    TPM2_HANDLE handle_a = session_entry_get_handle (entry_a);
-    TPM2_HANDLE handle_b = *(TPM2_HANDLE*)b;
+    return entry;
+}
+/*
+ * Add a session abandoned by its creator to the abandoned session store,
+ * taking over the caller's reference. Sessions are kept newest first in
+ * the abandoned_session_queue and indexed by handle in the
+ * abandoned_session_table, which maps each handle to the session's link
+ * in the queue. When the store is full the oldest sessions are flushed
+ * from the TPM to make room.
+ */
+static void
+resource_manager_abandon_session (ResourceManager *resmgr,
+                                  SessionEntry    *entry)
+{
+    SessionEntry *stale;
+    TPM2_HANDLE handle = session_entry_get_handle (entry);
 
-    if (handle_a < handle_b) {
-        return -1;
-    } else if (handle_a > handle_b) {
-        return 1;
-    } else {
-        return 0;
+    pthread_mutex_lock (&resmgr->abandoned_mutex);
+    while (g_queue_get_length (resmgr->abandoned_session_queue) >=
+               resmgr->abandoned_max &&
+           (stale = resource_manager_pop_abandoned (resmgr)) != NULL)
+    {
+        pthread_mutex_unlock (&resmgr->abandoned_mutex);
+        resource_manager_flush_abandoned (resmgr, stale);
+        pthread_mutex_lock (&resmgr->abandoned_mutex);
+    }
+    if (resmgr->abandoned_max == 0) {
+        pthread_mutex_unlock (&resmgr->abandoned_mutex);
+        resource_manager_flush_abandoned (resmgr, entry);
+        return;
     }
+    g_queue_push_head (resmgr->abandoned_session_queue, entry);
+    g_hash_table_insert (resmgr->abandoned_session_table,
+                         GUINT_TO_POINTER (handle),
+                         resmgr->abandoned_session_queue->head);
+    pthread_mutex_unlock (&resmgr->abandoned_mutex);
 }
+/*
+ * Remove the abandoned session with the given handle from the abandoned
+ * session store. The reference held by the store is passed to the caller.
+ * Returns NULL if no session with the handle has been abandoned.
+ */
+static SessionEntry*
+resource_manager_reclaim_abandoned (ResourceManager *resmgr,
+                                    TPM2_HANDLE      handle)
+{
+    SessionEntry *entry = NULL;
+    GList *link;
 
+    pthread_mutex_lock (&resmgr->abandoned_mutex);
+    link = g_hash_table_lookup (resmgr->abandoned_session_table,
+                                GUINT_TO_POINTER (handle));
+    if (link != NULL) {
+        entry = SESSION_ENTRY (link->data);
+        g_queue_delete_link (resmgr->abandoned_session_queue, link);
+        g_hash_table_remove (resmgr->abandoned_session_table,
+                             GUINT_TO_POINTER (handle));
+    }
+    pthread_mutex_unlock (&resmgr->abandoned_mutex);
+
+    return entry;
+}
+/*
+ * Flush up to ABANDONED_EXPIRE_BATCH abandoned sessions that have been in
+ * the abandoned session store for longer than abandoned_ttl. This is done
+ * by the ResourceManager thread when there are no commands to process so
+ * it's kept off of the command path. In run-to-completion mode it's done
+ * after each command instead.
+ * Returns 0 if there are more expired sessions to flush, the monotonic time
+ * at which the next session expires, or -1 if no session will expire.
+ */
+gint64
+resource_manager_expire_abandoned (ResourceManager *resmgr)
+{
+    SessionEntry *expired [ABANDONED_EXPIRE_BATCH], *entry;
+    gint64 now, expire_time, ret = -1;
+    guint count = 0, i;
+
+    if (resmgr->abandoned_ttl <= 0) {
+        return -1;
+    }
+    now = g_get_monotonic_time ();
+    pthread_mutex_lock (&resmgr->abandoned_mutex);
+    while ((entry = g_queue_peek_tail (resmgr->abandoned_session_queue))
+           != NULL)
+    {
+        expire_time = session_entry_get_closed_time (entry) +
+            resmgr->abandoned_ttl;
+        if (expire_time > now) {
+            ret = expire_time;
+            break;
+        }
+        if (count == ABANDONED_EXPIRE_BATCH) {
+            ret = 0;
+            break;
+        }
+        expired [count++] = resource_manager_pop_abandoned (resmgr);
+    }
+    pthread_mutex_unlock (&resmgr->abandoned_mutex);
+    for (i = 0; i < count; ++i) {
+        resource_manager_flush_abandoned (resmgr, expired [i]);
+    }
+    if (count > 0) {
+        g_debug ("%s: flushed %u abandoned sessions older than %" PRId64
+                 "us", __func__, count, resmgr->abandoned_ttl);
+    }
+
+    return ret;
+}
 /*
  * This function is invoked after the session has been created so it
  * is loaded in the TPM. If this is a new session (one that hasn't
  * been previously loaded) then the entry we create must be added to
  * both the session_list maintained by the resource manager as well
- * as the list of sessions currently loaded (loaded_session_list) so
+ * as the list of sessions currently loaded (loaded_sessions) so
  * that the session will be saved at the end of processing the command.
  * If this is not a new session we only add it to the list of sessions
  * currently loaded.
@@ -961,20 +1707,18 @@ session_entry_compare_on_handle (gconstpointer a,
 void
 create_context_mapping_session (ResourceManager *resmgr,
                                 Tpm2Response    *response,
-                                SessionList     *loaded_session_list)
+                                LoadedSessions  *loaded_sessions)
 {
-    GList *abandoned_link;
     SessionEntry *session_entry = NULL, *abandoned_entry = NULL;
     TPM2_HANDLE    handle;
     Connection   *connection;
 
     handle = tpm2_response_get_handle (response);
+    session_list_lock (resmgr->session_list);
     session_entry = session_list_lookup_handle (resmgr->session_list, handle);
-    abandoned_link = g_queue_find_custom (resmgr->abandoned_session_queue,
-                                          &handle,
-                                          session_entry_compare_on_handle);
-    if (abandoned_link != NULL) {
-        abandoned_entry = SESSION_ENTRY (abandoned_link->data);
+    session_list_unlock (resmgr->session_list);
+    if (session_entry == NULL) {
+        abandoned_entry = resource_manager_reclaim_abandoned (resmgr, handle);
     }
     connection = tpm2_response_get_connection (response);
     if (session_entry == NULL && abandoned_entry == NULL) {
@@ -982,15 +1726,18 @@ create_context_mapping_session (ResourceManager *resmgr,
                  "adding to ResourceManager session list");
         session_entry = session_entry_new (connection, handle);
         session_list_insert (resmgr->session_list, session_entry);
+        loaded_sessions_insert (loaded_sessions, session_entry);
         g_debug ("dumping resmgr->session_list:");
         session_list_prettyprint (resmgr->session_list);
     } else if (session_entry != NULL) {
         g_debug ("%s: session_entry 0x%08" PRIxPTR " for handle 0x%08" PRIx32
                  " exists. Adding to list of loaded sessions",
                  __func__, (uintptr_t)session_entry, handle);
-        session_entry_set_connection (session_entry, connection);
+        session_list_set_connection (resmgr->session_list,
+                                     session_entry,
+                                     connection);
         session_entry_set_state (session_entry, SESSION_ENTRY_SAVED_RM);
-        session_list_insert (loaded_session_list, session_entry);
+        loaded_sessions_insert (loaded_sessions, session_entry);
     } else if (abandoned_entry != NULL) {
         g_debug ("%s: session_entry 0x%08" PRIxPTR " for handle 0x%08" PRIx32
                  " exists and was abandoned. Removing from abandoned list, "
@@ -998,15 +1745,12 @@ create_context_mapping_session (ResourceManager *resmgr,
                  __func__, (uintptr_t)abandoned_entry, handle);
         session_entry_set_connection (abandoned_entry, connection);
         session_entry_set_state (abandoned_entry, SESSION_ENTRY_SAVED_RM);
-        session_list_insert (loaded_session_list, abandoned_entry);
+        loaded_sessions_insert (loaded_sessions, abandoned_entry);
         session_list_insert (resmgr->session_list, abandoned_entry);
-        g_queue_remove (resmgr->abandoned_session_queue, abandoned_entry);
     }
     g_clear_object (&connection);
     g_clear_object (&session_entry);
     g_clear_object (&abandoned_entry);
-    g_debug ("dumping loaded_session_list:");
-    session_list_prettyprint (loaded_session_list);
 }
 /*
  * Each Tpm2Response object can have at most one handle in it.
@@ -1024,34 +1768,88 @@ create_context_mapping_session (ResourceManager *resmgr,
  * new session_entry_t object, populate the connection field with the
  * connection associated with the response object, and set the savedHandle
  * field. We then add this entry to the list of sessions we're tracking
- * (session_slist) and the list of loaded sessions (loaded_session_slist).
+ * (session_slist) and the list of loaded sessions (loaded_sessions).
+ * Returns an RC other than TSS2_RC_SUCCESS if the mapping can't be created,
+ * in which case the response must not be sent to the client.
  */
-void
+TSS2_RC
 resource_manager_create_context_mapping (ResourceManager  *resmgr,
                                          Tpm2Response     *response,
                                          GSList          **loaded_transient_slist,
-                                         SessionList      *loaded_session_list)
+                                         LoadedSessions   *loaded_sessions)
 {
     TPM2_HANDLE       handle;
+    TSS2_RC           rc = TSS2_RC_SUCCESS;
 
     g_debug ("resource_manager_create_context_mapping");
     if (!tpm2_response_has_handle (response)) {
         g_debug ("response 0x%" PRIxPTR " has no handles", (uintptr_t)response);
-        return;
+        return rc;
     }
     handle = tpm2_response_get_handle (response);
     switch (handle >> TPM2_HR_SHIFT) {
     case TPM2_HT_TRANSIENT:
-        create_context_mapping_transient (resmgr, response, loaded_transient_slist);
+        rc = create_context_mapping_transient (resmgr,
+                                               response,
+                                               loaded_transient_slist);
         break;
     case TPM2_HT_HMAC_SESSION:
     case TPM2_HT_POLICY_SESSION:
-        create_context_mapping_session (resmgr, response, loaded_session_list);
+        create_context_mapping_session (resmgr, response, loaded_sessions);
         break;
     default:
         g_debug ("  not creating context for handle: 0x%08" PRIx32, handle);
         break;
     }
+
+    return rc;
+}
+/*
+ * When the TPM runs out of room for objects or sessions it fails the
+ * command without executing it. If the RM is keeping objects or sessions
+ * resident we can make room by evicting all of them except those used by
+ * the command and then replay the command. This function does the
+ * eviction appropriate for the response code 'rc' and returns TRUE if
+ * anything was evicted. FALSE indicates that the command shouldn't be
+ * retried.
+ */
+static gboolean
+resource_manager_evict_for_retry (ResourceManager *resmgr,
+                                  TSS2_RC          rc,
+                                  GSList          *entry_slist,
+                                  LoadedSessions  *loaded_sessions)
+{
+    guint length_before, length_after;
+
+    resource_manager_resident_lock (resmgr);
+    switch (rc) {
+    case TPM2_RC_OBJECT_MEMORY:
+    case TPM2_RC_OBJECT_HANDLES:
+        length_before = g_queue_get_length (resmgr->resident_queue);
+        resource_manager_resident_evict (resmgr,
+                                         entry_slist,
+                                         resmgr->resident_max);
+        length_after = g_queue_get_length (resmgr->resident_queue);
+        break;
+    case TPM2_RC_SESSION_MEMORY:
+        length_before = g_queue_get_length (resmgr->session_resident_queue);
+        resource_manager_session_evict (resmgr,
+                                        loaded_sessions,
+                                        resmgr->session_resident_max);
+        length_after = g_queue_get_length (resmgr->session_resident_queue);
+        break;
+    default:
+        length_before = length_after = 0;
+        break;
+    }
+    resource_manager_resident_unlock (resmgr);
+    if (length_after < length_before) {
+        g_info ("%s: TPM returned RC 0x%" PRIx32 ", evicted %u resident "
+                "contexts, retrying command", __func__, rc,
+                length_before - length_after);
+        return TRUE;
+    }
+    return FALSE;
 }
 /**
  * This function is invoked in response to the receipt of a Tpm2Command.
@@ -1060,17 +1858,25 @@ resource_manager_create_context_mapping (ResourceManager  *resmgr,
  * The AccessBroker will send us back a Tpm2Response that we send back to
  * the client by way of our Sink object. The flow is roughly:
  * - Receive the Tpm2Command as a parameter
+ * - Check quotas.
  * - Load all virtualized objects required by the command.
- * - Send the Tpm2Command out through the AccessBroker.
- * - Receive the response from the AccessBroker.
+ * - Submit the Tpm2Command to the TPM through the AccessBroker.
+ * - Receive the response from the AccessBroker. If the TPM was out of
+ *   memory for objects or sessions, evict resident ones and send the
+ *   command again, at most MAX_COMMAND_RETRY times.
+ * - If the AccessBroker says the command should be retried later, restore
+ *   the virtual handles, release the contexts and return FALSE. The
+ *   caller sends the command through here again once
+ *   tpm2_command_get_not_before has passed.
  * - Virtualize the new objects created by the command & referenced in the
  *   response.
  * - Enqueue the response back out to the processing pipeline through the
  *   Sink object.
  * - Flush all objects loaded for the command or as part of executing the
- *   command..
+ *   command, or keep them resident if there's room for them in the TPM.
+ * Returns TRUE once the command has been answered.
  */
-void
+gboolean
 resource_manager_process_tpm2_command (ResourceManager   *resmgr,
                                        Tpm2Command       *command)
 {
@@ -1078,27 +1884,52 @@ resource_manager_process_tpm2_command (ResourceManager   *resmgr,
     Tpm2Response   *response;
     TSS2_RC         rc = TSS2_RC_SUCCESS;
     GSList         *entry_slist = NULL;
-    SessionList    *session_list_tmp;
+    LoadedSessions  loaded_sessions = LOADED_SESSIONS_INIT;
     TPMA_CC         command_attrs;
+    TPM2_HANDLE     handles [TPM2_COMMAND_MAX_HANDLES] = { 0, };
+    size_t          handle_count = TPM2_COMMAND_MAX_HANDLES;
+    gboolean        contexts, answered = TRUE;
+    guint           retry;
+    gint64          start, exec;
 
-    session_list_tmp = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT);
     command_attrs = tpm2_command_get_attributes (command);
+    /*
+     * A command with no handles, no auth area and no handle in the response
+     * doesn't use or create any context. Skip loading and saving them.
+     */
+    contexts = (command_attrs & (TPMA_CC_CHANDLES | TPMA_CC_RHANDLE)) ||
+        tpm2_command_has_auths (command);
     g_debug ("resource_manager_process_tpm2_command: resmgr: 0x%" PRIxPTR
              ", cmd: 0x%" PRIxPTR, (uintptr_t)resmgr, (uintptr_t)command);
     dump_command (command);
     connection = tpm2_command_get_connection (command);
     /* If executing the command would exceed a per connection quota */
-    rc = resource_manager_quota_check (resmgr, command);
-    if (rc != TSS2_RC_SUCCESS) {
-        response = tpm2_response_new_rc (connection, rc);
+    response = resource_manager_prepare_command (resmgr, command);
+    if (response != NULL) {
         goto send_response;
     }
     /* Load transient object contexts, switch virtual to physical handles */
-    if (tpm2_command_get_handle_count (command) > 0) {
+    if (contexts) {
+        tpm2_command_get_handles (command, handles, &handle_count);
         resource_manager_load_contexts (resmgr,
                                         command,
                                         &entry_slist,
-                                        session_list_tmp);
+                                        &loaded_sessions);
+    }
+    /* make room for any transient object the command may create */
+    if (resmgr->resident_max > 0 && command_attrs & TPMA_CC_RHANDLE) {
+        resource_manager_resident_lock (resmgr);
+        resource_manager_resident_evict (resmgr, entry_slist, 1);
+        resource_manager_resident_unlock (resmgr);
+    }
+    /* and for any session the command may start or load */
+    if (resmgr->session_resident_max > 0 &&
+        (tpm2_command_get_code (command) == TPM2_CC_StartAuthSession ||
+         tpm2_command_get_code (command) == TPM2_CC_ContextLoad))
+    {
+        resource_manager_resident_lock (resmgr);
+        resource_manager_session_evict (resmgr, &loaded_sessions, 1);
+        resource_manager_resident_unlock (resmgr);
     }
     /* load session contexts */
     /* Do any special processing of the command. This could be as simple as 
@@ -1108,55 +1939,153 @@ resource_manager_process_tpm2_command (ResourceManager   *resmgr,
     if (response != NULL) {
         goto send_response;
     }
-    response = access_broker_send_command (resmgr->access_broker,
-                                           command,
-                                           &rc);
-    if (response == NULL) {
-        g_warning ("access_broker_send_command returned error: 0x%x", rc);
+    /* the deadline may have passed while we were loading contexts */
+    rc = resource_manager_abandon_check (resmgr, command);
+    if (rc != TSS2_RC_SUCCESS) {
         response = tpm2_response_new_rc (connection, rc);
+        goto send_response;
     }
+    start = g_get_monotonic_time ();
+    for (retry = 0; ; ++retry) {
+        rc = access_broker_submit (resmgr->access_broker, command);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("access_broker_submit returned error: 0x%x", rc);
+            response = tpm2_response_new_rc (connection, rc);
+            break;
+        }
+        response = access_broker_complete (resmgr->access_broker, &rc);
+        if (response == NULL) {
+            g_warning ("access_broker_complete returned error: 0x%x", rc);
+            response = tpm2_response_new_rc (connection, rc);
+            break;
+        }
+        if (retry >= MAX_COMMAND_RETRY ||
+            !resource_manager_evict_for_retry (resmgr,
+                                               tpm2_response_get_code (response),
+                                               entry_slist,
+                                               &loaded_sessions))
+        {
+            break;
+        }
+        g_object_unref (response);
+    }
+    if (access_broker_should_retry (resmgr->access_broker,
+                                    command,
+                                    response))
+    {
+        g_object_unref (response);
+        if (contexts) {
+            tpm2_command_set_handles (command, handles, handle_count);
+        }
+        /* the command wasn't executed so it didn't flush anything */
+        command_attrs &= ~TPMA_CC_FLUSHED;
+        answered = FALSE;
+        goto post_process;
+    }
+    exec = g_get_monotonic_time () - start;
+    ++resmgr->exec_count;
+    resmgr->exec_time += exec;
+    g_debug ("%s: TPM execution took %" PRId64 "us", __func__, exec);
+    latency_table_update (resmgr->latency_table,
+                          tpm2_command_get_code (command),
+                          exec);
     dump_response (response);
     /* transform virtualized handles in Tpm2Response if necessary */
-    resource_manager_create_context_mapping (resmgr,
-                                             response,
-                                             &entry_slist,
-                                             session_list_tmp);
+    rc = resource_manager_create_context_mapping (resmgr,
+                                                  response,
+                                                  &entry_slist,
+                                                  &loaded_sessions);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_object_unref (response);
+        response = tpm2_response_new_rc (connection, rc);
+    }
 send_response:
     /* send response to next processing stage */
     sink_enqueue (resmgr->sink, G_OBJECT (response));
     g_object_unref (response);
+post_process:
     /* save contexts that were previously loaded by 'load_contexts */
-    post_process_entry_list (resmgr, &entry_slist, connection, command_attrs);
+    if (contexts) {
+        post_process_entry_list (resmgr,
+                                 &entry_slist,
+                                 connection,
+                                 command_attrs);
+        post_process_loaded_sessions (resmgr, &loaded_sessions);
+    }
     g_object_unref (connection);
-    post_process_loaded_sessions (resmgr, session_list_tmp);
-    g_debug ("unreffing session_list_tmp");
-    g_object_unref (session_list_tmp);
-    return;
+    return answered;
 }
 /**
  * This function acts as a thread. It simply:
  * - Blocks on the in_queue. Then wakes up and
- * - Dequeues a message from the in_queue.
- * - Processes the message (depending on TYPE)
+ * - Dequeues the next message from the in_queue. The FairQueue decides
+ *   which connection gets served next.
+ * - Processes the message (depending on TYPE). Tpm2Responses created by
+ *   an earlier pipeline stage are passed on to the Sink unchanged. A
+ *   Tpm2Command that is to be retried goes back to the FairQueue which
+ *   holds it, and the commands behind it from the same Connection, until
+ *   it's due.
  * - Does it all over again.
+ * In run-to-completion mode commands are processed by the thread that
+ * enqueues them and only ControlMessages are queued. The thread then just
+ * waits for the one telling it to exit.
  */
 gpointer
 resource_manager_thread (gpointer data)
 {
     ResourceManager *resmgr = RESOURCE_MANAGER (data);
     GObject         *obj = NULL;
+    gint64           expire_time;
 
     g_debug ("resource_manager_thread start");
+    if (resmgr->run_to_completion) {
+        obj = fair_queue_dequeue (resmgr->in_queue);
+        g_debug ("resource_manager_thread: run-to-completion, got obj: "
+                 "0x%" PRIxPTR, (uintptr_t)obj);
+        g_clear_object (&obj);
+        return NULL;
+    }
     while (TRUE) {
-        obj = message_queue_dequeue (resmgr->in_queue);
-        g_debug ("resource_manager_thread: message_queue_dequeue got obj: "
+        obj = fair_queue_try_dequeue (resmgr->in_queue);
+        if (obj == NULL) {
+            /* nothing is waiting so nothing is delayed */
+            g_atomic_int_set (&resmgr->queue_delay, 0);
+            /* idle: flush expired abandoned sessions between commands */
+            expire_time = resource_manager_expire_abandoned (resmgr);
+            if (expire_time == 0) {
+                continue;
+            } else if (expire_time < 0) {
+                obj = fair_queue_dequeue (resmgr->in_queue);
+            } else {
+                obj = fair_queue_timed_dequeue (resmgr->in_queue,
+                                                expire_time);
+                if (obj == NULL) {
+                    continue;
+                }
+            }
+        }
+        /* a retried command has already been through the queue */
+        if (IS_TPM2_COMMAND (obj) &&
+            tpm2_command_get_retries (TPM2_COMMAND (obj)) == 0)
+        {
+            resource_manager_sample_delay (resmgr, TPM2_COMMAND (obj));
+        }
+        g_debug ("resource_manager_thread: fair_queue_dequeue got obj: "
                  "0x%" PRIxPTR, (uintptr_t)obj);
         if (obj == NULL) {
             g_debug ("resource_manager_thread: dequeued a null object");
             break;
         }
         if (IS_TPM2_COMMAND (obj)) {
-            resource_manager_process_tpm2_command (resmgr, TPM2_COMMAND (obj));
+            if (!resource_manager_process_tpm2_command (resmgr,
+                                                        TPM2_COMMAND (obj)))
+            {
+                fair_queue_requeue (resmgr->in_queue, TPM2_COMMAND (obj));
+            }
+            g_object_unref (obj);
+        } else if (IS_TPM2_RESPONSE (obj)) {
+            /* responses from earlier stages go straight to the client */
+            sink_enqueue (resmgr->sink, obj);
             g_object_unref (obj);
         } else if (IS_CONTROL_MESSAGE (obj)) {
             /* we must unref the message before processing the ControlCode
@@ -1180,22 +2109,158 @@ resource_manager_unblock (Thread *self)
     msg = control_message_new (CHECK_CANCEL);
     g_debug ("resource_manager_cancel: enqueuing ControlMessage: 0x%" PRIxPTR,
              (uintptr_t)msg);
-    message_queue_enqueue (resmgr->in_queue, G_OBJECT (msg));
+    fair_queue_enqueue (resmgr->in_queue, G_OBJECT (msg));
     g_object_unref (msg);
 }
+/*
+ * Decide whether a new command should be turned away because the queue is
+ * too slow. Called by the threads enqueuing commands.
+ */
+static gboolean
+resource_manager_should_shed (ResourceManager *resmgr,
+                              Tpm2Command     *command)
+{
+    Connection *connection;
+    guint weight;
+
+    if (resmgr->shed_delay == 0 ||
+        g_atomic_int_get (&resmgr->queue_delay) <= resmgr->shed_delay)
+    {
+        return FALSE;
+    }
+    if (resmgr->shed_max_weight < FAIR_QUEUE_WEIGHT_MAX) {
+        connection = tpm2_command_get_connection (command);
+        weight = fair_queue_get_weight (resmgr->in_queue,
+                                        connection_get_identity (connection));
+        g_object_unref (connection);
+        if (weight > resmgr->shed_max_weight) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+/*
+ * Answer the command with TPM2_RC_RETRY without sending it to the TPM.
+ */
+static void
+resource_manager_shed (ResourceManager *resmgr,
+                       Tpm2Command     *command)
+{
+    Connection *connection;
+    Tpm2Response *response;
+
+    connection = tpm2_command_get_connection (command);
+    g_debug ("%s: queueing delay %dus over budget, shedding Tpm2Command 0x%"
+             PRIxPTR " from Connection 0x%" PRIxPTR, __func__,
+             g_atomic_int_get (&resmgr->queue_delay), (uintptr_t)command,
+             (uintptr_t)connection);
+    response = tpm2_response_new_rc (connection, TPM2_RC_RETRY);
+    sink_enqueue (resmgr->sink, G_OBJECT (response));
+    g_object_unref (response);
+    g_object_unref (connection);
+    g_atomic_int_inc (&resmgr->shed_count);
+}
 /**
  * Implement the 'enqueue' function from the Sink interface. This is how
- * new messages / commands get into the AccessBroker.
+ * new messages / commands get into the AccessBroker. In run-to-completion
+ * mode commands and responses are handled on the caller's thread and only
+ * ControlMessages are queued for the ResourceManager thread. Expired
+ * abandoned sessions are flushed after each command since the
+ * ResourceManager thread no longer does it when idle. A command that is
+ * to be retried is sent again from here once it's due: only this thread
+ * waits on it.
  */
 void
 resource_manager_enqueue (Sink        *sink,
                           GObject     *obj)
 {
     ResourceManager *resmgr = RESOURCE_MANAGER (sink);
+    gint64 delay;
 
     g_debug ("resource_manager_enqueue: ResourceManager: 0x%" PRIxPTR " obj: "
              "0x%" PRIxPTR, (uintptr_t)resmgr, (uintptr_t)obj);
-    message_queue_enqueue (resmgr->in_queue, obj);
+    if (resmgr->run_to_completion && IS_TPM2_COMMAND (obj)) {
+        while (!resource_manager_process_tpm2_command (resmgr,
+                                                       TPM2_COMMAND (obj)))
+        {
+            delay = tpm2_command_get_not_before (TPM2_COMMAND (obj)) -
+                g_get_monotonic_time ();
+            if (delay > 0) {
+                g_usleep (delay);
+            }
+        }
+        resource_manager_expire_abandoned (resmgr);
+    } else if (resmgr->run_to_completion && IS_TPM2_RESPONSE (obj)) {
+        sink_enqueue (resmgr->sink, obj);
+    } else if (IS_TPM2_COMMAND (obj) &&
+               resource_manager_should_shed (resmgr, TPM2_COMMAND (obj))) {
+        resource_manager_shed (resmgr, TPM2_COMMAND (obj));
+    } else {
+        fair_queue_enqueue (resmgr->in_queue, obj);
+    }
+}
+/*
+ * Answer commands with TPM2_RC_RETRY instead of queuing them once the
+ * average queueing delay is over 'delay' microseconds. Only commands from
+ * clients with a scheduling weight of at most 'max_weight' are turned
+ * away. A delay of 0 disables shedding.
+ */
+void
+resource_manager_set_load_shedding (ResourceManager *resmgr,
+                                    gint64           delay,
+                                    guint            max_weight)
+{
+    resmgr->shed_delay = delay;
+    resmgr->shed_max_weight = max_weight;
+}
+/*
+ * Bound the number of sessions abandoned by their creator that are kept
+ * for a later ContextLoad, and the time in microseconds they're kept for.
+ * A 'ttl' of 0 keeps them until they're pushed out by newer ones.
+ */
+void
+resource_manager_set_abandoned_limits (ResourceManager *resmgr,
+                                       guint            max,
+                                       gint64           ttl)
+{
+    resmgr->abandoned_max = max;
+    resmgr->abandoned_ttl = ttl;
+}
+/*
+ * Process commands on the thread that enqueues them instead of handing
+ * them to the ResourceManager thread. This trades the fair scheduling
+ * done by the FairQueue for lower latency: there's no queue hop and no
+ * thread wakeup between reading a command and sending it to the TPM.
+ * Callers must only enqueue from a single thread in this mode and must
+ * set it before the ResourceManager thread is started.
+ */
+void
+resource_manager_set_run_to_completion (ResourceManager *resmgr,
+                                        gboolean         enable)
+{
+    resmgr->run_to_completion = enable;
+}
+/*
+ * Set the scheduling weight for commands from the client with the given
+ * identity. See connection_get_identity.
+ */
+void
+resource_manager_set_weight (ResourceManager *resmgr,
+                             const gchar     *identity,
+                             guint            weight)
+{
+    fair_queue_set_weight (resmgr->in_queue, identity, weight);
+}
+/*
+ * Select how the next command is picked from the queued commands. Both
+ * schedulers use the execution times the ResourceManager records in its
+ * LatencyTable as the cost of a command.
+ */
+void
+resource_manager_set_scheduler (ResourceManager    *resmgr,
+                                FairQueueScheduler  scheduler)
+{
+    fair_queue_set_scheduler (resmgr->in_queue, scheduler);
 }
 /**
  * Implement the 'add_sink' function from the SourceInterface. This adds a
@@ -1255,6 +2320,14 @@ resource_manager_set_property (GObject        *object,
     case PROP_SESSION_LIST:
         resmgr->session_list = SESSION_LIST (g_value_dup_object (value));
         break;
+    case PROP_RESIDENT_MAX:
+        resmgr->resident_max = g_value_get_uint (value);
+        g_debug ("  resident_max: %u", resmgr->resident_max);
+        break;
+    case PROP_SESSION_RESIDENT_MAX:
+        resmgr->session_resident_max = g_value_get_uint (value);
+        g_debug ("  session_resident_max: %u", resmgr->session_resident_max);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1285,6 +2358,12 @@ resource_manager_get_property (GObject     *object,
     case PROP_SESSION_LIST:
         g_value_set_object (value, resmgr->session_list);
         break;
+    case PROP_RESIDENT_MAX:
+        g_value_set_uint (value, resmgr->resident_max);
+        break;
+    case PROP_SESSION_RESIDENT_MAX:
+        g_value_set_uint (value, resmgr->session_resident_max);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1298,23 +2377,91 @@ resource_manager_dispose (GObject *obj)
 {
     ResourceManager *resmgr = RESOURCE_MANAGER (obj);
     Thread *thread = THREAD (obj);
+    HandleMapEntry *entry;
+    SessionEntry *session_entry;
+    guint64 count = 0, time = 0;
 
     g_debug ("%s: 0x%" PRIxPTR, __func__, (uintptr_t)resmgr);
     if (resmgr == NULL)
         g_error ("%s: passed NULL parameter", __func__);
     if (thread->thread_id != 0)
         g_error ("%s: thread running, cancel thread first", __func__);
+    if (resmgr->in_queue != NULL) {
+        fair_queue_get_wait_stats (resmgr->in_queue, &count, &time);
+        g_info ("%s: %" PRIu64 " messages waited %" PRIu64 "us in queue, "
+                "%" PRIu64 " commands took %" PRIu64 "us in the TPM",
+                __func__, count, time, resmgr->exec_count, resmgr->exec_time);
+        g_info ("%s: %" PRIu64 " context loads and %" PRIu64 " context "
+                "saves avoided by keeping contexts resident", __func__,
+                resmgr->loads_avoided, resmgr->saves_avoided);
+        g_info ("%s: %d commands answered with TPM2_RC_RETRY to shed load",
+                __func__, g_atomic_int_get (&resmgr->shed_count));
+        g_info ("%s: %" PRIu64 " commands canceled or past their deadline "
+                "before reaching the TPM", __func__, resmgr->abandon_count);
+    }
+    if (resmgr->resident_queue != NULL) {
+        while ((entry = g_queue_pop_head (resmgr->resident_queue)) != NULL) {
+            access_broker_context_flush (resmgr->access_broker,
+                                         handle_map_entry_get_phandle (entry));
+            handle_map_entry_set_phandle (entry, 0);
+            resource_manager_resident_discharge (resmgr, entry);
+            g_object_unref (entry);
+        }
+        g_clear_pointer (&resmgr->resident_queue, g_queue_free);
+    }
+    if (resmgr->session_resident_queue != NULL) {
+        while ((session_entry =
+                    g_queue_pop_head (resmgr->session_resident_queue)) != NULL)
+        {
+            resource_manager_resident_discharge (resmgr, session_entry);
+            g_object_unref (session_entry);
+        }
+        g_clear_pointer (&resmgr->session_resident_queue, g_queue_free);
+    }
+    g_clear_pointer (&resmgr->resident_owner, g_hash_table_unref);
     g_clear_object (&resmgr->in_queue);
+    g_clear_object (&resmgr->latency_table);
     g_clear_object (&resmgr->sink);
     g_clear_object (&resmgr->access_broker);
     g_clear_object (&resmgr->session_list);
-    g_clear_object (&resmgr->abandoned_session_queue);
+    if (resmgr->abandoned_session_queue != NULL) {
+        g_queue_free_full (resmgr->abandoned_session_queue, g_object_unref);
+        resmgr->abandoned_session_queue = NULL;
+    }
+    g_clear_pointer (&resmgr->abandoned_session_table, g_hash_table_unref);
     G_OBJECT_CLASS (resource_manager_parent_class)->dispose (obj);
 }
+/**
+ * Release resources that don't hold references to other objects.
+ */
+static void
+resource_manager_finalize (GObject *obj)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (obj);
+
+    pthread_mutex_destroy (&resmgr->resident_mutex);
+    pthread_mutex_destroy (&resmgr->abandoned_mutex);
+    G_OBJECT_CLASS (resource_manager_parent_class)->finalize (obj);
+}
 static void
 resource_manager_init (ResourceManager *manager)
 {
     manager->abandoned_session_queue = g_queue_new ();
+    manager->abandoned_session_table = g_hash_table_new (g_direct_hash,
+                                                         g_direct_equal);
+    manager->abandoned_max = RESOURCE_MANAGER_ABANDONED_MAX_DEFAULT;
+    manager->resident_queue = g_queue_new ();
+    manager->session_resident_queue = g_queue_new ();
+    manager->resident_owner = g_hash_table_new_full (g_direct_hash,
+                                                     g_direct_equal,
+                                                     NULL,
+                                                     g_object_unref);
+    if (pthread_mutex_init (&manager->resident_mutex, NULL) != 0)
+        g_error ("Failed to initialize ResourceManager resident_mutex: %s",
+                 strerror (errno));
+    if (pthread_mutex_init (&manager->abandoned_mutex, NULL) != 0)
+        g_error ("Failed to initialize ResourceManager abandoned_mutex: %s",
+                 strerror (errno));
 }
 /**
  * GObject class initialization function. This function boils down to:
@@ -1331,6 +2478,7 @@ resource_manager_class_init (ResourceManagerClass *klass)
     if (resource_manager_parent_class == NULL)
         resource_manager_parent_class = g_type_class_peek_parent (klass);
     object_class->dispose = resource_manager_dispose;
+    object_class->finalize = resource_manager_finalize;
     object_class->get_property = resource_manager_get_property;
     object_class->set_property = resource_manager_set_property;
     thread_class->thread_run     = resource_manager_thread;
@@ -1360,6 +2508,24 @@ resource_manager_class_init (ResourceManagerClass *klass)
                              "Data structure to hold session tracking data",
                              TYPE_SESSION_LIST,
                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_RESIDENT_MAX] =
+        g_param_spec_uint ("resident-max",
+                           "maximum resident objects",
+                           "Maximum number of transient objects kept loaded "
+                           "in the TPM between commands. 0 disables.",
+                           0,
+                           G_MAXUINT,
+                           0,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_SESSION_RESIDENT_MAX] =
+        g_param_spec_uint ("session-resident-max",
+                           "maximum resident sessions",
+                           "Maximum number of sessions kept loaded in the "
+                           "TPM between commands. 0 disables.",
+                           0,
+                           G_MAXUINT,
+                           0,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
@@ -1382,44 +2548,6 @@ resource_manager_sink_interface_init (gpointer g_iface)
     SinkInterface *sink = (SinkInterface*)g_iface;
     sink->enqueue = resource_manager_enqueue;
 }
-/*
- * This function prunes old sessions that have been abandoned by their creator.
- * When the upper bound on the number of abandoned sessions is exceeded this
- * function causes the older sessions to be removed from the internal queue
- * and flushed from the TPM.
- */
-void
-resource_manager_prune_abandoned (ResourceManager *resource_manager)
-{
-    SessionEntry *session_entry;
-    TPM2_HANDLE session_handle;
-    TSS2_RC rc;
-    guint length;
-
-    length = g_queue_get_length (resource_manager->abandoned_session_queue);
-    if (length < MAX_ABANDONED) {
-        g_debug ("%s: queue size %u max %u, no abandoned sessions to purge",
-                 __func__, length, MAX_ABANDONED);
-        return;
-    }
-
-    /* GQueue owned SessionEntry reference, must unref when done */
-    session_entry =
-        g_queue_pop_tail (resource_manager->abandoned_session_queue);
-    session_handle = session_entry_get_handle (session_entry);
-    g_debug ("%s: flushing stale abandoned SessionEntry: 0x%" PRIxPTR " with "
-             "handle: 0x%08" PRIx32,
-             __func__, (uintptr_t)session_entry, session_handle);
-    rc = access_broker_context_flush (resource_manager->access_broker,
-                                      session_handle);
-    if (rc != TSS2_RC_SUCCESS) {
-        g_warning ("%s: failed to flush abandoned session context with "
-                   "handle 0x%" PRIx32 ": 0x%" PRIx32,
-                   __func__, session_handle, rc);
-    }
-    g_object_unref (session_entry);
-    return;
-}
 /*
  * This function is invoked when a connection is removed from the
  * ConnectionManager. This is if how we know a connection has been closed.
@@ -1434,7 +2562,18 @@ resource_manager_on_connection_removed (ConnectionManager *connection_manager,
     TSS2_RC          rc;
     SessionEntry    *session_entry;
     TPM2_HANDLE       handle;
+    HandleMap       *trans_map;
 
+    g_info ("resource_manager_on_connection_removed: flushing resident "
+            "transient objects associated with connection 0x%" PRIxPTR,
+            (uintptr_t)connection);
+    trans_map = connection_get_trans_map (connection);
+    resource_manager_resident_lock (resource_manager);
+    handle_map_foreach (trans_map,
+                        resource_manager_resident_flush,
+                        resource_manager);
+    resource_manager_resident_unlock (resource_manager);
+    g_object_unref (trans_map);
     g_info ("resource_manager_on_connection_removed: flushing session "
             "contexts associated with connection 0x%" PRIxPTR,
             (uintptr_t)connection);
@@ -1456,10 +2595,9 @@ resource_manager_on_connection_removed (ConnectionManager *connection_manager,
                                  session_entry);
             session_entry_set_state (session_entry,
                                      SESSION_ENTRY_SAVED_CLIENT_CLOSED);
-            /* reference for SessionEntry is now "held" by GQueue */
-            resource_manager_prune_abandoned (resource_manager);
-            g_queue_push_head (resource_manager->abandoned_session_queue,
-                               session_entry);
+            /* reference for SessionEntry is now held by the abandoned store */
+            resource_manager_abandon_session (resource_manager,
+                                              session_entry);
             break;
         case SESSION_ENTRY_SAVED_CLIENT_CLOSED:
             /* This is a situation that should never happen */
@@ -1475,6 +2613,9 @@ resource_manager_on_connection_removed (ConnectionManager *connection_manager,
                 g_warning ("failed to flush context associated with "
                            "connection: 0x%" PRIxPTR, (uintptr_t)connection);
             }
+            resource_manager_resident_lock (resource_manager);
+            resource_manager_session_remove (session_entry, resource_manager);
+            resource_manager_resident_unlock (resource_manager);
             session_list_remove (resource_manager->session_list,
                                  session_entry);
             g_object_unref (session_entry);
@@ -1484,19 +2625,51 @@ resource_manager_on_connection_removed (ConnectionManager *connection_manager,
     g_debug ("resource_manager_on_connection_removed done");
     session_list_unlock (resource_manager->session_list);
 }
+/*
+ * This function is invoked when a client cancels its commands through the
+ * ConnectionManager. Queued commands are dropped when we get to them, here
+ * we ask the AccessBroker to abort the command from 'connection' that the
+ * TPM may be running. That's best effort only, see access_broker_cancel.
+ */
+void
+resource_manager_on_connection_canceled (ConnectionManager *connection_manager,
+                                         Connection        *connection,
+                                         ResourceManager   *resource_manager)
+{
+    g_debug ("%s: Connection 0x%" PRIxPTR " canceled", __func__,
+             (uintptr_t)connection);
+    access_broker_cancel (resource_manager->access_broker, connection);
+}
 /**
  * Create new ResourceManager object.
  */
 ResourceManager*
 resource_manager_new (AccessBroker    *broker,
-                      SessionList     *session_list)
+                      SessionList     *session_list,
+                      guint            resident_max,
+                      guint            session_resident_max)
 {
+    ResourceManager *resmgr;
+    TSS2_RC rc;
+
     if (broker == NULL)
         g_error ("resource_manager_new passed NULL AccessBroker");
-    MessageQueue *queue = message_queue_new ();
-    return RESOURCE_MANAGER (g_object_new (TYPE_RESOURCE_MANAGER,
-                                           "queue-in",        queue,
-                                           "access-broker",   broker,
-                                           "session-list",    session_list,
-                                           NULL));
+    LatencyTable *latency_table = latency_table_new ();
+    FairQueue *queue = fair_queue_new (latency_table);
+    resmgr = RESOURCE_MANAGER (g_object_new (TYPE_RESOURCE_MANAGER,
+                                             "queue-in",        queue,
+                                             "access-broker",   broker,
+                                             "session-list",    session_list,
+                                             "resident-max",    resident_max,
+                                             "session-resident-max",
+                                             session_resident_max,
+                                             NULL));
+    resmgr->latency_table = latency_table;
+    rc = access_broker_get_context_gap_max (broker, &resmgr->context_gap_max);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_info ("%s: TPM2_PT_CONTEXT_GAP_MAX unavailable, not managing "
+                "session context gap", __func__);
+        resmgr->context_gap_max = 0;
+    }
+    return resmgr;
 }
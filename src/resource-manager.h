@@ -34,13 +34,33 @@
 
 #include "access-broker.h"
 #include "connection-manager.h"
-#include "message-queue.h"
+#include "fair-queue.h"
 #include "session-list.h"
 #include "sink-interface.h"
 #include "thread.h"
 
 G_BEGIN_DECLS
 
+/*
+ * Upper bound on the sessions loaded for a single command: one for each
+ * handle and each auth in the command and one the response may create.
+ */
+#define LOADED_SESSIONS_MAX \
+    (TPM2_COMMAND_MAX_HANDLES + TPM2_COMMAND_MAX_AUTHS + 1)
+/*
+ * The sessions loaded in the TPM for the command being processed. This
+ * lives on the stack of the thread processing the command and holds a
+ * reference to each SessionEntry until loaded_sessions_clear.
+ */
+typedef struct _LoadedSessions {
+    guint          count;
+    SessionEntry  *entries [LOADED_SESSIONS_MAX];
+} LoadedSessions;
+
+#define LOADED_SESSIONS_INIT { 0, { NULL, } }
+
+#define RESOURCE_MANAGER_ABANDONED_MAX_DEFAULT 4
+
 typedef struct _ResourceManagerClass {
     ThreadClass      parent;
 } ResourceManagerClass;
@@ -48,10 +68,33 @@ typedef struct _ResourceManagerClass {
 typedef struct _ResourceManager {
     Thread            parent_instance;
     AccessBroker     *access_broker;
-    MessageQueue     *in_queue;
+    FairQueue        *in_queue;
+    LatencyTable     *latency_table;
     Sink             *sink;
     SessionList      *session_list;
+    pthread_mutex_t   abandoned_mutex;
     GQueue           *abandoned_session_queue;
+    GHashTable       *abandoned_session_table;
+    guint             abandoned_max;
+    gint64            abandoned_ttl;
+    pthread_mutex_t   resident_mutex;
+    GQueue           *resident_queue;
+    guint             resident_max;
+    GQueue           *session_resident_queue;
+    guint             session_resident_max;
+    GHashTable       *resident_owner;
+    guint32           context_gap_max;
+    guint64           context_counter;
+    guint64           exec_count;
+    guint64           exec_time;
+    guint64           loads_avoided;
+    guint64           saves_avoided;
+    gboolean          run_to_completion;
+    gint              queue_delay;
+    gint64            shed_delay;
+    guint             shed_max_weight;
+    gint              shed_count;
+    guint64           abandon_count;
 } ResourceManager;
 
 #define TYPE_RESOURCE_MANAGER              (resource_manager_get_type ())
@@ -63,24 +106,49 @@ typedef struct _ResourceManager {
 
 GType                 resource_manager_get_type       (void);
 ResourceManager*      resource_manager_new            (AccessBroker *broker,
-                                                       SessionList  *session_list);
-void                  resource_manager_process_tpm2_command (ResourceManager   *resmgr,
+                                                       SessionList  *session_list,
+                                                       guint         resident_max,
+                                                       guint         session_resident_max);
+gboolean              resource_manager_process_tpm2_command (ResourceManager   *resmgr,
                                                              Tpm2Command       *command);
 void                  resource_manager_flushsave_context (gpointer              entry,
                                                           gpointer              resmgr);
+void                  resource_manager_regap_sessions    (ResourceManager *resmgr);
+void                  resource_manager_set_weight        (ResourceManager *resmgr,
+                                                          const gchar     *identity,
+                                                          guint            weight);
+void                  resource_manager_set_scheduler     (ResourceManager *resmgr,
+                                                          FairQueueScheduler scheduler);
+void                  resource_manager_set_run_to_completion (ResourceManager *resmgr,
+                                                              gboolean         enable);
+void                  resource_manager_set_load_shedding (ResourceManager *resmgr,
+                                                          gint64           delay,
+                                                          guint            max_weight);
+void                  resource_manager_set_abandoned_limits (ResourceManager *resmgr,
+                                                             guint            max,
+                                                             gint64           ttl);
+gint64                resource_manager_expire_abandoned  (ResourceManager *resmgr);
 TSS2_RC               resource_manager_load_contexts     (ResourceManager *resmgr,
                                                           Tpm2Command     *command,
                                                           GSList         **slist,
-                                                          SessionList     *session_list);
+                                                          LoadedSessions  *loaded_sessions);
 TSS2_RC               resource_manager_virt_to_phys      (ResourceManager *resmgr,
                                                           Tpm2Command     *command,
                                                           HandleMapEntry  *entry,
                                                           guint8           handle_number);
+void                  post_process_entry_list            (ResourceManager *resmgr,
+                                                          GSList         **entry_slist,
+                                                          Connection      *connection,
+                                                          TPMA_CC          command_attrs);
 void                  resource_manager_enqueue           (Sink            *sink,
                                                           GObject         *obj);
 void                  resource_manager_on_connection_removed (ConnectionManager *connection_manager,
                                                               Connection        *connection,
                                                               ResourceManager   *resource_manager);
+void                  resource_manager_on_connection_canceled (ConnectionManager *connection_manager,
+                                                               Connection        *connection,
+                                                               ResourceManager   *resource_manager);
+void                  loaded_sessions_clear              (LoadedSessions  *loaded_sessions);
 
 G_END_DECLS
 #endif /* RESOURCE_MANAGER_H */
@@ -31,13 +31,13 @@
 #include <glib-object.h>
 #include <pthread.h>
 
-#include "message-queue.h"
-#include "thread.h"
+#include "parallel-stage.h"
+#include "tpm2-response.h"
 
 G_BEGIN_DECLS
 
 typedef struct _ResponseSinkClass {
-    ThreadClass       parent;
+    ParallelStageClass parent;
 } ResponseSinkClass;
 
 /** DON'T TOUCH!
@@ -46,8 +46,7 @@ typedef struct _ResponseSinkClass {
  * to access the structure directly you probably need to update the API.
  */
 typedef struct _ResponseSink {
-    Thread             parent_instance;
-    MessageQueue      *in_queue;
+    ParallelStage      parent_instance;
 } ResponseSink;
 
 #define TYPE_RESPONSE_SINK              (response_sink_get_type ())
@@ -58,7 +57,8 @@ typedef struct _ResponseSink {
 #define RESPONSE_SINK_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_RESPONSE_SINK, ResponseSinkClass))
 
 GType               response_sink_get_type    (void);
-ResponseSink*       response_sink_new         (void);
+ResponseSink*       response_sink_new         (guint workers);
+ssize_t             response_sink_process_response (Tpm2Response *response);
 
 G_END_DECLS
 #endif /* RESPONSE_SINK_H */
@@ -214,7 +214,8 @@ session_entry_get_state (SessionEntry *entry)
 /*
  * This function allows the caller to set the state of the SessionEntry. It
  * also ensures that if the SessionEntry is put into the 'SAVED_CLIENT_CLOSED'
- * state that the connection field is clear / NULL.
+ * state that the connection field is clear / NULL and records the time the
+ * session was abandoned.
  */
 void
 session_entry_set_state (SessionEntry *entry,
@@ -222,6 +223,7 @@ session_entry_set_state (SessionEntry *entry,
 {
     if (state == SESSION_ENTRY_SAVED_CLIENT_CLOSED) {
         g_clear_object (&entry->connection);
+        entry->closed_time = g_get_monotonic_time ();
     }
     entry->state = state;
 }
@@ -237,6 +239,31 @@ session_entry_set_connection (SessionEntry *entry,
     g_clear_object (&entry->connection);
     entry->connection = connection;
 }
+/*
+ * Accessor for the flag indicating whether the session is currently loaded
+ * in the TPM. When it is, the context member is stale and the session can
+ * be used without a ContextLoad.
+ */
+gboolean
+session_entry_get_loaded (SessionEntry *entry)
+{
+    return entry->loaded;
+}
+void
+session_entry_set_loaded (SessionEntry *entry,
+                          gboolean      loaded)
+{
+    entry->loaded = loaded;
+}
+/*
+ * Accessor for the monotonic time, in microseconds, at which the session
+ * was last put in the 'SAVED_CLIENT_CLOSED' state.
+ */
+gint64
+session_entry_get_closed_time (SessionEntry *entry)
+{
+    return entry->closed_time;
+}
 void
 session_entry_prettyprint (SessionEntry *entry)
 {
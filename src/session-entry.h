@@ -45,6 +45,12 @@ typedef struct _SessionEntry {
     Connection            *connection;
     SessionEntryStateEnum  state;
     TPMS_CONTEXT           context;
+    gboolean               loaded;
+    gint64                 closed_time;
+    /* owned by the SessionList holding the entry, see session-list.c */
+    GList                  list_link;
+    GList                  connection_link;
+    Connection            *list_connection;
 } SessionEntry;
 
 #define TYPE_SESSION_ENTRY              (session_entry_get_type   ())
@@ -65,6 +71,10 @@ void             session_entry_set_connection  (SessionEntry      *entry,
                                                 Connection        *connection);
 void             session_entry_set_state       (SessionEntry      *entry,
                                                 SessionEntryStateEnum state);
+gboolean         session_entry_get_loaded      (SessionEntry      *entry);
+void             session_entry_set_loaded      (SessionEntry      *entry,
+                                                gboolean           loaded);
+gint64           session_entry_get_closed_time (SessionEntry      *entry);
 void             session_entry_prettyprint     (SessionEntry      *entry);
 
 G_END_DECLS
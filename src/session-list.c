@@ -85,22 +85,107 @@ session_list_set_property (GObject        *object,
  * Initialize object. This requires:
  * 1) initializing the mutex that mediate access to the hash tables
  * 2) creating the hash tables
- * 3) initializing the handle_count
- * The handle_count is currently initialized to start allocating handles
- * @ 0xff. This is an arbitrary way we differentiate them from the handles
- * allocated by the TPM.
+ * The queues of entries in the connection_table are freed when their last
+ * entry is removed.
  */
 static void
 session_list_init (SessionList     *list)
 {
     g_debug ("session_list_init");
     pthread_mutex_init (&list->mutex, NULL);
-    list->session_entry_list = NULL;
+    g_queue_init (&list->entry_queue);
+    list->handle_table = g_hash_table_new (g_direct_hash, g_direct_equal);
+    list->connection_table =
+        g_hash_table_new_full (g_direct_hash,
+                               g_direct_equal,
+                               NULL,
+                               (GDestroyNotify)g_queue_free);
 }
 /*
- * GObject dispose function: unref all SessionEntry objects in the internal
- * GSList and unref the list itself. NULL the pointer to the internal list
- * as well.
+ * Add the entry to the queue of entries for its Connection. Entries
+ * without a Connection, like sessions abandoned by their creator, aren't
+ * indexed. The Connection the entry was indexed under is kept so it can be
+ * found again if the entry's connection is cleared.
+ * The caller must hold the lock.
+ */
+static void
+session_list_index_connection (SessionList  *list,
+                               SessionEntry *entry)
+{
+    GQueue *queue;
+
+    entry->list_connection = entry->connection;
+    if (entry->list_connection == NULL) {
+        return;
+    }
+    queue = g_hash_table_lookup (list->connection_table,
+                                 entry->list_connection);
+    if (queue == NULL) {
+        queue = g_queue_new ();
+        g_hash_table_insert (list->connection_table,
+                             entry->list_connection,
+                             queue);
+    }
+    entry->connection_link.data = entry;
+    g_queue_push_tail_link (queue, &entry->connection_link);
+}
+/*
+ * Remove the entry from the queue of entries for the Connection it was
+ * indexed under.
+ * The caller must hold the lock.
+ */
+static void
+session_list_unindex_connection (SessionList  *list,
+                                 SessionEntry *entry)
+{
+    GQueue *queue;
+
+    if (entry->list_connection == NULL) {
+        return;
+    }
+    queue = g_hash_table_lookup (list->connection_table,
+                                 entry->list_connection);
+    g_queue_unlink (queue, &entry->connection_link);
+    entry->connection_link.data = NULL;
+    if (g_queue_is_empty (queue)) {
+        g_hash_table_remove (list->connection_table, entry->list_connection);
+    }
+    entry->list_connection = NULL;
+}
+/*
+ * Returns TRUE if the entry is held by this SessionList.
+ * The caller must hold the lock.
+ */
+static gboolean
+session_list_contains (SessionList  *list,
+                       SessionEntry *entry)
+{
+    TPM2_HANDLE handle = session_entry_get_handle (entry);
+
+    return entry->list_link.data != NULL &&
+        g_hash_table_lookup (list->handle_table,
+                             GUINT_TO_POINTER (handle)) == entry;
+}
+/*
+ * Remove the entry from the list and both indexes and drop the reference
+ * held by the list.
+ * The caller must hold the lock.
+ */
+static void
+session_list_unlink (SessionList  *list,
+                     SessionEntry *entry)
+{
+    TPM2_HANDLE handle = session_entry_get_handle (entry);
+
+    g_queue_unlink (&list->entry_queue, &entry->list_link);
+    entry->list_link.data = NULL;
+    g_hash_table_remove (list->handle_table, GUINT_TO_POINTER (handle));
+    session_list_unindex_connection (list, entry);
+    g_object_unref (entry);
+}
+/*
+ * GObject dispose function: remove all SessionEntry objects from the list,
+ * dropping the references held on them, and free the indexes.
  */
 static void
 session_list_dispose (GObject *object)
@@ -108,10 +193,12 @@ session_list_dispose (GObject *object)
     SessionList *self = SESSION_LIST (object);
 
     g_debug ("%s: SessionList: 0x%" PRIxPTR " with %" PRIu32 " entries",
-             __func__, (uintptr_t)self,
-             g_list_length (self->session_entry_list));
-    g_list_free_full (self->session_entry_list, g_object_unref);
-    self->session_entry_list = NULL;
+             __func__, (uintptr_t)self, self->entry_queue.length);
+    while (self->entry_queue.head != NULL) {
+        session_list_unlink (self, SESSION_ENTRY (self->entry_queue.head->data));
+    }
+    g_clear_pointer (&self->handle_table, g_hash_table_unref);
+    g_clear_pointer (&self->connection_table, g_hash_table_unref);
     G_OBJECT_CLASS (session_list_parent_class)->dispose (object);
 }
 /*
@@ -126,11 +213,9 @@ session_list_finalize (GObject *object)
 {
     SessionList *self = SESSION_LIST (object);
 
-    g_debug ("session_list_finalize: SessionList: 0x%" PRIxPTR " with %"
-             PRIu32 " entries", (uintptr_t)self,
-             g_list_length (self->session_entry_list));
+    g_debug ("session_list_finalize: SessionList: 0x%" PRIxPTR,
+             (uintptr_t)self);
     pthread_mutex_destroy (&self->mutex);
-    g_list_free_full (self->session_entry_list, g_object_unref);
     G_OBJECT_CLASS (session_list_parent_class)->finalize (object);
 }
 /*
@@ -192,17 +277,21 @@ session_list_unlock (SessionList *list)
 /*
  * Insert GObject into the session list. We take a reference to the object
  * before we insert the object. When it is removed or if the SessionList
- * object is destroyed the object will be unref'd.
+ * object is destroyed the object will be unref'd. An entry can only be in
+ * one SessionList and there can only be one entry for each handle.
  */
 gboolean
 session_list_insert (SessionList      *list,
                      SessionEntry     *entry)
 {
+    TPM2_HANDLE handle;
+
     g_debug ("session_list_insert: 0x%" PRIxPTR ", entry: 0x%" PRIxPTR,
              (uintptr_t)list, (uintptr_t)entry);
     if (list == NULL || entry == NULL) {
         g_error ("session_list_insert passed NULL parameter");
     }
+    handle = session_entry_get_handle (entry);
     session_list_lock (list);
     if (session_list_is_full_unlocked (list, entry->connection)) {
         g_warning ("SessionList: 0x%" PRIxPTR " max_per_connection of %u "
@@ -210,9 +299,20 @@ session_list_insert (SessionList      *list,
         session_list_unlock (list);
         return FALSE;
     }
+    if (entry->list_link.data != NULL ||
+        g_hash_table_contains (list->handle_table, GUINT_TO_POINTER (handle)))
+    {
+        g_warning ("SessionList: 0x%" PRIxPTR " SessionEntry 0x%" PRIxPTR
+                   " with handle 0x%08" PRIx32 " is already in a SessionList",
+                   (uintptr_t)list, (uintptr_t)entry, handle);
+        session_list_unlock (list);
+        return FALSE;
+    }
     g_object_ref (entry);
-    list->session_entry_list = g_list_append (list->session_entry_list,
-                                                 entry);
+    entry->list_link.data = entry;
+    g_queue_push_tail_link (&list->entry_queue, &entry->list_link);
+    g_hash_table_insert (list->handle_table, GUINT_TO_POINTER (handle), entry);
+    session_list_index_connection (list, entry);
     session_list_unlock (list);
 
     return TRUE;
@@ -293,58 +393,53 @@ session_entry_compare_on_connection (gconstpointer a,
 
     return ret;
 }
-static gboolean
-session_list_remove_custom (SessionList  *list,
-                            gconstpointer data,
-                            GCompareFunc  func)
-{
-    GList       *list_entry;
-    SessionEntry *entry_data;
-
-    session_list_lock (list);
-    list_entry = g_list_find_custom (list->session_entry_list, data, func);
-    if (list_entry == NULL) {
-        session_list_unlock (list);
-        return FALSE;
-    }
-    entry_data = SESSION_ENTRY (list_entry->data);
-    list->session_entry_list = g_list_remove_link (list->session_entry_list,
-                                                     list_entry);
-    g_object_unref (entry_data);
-    session_list_unlock (list);
-
-    return TRUE;
-}
-                          
 /*
- * Remove the entry from the GList. The SessionList assumes that since the
- * entry is in the container it must hold a reference to the object and so
- * upon successful removal 
+ * Remove the entry with the given handle from the list. The SessionList
+ * assumes that since the entry is in the container it must hold a
+ * reference to the object and so upon successful removal the reference is
+ * dropped.
  * Returns TRUE on success, FALSE on failure.
  */
 gboolean
 session_list_remove_handle (SessionList      *list,
                             TPM2_HANDLE        handle)
 {
-    return session_list_remove_custom (list,
-                                       &handle,
-                                       session_entry_compare_on_handle);
+    SessionEntry *entry;
+
+    session_list_lock (list);
+    entry = g_hash_table_lookup (list->handle_table,
+                                 GUINT_TO_POINTER (handle));
+    if (entry != NULL) {
+        session_list_unlink (list, entry);
+    }
+    session_list_unlock (list);
+
+    return entry != NULL ? TRUE : FALSE;
 }
 /*
+ * Remove the oldest entry associated with the connection from the list.
  * Returns TRUE on success, FALSE on failure.
  */
 gboolean
 session_list_remove_connection (SessionList      *list,
                                 Connection       *connection)
 {
-    return session_list_remove_custom (list,
-                                       connection,
-                                       session_entry_compare_on_connection);
+    GQueue *queue;
+
+    session_list_lock (list);
+    queue = g_hash_table_lookup (list->connection_table, connection);
+    if (queue == NULL) {
+        session_list_unlock (list);
+        return FALSE;
+    }
+    session_list_unlink (list, SESSION_ENTRY (queue->head->data));
+    session_list_unlock (list);
+
+    return TRUE;
 }
 /*
- * This function is a thin wrapper around the g_list_remove function. Pass it
- * a SessionEntry. It will find it in the list and remove the associated entry
- * and then unref it (to account for the SessionList no longer holding a
+ * Pass this function a SessionEntry. It will remove it from the list and
+ * then unref it (to account for the SessionList no longer holding a
  * reference). This function does not lock the SessionList during this
  * operation so the caller will have to do this themselves.
  */
@@ -354,30 +449,54 @@ session_list_remove (SessionList   *list,
 {
     g_debug ("session_list_remove: SessionList: 0x%" PRIxPTR " SessionEntry: "
              "0x%" PRIxPTR, (uintptr_t)list, (uintptr_t)entry);
-    list->session_entry_list = g_list_remove (list->session_entry_list, entry);
-    g_object_unref (entry);
+    if (!session_list_contains (list, entry)) {
+        g_warning ("%s: SessionEntry 0x%" PRIxPTR " not in SessionList 0x%"
+                   PRIxPTR, __func__, (uintptr_t)entry, (uintptr_t)list);
+        return;
+    }
+    session_list_unlink (list, entry);
 }
 /*
- * Get last entry in list and remove it from the list.
+ * Get last entry in list and remove it from the list. The reference held
+ * by the list is passed to the caller.
  */
 SessionEntry*
 session_list_remove_last (SessionList *list)
 {
-    GList       *list_entry;
-    SessionEntry *entry_data;
+    SessionEntry *entry = NULL;
 
     session_list_lock (list);
-    list_entry = g_list_last (list->session_entry_list);
-    if (list_entry == NULL) {
-        session_list_unlock (list);
-        return NULL;
+    if (list->entry_queue.tail != NULL) {
+        entry = g_object_ref (SESSION_ENTRY (list->entry_queue.tail->data));
+        session_list_unlink (list, entry);
     }
-    entry_data = SESSION_ENTRY (list_entry->data);
-    list->session_entry_list = g_list_remove_link (list->session_entry_list,
-                                                     list_entry);
     session_list_unlock (list);
 
-    return entry_data;
+    return entry;
+}
+/*
+ * Change the Connection associated with an entry in the list. While an
+ * entry is in a SessionList its connection must only be changed through
+ * this function so that it's indexed under the right Connection. An entry
+ * that isn't in the list just has its connection set.
+ */
+void
+session_list_set_connection (SessionList  *list,
+                             SessionEntry *entry,
+                             Connection   *connection)
+{
+    gboolean contains;
+
+    session_list_lock (list);
+    contains = session_list_contains (list, entry);
+    if (contains) {
+        session_list_unindex_connection (list, entry);
+    }
+    session_entry_set_connection (entry, connection);
+    if (contains) {
+        session_list_index_connection (list, entry);
+    }
+    session_list_unlock (list);
 }
 /*
  * This is a lookup function to find an entry in the SessionList given
@@ -391,14 +510,11 @@ SessionEntry*
 session_list_lookup_connection (SessionList   *list,
                                 Connection    *connection)
 {
-    GList *list_entry;
+    GQueue *queue;
 
-    list_entry = g_list_find_custom (list->session_entry_list,
-                                      connection,
-                                      session_entry_compare_on_connection);
-    if (list_entry != NULL) {
-        g_object_ref (list_entry->data);
-        return SESSION_ENTRY (list_entry->data);
+    queue = g_hash_table_lookup (list->connection_table, connection);
+    if (queue != NULL) {
+        return SESSION_ENTRY (g_object_ref (queue->head->data));
     } else {
         return NULL;
     }
@@ -415,17 +531,52 @@ SessionEntry*
 session_list_lookup_handle (SessionList   *list,
                             TPM2_HANDLE     handle)
 {
-    GList *list_entry;
+    SessionEntry *entry;
 
-    list_entry = g_list_find_custom (list->session_entry_list,
-                                      &handle,
-                                      session_entry_compare_on_handle);
-    if (list_entry != NULL) {
-        g_object_ref (list_entry->data);
-        return SESSION_ENTRY (list_entry->data);
-    } else {
-        return NULL;
+    entry = g_hash_table_lookup (list->handle_table,
+                                 GUINT_TO_POINTER (handle));
+    if (entry != NULL) {
+        g_object_ref (entry);
     }
+    return entry;
+}
+/*
+ * Find the SessionEntry with the oldest context saved by the RM. This is
+ * the one with the lowest context sequence number that's in the
+ * SESSION_ENTRY_SAVED_RM state and isn't currently loaded in the TPM.
+ * Sessions saved by the client are ignored since the RM doesn't hold
+ * their saved context. The caller *must* hold the lock on the SessionList.
+ * This function increases the reference count on the SessionEntry
+ * returned. The caller must decrement the reference count when it is done
+ * with the entry.
+ */
+SessionEntry*
+session_list_oldest_saved (SessionList *list)
+{
+    GList        *list_entry;
+    SessionEntry *entry, *oldest = NULL;
+
+    for (list_entry = list->entry_queue.head;
+         list_entry != NULL;
+         list_entry = list_entry->next)
+    {
+        entry = SESSION_ENTRY (list_entry->data);
+        if (session_entry_get_state (entry) != SESSION_ENTRY_SAVED_RM ||
+            session_entry_get_loaded (entry))
+        {
+            continue;
+        }
+        if (oldest == NULL ||
+            session_entry_get_context (entry)->sequence <
+                session_entry_get_context (oldest)->sequence)
+        {
+            oldest = entry;
+        }
+    }
+    if (oldest != NULL) {
+        g_object_ref (oldest);
+    }
+    return oldest;
 }
 /*
  * Simple wrapper around the function that reports the number of entries in
@@ -437,48 +588,26 @@ session_list_size (SessionList *list)
     guint ret;
 
     session_list_lock (list);
-    ret = g_list_length (list->session_entry_list);
+    ret = list->entry_queue.length;
     session_list_unlock (list);
 
     return ret;
 }
-/*
- * Structure used to hold data needed to count SessionEntry objects associated
- * with a given connection.
- */
-typedef struct {
-    Connection *connection;
-    size_t      count;
-} connection_count_data_t;
-/*
- * Callback function used to count the number of SessionEntry objects in the
- * list associated with a given connection.
- */
-static void
-session_list_connection_counter (gpointer data,
-                                 gpointer user_data)
-{
-    SessionEntry *entry = SESSION_ENTRY (data);
-    connection_count_data_t *count_data = (connection_count_data_t*)user_data;
-
-    if (count_data->connection == session_entry_get_connection (entry)) {
-        ++count_data->count;
-    }
-}
 /*
  * Returns the number of entries associated with the provided connection.
+ * The caller must hold the lock.
  */
 size_t
 session_list_connection_count (SessionList *list,
                                Connection  *connection)
 {
-    connection_count_data_t count_data = {
-        .connection = connection,
-        .count = 0,
-    };
+    GQueue *queue;
 
-    session_list_foreach (list, session_list_connection_counter, &count_data);
-    return count_data.count;
+    if (connection == NULL) {
+        return 0;
+    }
+    queue = g_hash_table_lookup (list->connection_table, connection);
+    return queue != NULL ? queue->length : 0;
 }
 /*
  * Return false if the number of entries in the list is greater than or equal
@@ -530,19 +659,22 @@ session_list_prettyprint (SessionList *list)
 {
     g_debug ("SessionList: 0x%" PRIxPTR, (uintptr_t)list);
     session_list_lock (list);
-    g_list_foreach (list->session_entry_list,
-                     session_list_dump_entry,
-                     NULL);
+    session_list_foreach (list, session_list_dump_entry, NULL);
     session_list_unlock (list);
 }
 /*
+ * Call 'func' for each entry in the order they were inserted. Like
+ * g_list_foreach 'func' may remove the entry it's passed from the list.
  */
 void
 session_list_foreach (SessionList *list,
                       GFunc        func,
                       gpointer     user_data)
 {
-    g_list_foreach (list->session_entry_list,
-                     func,
-                     user_data);
+    GList *link, *next;
+
+    for (link = list->entry_queue.head; link != NULL; link = next) {
+        next = link->next;
+        func (link->data, user_data);
+    }
 }
@@ -44,11 +44,21 @@ typedef struct _SessionListClass {
     GObjectClass      parent;
 } SessionListClass;
 
+/*
+ * The SessionEntry objects are kept in insertion order in 'entry_queue'.
+ * They're indexed by handle in 'handle_table' and by Connection in
+ * 'connection_table', which maps each Connection to a GQueue of its
+ * entries. Both queues are linked through GList nodes embedded in the
+ * SessionEntry so inserting and removing an entry is O(1) and an entry
+ * can only be held by one SessionList at a time.
+ */
 typedef struct _SessionList {
     GObject             parent_instance;
     pthread_mutex_t     mutex;
     guint               max_per_connection;
-    GList              *session_entry_list;
+    GQueue              entry_queue;
+    GHashTable         *handle_table;
+    GHashTable         *connection_table;
 } SessionList;
 
 #define TYPE_SESSION_LIST              (session_list_get_type   ())
@@ -68,12 +78,16 @@ SessionEntry*  session_list_lookup_connection (SessionList      *list,
                                                Connection       *connection);
 SessionEntry*  session_list_lookup_handle     (SessionList      *list,
                                               TPM2_HANDLE        handle);
+SessionEntry*  session_list_oldest_saved      (SessionList      *list);
 gint           session_list_remove_handle     (SessionList      *list,
                                                TPM2_HANDLE        handle);
 gint           session_list_remove_connection (SessionList      *list,
                                                Connection       *connection);
 void           session_list_remove            (SessionList      *list,
                                                SessionEntry     *entry);
+void           session_list_set_connection    (SessionList      *list,
+                                               SessionEntry     *entry,
+                                               Connection       *connection);
 guint          session_list_size              (SessionList      *list);
 gboolean       session_list_is_full           (SessionList      *list,
                                                Connection       *connection);
@@ -33,16 +33,19 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
 #include <sapi/tpm20.h>
 #include "tabrmd.h"
 #include "access-broker.h"
+#include "buffer-pool.h"
 #include "connection.h"
 #include "connection-manager.h"
 #include "tabrmd.h"
 #include "logging.h"
 #include "thread.h"
+#include "command-parser.h"
 #include "command-source.h"
 #include "ipc-frontend.h"
 #include "ipc-frontend-dbus.h"
@@ -69,11 +72,13 @@ typedef struct gmain_data {
     AccessBroker           *access_broker;
     ResourceManager        *resource_manager;
     CommandSource          *command_source;
+    CommandParser          *command_parser;
     Random                 *random;
     ResponseSink           *response_sink;
     GMutex                  init_mutex;
     Tcti                   *tcti;
     IpcFrontend            *ipc_frontend;
+    GThread                *self_test_thread;
 } gmain_data_t;
 
 /**
@@ -102,6 +107,19 @@ signal_handler (gpointer user_data)
     return G_SOURCE_CONTINUE;
 }
 
+/*
+ * Thread function to run the TPM self tests in the background. The
+ * AccessBroker reference passed in is owned by this thread.
+ */
+static gpointer
+self_test_thread_func (gpointer user_data)
+{
+    AccessBroker *access_broker = ACCESS_BROKER (user_data);
+
+    access_broker_self_test (access_broker);
+    g_object_unref (access_broker);
+    return NULL;
+}
 static void
 on_ipc_frontend_disconnect (IpcFrontend *ipc_frontend,
                             GMainLoop   *loop)
@@ -122,6 +140,7 @@ on_ipc_frontend_disconnect (IpcFrontend *ipc_frontend,
  * - Creates the ConnectionManager.
  * - Creates the TCTI instance used by the Tab.
  * - Creates an access broker and verify the current state of the TPM.
+ * - Optionally starts the TPM self tests in the background.
  * - Creates and wires up the objects that make up the TPM command
  *   processing pipeline.
  * - Starts all of the threads in the command processing pipeline.
@@ -136,6 +155,11 @@ init_thread_func (gpointer user_data)
     CommandAttrs *command_attrs;
     ConnectionManager *connection_manager = NULL;
     SessionList *session_list;
+    guint32 resident_max = 0, session_resident_max = 0;
+    guint32 max_command = 0, max_response = 0;
+    guint workers;
+    GHashTableIter iter;
+    gpointer identity, weight;
 
     g_info ("init_thread_func start");
     g_mutex_lock (&data->init_mutex);
@@ -199,6 +223,27 @@ init_thread_func (gpointer user_data)
     if (data->options.flush_all) {
         access_broker_flush_all_context (data->access_broker);
     }
+    /*
+     * Size the command / response buffers for the largest the TPM handles.
+     * Each command in flight holds a command buffer until it's sent and a
+     * response buffer after.
+     */
+    rc = access_broker_get_max_command (data->access_broker, &max_command);
+    if (rc == TSS2_RC_SUCCESS)
+        rc = access_broker_get_max_response (data->access_broker,
+                                             &max_response);
+    if (rc != TSS2_RC_SUCCESS)
+        g_error ("failed to get TPM max command / response size: 0x%" PRIx32,
+                 rc);
+    buffer_pool_init (MAX (max_command, max_response),
+                      MIN (data->options.in_flight_total_max * 2,
+                           BUFFER_POOL_COUNT_MAX));
+    if (data->options.self_test) {
+        data->self_test_thread =
+            g_thread_new (TABD_SELF_TEST_THREAD_NAME,
+                          self_test_thread_func,
+                          g_object_ref (data->access_broker));
+    }
     /**
      * Instantiate and the objects that make up the TPM command processing
      * pipeline.
@@ -214,13 +259,68 @@ init_thread_func (gpointer user_data)
         command_source_new (connection_manager, command_attrs);
     g_debug ("created command source: 0x%" PRIxPTR,
              (uintptr_t)data->command_source);
+    command_source_set_in_flight_max (data->command_source,
+                                      data->options.in_flight_max,
+                                      data->options.in_flight_total_max);
+    /*
+     * In run-to-completion mode the stages around the ResourceManager get
+     * no worker threads: each command is parsed, sent to the TPM and its
+     * response written by the thread that read it.
+     */
+    workers = data->options.run_to_completion ? 0 : data->options.workers;
+    data->command_parser = command_parser_new (workers);
+    g_debug ("created CommandParser: 0x%" PRIxPTR,
+             (uintptr_t)data->command_parser);
+    /*
+     * Keep transient objects and sessions loaded in the TPM between commands
+     * unless disabled. The TPM tells us how many it has room for.
+     */
+    if (!data->options.disable_resident) {
+        rc = access_broker_get_trans_avail (data->access_broker,
+                                            &resident_max);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("failed to get TPM2_PT_HR_TRANSIENT_AVAIL, resident "
+                       "transient objects disabled: 0x%" PRIx32, rc);
+            resident_max = 0;
+        }
+        rc = access_broker_get_loaded_avail (data->access_broker,
+                                             &session_resident_max);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("failed to get TPM2_PT_HR_LOADED_AVAIL, resident "
+                       "sessions disabled: 0x%" PRIx32, rc);
+            session_resident_max = 0;
+        }
+    }
+    g_debug ("resident transient objects max: %" PRIu32 ", resident "
+             "sessions max: %" PRIu32, resident_max, session_resident_max);
     session_list = session_list_new (data->options.max_sessions);
     data->resource_manager = resource_manager_new (data->access_broker,
-                                                   session_list);
+                                                   session_list,
+                                                   resident_max,
+                                                   session_resident_max);
     g_clear_object (&session_list);
     g_debug ("created ResourceManager: 0x%" PRIxPTR,
              (uintptr_t)data->resource_manager);
-    data->response_sink = response_sink_new ();
+    resource_manager_set_scheduler (data->resource_manager,
+                                    data->options.scheduler);
+    resource_manager_set_run_to_completion (data->resource_manager,
+                                            data->options.run_to_completion);
+    resource_manager_set_load_shedding (data->resource_manager,
+                                        (gint64)data->options.shed_delay * 1000,
+                                        data->options.shed_max_weight);
+    resource_manager_set_abandoned_limits (data->resource_manager,
+                                           data->options.abandoned_max,
+                                           (gint64)data->options.abandoned_ttl *
+                                               G_USEC_PER_SEC);
+    if (data->options.client_weights != NULL) {
+        g_hash_table_iter_init (&iter, data->options.client_weights);
+        while (g_hash_table_iter_next (&iter, &identity, &weight)) {
+            resource_manager_set_weight (data->resource_manager,
+                                         identity,
+                                         GPOINTER_TO_UINT (weight));
+        }
+    }
+    data->response_sink = response_sink_new (workers);
     g_debug ("created response source: 0x%" PRIxPTR,
              (uintptr_t)data->response_sink);
     g_object_unref (command_attrs);
@@ -233,13 +333,34 @@ init_thread_func (gpointer user_data)
                       "connection-removed",
                       G_CALLBACK (resource_manager_on_connection_removed),
                       data->resource_manager);
+    g_signal_connect (connection_manager,
+                      "connection-canceled",
+                      G_CALLBACK (resource_manager_on_connection_canceled),
+                      data->resource_manager);
     g_object_unref (connection_manager);
+    /*
+     * The CommandSource stops reading from clients with too many commands
+     * in flight and needs to know when responses have been sent. The
+     * handler holds a reference to the CommandSource so it outlives the
+     * ResponseSink threads.
+     */
+    g_signal_connect_data (data->response_sink,
+                           "response-sent",
+                           G_CALLBACK (command_source_on_response_sent),
+                           g_object_ref (data->command_source),
+                           (GClosureNotify)g_object_unref,
+                           0);
     /**
      * Wire up the TPM command processing pipeline. TPM command buffers
-     * flow from the CommandSource, to the Tab then finally back to the
-     * caller through the ResponseSink.
+     * flow from the CommandSource, through the CommandParser, to the
+     * ResourceManager then finally back to the caller through the
+     * ResponseSink. Only the ResourceManager, which talks to the TPM, is a
+     * single thread. The CommandParser and ResponseSink spread the work
+     * for different connections across 'workers' threads.
      */
     source_add_sink (SOURCE (data->command_source),
+                     SINK   (data->command_parser));
+    source_add_sink (SOURCE (data->command_parser),
                      SINK   (data->resource_manager));
     source_add_sink (SOURCE (data->resource_manager),
                      SINK   (data->response_sink));
@@ -249,6 +370,9 @@ init_thread_func (gpointer user_data)
     ret = thread_start (THREAD (data->command_source));
     if (ret != 0)
         g_error ("failed to start connection_source");
+    ret = thread_start (THREAD (data->command_parser));
+    if (ret != 0)
+        g_error ("failed to start CommandParser: %s", strerror (errno));
     ret = thread_start (THREAD (data->resource_manager));
     if (ret != 0)
         g_error ("failed to start ResourceManager: %s", strerror (errno));
@@ -334,6 +458,41 @@ tcti_conf_parse (gchar *combined_conf,
 
     return TRUE;
 }
+/*
+ * Parse a client weight string of the form "identity=weight". The string
+ * is split in place by replacing the last '=' with a NUL. The identity may
+ * itself contain '=' but the weight must be an integer between 1 and
+ * FAIR_QUEUE_WEIGHT_MAX.
+ * This function returns TRUE if 'weight_conf' is successfully parsed, FALSE
+ * otherwise.
+ */
+gboolean
+weight_conf_parse (gchar  *weight_conf,
+                   gchar **identity,
+                   guint  *weight)
+{
+    gchar *split, *end = NULL;
+    guint64 value;
+
+    if (weight_conf == NULL || identity == NULL || weight == NULL) {
+        return FALSE;
+    }
+    split = strrchr (weight_conf, '=');
+    if (split == NULL || split == weight_conf || split [1] == '\0') {
+        return FALSE;
+    }
+    value = g_ascii_strtoull (&split [1], &end, 10);
+    if (end == NULL || end [0] != '\0' ||
+        value < 1 || value > FAIR_QUEUE_WEIGHT_MAX)
+    {
+        return FALSE;
+    }
+    split [0] = '\0';
+    *identity = weight_conf;
+    *weight = (guint)value;
+
+    return TRUE;
+}
 /**
  * This function parses the parameter argument vector and populates the
  * parameter 'options' structure with data needed to configure the tabrmd.
@@ -350,10 +509,12 @@ parse_opts (gint            argc,
             tabrmd_options_t *options)
 {
     gchar *logger_name = "stdout", *tcti_optconf = NULL;
-    gchar *ipc_mode = "dbus";
+    gchar *ipc_mode = "dbus", *scheduler = "drr";
     GOptionContext *ctx;
     GError *err = NULL;
     gboolean session_bus = FALSE;
+    gchar **weight_confs = NULL, *identity;
+    guint weight, i;
 
     GOptionEntry entries[] = {
         { "dbus-name", 'n', 0, G_OPTION_ARG_STRING, &options->dbus_name,
@@ -366,11 +527,66 @@ parse_opts (gint            argc,
         { "flush-all", 'f', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
           &options->flush_all,
           "Flush all objects and sessions from TPM on startup." },
+        { "disable-resident", 'R', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &options->disable_resident,
+          "Save and flush transient objects and sessions after every "
+          "command instead of keeping them loaded in the TPM." },
+        { "self-test", 'T', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &options->self_test,
+          "Run the TPM self tests for untested algorithms in the background "
+          "on startup." },
+        { "weight", 'w', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING_ARRAY,
+          &weight_confs,
+          "Scheduling weight for commands from a client, may be given more "
+          "than once. Clients are identified by \"pid:<PID>\" for D-Bus or "
+          "\"tls:<address>\" for TLS connections.", "identity=weight" },
+        { "scheduler", 'S', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &scheduler,
+          "How to pick the next command to send to the TPM: deficit round "
+          "robin between clients (default), shortest expected job first or "
+          "batches from the same client to minimise context swaps.",
+          "[drr|sejf|affinity]" },
+        { "workers", 'W', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->workers,
+          "Number of threads parsing commands and writing responses. "
+          "Commands are only ever sent to the TPM from one thread." },
+        { "run-to-completion", 'C', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &options->run_to_completion,
+          "Process each command from parsing to writing the response on the "
+          "thread that read it. Lowers latency but disables scheduling "
+          "between clients." },
+        { "max-in-flight", 'q', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->in_flight_max,
+          "Maximum number of commands from one client that have been read "
+          "but not yet answered. Further commands are left in the socket "
+          "until responses are sent." },
+        { "max-in-flight-total", 'Q', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->in_flight_total_max,
+          "Maximum number of commands from all clients that have been read "
+          "but not yet answered." },
+        { "shed-delay", 'D', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->shed_delay,
+          "Answer new commands with TPM_RC_RETRY instead of queuing them "
+          "while the average queueing delay is over this many "
+          "milliseconds. 0 (default) disables this." },
+        { "shed-max-weight", 'P', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->shed_max_weight,
+          "Only turn away commands from clients with at most this "
+          "scheduling weight (see --weight). All clients by default." },
         { "max-connections", 'm', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
           &options->max_connections, "Maximum number of client connections." },
         { "max-sessions", 'e', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
           &options->max_sessions,
           "Maximum number of sessions per connection." },
+        { "max-abandoned", 'A', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->abandoned_max,
+          "Maximum number of sessions saved by clients that have since "
+          "disconnected kept for a later ContextLoad." },
+        { "abandoned-ttl", 'L', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->abandoned_ttl,
+          "Flush sessions saved by clients that have since disconnected "
+          "after this many seconds. 0 (default) keeps them until pushed out "
+          "by newer ones." },
         { "max-transient-objects", 'r', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
           &options->max_transient_objects,
           "Maximum number of loaded transient objects per client." },
@@ -412,17 +628,22 @@ parse_opts (gint            argc,
     if (set_logger (logger_name) == -1) {
         tabrmd_critical ("Unknown logger: %s, try --help\n", logger_name);
     }
-    if (options->max_connections < 1 ||
-        options->max_connections > TABRMD_CONNECTION_MAX)
-    {
-        tabrmd_critical ("maximum number of connections must be between 1 "
-                         "and %d", TABRMD_CONNECTION_MAX);
+    if (options->max_connections < 1) {
+        tabrmd_critical ("maximum number of connections must be at least 1");
     }
     if (options->max_sessions < 1 ||
-        options->max_sessions > TABRMD_SESSIONS_MAX_DEFAULT)
+        options->max_sessions > TABRMD_SESSIONS_MAX)
     {
         tabrmd_critical ("max-sessions must be between 1 and %d",
-                         TABRMD_SESSIONS_MAX_DEFAULT);
+                         TABRMD_SESSIONS_MAX);
+    }
+    if (options->abandoned_max > TABRMD_ABANDONED_MAX) {
+        tabrmd_critical ("max-abandoned must be between 0 and %d",
+                         TABRMD_ABANDONED_MAX);
+    }
+    if (options->abandoned_ttl > TABRMD_ABANDONED_TTL_MAX) {
+        tabrmd_critical ("abandoned-ttl must be between 0 and %d",
+                         TABRMD_ABANDONED_TTL_MAX);
     }
     if (options->max_transient_objects < 1 ||
         options->max_transient_objects > TABRMD_TRANSIENT_MAX)
@@ -430,6 +651,30 @@ parse_opts (gint            argc,
         tabrmd_critical ("max-trans-obj parameter must be between 1 and %d",
                          TABRMD_TRANSIENT_MAX);
     }
+    if (options->workers < 1 ||
+        options->workers > TABRMD_WORKERS_MAX)
+    {
+        tabrmd_critical ("workers must be between 1 and %d",
+                         TABRMD_WORKERS_MAX);
+    }
+    if (options->in_flight_max < 1 ||
+        options->in_flight_max > TABRMD_IN_FLIGHT_MAX ||
+        options->in_flight_total_max < 1 ||
+        options->in_flight_total_max > TABRMD_IN_FLIGHT_MAX)
+    {
+        tabrmd_critical ("max-in-flight and max-in-flight-total must be "
+                         "between 1 and %d", TABRMD_IN_FLIGHT_MAX);
+    }
+    if (options->shed_delay > TABRMD_SHED_DELAY_MAX) {
+        tabrmd_critical ("shed-delay must be between 0 and %d",
+                         TABRMD_SHED_DELAY_MAX);
+    }
+    if (options->shed_max_weight < 1 ||
+        options->shed_max_weight > FAIR_QUEUE_WEIGHT_MAX)
+    {
+        tabrmd_critical ("shed-max-weight must be between 1 and %d",
+                         FAIR_QUEUE_WEIGHT_MAX);
+    }
     if (!tcti_conf_parse (tcti_optconf,
                           &options->tcti_filename,
                           &options->tcti_conf)) {
@@ -439,6 +684,32 @@ parse_opts (gint            argc,
     if (options->cert_file && g_access (options->cert_file, R_OK)) {
         tabrmd_critical ("certificate file not accessible: %s", strerror(errno));
     }
+    for (i = 0; weight_confs != NULL && weight_confs [i] != NULL; ++i) {
+        if (!weight_conf_parse (weight_confs [i], &identity, &weight)) {
+            tabrmd_critical ("bad weight \"%s\", must be identity=weight "
+                             "with weight between 1 and %d",
+                             weight_confs [i], FAIR_QUEUE_WEIGHT_MAX);
+        }
+        if (options->client_weights == NULL) {
+            options->client_weights = g_hash_table_new_full (g_str_hash,
+                                                             g_str_equal,
+                                                             g_free,
+                                                             NULL);
+        }
+        g_hash_table_replace (options->client_weights,
+                              g_strdup (identity),
+                              GUINT_TO_POINTER (weight));
+    }
+    g_strfreev (weight_confs);
+    if (!g_strcmp0 (scheduler, "drr")) {
+        options->scheduler = FAIR_QUEUE_SCHEDULER_DRR;
+    } else if (!g_strcmp0 (scheduler, "sejf")) {
+        options->scheduler = FAIR_QUEUE_SCHEDULER_SEJF;
+    } else if (!g_strcmp0 (scheduler, "affinity")) {
+        options->scheduler = FAIR_QUEUE_SCHEDULER_AFFINITY;
+    } else {
+        tabrmd_critical ("Scheduler %s is not supported", scheduler);
+    }
     if (!g_strcmp0(ipc_mode, "dbus")) {
         options->ipc_mode_dbus = TRUE;
     } else if (!g_strcmp0(ipc_mode, "tls")) {
@@ -456,6 +727,37 @@ thread_cleanup (Thread *thread)
     thread_join (thread);
     g_object_unref (thread);
 }
+/*
+ * Each client connection holds a socket open in the daemon. Raise the soft
+ * limit on open files, as far as the hard limit allows, so that
+ * 'max_connections' clients can connect.
+ */
+static void
+raise_nofile_limit (guint max_connections)
+{
+    struct rlimit limit;
+    rlim_t want = (rlim_t)max_connections + TABRMD_NOFILE_RESERVED;
+
+    if (getrlimit (RLIMIT_NOFILE, &limit) != 0) {
+        g_warning ("failed to get RLIMIT_NOFILE: %s", strerror (errno));
+        return;
+    }
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= want) {
+        return;
+    }
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < want) {
+        g_warning ("max-connections of %u needs %ju open files but the hard "
+                   "limit is %ju", max_connections, (uintmax_t)want,
+                   (uintmax_t)limit.rlim_max);
+        want = limit.rlim_max;
+    }
+    g_debug ("raising RLIMIT_NOFILE from %ju to %ju",
+             (uintmax_t)limit.rlim_cur, (uintmax_t)want);
+    limit.rlim_cur = want;
+    if (setrlimit (RLIMIT_NOFILE, &limit) != 0) {
+        g_warning ("failed to set RLIMIT_NOFILE: %s", strerror (errno));
+    }
+}
 /**
  * This is the entry point for the TPM2 Access Broker and Resource Manager
  * daemon. It is responsible for the top most initialization and
@@ -483,6 +785,7 @@ main (int argc, char *argv[])
         g_print ("refusing to run as root. pass --allow-root if you know what you're doing.");
         return 1;
     }
+    raise_nofile_limit (gmain_data.options.max_connections);
 
     gmain_data.tcti = TCTI (tcti_dynamic_new (gmain_data.options.tcti_filename,
                                               gmain_data.options.tcti_conf));
@@ -500,15 +803,21 @@ main (int argc, char *argv[])
     g_main_loop_run (gmain_data.loop);
     g_info ("g_main_loop_run done, cleaning up");
     g_thread_join (init_thread);
+    if (gmain_data.self_test_thread != NULL) {
+        g_thread_join (gmain_data.self_test_thread);
+    }
     /* cleanup glib stuff first so we stop getting events */
     ipc_frontend_disconnect (gmain_data.ipc_frontend);
     g_object_unref (gmain_data.ipc_frontend);
     /* tear down the command processing pipeline */
     thread_cleanup (THREAD (gmain_data.command_source));
+    thread_cleanup (THREAD (gmain_data.command_parser));
     thread_cleanup (THREAD (gmain_data.resource_manager));
     thread_cleanup (THREAD (gmain_data.response_sink));
     /* clean up what remains */
     g_object_unref (gmain_data.random);
     g_object_unref (gmain_data.tcti);
+    g_clear_pointer (&gmain_data.options.client_weights, g_hash_table_unref);
+    buffer_pool_fini ();
     return 0;
 }
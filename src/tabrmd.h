@@ -33,7 +33,8 @@
 #include "tcti-tabrmd.h"
 
 #define TABRMD_CONNECTIONS_MAX_DEFAULT 27
-#define TABRMD_CONNECTION_MAX 100
+/* file descriptors kept for the daemon's own use on top of one per client */
+#define TABRMD_NOFILE_RESERVED 64
 #define TABRMD_DBUS_INTERFACE_DEFAULT        TCTI_TABRMD_DBUS_INTERFACE_DEFAULT
 #define TABRMD_DBUS_NAME_DEFAULT             TCTI_TABRMD_DBUS_NAME_DEFAULT
 #define TABRMD_DBUS_TYPE_DEFAULT             TCTI_TABRMD_DBUS_TYPE_DEFAULT
@@ -48,8 +49,26 @@
 #define TABRMD_TCTI_CONF_DEFAULT NULL
 #define TABRMD_TRANSIENT_MAX_DEFAULT 27
 #define TABRMD_TRANSIENT_MAX 100
+/* like IPC_FRONTEND_*, these expand to constants from fair-queue.h */
+#define TABRMD_SCHEDULER_DEFAULT FAIR_QUEUE_SCHEDULER_DRR
+#define TABRMD_SHED_MAX_WEIGHT_DEFAULT FAIR_QUEUE_WEIGHT_MAX
+#define TABRMD_WORKERS_DEFAULT 4
+#define TABRMD_WORKERS_MAX 64
+#define TABRMD_IN_FLIGHT_MAX_DEFAULT 8
+#define TABRMD_IN_FLIGHT_TOTAL_MAX_DEFAULT 256
+#define TABRMD_IN_FLIGHT_MAX 65536
+/* queueing delay in milliseconds, 0 disables load shedding */
+#define TABRMD_SHED_DELAY_DEFAULT 0
+#define TABRMD_SHED_DELAY_MAX 60000
+/* sessions abandoned by their creator kept for a later ContextLoad */
+#define TABRMD_ABANDONED_MAX_DEFAULT 4
+#define TABRMD_ABANDONED_MAX 1024
+/* seconds abandoned sessions are kept, 0 keeps them until pushed out */
+#define TABRMD_ABANDONED_TTL_DEFAULT 0
+#define TABRMD_ABANDONED_TTL_MAX 86400
 
 #define TABD_INIT_THREAD_NAME "tss2-tabrmd_init-thread"
+#define TABD_SELF_TEST_THREAD_NAME "tss2-tabrmd_self-test-thread"
 
 /* implementation specific RCs */
 #define TSS2_RESMGR_RC_INTERNAL_ERROR (TSS2_RC)(TSS2_RESMGR_RC_LAYER | (1 << TSS2_LEVEL_IMPLEMENTATION_SPECIFIC_SHIFT))
@@ -66,6 +85,8 @@
 #define TABRMD_OPTIONS_INIT_DEFAULT { \
     .bus = (GBusType)TABRMD_DBUS_TYPE_DEFAULT, \
     .flush_all = FALSE, \
+    .disable_resident = FALSE, \
+    .self_test = FALSE, \
     .max_connections = TABRMD_CONNECTIONS_MAX_DEFAULT, \
     .max_transient_objects = TABRMD_TRANSIENT_MAX_DEFAULT, \
     .max_sessions = TABRMD_SESSIONS_MAX_DEFAULT, \
@@ -76,11 +97,23 @@
     .allow_root = FALSE, \
     .tcti_filename = TABRMD_TCTI_FILENAME_DEFAULT, \
     .tcti_conf = TABRMD_TCTI_CONF_DEFAULT, \
+    .client_weights = NULL, \
+    .scheduler = TABRMD_SCHEDULER_DEFAULT, \
+    .workers = TABRMD_WORKERS_DEFAULT, \
+    .run_to_completion = FALSE, \
+    .in_flight_max = TABRMD_IN_FLIGHT_MAX_DEFAULT, \
+    .in_flight_total_max = TABRMD_IN_FLIGHT_TOTAL_MAX_DEFAULT, \
+    .shed_delay = TABRMD_SHED_DELAY_DEFAULT, \
+    .shed_max_weight = TABRMD_SHED_MAX_WEIGHT_DEFAULT, \
+    .abandoned_max = TABRMD_ABANDONED_MAX_DEFAULT, \
+    .abandoned_ttl = TABRMD_ABANDONED_TTL_DEFAULT, \
 }
 
 typedef struct tabrmd_options {
     GBusType        bus;
     gboolean        flush_all;
+    gboolean        disable_resident;
+    gboolean        self_test;
     guint           max_connections;
     guint           max_transient_objects;
     guint           max_sessions;
@@ -93,6 +126,16 @@ typedef struct tabrmd_options {
     gboolean        allow_root;
     gchar          *tcti_filename;
     gchar          *tcti_conf;
+    GHashTable     *client_weights;
+    guint           scheduler;
+    guint           workers;
+    gboolean        run_to_completion;
+    guint           in_flight_max;
+    guint           in_flight_total_max;
+    guint           shed_delay;
+    guint           shed_max_weight;
+    guint           abandoned_max;
+    guint           abandoned_ttl;
 } tabrmd_options_t;
 
 GQuark  tabrmd_error_quark (void);
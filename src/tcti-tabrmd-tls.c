@@ -306,9 +306,22 @@ tss2_tcti_tabrmd_tls_finalize (TSS2_TCTI_CONTEXT *context)
     g_clear_object (&TSS2_TCTI_TABRMD_TLS_SOCKET (context));
 }
 
+/*
+ * Cancel the command we're waiting on by sending the daemon a
+ * TCTI_TABRMD_CC_CANCEL command. It has no response so we stay in the
+ * RECEIVE state: the response to the canceled command is still coming,
+ * with TPM2_RC_CANCELED if the daemon or the TPM dropped it.
+ */
 static TSS2_RC
 tss2_tcti_tabrmd_tls_cancel (TSS2_TCTI_CONTEXT *context)
 {
+    static const uint8_t cancel_cmd [TPM_HEADER_SIZE] = {
+        0x80, 0x01,             /* TPM2_ST_NO_SESSIONS */
+        0x00, 0x00, 0x00, 0x0a, /* commandSize */
+        0x20, 0x00, 0x01, 0x02, /* TCTI_TABRMD_CC_CANCEL */
+    };
+    ssize_t write_ret;
+
     if (context == NULL) {
         return TSS2_TCTI_RC_BAD_CONTEXT;
     }
@@ -317,9 +330,23 @@ tss2_tcti_tabrmd_tls_cancel (TSS2_TCTI_CONTEXT *context)
     if (TSS2_TCTI_TABRMD_TLS_STATE (context) != TABRMD_TLS_STATE_RECEIVE) {
         return TSS2_TCTI_RC_BAD_SEQUENCE;
     }
-
-    g_warning ("cancel command not implemented");
-    return TSS2_TCTI_RC_NOT_IMPLEMENTED;
+    write_ret = write_all (TSS2_TCTI_TABRMD_TLS_OSTREAM (context),
+                           cancel_cmd,
+                           sizeof (cancel_cmd));
+    switch (write_ret) {
+    case -1:
+        g_debug ("tss2_tcti_tabrmd_tls_cancel: error writing to pipe: %s",
+                 strerror (errno));
+        return TSS2_TCTI_RC_IO_ERROR;
+    case 0:
+        g_debug ("tss2_tcti_tabrmd_tls_cancel: EOF returned writing to pipe");
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    case sizeof (cancel_cmd):
+        return TSS2_RC_SUCCESS;
+    default:
+        g_debug ("tss2_tcti_tabrmd_tls_cancel: short write");
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    }
 }
 
 static TSS2_RC
@@ -26,7 +26,10 @@
  */
 #include <inttypes.h>
 #include <stdint.h>
+#include <string.h>
 
+#include "buffer-pool.h"
+#include "object-pool.h"
 #include "tpm2-command.h"
 #include "tpm2-header.h"
 #include "util.h"
@@ -128,6 +131,22 @@ enum {
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+static ObjectPool tpm2_command_pool = OBJECT_POOL_INIT;
+/*
+ * Take a reference to the Connection that sent the command and snapshot
+ * the state of the connection that applies to the command.
+ */
+static void
+tpm2_command_set_connection (Tpm2Command *self,
+                             Connection  *connection)
+{
+    self->connection = g_object_ref (connection);
+    self->cancel_seq = connection_get_cancel_seq (connection);
+    if (connection_get_timeout (connection) != 0) {
+        self->deadline = self->timestamp +
+            (gint64)connection_get_timeout (connection) * 1000;
+    }
+}
 /**
  * GObject property setter.
  */
@@ -158,8 +177,7 @@ tpm2_command_set_property (GObject        *object,
             g_warning ("  connection already set");
             break;
         }
-        self->connection = g_value_get_object (value);
-        g_object_ref (self->connection);
+        tpm2_command_set_connection (self, g_value_get_object (value));
         break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -196,6 +214,10 @@ tpm2_command_get_property (GObject     *object,
         break;
     }
 }
+/*
+ * Release everything the command holds and reset it to the state of a new
+ * instance. If the pool takes the instance we're done: it's alive again.
+ */
 static void
 tpm2_command_dispose (GObject *obj)
 {
@@ -203,6 +225,12 @@ tpm2_command_dispose (GObject *obj)
 
     g_debug ("%s: Tpm2Command 0x%" PRIxPTR, __func__, (uintptr_t)cmd);
     g_clear_object (&cmd->connection);
+    g_clear_pointer (&cmd->buffer, buffer_pool_free);
+    memset ((guint8*)cmd + sizeof (GObject), 0,
+            sizeof (Tpm2Command) - sizeof (GObject));
+    if (object_pool_put (&tpm2_command_pool, obj)) {
+        return;
+    }
     G_OBJECT_CLASS (tpm2_command_parent_class)->dispose (obj);
 }
 /**
@@ -215,12 +243,14 @@ tpm2_command_finalize (GObject *obj)
     Tpm2Command *cmd = TPM2_COMMAND (obj);
 
     g_debug ("tpm2_command_finalize");
-    g_clear_pointer (&cmd->buffer, g_free);
+    g_clear_pointer (&cmd->buffer, buffer_pool_free);
     G_OBJECT_CLASS (tpm2_command_parent_class)->finalize (obj);
 }
 static void
 tpm2_command_init (Tpm2Command *command)
-{ /* noop */ }
+{
+    command->timestamp = g_get_monotonic_time ();
+}
 /**
  * Boilerplate GObject initialization. Get a pointer to the parent class,
  * setup a finalize function.
@@ -269,7 +299,11 @@ tpm2_command_class_init (Tpm2CommandClass *klass)
                                        obj_properties);
 }
 /**
- * Boilerplate constructor, but some GObject properties would be nice.
+ * Constructor. A Tpm2Command is created for every command so this takes an
+ * idle instance from the pool if there is one and sets the fields directly
+ * instead of going through the GObject property machinery. The properties
+ * are still there for g_object_new callers. The command takes ownership of
+ * the buffer and releases it with buffer_pool_free.
  */
 Tpm2Command*
 tpm2_command_new (Connection     *connection,
@@ -277,12 +311,19 @@ tpm2_command_new (Connection     *connection,
                   size_t           size,
                   TPMA_CC          attributes)
 {
-    return TPM2_COMMAND (g_object_new (TYPE_TPM2_COMMAND,
-                                       "attributes", attributes,
-                                       "buffer",  buffer,
-                                       "buffer-size", size,
-                                       "connection", connection,
-                                       NULL));
+    Tpm2Command *command;
+
+    command = (Tpm2Command*)object_pool_get (&tpm2_command_pool);
+    if (command == NULL) {
+        command = TPM2_COMMAND (g_object_new (TYPE_TPM2_COMMAND, NULL));
+    }
+    command->timestamp = g_get_monotonic_time ();
+    command->attributes = attributes;
+    command->buffer = buffer;
+    command->buffer_size = size;
+    tpm2_command_set_connection (command, connection);
+
+    return command;
 }
 /* Simple "getter" to expose the attributes associated with the command. */
 TPMA_CC
@@ -290,6 +331,76 @@ tpm2_command_get_attributes (Tpm2Command *command)
 {
     return command->attributes;
 }
+/*
+ * The monotonic time in microseconds when the command was created, which
+ * is when it was read from the client.
+ */
+gint64
+tpm2_command_get_timestamp (Tpm2Command *command)
+{
+    return command->timestamp;
+}
+/*
+ * The monotonic time in microseconds after which the command should be
+ * abandoned instead of sent to the TPM. This is derived from the timeout
+ * of the connection when the command was created. 0 means no deadline.
+ */
+gint64
+tpm2_command_get_deadline (Tpm2Command *command)
+{
+    return command->deadline;
+}
+/*
+ * A command is canceled if its connection has been canceled since the
+ * command was created. See connection_cancel.
+ */
+gboolean
+tpm2_command_is_canceled (Tpm2Command *command)
+{
+    return command->cancel_seq !=
+        connection_get_cancel_seq (command->connection);
+}
+/*
+ * The number of times the command has been sent to the TPM again after a
+ * response code with a retry policy.
+ */
+guint
+tpm2_command_get_retries (Tpm2Command *command)
+{
+    return command->retries;
+}
+/*
+ * The monotonic time in microseconds when the command was first retried.
+ * 0 if it hasn't been.
+ */
+gint64
+tpm2_command_get_retry_start (Tpm2Command *command)
+{
+    return command->retry_start;
+}
+/*
+ * The monotonic time in microseconds before which the command must not be
+ * sent to the TPM again. 0 if the command isn't being retried.
+ */
+gint64
+tpm2_command_get_not_before (Tpm2Command *command)
+{
+    return command->not_before;
+}
+/*
+ * Count a retry of the command and set the time before which it must not
+ * be sent again.
+ */
+void
+tpm2_command_retry_at (Tpm2Command *command,
+                       gint64       not_before)
+{
+    if (command->retry_start == 0) {
+        command->retry_start = g_get_monotonic_time ();
+    }
+    ++command->retries;
+    command->not_before = not_before;
+}
 /**
  */
 guint8*
@@ -661,11 +772,20 @@ tpm2_command_foreach_auth (Tpm2Command *command,
                            gpointer     user_data)
 {
     size_t   offset;
+    guint8   i;
 
     if (command == NULL || callback == NULL) {
         g_warning ("%s passed NULL parameter", __func__);
         return FALSE;
     }
+    /* tpm2_command_parse has already found and checked the auths */
+    if (command->parsed) {
+        for (i = 0; i < command->auth_count; ++i) {
+            offset = command->auth_offsets [i];
+            callback (&offset, user_data);
+        }
+        return TRUE;
+    }
 
     if (AUTH_AREA_FIRST_OFFSET (command) > command->buffer_size) {
         g_warning ("%s: auth area begins after end of buffer", __func__);
@@ -693,3 +813,62 @@ tpm2_command_foreach_auth (Tpm2Command *command,
 
     return TRUE;
 }
+/*
+ * Check that the structure of the command buffer is consistent: the size
+ * in the header matches the buffer, the handle area fits and every
+ * authorization in the auth area lies within it. The offset of each
+ * authorization is recorded so tpm2_command_foreach_auth doesn't have to
+ * walk the auth area again. This only reads the command buffer and may be
+ * called from any thread before the command is handed to the
+ * ResourceManager.
+ * Returns the TPM2_RC the TPM would respond with for the first problem
+ * found, TSS2_RC_SUCCESS otherwise.
+ */
+TSS2_RC
+tpm2_command_parse (Tpm2Command *command)
+{
+    size_t offset, end;
+
+    if (command == NULL) {
+        g_warning ("%s passed NULL parameter", __func__);
+        return TPM2_RC_FAILURE;
+    }
+    command->parsed = FALSE;
+    command->auth_count = 0;
+    if (command->buffer_size < TPM_HEADER_SIZE ||
+        tpm2_command_get_size (command) != command->buffer_size)
+    {
+        return TPM2_RC_COMMAND_SIZE;
+    }
+    if (HANDLE_OFFSET (tpm2_command_get_handle_count (command)) >
+        command->buffer_size)
+    {
+        return TPM2_RC_COMMAND_SIZE;
+    }
+    if (tpm2_command_has_auths (command)) {
+        if (AUTH_AREA_SIZE_END_OFFSET (command) > command->buffer_size ||
+            AUTH_AREA_END_OFFSET (command) > command->buffer_size)
+        {
+            return TPM2_RC_AUTHSIZE;
+        }
+        end = AUTH_AREA_END_OFFSET (command);
+        for (offset = AUTH_AREA_FIRST_OFFSET (command);
+             offset < end;
+             offset = AUTH_AUTH_BUF_END_OFFSET (command, offset))
+        {
+            /* each field must be in bounds before the next is read */
+            if (command->auth_count >= TPM2_COMMAND_MAX_AUTHS ||
+                AUTH_NONCE_SIZE_END_OFFSET (offset) > end ||
+                AUTH_AUTH_SIZE_END_OFFSET (command, offset) > end ||
+                AUTH_AUTH_BUF_END_OFFSET (command, offset) > end)
+            {
+                command->auth_count = 0;
+                return TPM2_RC_AUTHSIZE;
+            }
+            command->auth_offsets [command->auth_count++] = offset;
+        }
+    }
+    command->parsed = TRUE;
+
+    return TSS2_RC_SUCCESS;
+}
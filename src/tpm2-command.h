@@ -34,6 +34,8 @@
 
 G_BEGIN_DECLS
 
+#define TPM2_COMMAND_MAX_AUTHS       3
+
 typedef struct _Tpm2CommandClass {
     GObjectClass    parent;
 } Tpm2CommandClass;
@@ -44,6 +46,17 @@ typedef struct _Tpm2Command {
     Connection     *connection;
     guint8         *buffer;
     size_t          buffer_size;
+    gint64          timestamp;
+    gint64          deadline;
+    gint            cancel_seq;
+    /* TPM retries, see access_broker_should_retry */
+    guint           retries;
+    gint64          retry_start;
+    gint64          not_before;
+    /* filled in by tpm2_command_parse */
+    gboolean        parsed;
+    guint8          auth_count;
+    size_t          auth_offsets [TPM2_COMMAND_MAX_AUTHS];
 } Tpm2Command;
 
 #include "command-attrs.h"
@@ -63,6 +76,14 @@ Tpm2Command*          tpm2_command_new             (Connection      *connection,
                                                     size_t            size,
                                                     TPMA_CC           attrs);
 TPMA_CC               tpm2_command_get_attributes  (Tpm2Command      *command);
+gint64                tpm2_command_get_timestamp   (Tpm2Command      *command);
+gint64                tpm2_command_get_deadline    (Tpm2Command      *command);
+gboolean              tpm2_command_is_canceled     (Tpm2Command      *command);
+guint                 tpm2_command_get_retries     (Tpm2Command      *command);
+gint64                tpm2_command_get_retry_start (Tpm2Command      *command);
+gint64                tpm2_command_get_not_before  (Tpm2Command      *command);
+void                  tpm2_command_retry_at        (Tpm2Command      *command,
+                                                    gint64            not_before);
 TPMA_SESSION          tpm2_command_get_auth_attrs  (Tpm2Command      *command,
                                                     size_t            auth_offset);
 TPM2_HANDLE            tpm2_command_get_auth_handle (Tpm2Command      *command,
@@ -94,6 +115,7 @@ UINT32                tpm2_command_get_auths_size  (Tpm2Command      *command);
 gboolean              tpm2_command_foreach_auth    (Tpm2Command      *command,
                                                     GFunc             func,
                                                     gpointer          user_data);
+TSS2_RC               tpm2_command_parse           (Tpm2Command      *command);
 
 G_END_DECLS
 
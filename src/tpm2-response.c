@@ -29,6 +29,8 @@
 #include <string.h>
 #include <sapi/tpm20.h>
 
+#include "buffer-pool.h"
+#include "object-pool.h"
 #include "tpm2-header.h"
 #include "tpm2-response.h"
 #include "util.h"
@@ -56,6 +58,7 @@ enum {
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+static ObjectPool tpm2_response_pool = OBJECT_POOL_INIT;
 /**
  * GObject property setter.
  */
@@ -124,6 +127,11 @@ tpm2_response_get_property (GObject     *object,
         break;
     }
 }
+/*
+ * Release everything the response holds and reset it to the state of a
+ * new instance. If the pool takes the instance we're done: it's alive
+ * again.
+ */
 static void
 tpm2_response_dispose (GObject *obj)
 {
@@ -131,6 +139,12 @@ tpm2_response_dispose (GObject *obj)
 
     g_debug ("%s: Tpm2Response: 0x%" PRIxPTR, __func__, (uintptr_t)self);
     g_clear_object (&self->connection);
+    g_clear_pointer (&self->buffer, buffer_pool_free);
+    self->buffer_size = 0;
+    self->attributes = 0;
+    if (object_pool_put (&tpm2_response_pool, obj)) {
+        return;
+    }
     G_OBJECT_CLASS (tpm2_response_parent_class)->dispose (obj);
 }
 /**
@@ -143,7 +157,7 @@ tpm2_response_finalize (GObject *obj)
     Tpm2Response *self = TPM2_RESPONSE (obj);
 
     g_debug ("tpm2_response_finalize");
-    g_clear_pointer (&self->buffer, g_free);
+    g_clear_pointer (&self->buffer, buffer_pool_free);
     G_OBJECT_CLASS (tpm2_response_parent_class)->finalize (obj);
 }
 static void
@@ -197,7 +211,10 @@ tpm2_response_class_init (Tpm2ResponseClass *klass)
                                        obj_properties);
 }
 /**
- * Boilerplate constructor, but some GObject properties would be nice.
+ * Constructor. Like tpm2_command_new this reuses an idle instance from the
+ * pool if there is one and sets the fields directly instead of going
+ * through the GObject property machinery. The response takes ownership of
+ * the buffer and releases it with buffer_pool_free.
  */
 Tpm2Response*
 tpm2_response_new (Connection     *connection,
@@ -205,12 +222,18 @@ tpm2_response_new (Connection     *connection,
                    size_t           buffer_size,
                    TPMA_CC          attributes)
 {
-    return TPM2_RESPONSE (g_object_new (TYPE_TPM2_RESPONSE,
-                                        "attributes", attributes,
-                                       "buffer",  buffer,
-                                       "buffer-size", buffer_size,
-                                       "connection", connection,
-                                       NULL));
+    Tpm2Response *response;
+
+    response = (Tpm2Response*)object_pool_get (&tpm2_response_pool);
+    if (response == NULL) {
+        response = TPM2_RESPONSE (g_object_new (TYPE_TPM2_RESPONSE, NULL));
+    }
+    response->attributes = attributes;
+    response->buffer = buffer;
+    response->buffer_size = buffer_size;
+    response->connection = g_object_ref (connection);
+
+    return response;
 }
 /**
  * This is a convenience wrapper that is used to create an error response
@@ -222,13 +245,7 @@ tpm2_response_new_rc (Connection *connection,
 {
     guint8 *buffer;
 
-    buffer = calloc (1, TPM_RESPONSE_HEADER_SIZE);
-    if (buffer == NULL) {
-        g_warning ("tpm2_response_new_rc: failed to allocate 0x%zx"
-                   " bytes for response: errno: %d: %s",
-                   TPM_RESPONSE_HEADER_SIZE, errno, strerror (errno));
-        return NULL;
-    }
+    buffer = buffer_pool_alloc (TPM_RESPONSE_HEADER_SIZE);
     TPM_RESPONSE_TAG (buffer)  = htobe16 (TPM2_ST_NO_SESSIONS);
     TPM_RESPONSE_SIZE (buffer) = htobe32 (TPM_RESPONSE_HEADER_SIZE);
     TPM_RESPONSE_CODE (buffer) = htobe32 (rc);
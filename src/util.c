@@ -35,6 +35,7 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "buffer-pool.h"
 #include "util.h"
 #include "tpm2-header.h"
 
@@ -191,7 +192,8 @@ read_data (GInputStream  *istream,
  *   0: If data is successfully read.
  *      NOTE: The index will be updated to the size of the command buffer.
  *   errno: In the event of an error from the underlying 'read' syscall.
- *   EPROTO: If buf_size is less than the size from the command buffer.
+ *   EPROTO: If buf_size is less than the size from the command buffer or the
+ *     size from the command buffer is less than the size of the header.
  */
 int
 read_tpm_buffer (GInputStream             *istream,
@@ -221,8 +223,11 @@ read_tpm_buffer (GInputStream             *istream,
     if (size == TPM_HEADER_SIZE) {
         return ret;
     }
-    /* Not enough space in buf to for data in the buffer (header.size). */
-    if (size > buf_size) {
+    /*
+     * Not enough space in buf to for data in the buffer (header.size), or
+     * header.size is too small to even hold the header.
+     */
+    if (size > buf_size || size < TPM_HEADER_SIZE) {
         return EPROTO;
     }
     /* Now that we have the header, we know the whole buffer size. Get it. */
@@ -231,34 +236,42 @@ read_tpm_buffer (GInputStream             *istream,
 /*
  * This fucntion is a wrapper around the read_tpm_buffer function above. It
  * adds the memory allocation logic necessary to create the buffer to hold
- * the TPM command / response buffer.
+ * the TPM command / response buffer. The buffer comes from the buffer pool
+ * so any command up to the size of a pool buffer is read without touching
+ * the heap. Larger commands are copied to a buffer big enough to hold them
+ * once the header is read.
  * Returns NULL on error, and a pointer to the allocated buffer on success.
- *   The size of the allocated buffer is returned through the *buf_size
- *   parameter on success.
+ *   The size of the command / response is returned through the *buf_size
+ *   parameter on success. The buffer must be freed with buffer_pool_free.
  */
 uint8_t*
 read_tpm_buffer_alloc (GInputStream *istream,
                        size_t       *buf_size)
 {
-    uint8_t *buf = NULL;
-    size_t   size_tmp = TPM_HEADER_SIZE, index = 0;
+    uint8_t *buf = NULL, *buf_tmp;
+    size_t   size_tmp, index = 0;
     int ret = 0;
 
     if (istream == NULL || buf_size == NULL) {
         g_warning ("%s: got null parameter", __func__);
         return NULL;
     }
+    size_tmp = MAX (buffer_pool_get_buffer_size (), TPM_HEADER_SIZE);
+    buf = buffer_pool_alloc (size_tmp);
     do {
-        buf = g_realloc (buf, size_tmp);
         ret = read_tpm_buffer (istream, &index, buf, size_tmp);
         switch (ret) {
         case EPROTO:
             size_tmp = get_command_size (buf);
-            if (size_tmp < TPM_HEADER_SIZE && size_tmp > UTIL_BUF_MAX) {
+            if (size_tmp < TPM_HEADER_SIZE || size_tmp > UTIL_BUF_MAX) {
                 g_warning ("%s: tpm buffer size is ouside of acceptable bounds: %zd",
                            __func__, size_tmp);
                 goto err_out;
             }
+            buf_tmp = buffer_pool_alloc (size_tmp);
+            memcpy (buf_tmp, buf, index);
+            buffer_pool_free (buf);
+            buf = buf_tmp;
             break;
         case 0:
             /* done */
@@ -270,13 +283,11 @@ read_tpm_buffer_alloc (GInputStream *istream,
     g_debug ("%s: read TPM buffer to 0x%" PRIxPTR " of size: %zd",
              __func__, (uintptr_t)buf, index);
     g_debug_bytes (buf, index, 16, 4);
-    *buf_size = size_tmp;
+    *buf_size = index;
     return buf;
 err_out:
     g_debug ("%s: err_out freeing buffer at 0x%" PRIxPTR, __func__, (uintptr_t)buf);
-    if (buf != NULL) {
-        g_free (buf);
-    }
+    buffer_pool_free (buf);
     return NULL;
 }
 /*
@@ -90,6 +90,38 @@ __wrap_Tss2_Sys_GetCapability (TSS2_SYS_CONTEXT         *sysContext,
     g_debug ("__wrap_Tss2_Sys_GetCapability returning: 0x%x", rc);
     return rc;
 }
+/*
+ * Mock IncrementalSelfTest. Pops the number of algorithms to return in the
+ * toDoList and the RC off the mock stack. All algorithms are TPM2_ALG_RSA.
+ */
+TSS2_RC
+__wrap_Tss2_Sys_IncrementalSelfTest (TSS2_SYS_CONTEXT         *sysContext,
+                                     TSS2L_SYS_AUTH_COMMAND const *cmdAuthsArray,
+                                     TPML_ALG                 *toTest,
+                                     TPML_ALG                 *toDoList,
+                                     TSS2L_SYS_AUTH_RESPONSE  *rspAuthsArray)
+{
+    UINT32 i;
+
+    toDoList->count = mock_type (UINT32);
+    for (i = 0; i < toDoList->count; ++i) {
+        toDoList->algorithms [i] = TPM2_ALG_RSA;
+    }
+    return mock_type (TSS2_RC);
+}
+/*
+ * Mock GetTestResult. Pops the test result and the RC off the mock stack.
+ */
+TSS2_RC
+__wrap_Tss2_Sys_GetTestResult (TSS2_SYS_CONTEXT         *sysContext,
+                               TSS2L_SYS_AUTH_COMMAND const *cmdAuthsArray,
+                               TPM2B_MAX_BUFFER         *outData,
+                               TPM2_RC                  *testResult,
+                               TSS2L_SYS_AUTH_RESPONSE  *rspAuthsArray)
+{
+    *testResult = mock_type (TPM2_RC);
+    return mock_type (TSS2_RC);
+}
 TSS2_RC
 __wrap_tcti_echo_transmit (TSS2_TCTI_CONTEXT *tcti_context,
                            size_t             size,
@@ -115,6 +147,25 @@ __wrap_tcti_echo_receive (TSS2_TCTI_CONTEXT *tcti_context,
 
     return rc;
 }
+/*
+ * Alternative to the above that also writes a response header with the
+ * response code taken from the mock stack.
+ */
+static TSS2_RC
+tcti_echo_receive_response_code (TSS2_TCTI_CONTEXT *tcti_context,
+                                 size_t            *size,
+                                 uint8_t           *response,
+                                 int32_t            timeout)
+{
+    TSS2_RC rc            = mock_type (TSS2_RC);
+    TSS2_RC response_code = mock_type (TSS2_RC);
+
+    *size = TPM_HEADER_SIZE;
+    set_response_size (response, TPM_HEADER_SIZE);
+    set_response_code (response, response_code);
+
+    return rc;
+}
 /**
  * Do the minimum setup required by the AccessBroker object. This does not
  * call the access_broker_init_tpm function intentionally. We test that function
@@ -369,6 +420,107 @@ access_broker_send_command_success (void **state)
     assert_int_equal (connection, data->connection);
     g_object_unref (connection);
 }
+/*
+ * When the TPM responds with TPM2_RC_YIELDED access_broker_send_command
+ * must send the command again and only return the final response. The
+ * retry must be counted in the retry stats.
+ */
+static void
+access_broker_send_command_retry_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_RC rc;
+    guint64 count = 0, time = 0;
+
+    TSS2_TCTI_RECEIVE (tcti_peek_context (TCTI (data->tcti))) =
+        tcti_echo_receive_response_code;
+    will_return (__wrap_tcti_echo_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_echo_receive_response_code, TSS2_RC_SUCCESS);
+    will_return (tcti_echo_receive_response_code, TPM2_RC_YIELDED);
+    will_return (__wrap_tcti_echo_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_echo_receive_response_code, TSS2_RC_SUCCESS);
+    will_return (tcti_echo_receive_response_code, TSS2_RC_SUCCESS);
+    data->response = access_broker_send_command (data->broker, data->command, &rc);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_response_get_code (data->response), TSS2_RC_SUCCESS);
+    access_broker_get_retry_stats (data->broker, &count, &time);
+    assert_int_equal (count, 1);
+    assert_int_equal (tpm2_command_get_retries (data->command), 1);
+}
+/*
+ * A TPM2_RC_RETRY response is retried after the policy's backoff, and the
+ * command is no longer in flight while it waits. Other response codes
+ * aren't retried.
+ */
+static void
+access_broker_should_retry_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    guint64 count = 0, time = 0;
+    gint64 now;
+
+    now = g_get_monotonic_time ();
+    response = tpm2_response_new_rc (data->connection, TPM2_RC_RETRY);
+    assert_true (access_broker_should_retry (data->broker,
+                                             data->command,
+                                             response));
+    g_object_unref (response);
+    assert_true (tpm2_command_get_not_before (data->command) > now);
+    assert_null (data->broker->in_flight);
+
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    assert_false (access_broker_should_retry (data->broker,
+                                              data->command,
+                                              response));
+    g_object_unref (response);
+    access_broker_get_retry_stats (data->broker, &count, &time);
+    assert_int_equal (count, 1);
+}
+/*
+ * A submitted command stays in flight until access_broker_complete gets
+ * the response.
+ */
+static void
+access_broker_submit_complete_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_RC rc;
+
+    will_return (__wrap_tcti_echo_transmit, TSS2_RC_SUCCESS);
+    rc = access_broker_submit (data->broker, data->command);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_ptr_equal (data->broker->in_flight, data->command);
+
+    will_return (__wrap_tcti_echo_receive, TSS2_RC_SUCCESS);
+    data->response = access_broker_complete (data->broker, &rc);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_non_null (data->response);
+    assert_null (data->broker->in_flight);
+}
+/*
+ * The self test function must first get the list of untested algorithms,
+ * test each one individually and then return the overall test result.
+ */
+static void
+access_broker_self_test_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_RC rc;
+
+    /* query: two algorithms left to test */
+    will_return (__wrap_Tss2_Sys_IncrementalSelfTest, 2);
+    will_return (__wrap_Tss2_Sys_IncrementalSelfTest, TSS2_RC_SUCCESS);
+    /* one call per algorithm */
+    will_return (__wrap_Tss2_Sys_IncrementalSelfTest, 0);
+    will_return (__wrap_Tss2_Sys_IncrementalSelfTest, TSS2_RC_SUCCESS);
+    will_return (__wrap_Tss2_Sys_IncrementalSelfTest, 0);
+    will_return (__wrap_Tss2_Sys_IncrementalSelfTest, TSS2_RC_SUCCESS);
+    will_return (__wrap_Tss2_Sys_GetTestResult, TPM2_RC_SUCCESS);
+    will_return (__wrap_Tss2_Sys_GetTestResult, TSS2_RC_SUCCESS);
+    rc = access_broker_self_test (data->broker);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+}
 
 int
 main (int   argc,
@@ -399,6 +551,18 @@ main (int   argc,
         cmocka_unit_test_setup_teardown (access_broker_send_command_success,
                                          access_broker_setup_with_command,
                                          access_broker_teardown),
+        cmocka_unit_test_setup_teardown (access_broker_submit_complete_test,
+                                         access_broker_setup_with_command,
+                                         access_broker_teardown),
+        cmocka_unit_test_setup_teardown (access_broker_should_retry_test,
+                                         access_broker_setup_with_command,
+                                         access_broker_teardown),
+        cmocka_unit_test_setup_teardown (access_broker_send_command_retry_test,
+                                         access_broker_setup_with_command,
+                                         access_broker_teardown),
+        cmocka_unit_test_setup_teardown (access_broker_self_test_test,
+                                         access_broker_setup_with_init,
+                                         access_broker_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
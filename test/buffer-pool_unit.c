@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <glib.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "buffer-pool.h"
+
+#define TEST_BUFFER_SIZE  4096
+#define TEST_BUFFER_COUNT 4
+
+static int
+buffer_pool_setup (void **state)
+{
+    buffer_pool_init (TEST_BUFFER_SIZE, TEST_BUFFER_COUNT);
+    return 0;
+}
+static int
+buffer_pool_teardown (void **state)
+{
+    buffer_pool_fini ();
+    return 0;
+}
+/*
+ * Without a pool buffers come from g_malloc and go back with g_free.
+ */
+static void
+buffer_pool_uninitialized_test (void **state)
+{
+    guint8 *buf;
+
+    assert_int_equal (buffer_pool_get_buffer_size (), 0);
+    buf = buffer_pool_alloc (10);
+    assert_non_null (buf);
+    buffer_pool_free (buf);
+}
+/*
+ * A buffer returned to the pool is the next one handed out.
+ */
+static void
+buffer_pool_reuse_test (void **state)
+{
+    guint8 *buf;
+
+    assert_int_equal (buffer_pool_get_buffer_size (), TEST_BUFFER_SIZE);
+    buf = buffer_pool_alloc (TEST_BUFFER_SIZE);
+    assert_non_null (buf);
+    buffer_pool_free (buf);
+    assert_ptr_equal (buffer_pool_alloc (10), buf);
+    buffer_pool_free (buf);
+    assert_int_equal (buffer_pool_get_miss_count (), 0);
+}
+/*
+ * Once every buffer is out allocations fall back to g_malloc and are
+ * counted as misses. Requests larger than the pool buffers aren't.
+ */
+static void
+buffer_pool_exhausted_test (void **state)
+{
+    guint8 *bufs [TEST_BUFFER_COUNT + 1], *big;
+    guint i;
+
+    for (i = 0; i < TEST_BUFFER_COUNT + 1; ++i) {
+        bufs [i] = buffer_pool_alloc (TEST_BUFFER_SIZE);
+        assert_non_null (bufs [i]);
+    }
+    assert_int_equal (buffer_pool_get_miss_count (), 1);
+    big = buffer_pool_alloc (TEST_BUFFER_SIZE + 1);
+    assert_non_null (big);
+    assert_int_equal (buffer_pool_get_miss_count (), 1);
+    buffer_pool_free (big);
+    for (i = 0; i < TEST_BUFFER_COUNT + 1; ++i) {
+        buffer_pool_free (bufs [i]);
+    }
+}
+/*
+ * The pool isn't freed while a buffer is still in use.
+ */
+static void
+buffer_pool_fini_in_use_test (void **state)
+{
+    guint8 *buf;
+
+    buf = buffer_pool_alloc (TEST_BUFFER_SIZE);
+    buffer_pool_fini ();
+    assert_int_equal (buffer_pool_get_buffer_size (), TEST_BUFFER_SIZE);
+    buffer_pool_free (buf);
+    buffer_pool_fini ();
+    assert_int_equal (buffer_pool_get_buffer_size (), 0);
+}
+static gpointer
+buffer_pool_free_thread (gpointer data)
+{
+    buffer_pool_free (data);
+    return NULL;
+}
+/*
+ * A buffer freed by another thread is cached by that thread and goes back
+ * to the shared free list when the thread exits.
+ */
+static void
+buffer_pool_thread_test (void **state)
+{
+    GThread *thread;
+    guint8 *buf;
+
+    buf = buffer_pool_alloc (TEST_BUFFER_SIZE);
+    thread = g_thread_new ("buffer-pool-test", buffer_pool_free_thread, buf);
+    g_thread_join (thread);
+    buffer_pool_fini ();
+    assert_int_equal (buffer_pool_get_buffer_size (), 0);
+}
+gint
+main (gint    argc,
+      gchar  *argv[])
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (buffer_pool_uninitialized_test),
+        cmocka_unit_test_setup_teardown (buffer_pool_reuse_test,
+                                         buffer_pool_setup,
+                                         buffer_pool_teardown),
+        cmocka_unit_test_setup_teardown (buffer_pool_exhausted_test,
+                                         buffer_pool_setup,
+                                         buffer_pool_teardown),
+        cmocka_unit_test_setup_teardown (buffer_pool_fini_in_use_test,
+                                         buffer_pool_setup,
+                                         buffer_pool_teardown),
+        cmocka_unit_test_setup_teardown (buffer_pool_thread_test,
+                                         buffer_pool_setup,
+                                         buffer_pool_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
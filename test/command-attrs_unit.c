@@ -273,6 +273,59 @@ command_attrs_from_cc_fail_test (void **state)
                                        TPM2_CC_EvictControl);
     assert_int_equal (ret_attrs, 0);
 }
+/*
+ * A TPM2_CC between two that the TPM implements, or with bits set outside
+ * of the commandIndex and V bit, has no attributes.
+ */
+static void
+command_attrs_from_cc_gap_test (void **state)
+{
+    test_data_t *data = *state;
+
+    assert_int_equal (command_attrs_from_cc (data->command_attrs,
+                                             TPM2_CC_HierarchyControl + 1),
+                      0);
+    assert_int_equal (command_attrs_from_cc (data->command_attrs,
+                                             TPM2_CC_HierarchyControl - 1),
+                      0);
+    assert_int_equal (command_attrs_from_cc (data->command_attrs,
+                                             TPM2_CC_HierarchyControl |
+                                             0x40000000),
+                      0);
+}
+/*
+ * Vendor commands are looked up by their TPM2_CC with the V bit set and
+ * are kept apart from spec commands with the same commandIndex.
+ */
+static void
+command_attrs_from_cc_vendor_test (void **state)
+{
+    test_data_t *data = *state;
+    gint         ret;
+    TPMA_CC      spec_attrs = TPM2_CC_HierarchyControl;
+    TPMA_CC      vendor_attrs = TPMA_CC_V | TPM2_CC_HierarchyControl |
+                                (1 << TPMA_CC_CHANDLES_SHIFT);
+    TPMA_CC      command_attributes [2] = { vendor_attrs, spec_attrs };
+
+    will_return (__wrap_access_broker_lock_sapi, 1);
+    will_return (__wrap_access_broker_get_max_command, 2);
+    will_return (__wrap_access_broker_get_max_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_Tss2_Sys_GetCapability, &command_attributes);
+    will_return (__wrap_Tss2_Sys_GetCapability, TSS2_RC_SUCCESS);
+
+    ret = command_attrs_init_tpm (data->command_attrs, data->access_broker);
+    assert_int_equal (ret, 0);
+    assert_int_equal (command_attrs_from_cc (data->command_attrs,
+                                             TPM2_CC_HierarchyControl),
+                      spec_attrs);
+    assert_int_equal (command_attrs_from_cc (data->command_attrs,
+                                             TPMA_CC_V |
+                                             TPM2_CC_HierarchyControl),
+                      vendor_attrs);
+    assert_int_equal (command_attrs_from_cc (data->command_attrs,
+                                             TPMA_CC_V | TPM2_CC_ChangePPS),
+                      0);
+}
 gint
 main (gint    argc,
       gchar  *argv[])
@@ -302,6 +355,12 @@ main (gint    argc,
         cmocka_unit_test_setup_teardown (command_attrs_from_cc_fail_test,
                                          command_attrs_init_tpm_setup,
                                          command_attrs_teardown),
+        cmocka_unit_test_setup_teardown (command_attrs_from_cc_gap_test,
+                                         command_attrs_init_tpm_setup,
+                                         command_attrs_teardown),
+        cmocka_unit_test_setup_teardown (command_attrs_from_cc_vendor_test,
+                                         command_attrs_setup,
+                                         command_attrs_teardown),
         NULL,
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
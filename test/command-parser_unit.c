@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <glib.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "command-parser.h"
+#include "response-sink.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "tpm2-response.h"
+#include "util.h"
+
+#define WORKERS 4
+
+typedef struct {
+    CommandParser *parser;
+    HandleMap     *handle_map;
+    Connection    *connection;
+    gint           client_fd;
+} test_data_t;
+
+static Connection*
+command_parser_connection_new (HandleMap *handle_map,
+                               guint64    id,
+                               gint      *client_fd)
+{
+    Connection *connection;
+    GIOStream  *iostream;
+
+    iostream = create_connection_iostream (client_fd);
+    connection = connection_new (iostream, id, handle_map);
+    g_object_unref (iostream);
+    return connection;
+}
+/*
+ * Create a Tpm2Command with no handles or auths. The size field in the
+ * header is set to 'size'.
+ */
+static Tpm2Command*
+command_parser_command_new (Connection *connection,
+                            guint32     size)
+{
+    guint8 *buffer;
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    buffer [1] = TPM2_ST_NO_SESSIONS & 0xff;
+    buffer [0] = TPM2_ST_NO_SESSIONS >> 8;
+    *(UINT32*)&buffer [2] = htobe32 (size);
+    return tpm2_command_new (connection,
+                             buffer,
+                             TPM_HEADER_SIZE,
+                             (TPMA_CC){ 0, });
+}
+
+static int
+command_parser_setup (void **state)
+{
+    test_data_t *data;
+
+    data = calloc (1, sizeof (test_data_t));
+    assert_non_null (data);
+    data->parser = command_parser_new (WORKERS);
+    data->handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    data->connection = command_parser_connection_new (data->handle_map,
+                                                      1,
+                                                      &data->client_fd);
+    *state = data;
+    return 0;
+}
+
+static int
+command_parser_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_object_unref (data->parser);
+    g_object_unref (data->connection);
+    g_object_unref (data->handle_map);
+    free (data);
+    return 0;
+}
+
+static void
+command_parser_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_COMMAND_PARSER (data->parser));
+    assert_true (IS_PARALLEL_STAGE (data->parser));
+}
+/*
+ * A well formed command is parsed and passed on unchanged.
+ */
+static void
+command_parser_process_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    GObject *obj;
+
+    command = command_parser_command_new (data->connection, TPM_HEADER_SIZE);
+    obj = command_parser_process (PARALLEL_STAGE (data->parser),
+                                  G_OBJECT (command));
+    assert_ptr_equal (obj, command);
+    assert_true (command->parsed);
+    g_object_unref (obj);
+    g_object_unref (command);
+}
+/*
+ * A command with a bad size is answered by the parser with a response
+ * for the same connection.
+ */
+static void
+command_parser_process_malformed_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    Connection *connection;
+    GObject *obj;
+
+    command = command_parser_command_new (data->connection,
+                                          TPM_HEADER_SIZE + 1);
+    obj = command_parser_process (PARALLEL_STAGE (data->parser),
+                                  G_OBJECT (command));
+    assert_true (IS_TPM2_RESPONSE (obj));
+    assert_int_equal (tpm2_response_get_code (TPM2_RESPONSE (obj)),
+                      TPM2_RC_COMMAND_SIZE);
+    connection = tpm2_response_get_connection (TPM2_RESPONSE (obj));
+    assert_ptr_equal (connection, data->connection);
+    g_object_unref (connection);
+    g_object_unref (obj);
+    g_object_unref (command);
+}
+/*
+ * Commands from one connection always go to the same worker so they're
+ * kept in order.
+ */
+static void
+command_parser_worker_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command_a, *command_b;
+    Connection *connection;
+    gint client_fd;
+
+    connection = command_parser_connection_new (data->handle_map,
+                                                1 + WORKERS,
+                                                &client_fd);
+    command_a = command_parser_command_new (data->connection,
+                                            TPM_HEADER_SIZE);
+    command_b = command_parser_command_new (connection, TPM_HEADER_SIZE);
+    assert_int_equal (parallel_stage_get_worker (PARALLEL_STAGE (data->parser),
+                                                 G_OBJECT (command_a)),
+                      1);
+    assert_int_equal (parallel_stage_get_worker (PARALLEL_STAGE (data->parser),
+                                                 G_OBJECT (command_b)),
+                      1);
+    g_object_unref (command_a);
+    g_object_unref (command_b);
+    g_object_unref (connection);
+}
+/*
+ * Without workers the parser runs on the caller's thread: the response to
+ * a malformed command has been written to the client by the time
+ * sink_enqueue returns.
+ */
+static void
+command_parser_run_to_completion_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    CommandParser *parser;
+    ResponseSink *response_sink;
+    Tpm2Command *command;
+    guint8 buffer [TPM_HEADER_SIZE] = { 0, };
+    ssize_t ret;
+
+    parser = command_parser_new (0);
+    response_sink = response_sink_new (0);
+    source_add_sink (SOURCE (parser), SINK (response_sink));
+    command = command_parser_command_new (data->connection,
+                                          TPM_HEADER_SIZE + 1);
+    sink_enqueue (SINK (parser), G_OBJECT (command));
+    ret = read (data->client_fd, buffer, sizeof (buffer));
+    assert_int_equal (ret, TPM_HEADER_SIZE);
+    assert_int_equal (be32toh (*(UINT32*)&buffer [6]),
+                      TPM2_RC_COMMAND_SIZE);
+    g_object_unref (command);
+    g_object_unref (parser);
+    g_object_unref (response_sink);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (command_parser_type_test,
+                                         command_parser_setup,
+                                         command_parser_teardown),
+        cmocka_unit_test_setup_teardown (command_parser_process_test,
+                                         command_parser_setup,
+                                         command_parser_teardown),
+        cmocka_unit_test_setup_teardown (command_parser_process_malformed_test,
+                                         command_parser_setup,
+                                         command_parser_teardown),
+        cmocka_unit_test_setup_teardown (command_parser_worker_test,
+                                         command_parser_setup,
+                                         command_parser_teardown),
+        cmocka_unit_test_setup_teardown (command_parser_run_to_completion_test,
+                                         command_parser_setup,
+                                         command_parser_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
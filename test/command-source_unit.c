@@ -47,6 +47,7 @@
 #include "command-source.h"
 #include "tabrmd.h"
 #include "tpm2-command.h"
+#include "tpm2-response.h"
 #include "util.h"
 
 typedef struct source_test_data {
@@ -65,13 +66,6 @@ __wrap_command_attrs_from_cc (CommandAttrs *attrs,
 {
     return (TPMA_CC)mock_type (UINT32);
 }
-Connection*
-__wrap_connection_manager_lookup_istream (ConnectionManager *manager,
-                                          GInputStream      *istream)
-{
-    g_debug ("%s", __func__);
-    return CONNECTION (mock_ptr_type (GObject*));
-}
 gint
 __wrap_connection_manager_remove      (ConnectionManager  *manager,
                                        Connection         *connection)
@@ -97,13 +91,12 @@ void
 __wrap_sink_enqueue (Sink     *sink,
                      GObject  *obj)
 {
-    Tpm2Command **command;
+    GObject **obj_out;
 
     g_debug ("%s", __func__);
-    command = mock_ptr_type (Tpm2Command**);
+    obj_out = mock_ptr_type (GObject**);
 
-    *command = TPM2_COMMAND (obj);
-    g_object_ref (*command);
+    *obj_out = g_object_ref (obj);
 }
 /*
  * This wrap function allows us to gain access to the data that will be
@@ -277,6 +270,7 @@ static void
 command_source_on_io_ready_success_test (void **state)
 {
     struct source_test_data *data = (struct source_test_data*)*state;
+    source_data_t *source_data;
     GIOStream   *iostream;
     HandleMap   *handle_map;
     Connection *connection;
@@ -293,7 +287,7 @@ command_source_on_io_ready_success_test (void **state)
     g_object_unref (handle_map);
     g_object_unref (iostream);
         /* prime wraps */
-    will_return (__wrap_connection_manager_lookup_istream, connection);
+    will_return (__wrap_g_source_set_callback, &source_data);
 
     /* setup read of tpm buffer */
     will_return (__wrap_read_tpm_buffer_alloc, data_in);
@@ -303,12 +297,112 @@ command_source_on_io_ready_success_test (void **state)
 
     will_return (__wrap_sink_enqueue, &command_out);
 
-    command_source_on_input_ready (NULL, data->source);
+    command_source_on_new_connection (data->manager, connection, data->source);
+    command_source_on_input_ready (NULL, source_data);
 
     assert_memory_equal (tpm2_command_get_buffer (command_out),
                          data_in,
                          sizeof (data_in));
     g_object_unref (command_out);
+    g_object_unref (connection);
+}
+/*
+ * Once a connection has as many commands in flight as allowed the
+ * CommandSource stops watching it. Sending the response for one of them
+ * starts watching it again.
+ */
+static void
+command_source_on_io_ready_in_flight_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    source_data_t *source_data;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    Tpm2Command *command_out;
+    gint client_fd;
+    gboolean ret;
+    guint8 data_in [] = { 0x80, 0x01, 0x0,  0x0,  0x0,  0x0a,
+                          0x0,  0x0,  0x01, 0x7a };
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    command_source_set_in_flight_max (data->source, 1, 0);
+
+    will_return (__wrap_g_source_set_callback, &source_data);
+    command_source_on_new_connection (data->manager, connection, data->source);
+    will_return (__wrap_read_tpm_buffer_alloc, data_in);
+    will_return (__wrap_read_tpm_buffer_alloc, sizeof (data_in));
+    will_return (__wrap_command_attrs_from_cc, 0);
+    will_return (__wrap_sink_enqueue, &command_out);
+    ret = command_source_on_input_ready (NULL, source_data);
+    assert_int_equal (ret, G_SOURCE_REMOVE);
+    assert_true (source_data->paused);
+    assert_int_equal (g_queue_get_length (&data->source->paused_queue), 1);
+    assert_int_equal (connection_get_in_flight (connection), 1);
+    /* the main loop isn't running so the resume happens right away */
+    will_return (__wrap_g_source_set_callback, &source_data);
+    command_source_on_response_sent (NULL, connection, data->source);
+    assert_false (source_data->paused);
+    assert_int_equal (data->source->paused, 0);
+    assert_true (g_queue_is_empty (&data->source->paused_queue));
+    assert_int_equal (connection_get_in_flight (connection), 0);
+    g_object_unref (command_out);
+    g_object_unref (connection);
+}
+/*
+ * Commands with TCTI_TABRMD_CC_* codes are handled by the CommandSource.
+ * Setting the timeout is answered with a Tpm2Response sent down the
+ * pipeline in place of a command. A cancel has no response.
+ */
+static void
+command_source_on_io_ready_control_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    source_data_t *source_data;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    GObject *obj_out = NULL;
+    gint client_fd, cancel_seq;
+    gboolean ret;
+    guint8 set_timeout [] = { 0x80, 0x01, 0x0,  0x0,  0x0,  0x0e,
+                              0x20, 0x0,  0x01, 0x01,
+                              0x0,  0x0,  0x03, 0xe8 };
+    guint8 cancel [] = { 0x80, 0x01, 0x0,  0x0,  0x0,  0x0a,
+                         0x20, 0x0,  0x01, 0x02 };
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+
+    will_return (__wrap_g_source_set_callback, &source_data);
+    command_source_on_new_connection (data->manager, connection, data->source);
+    will_return (__wrap_read_tpm_buffer_alloc, set_timeout);
+    will_return (__wrap_read_tpm_buffer_alloc, sizeof (set_timeout));
+    will_return (__wrap_sink_enqueue, &obj_out);
+    ret = command_source_on_input_ready (NULL, source_data);
+    assert_int_equal (ret, G_SOURCE_CONTINUE);
+    assert_int_equal (connection_get_timeout (connection), 1000);
+    assert_true (IS_TPM2_RESPONSE (obj_out));
+    assert_int_equal (tpm2_response_get_code (TPM2_RESPONSE (obj_out)),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (connection_get_in_flight (connection), 1);
+    g_clear_object (&obj_out);
+
+    cancel_seq = connection_get_cancel_seq (connection);
+    will_return (__wrap_read_tpm_buffer_alloc, cancel);
+    will_return (__wrap_read_tpm_buffer_alloc, sizeof (cancel));
+    ret = command_source_on_input_ready (NULL, source_data);
+    assert_int_equal (ret, G_SOURCE_CONTINUE);
+    assert_int_equal (connection_get_cancel_seq (connection), cancel_seq + 1);
+    assert_int_equal (connection_get_in_flight (connection), 1);
+    g_object_unref (connection);
 }
 /*
  * This tests the CommandSource on_io_ready function for situations where
@@ -336,7 +430,6 @@ command_source_on_io_ready_eof_test (void **state)
     g_object_unref (iostream);
         /* prime wraps */
     will_return (__wrap_g_source_set_callback, &source_data);
-    will_return (__wrap_connection_manager_lookup_istream, connection);
     will_return (__wrap_read_tpm_buffer_alloc, NULL);
     will_return (__wrap_read_tpm_buffer_alloc, 0);
     will_return (__wrap_connection_manager_remove, TRUE);
@@ -346,6 +439,7 @@ command_source_on_io_ready_eof_test (void **state)
     assert_int_equal (ret, G_SOURCE_REMOVE);
     hash_table_size = g_hash_table_size (data->source->istream_to_source_data_map);
     assert_int_equal (hash_table_size, 0);
+    g_object_unref (connection);
 }
 /* command_source_connection_test end */
 int
@@ -365,6 +459,12 @@ main (int argc,
         cmocka_unit_test_setup_teardown (command_source_on_io_ready_success_test,
                                          command_source_connection_setup,
                                          command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_in_flight_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_control_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
         cmocka_unit_test_setup_teardown (command_source_on_io_ready_eof_test,
                                          command_source_connection_setup,
                                          command_source_teardown),
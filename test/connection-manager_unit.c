@@ -154,6 +154,103 @@ connection_manager_remove_test (void **state)
     ret_bool = connection_manager_remove (manager, connection);
     assert_true (ret_bool);
 }
+/*
+ * Create a Connection with the given ID. The caller must close the client
+ * end of the socket returned in 'client_fd'.
+ */
+static Connection*
+connection_manager_test_connection (guint64  id,
+                                    gint    *client_fd)
+{
+    Connection *connection;
+    HandleMap  *handle_map;
+    GIOStream  *iostream;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (client_fd);
+    connection = connection_new (iostream, id, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+
+    return connection;
+}
+/*
+ * Once max_connections are in the manager further inserts fail until a
+ * connection is removed.
+ */
+static void
+connection_manager_full_test (void **state)
+{
+    ConnectionManager *manager;
+    Connection *connections [3];
+    gint client_fds [3];
+    guint i;
+
+    manager = connection_manager_new (2);
+    for (i = 0; i < 3; ++i) {
+        connections [i] = connection_manager_test_connection (i + 1,
+                                                              &client_fds [i]);
+    }
+    assert_int_equal (connection_manager_insert (manager, connections [0]), 0);
+    assert_int_equal (connection_manager_insert (manager, connections [1]), 0);
+    assert_true (connection_manager_is_full (manager));
+    assert_int_equal (connection_manager_insert (manager, connections [2]), -1);
+    assert_int_equal (connection_manager_size (manager), 2);
+    assert_true (connection_manager_remove (manager, connections [0]));
+    assert_false (connection_manager_is_full (manager));
+    assert_int_equal (connection_manager_insert (manager, connections [2]), 0);
+    assert_int_equal (connection_manager_size (manager), 2);
+
+    g_object_unref (manager);
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (connections [i]);
+        close (client_fds [i]);
+    }
+}
+/*
+ * Insert more connections than there are shards so that each shard holds
+ * several. Every connection must be found by istream and by ID and the
+ * manager must be empty once they're all removed.
+ */
+#define SHARDS_TEST_CONNECTIONS (4 * CONNECTION_MANAGER_SHARDS)
+static void
+connection_manager_shards_test (void **state)
+{
+    ConnectionManager *manager;
+    Connection *connections [SHARDS_TEST_CONNECTIONS], *connection_lookup;
+    gint client_fds [SHARDS_TEST_CONNECTIONS];
+    guint i;
+
+    manager = connection_manager_new (SHARDS_TEST_CONNECTIONS);
+    for (i = 0; i < SHARDS_TEST_CONNECTIONS; ++i) {
+        connections [i] = connection_manager_test_connection (i + 1,
+                                                              &client_fds [i]);
+        assert_int_equal (connection_manager_insert (manager,
+                                                     connections [i]),
+                          0);
+    }
+    assert_int_equal (connection_manager_size (manager),
+                      SHARDS_TEST_CONNECTIONS);
+    for (i = 0; i < SHARDS_TEST_CONNECTIONS; ++i) {
+        connection_lookup =
+            connection_manager_lookup_istream (manager,
+                                               connection_key_istream (connections [i]));
+        assert_ptr_equal (connection_lookup, connections [i]);
+        g_object_unref (connection_lookup);
+        connection_lookup = connection_manager_lookup_id (manager, i + 1);
+        assert_ptr_equal (connection_lookup, connections [i]);
+        g_object_unref (connection_lookup);
+        assert_true (connection_manager_contains_id (manager, i + 1));
+    }
+    for (i = 0; i < SHARDS_TEST_CONNECTIONS; ++i) {
+        assert_true (connection_manager_remove (manager, connections [i]));
+        assert_false (connection_manager_contains_id (manager, i + 1));
+        g_object_unref (connections [i]);
+        close (client_fds [i]);
+    }
+    assert_int_equal (connection_manager_size (manager), 0);
+    g_object_unref (manager);
+}
 
 int
 main(int argc, char* argv[])
@@ -172,6 +269,8 @@ main(int argc, char* argv[])
         cmocka_unit_test_setup_teardown (connection_manager_remove_test,
                                          connection_manager_setup,
                                          connection_manager_teardown),
+        cmocka_unit_test (connection_manager_full_test),
+        cmocka_unit_test (connection_manager_shards_test),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -149,6 +149,17 @@ connection_key_id_test (void **state)
     assert_int_equal (connection->id, *key);
 }
 
+static void
+connection_identity_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+
+    assert_null (connection_get_identity (data->connection));
+    connection_set_identity (data->connection, "pid:1234");
+    assert_string_equal (connection_get_identity (data->connection),
+                         "pid:1234");
+}
+
 /* connection_client_to_server_test begin
  * This test creates a connection and communicates with it as though the pipes
  * that are created as part of connection setup.
@@ -195,6 +206,9 @@ main(int argc, char* argv[])
         cmocka_unit_test_setup_teardown (connection_key_id_test,
                                          connection_setup,
                                          connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_identity_test,
+                                         connection_setup,
+                                         connection_teardown),
         cmocka_unit_test_setup_teardown (connection_client_to_server_test,
                                          connection_setup,
                                          connection_teardown),
@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <glib.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "connection.h"
+#include "control-message.h"
+#include "fair-queue.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define COMMANDS_PER_CONNECTION 4
+#define LATENCY_CHEAP             100
+#define LATENCY_EXPENSIVE         1000000
+
+typedef struct {
+    FairQueue   *queue;
+    LatencyTable *latency_table;
+    HandleMap   *handle_map;
+    Connection  *connection_a;
+    Connection  *connection_b;
+} test_data_t;
+
+static Connection*
+fair_queue_connection_new (HandleMap   *handle_map,
+                           guint64      id,
+                           const gchar *identity)
+{
+    Connection *connection;
+    GIOStream  *iostream;
+    gint        client_fd;
+
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, id, handle_map);
+    g_object_unref (iostream);
+    connection_set_identity (connection, identity);
+    return connection;
+}
+
+static int
+fair_queue_setup (void **state)
+{
+    test_data_t *data;
+
+    data = calloc (1, sizeof (test_data_t));
+    assert_non_null (data);
+    data->latency_table = latency_table_new ();
+    data->queue = fair_queue_new (data->latency_table);
+    data->handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    data->connection_a = fair_queue_connection_new (data->handle_map,
+                                                    1,
+                                                    "pid:1");
+    data->connection_b = fair_queue_connection_new (data->handle_map,
+                                                    2,
+                                                    "pid:2");
+    *state = data;
+    return 0;
+}
+
+static int
+fair_queue_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_object_unref (data->queue);
+    g_object_unref (data->latency_table);
+    g_object_unref (data->connection_a);
+    g_object_unref (data->connection_b);
+    g_object_unref (data->handle_map);
+    free (data);
+    return 0;
+}
+/*
+ * Enqueue 'count' commands with the given command code from the given
+ * connection.
+ */
+static void
+fair_queue_enqueue_commands (FairQueue  *queue,
+                             Connection *connection,
+                             TPM2_CC     command_code,
+                             guint       count)
+{
+    Tpm2Command *command;
+    guint8 *buffer;
+    guint i;
+
+    for (i = 0; i < count; ++i) {
+        buffer = calloc (1, TPM_HEADER_SIZE);
+        buffer [6] = command_code >> 24;
+        buffer [7] = command_code >> 16;
+        buffer [8] = command_code >> 8;
+        buffer [9] = command_code & 0xff;
+        command = tpm2_command_new (connection,
+                                    buffer,
+                                    TPM_HEADER_SIZE,
+                                    (TPMA_CC){ command_code, });
+        fair_queue_enqueue (queue, G_OBJECT (command));
+        g_object_unref (command);
+    }
+}
+/*
+ * Dequeue a command and check that it came from the expected connection.
+ */
+static void
+fair_queue_assert_next (FairQueue  *queue,
+                        Connection *connection)
+{
+    GObject *obj;
+    Connection *connection_out;
+
+    obj = fair_queue_dequeue (queue);
+    assert_true (IS_TPM2_COMMAND (obj));
+    connection_out = tpm2_command_get_connection (TPM2_COMMAND (obj));
+    assert_ptr_equal (connection_out, connection);
+    g_object_unref (connection_out);
+    g_object_unref (obj);
+}
+
+static void
+fair_queue_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (G_IS_OBJECT (data->queue));
+    assert_true (IS_FAIR_QUEUE (data->queue));
+}
+/*
+ * A client with many pending commands must not keep the other client from
+ * being served: with equal weights they take turns.
+ */
+static void
+fair_queue_round_robin_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint i;
+
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_a,
+                                 TPM2_CC_PCR_Read,
+                                 COMMANDS_PER_CONNECTION);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_b,
+                                 TPM2_CC_PCR_Read,
+                                 COMMANDS_PER_CONNECTION);
+    for (i = 0; i < COMMANDS_PER_CONNECTION; ++i) {
+        fair_queue_assert_next (data->queue, data->connection_a);
+        fair_queue_assert_next (data->queue, data->connection_b);
+    }
+}
+/*
+ * A client with weight 2 gets two commands executed for every one from a
+ * client with the default weight.
+ */
+static void
+fair_queue_weight_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint i;
+
+    fair_queue_set_weight (data->queue, "pid:1", 2);
+    assert_int_equal (fair_queue_get_weight (data->queue, "pid:1"), 2);
+    assert_int_equal (fair_queue_get_weight (data->queue, "pid:2"),
+                      FAIR_QUEUE_WEIGHT_DEFAULT);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_a,
+                                 TPM2_CC_PCR_Read,
+                                 COMMANDS_PER_CONNECTION);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_b,
+                                 TPM2_CC_PCR_Read,
+                                 COMMANDS_PER_CONNECTION);
+    for (i = 0; i < COMMANDS_PER_CONNECTION / 2; ++i) {
+        fair_queue_assert_next (data->queue, data->connection_a);
+        fair_queue_assert_next (data->queue, data->connection_a);
+        fair_queue_assert_next (data->queue, data->connection_b);
+    }
+    for (i = 0; i < COMMANDS_PER_CONNECTION / 2; ++i) {
+        fair_queue_assert_next (data->queue, data->connection_b);
+    }
+}
+/*
+ * Under DRR a client is charged for the expected TPM time of its commands:
+ * one expensive command from a client uses up as many turns as many cheap
+ * commands from another.
+ */
+static void
+fair_queue_drr_cost_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint i;
+
+    latency_table_update (data->latency_table,
+                          TPM2_CC_PCR_Read,
+                          LATENCY_CHEAP);
+    latency_table_update (data->latency_table,
+                          TPM2_CC_CreatePrimary,
+                          LATENCY_EXPENSIVE);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_a,
+                                 TPM2_CC_CreatePrimary,
+                                 2);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_b,
+                                 TPM2_CC_PCR_Read,
+                                 COMMANDS_PER_CONNECTION);
+    /* A's credit doesn't cover CreatePrimary, B drains while A saves up */
+    for (i = 0; i < COMMANDS_PER_CONNECTION; ++i) {
+        fair_queue_assert_next (data->queue, data->connection_b);
+    }
+    fair_queue_assert_next (data->queue, data->connection_a);
+    fair_queue_assert_next (data->queue, data->connection_a);
+}
+/*
+ * With shortest expected job first, cheap commands queued behind an
+ * expensive one from another client are served first.
+ */
+static void
+fair_queue_sejf_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint i;
+
+    fair_queue_set_scheduler (data->queue, FAIR_QUEUE_SCHEDULER_SEJF);
+    latency_table_update (data->latency_table,
+                          TPM2_CC_PCR_Read,
+                          LATENCY_CHEAP);
+    latency_table_update (data->latency_table,
+                          TPM2_CC_CreatePrimary,
+                          LATENCY_EXPENSIVE);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_a,
+                                 TPM2_CC_CreatePrimary,
+                                 1);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_b,
+                                 TPM2_CC_PCR_Read,
+                                 COMMANDS_PER_CONNECTION);
+    for (i = 0; i < COMMANDS_PER_CONNECTION; ++i) {
+        fair_queue_assert_next (data->queue, data->connection_b);
+    }
+    fair_queue_assert_next (data->queue, data->connection_a);
+}
+/*
+ * With connection affinity the Connection with contexts loaded in the TPM
+ * is served first even though the other queued a command earlier, and all
+ * of its queued commands are served back to back.
+ */
+static void
+fair_queue_affinity_resident_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    fair_queue_set_scheduler (data->queue, FAIR_QUEUE_SCHEDULER_AFFINITY);
+    /* only connection_b has a context loaded in the TPM */
+    connection_resident_inc (data->connection_b);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_a,
+                                 TPM2_CC_PCR_Read,
+                                 1);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_b,
+                                 TPM2_CC_PCR_Read,
+                                 2);
+    fair_queue_assert_next (data->queue, data->connection_b);
+    fair_queue_assert_next (data->queue, data->connection_b);
+    fair_queue_assert_next (data->queue, data->connection_a);
+}
+/*
+ * A batch ends once it has used up the fairness window: each command of
+ * unknown cost counts for 10ms against a 50ms window.
+ */
+static void
+fair_queue_affinity_window_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint i;
+
+    fair_queue_set_scheduler (data->queue, FAIR_QUEUE_SCHEDULER_AFFINITY);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_a,
+                                 TPM2_CC_PCR_Read,
+                                 6);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_b,
+                                 TPM2_CC_PCR_Read,
+                                 1);
+    for (i = 0; i < 5; ++i) {
+        fair_queue_assert_next (data->queue, data->connection_a);
+    }
+    fair_queue_assert_next (data->queue, data->connection_b);
+    fair_queue_assert_next (data->queue, data->connection_a);
+}
+/*
+ * ControlMessages jump ahead of queued commands and every dequeue is
+ * counted in the wait statistics.
+ */
+static void
+fair_queue_control_message_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ControlMessage *msg;
+    GObject *obj;
+    guint64 count = 0, time = 0;
+
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_a,
+                                 TPM2_CC_PCR_Read,
+                                 1);
+    msg = control_message_new (CHECK_CANCEL);
+    fair_queue_enqueue (data->queue, G_OBJECT (msg));
+    g_object_unref (msg);
+    obj = fair_queue_dequeue (data->queue);
+    assert_true (IS_CONTROL_MESSAGE (obj));
+    g_object_unref (obj);
+    fair_queue_assert_next (data->queue, data->connection_a);
+    fair_queue_get_wait_stats (data->queue, &count, &time);
+    assert_int_equal (count, 2);
+}
+/*
+ * try_dequeue returns NULL instead of blocking when the queue is empty.
+ */
+static void
+fair_queue_try_dequeue_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    GObject *obj;
+
+    assert_null (fair_queue_try_dequeue (data->queue));
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_a,
+                                 TPM2_CC_PCR_Read,
+                                 1);
+    obj = fair_queue_try_dequeue (data->queue);
+    assert_true (IS_TPM2_COMMAND (obj));
+    g_object_unref (obj);
+    assert_null (fair_queue_try_dequeue (data->queue));
+}
+/*
+ * timed_dequeue returns NULL once the end time has passed if the queue is
+ * still empty.
+ */
+static void
+fair_queue_timed_dequeue_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    GObject *obj;
+    gint64 end_time;
+
+    end_time = g_get_monotonic_time () + 10000;
+    assert_null (fair_queue_timed_dequeue (data->queue, end_time));
+    assert_true (g_get_monotonic_time () >= end_time);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_a,
+                                 TPM2_CC_PCR_Read,
+                                 1);
+    obj = fair_queue_timed_dequeue (data->queue, g_get_monotonic_time ());
+    assert_true (IS_TPM2_COMMAND (obj));
+    g_object_unref (obj);
+}
+/*
+ * A requeued command holds back the commands behind it from the same
+ * connection until it's due, while the other connection is served.
+ */
+static void
+fair_queue_requeue_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    GObject *obj, *retried;
+    gint64 not_before;
+
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_a,
+                                 TPM2_CC_PCR_Read,
+                                 2);
+    fair_queue_enqueue_commands (data->queue,
+                                 data->connection_b,
+                                 TPM2_CC_PCR_Read,
+                                 1);
+    retried = fair_queue_dequeue (data->queue);
+    not_before = g_get_monotonic_time () + 10000;
+    tpm2_command_retry_at (TPM2_COMMAND (retried), not_before);
+    fair_queue_requeue (data->queue, TPM2_COMMAND (retried));
+    fair_queue_assert_next (data->queue, data->connection_b);
+    assert_null (fair_queue_try_dequeue (data->queue));
+    obj = fair_queue_dequeue (data->queue);
+    assert_true (g_get_monotonic_time () >= not_before);
+    assert_ptr_equal (obj, retried);
+    g_object_unref (obj);
+    g_object_unref (retried);
+    fair_queue_assert_next (data->queue, data->connection_a);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (fair_queue_type_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_round_robin_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_weight_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_drr_cost_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_sejf_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_affinity_resident_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_affinity_window_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_control_message_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_try_dequeue_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_timed_dequeue_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+        cmocka_unit_test_setup_teardown (fair_queue_requeue_test,
+                                         fair_queue_setup,
+                                         fair_queue_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -105,6 +105,19 @@ handle_map_entry_get_vhandle_test (void **state)
     assert_int_equal (VHANDLE,
                       handle_map_entry_get_vhandle (data->handle_map_entry));
 }
+/*
+ * A new HandleMapEntry has no saved context. Once the flag is set the
+ * 'get_context_valid' accessor must reflect it.
+ */
+static void
+handle_map_entry_context_valid_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_false (handle_map_entry_get_context_valid (data->handle_map_entry));
+    handle_map_entry_set_context_valid (data->handle_map_entry, TRUE);
+    assert_true (handle_map_entry_get_context_valid (data->handle_map_entry));
+}
 
 gint
 main (gint    argc,
@@ -120,6 +133,9 @@ main (gint    argc,
         cmocka_unit_test_setup_teardown (handle_map_entry_get_vhandle_test,
                                          handle_map_entry_setup,
                                          handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_context_valid_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
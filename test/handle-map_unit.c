@@ -33,7 +33,8 @@
 #include "handle-map-entry.h"
 
 #define PHANDLE 0xdeadbeef
-#define VHANDLE 0xfeebdaed
+/* generation 1 of slot 2 */
+#define VHANDLE (TPM2_HR_TRANSIENT + 0x020001)
 
 typedef struct {
     HandleMap         *map;
@@ -155,6 +156,96 @@ handle_map_next_vhandle_test (void **state)
     handle2 = handle_map_next_vhandle (data->map);
     assert_true (handle2 != handle1);
 }
+/*
+ * Once a vhandle is removed its slot is reused for the next vhandle with
+ * a new generation. The old vhandle must not find the new entry.
+ */
+static void
+handle_map_next_vhandle_recycle_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    TPM2_HANDLE handle1, handle2;
+
+    handle1 = handle_map_next_vhandle (data->map);
+    assert_true (handle_map_insert (data->map, handle1, data->entry));
+    assert_true (handle_map_remove (data->map, handle1));
+    handle2 = handle_map_next_vhandle (data->map);
+    assert_int_equal (handle2 >> HANDLE_MAP_SLOT_SHIFT,
+                      handle1 >> HANDLE_MAP_SLOT_SHIFT);
+    assert_true (handle2 != handle1);
+    assert_true (handle_map_insert (data->map, handle2, data->entry));
+    assert_null (handle_map_vlookup (data->map, handle1));
+    entry = handle_map_vlookup (data->map, handle2);
+    assert_ptr_equal (entry, data->entry);
+    g_object_unref (entry);
+}
+/*
+ * No vhandle is issued once every slot is in use.
+ */
+static void
+handle_map_next_vhandle_full_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPM2_HANDLE handle;
+    guint i;
+
+    for (i = 0; i < MAX_ENTRIES_DEFAULT; ++i) {
+        handle = handle_map_next_vhandle (data->map);
+        assert_int_equal (handle >> TPM2_HR_SHIFT, TPM2_HT_TRANSIENT);
+        assert_true (handle_map_insert (data->map, handle, data->entry));
+    }
+    assert_true (handle_map_is_full (data->map));
+    assert_int_equal (handle_map_next_vhandle (data->map), 0);
+    assert_int_equal (handle_map_size (data->map), MAX_ENTRIES_DEFAULT);
+}
+/*
+ * Handles of another type, or for a slot that's in use, are rejected.
+ */
+static void
+handle_map_insert_invalid_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_false (handle_map_insert (data->map,
+                                     (TPM2_HT_PERSISTENT << TPM2_HR_SHIFT) + 0x020001,
+                                     data->entry));
+    assert_false (handle_map_insert (data->map, VHANDLE + 1, data->entry));
+    assert_int_equal (handle_map_size (data->map), 1);
+}
+/*
+ * handle_map_foreach visits entries in ascending vhandle order, even after
+ * a slot in the middle has been reused.
+ */
+static void
+handle_map_foreach_callback (gpointer key,
+                             gpointer value,
+                             gpointer user_data)
+{
+    TPM2_HANDLE *last = (TPM2_HANDLE*)user_data;
+
+    assert_true (GPOINTER_TO_UINT (key) > *last);
+    *last = GPOINTER_TO_UINT (key);
+}
+
+static void
+handle_map_foreach_order_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPM2_HANDLE handles [3], last = 0;
+    guint i;
+
+    for (i = 0; i < 3; ++i) {
+        handles [i] = handle_map_next_vhandle (data->map);
+        handle_map_insert (data->map, handles [i], data->entry);
+    }
+    handle_map_remove (data->map, handles [1]);
+    handles [1] = handle_map_next_vhandle (data->map);
+    handle_map_insert (data->map, handles [1], data->entry);
+
+    handle_map_foreach (data->map, handle_map_foreach_callback, &last);
+    assert_int_equal (last, handles [2]);
+}
 int
 main(int argc, char* argv[])
 {
@@ -174,6 +265,18 @@ main(int argc, char* argv[])
         cmocka_unit_test_setup_teardown (handle_map_next_vhandle_test,
                                          handle_map_setup_with_entry,
                                          handle_map_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_next_vhandle_recycle_test,
+                                         handle_map_setup_base,
+                                         handle_map_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_next_vhandle_full_test,
+                                         handle_map_setup_base,
+                                         handle_map_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_insert_invalid_test,
+                                         handle_map_setup_with_entry,
+                                         handle_map_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_foreach_order_test,
+                                         handle_map_setup_base,
+                                         handle_map_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
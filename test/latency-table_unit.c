@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <glib.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "latency-table.h"
+
+static int
+latency_table_setup (void **state)
+{
+    *state = latency_table_new ();
+    return 0;
+}
+
+static int
+latency_table_teardown (void **state)
+{
+    g_object_unref (*state);
+    return 0;
+}
+
+static void
+latency_table_type_test (void **state)
+{
+    LatencyTable *table = LATENCY_TABLE (*state);
+
+    assert_true (IS_LATENCY_TABLE (table));
+}
+/*
+ * Command codes without samples have no estimate.
+ */
+static void
+latency_table_unknown_test (void **state)
+{
+    LatencyTable *table = LATENCY_TABLE (*state);
+
+    assert_int_equal (latency_table_estimate (table, TPM2_CC_PCR_Read), 0);
+}
+/*
+ * The first sample is taken as is, later samples move the estimate a
+ * fraction of the way towards them in either direction.
+ */
+static void
+latency_table_update_test (void **state)
+{
+    LatencyTable *table = LATENCY_TABLE (*state);
+
+    latency_table_update (table, TPM2_CC_PCR_Read, 800);
+    assert_int_equal (latency_table_estimate (table, TPM2_CC_PCR_Read), 800);
+    latency_table_update (table, TPM2_CC_PCR_Read, 1600);
+    assert_int_equal (latency_table_estimate (table, TPM2_CC_PCR_Read),
+                      800 + (800 >> LATENCY_TABLE_EWMA_SHIFT));
+    latency_table_update (table, TPM2_CC_CreatePrimary, 100);
+    latency_table_update (table, TPM2_CC_CreatePrimary, 20);
+    assert_int_equal (latency_table_estimate (table, TPM2_CC_CreatePrimary),
+                      100 - (80 >> LATENCY_TABLE_EWMA_SHIFT));
+    assert_int_equal (latency_table_estimate (table, TPM2_CC_PCR_Read),
+                      800 + (800 >> LATENCY_TABLE_EWMA_SHIFT));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (latency_table_type_test,
+                                         latency_table_setup,
+                                         latency_table_teardown),
+        cmocka_unit_test_setup_teardown (latency_table_unknown_test,
+                                         latency_table_setup,
+                                         latency_table_teardown),
+        cmocka_unit_test_setup_teardown (latency_table_update_test,
+                                         latency_table_setup,
+                                         latency_table_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Microbenchmark for the MessageQueue. Producer threads push a shared
+ * ControlMessage through the queue to a single consumer, the way the
+ * ParallelStage uses it. The same is done with a GAsyncQueue wrapped the
+ * way the MessageQueue used to wrap it for comparison. The average cost
+ * of moving one message from a producer to the consumer is printed.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "control-message.h"
+#include "message-queue.h"
+
+#define BENCH_MESSAGES_DEFAULT 1000000
+#define BENCH_PRODUCERS_MAX    8
+
+typedef struct {
+    gpointer  queue;
+    GObject  *msg;
+    guint     count;
+} bench_producer_t;
+
+static void*
+bench_message_queue_producer (void *data)
+{
+    bench_producer_t *producer = (bench_producer_t*)data;
+    guint i;
+
+    for (i = 0; i < producer->count; ++i) {
+        message_queue_enqueue (MESSAGE_QUEUE (producer->queue), producer->msg);
+    }
+    return NULL;
+}
+
+static void*
+bench_async_queue_producer (void *data)
+{
+    bench_producer_t *producer = (bench_producer_t*)data;
+    guint i;
+
+    for (i = 0; i < producer->count; ++i) {
+        g_object_ref (producer->msg);
+        g_async_queue_push ((GAsyncQueue*)producer->queue, producer->msg);
+    }
+    return NULL;
+}
+
+static GObject*
+bench_message_queue_consume (gpointer queue)
+{
+    return message_queue_dequeue (MESSAGE_QUEUE (queue));
+}
+
+static GObject*
+bench_async_queue_consume (gpointer queue)
+{
+    return G_OBJECT (g_async_queue_pop ((GAsyncQueue*)queue));
+}
+/*
+ * Run 'producers' threads enqueuing 'messages' messages in total and
+ * consume them on the calling thread. Returns the time taken in ns per
+ * message.
+ */
+static gdouble
+bench_run (gpointer   queue,
+           void*    (*produce) (void*),
+           GObject* (*consume) (gpointer),
+           guint      producers,
+           guint      messages)
+{
+    bench_producer_t producer [BENCH_PRODUCERS_MAX];
+    pthread_t threads [BENCH_PRODUCERS_MAX];
+    GObject *msg;
+    gint64 start;
+    guint i;
+
+    msg = G_OBJECT (control_message_new (CHECK_CANCEL));
+    start = g_get_monotonic_time ();
+    for (i = 0; i < producers; ++i) {
+        producer [i].queue = queue;
+        producer [i].msg = msg;
+        producer [i].count = messages / producers;
+        if (pthread_create (&threads [i], NULL, produce, &producer [i]) != 0) {
+            g_error ("failed to create producer thread");
+        }
+    }
+    for (i = 0; i < messages / producers * producers; ++i) {
+        g_object_unref (consume (queue));
+    }
+    for (i = 0; i < producers; ++i) {
+        pthread_join (threads [i], NULL);
+    }
+    g_object_unref (msg);
+
+    return (gdouble)(g_get_monotonic_time () - start) * 1000 / messages;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    MessageQueue *message_queue;
+    GAsyncQueue *async_queue;
+    guint messages = BENCH_MESSAGES_DEFAULT, producers;
+
+    if (argc > 1) {
+        messages = strtoul (argv [1], NULL, 10);
+    }
+    if (messages < BENCH_PRODUCERS_MAX) {
+        g_printerr ("usage: %s [messages >= %d]\n", argv [0],
+                    BENCH_PRODUCERS_MAX);
+        return 1;
+    }
+    g_print ("%-10s %-12s %-12s\n", "producers", "GAsyncQueue", "MessageQueue");
+    for (producers = 1; producers <= BENCH_PRODUCERS_MAX; producers *= 2) {
+        async_queue = g_async_queue_new_full (g_object_unref);
+        message_queue = message_queue_new ();
+        g_print ("%-10u %-9.1f ns %-9.1f ns\n",
+                 producers,
+                 bench_run (async_queue,
+                            bench_async_queue_producer,
+                            bench_async_queue_consume,
+                            producers,
+                            messages),
+                 bench_run (message_queue,
+                            bench_message_queue_producer,
+                            bench_message_queue_consume,
+                            producers,
+                            messages));
+        g_async_queue_unref (async_queue);
+        g_object_unref (message_queue);
+    }
+    return 0;
+}
@@ -57,7 +57,7 @@ message_queue_teardown (void **state)
 {
     msgq_test_data_t *data = (msgq_test_data_t*)*state;
 
-    g_object_unref (data->queue);
+    g_clear_object (&data->queue);
     free (data);
     return 0;
 }
@@ -167,6 +167,92 @@ message_queue_thread_unblock_test (void **state)
     assert_int_equal (ret, 0);
 }
 
+#define PRODUCERS 4
+#define PRODUCER_MESSAGES (MESSAGE_QUEUE_CAPACITY * 2)
+
+typedef struct {
+    MessageQueue *queue;
+    GObject      *msgs [PRODUCER_MESSAGES];
+} producer_data_t;
+/*
+ * Producer thread for message_queue_multi_producer_test. Enqueues its
+ * messages in order.
+ */
+void*
+producer_func (void *arg)
+{
+    producer_data_t *producer = (producer_data_t*)arg;
+    guint i;
+
+    for (i = 0; i < PRODUCER_MESSAGES; ++i) {
+        message_queue_enqueue (producer->queue, producer->msgs [i]);
+    }
+    return NULL;
+}
+/*
+ * Several producers fill the queue past its capacity while we consume.
+ * Every message must come out exactly once and the messages from each
+ * producer must come out in the order they were enqueued.
+ */
+static void
+message_queue_multi_producer_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    producer_data_t producers [PRODUCERS];
+    pthread_t thread_ids [PRODUCERS];
+    guint next [PRODUCERS] = { 0, };
+    GObject *obj;
+    guint i, j, producer;
+    int ret;
+
+    for (i = 0; i < PRODUCERS; ++i) {
+        producers [i].queue = data->queue;
+        for (j = 0; j < PRODUCER_MESSAGES; ++j) {
+            producers [i].msgs [j] = G_OBJECT (control_message_new (CHECK_CANCEL));
+            g_object_set_data (producers [i].msgs [j],
+                               "producer",
+                               GUINT_TO_POINTER (i));
+        }
+        ret = pthread_create (&thread_ids [i],
+                              NULL,
+                              producer_func,
+                              &producers [i]);
+        assert_int_equal (ret, 0);
+    }
+    for (i = 0; i < PRODUCERS * PRODUCER_MESSAGES; ++i) {
+        obj = message_queue_dequeue (data->queue);
+        producer = GPOINTER_TO_UINT (g_object_get_data (obj, "producer"));
+        assert_true (producer < PRODUCERS);
+        assert_ptr_equal (obj, producers [producer].msgs [next [producer]]);
+        ++next [producer];
+        g_object_unref (obj);
+    }
+    for (i = 0; i < PRODUCERS; ++i) {
+        ret = pthread_join (thread_ids [i], NULL);
+        assert_int_equal (ret, 0);
+        assert_int_equal (next [i], PRODUCER_MESSAGES);
+        for (j = 0; j < PRODUCER_MESSAGES; ++j) {
+            g_object_unref (producers [i].msgs [j]);
+        }
+    }
+}
+/*
+ * Objects left in the queue are released when it's destroyed.
+ */
+static void
+message_queue_dispose_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msg = control_message_new (CHECK_CANCEL);
+
+    g_object_add_weak_pointer (G_OBJECT (msg), (gpointer*)&msg);
+    message_queue_enqueue (data->queue, G_OBJECT (msg));
+    g_object_unref (msg);
+    assert_non_null (msg);
+    g_clear_object (&data->queue);
+    assert_null (msg);
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -181,6 +267,12 @@ main(int argc, char* argv[])
         cmocka_unit_test_setup_teardown (message_queue_thread_unblock_test,
                                          message_queue_setup,
                                          message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_multi_producer_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_dispose_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Microbenchmark for the ObjectPool. Each cycle creates and releases the
+ * message objects the daemon creates for a command: a Tpm2Command, its
+ * Tpm2Response and a HandleMapEntry. This is done first the way the _new
+ * functions used to do it, g_object_new with properties and no pooling,
+ * and then with the pooled _new functions. The average time and number of
+ * heap allocations per cycle are printed. The command and response
+ * buffers are allocated in both cases.
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc for the
+ * whole process, GLib included, so this only builds against glibc.
+ */
+#include <glib.h>
+#include <glib-object.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "handle-map.h"
+#include "handle-map-entry.h"
+#include "object-pool.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "tpm2-response.h"
+#include "util.h"
+
+#define BENCH_CYCLES_DEFAULT 1000000
+
+extern void *__libc_malloc  (size_t size);
+extern void *__libc_calloc  (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static gint bench_allocs;
+
+void*
+malloc (size_t size)
+{
+    g_atomic_int_inc (&bench_allocs);
+    return __libc_malloc (size);
+}
+
+void*
+calloc (size_t nmemb,
+        size_t size)
+{
+    g_atomic_int_inc (&bench_allocs);
+    return __libc_calloc (nmemb, size);
+}
+
+void*
+realloc (void   *ptr,
+         size_t  size)
+{
+    g_atomic_int_inc (&bench_allocs);
+    return __libc_realloc (ptr, size);
+}
+
+static void
+bench_cycle_properties (Connection *connection)
+{
+    GObject *command, *response, *entry;
+
+    command = g_object_new (TYPE_TPM2_COMMAND,
+                            "attributes", 0,
+                            "buffer", g_malloc0 (TPM_HEADER_SIZE),
+                            "buffer-size", TPM_HEADER_SIZE,
+                            "connection", connection,
+                            NULL);
+    response = g_object_new (TYPE_TPM2_RESPONSE,
+                             "attributes", 0,
+                             "buffer", g_malloc0 (TPM_HEADER_SIZE),
+                             "buffer-size", TPM_HEADER_SIZE,
+                             "connection", connection,
+                             NULL);
+    entry = g_object_new (TYPE_HANDLE_MAP_ENTRY,
+                          "phandle", TPM2_HR_TRANSIENT,
+                          "vhandle", TPM2_HR_TRANSIENT + 1,
+                          NULL);
+    g_object_unref (entry);
+    g_object_unref (response);
+    g_object_unref (command);
+}
+
+static void
+bench_cycle_pooled (Connection *connection)
+{
+    Tpm2Command *command;
+    Tpm2Response *response;
+    HandleMapEntry *entry;
+
+    command = tpm2_command_new (connection,
+                                g_malloc0 (TPM_HEADER_SIZE),
+                                TPM_HEADER_SIZE,
+                                0);
+    response = tpm2_response_new (connection,
+                                  g_malloc0 (TPM_HEADER_SIZE),
+                                  TPM_HEADER_SIZE,
+                                  0);
+    entry = handle_map_entry_new (TPM2_HR_TRANSIENT, TPM2_HR_TRANSIENT + 1);
+    g_object_unref (entry);
+    g_object_unref (response);
+    g_object_unref (command);
+}
+/*
+ * Run 'cycles' cycles after a short warm up so that the pools and the type
+ * system are in their steady state. Prints the time in ns and the number
+ * of allocations per cycle.
+ */
+static void
+bench_run (const gchar *name,
+           void       (*cycle) (Connection*),
+           Connection  *connection,
+           guint        cycles)
+{
+    gint64 start, time;
+    gint allocs;
+    guint i;
+
+    for (i = 0; i < 1000; ++i) {
+        cycle (connection);
+    }
+    allocs = g_atomic_int_get (&bench_allocs);
+    start = g_get_monotonic_time ();
+    for (i = 0; i < cycles; ++i) {
+        cycle (connection);
+    }
+    time = g_get_monotonic_time () - start;
+    allocs = g_atomic_int_get (&bench_allocs) - allocs;
+    g_print ("%-12s %-9.1f ns %-9.2f\n", name,
+             (gdouble)time * 1000 / cycles, (gdouble)allocs / cycles);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    Connection *connection;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    guint cycles = BENCH_CYCLES_DEFAULT;
+    gint client_fd;
+
+    if (argc > 1) {
+        cycles = strtoul (argv [1], NULL, 10);
+    }
+    if (cycles == 0) {
+        g_printerr ("usage: %s [cycles > 0]\n", argv [0]);
+        return 1;
+    }
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+
+    g_print ("%-12s %-12s %-9s\n", "objects", "time/cycle", "allocs/cycle");
+    object_pool_set_enabled (FALSE);
+    bench_run ("properties", bench_cycle_properties, connection, cycles);
+    object_pool_set_enabled (TRUE);
+    bench_run ("pooled", bench_cycle_pooled, connection, cycles);
+
+    g_object_unref (connection);
+    close (client_fd);
+    return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <glib.h>
+#include <glib-object.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "object-pool.h"
+
+/*
+ * An empty pool hands out nothing. An instance put in the pool gets a
+ * reference from it and is handed out again.
+ */
+static void
+object_pool_put_get_test (void **state)
+{
+    ObjectPool pool = OBJECT_POOL_INIT;
+    GObject *obj;
+
+    assert_null (object_pool_get (&pool));
+    obj = g_object_new (G_TYPE_OBJECT, NULL);
+    assert_true (object_pool_put (&pool, obj));
+    assert_int_equal (obj->ref_count, 2);
+    g_object_unref (obj);
+    assert_ptr_equal (object_pool_get (&pool), obj);
+    assert_null (object_pool_get (&pool));
+    assert_int_equal (obj->ref_count, 1);
+    g_object_unref (obj);
+}
+/*
+ * Instances that are still referenced elsewhere aren't being finalized
+ * and must not be pooled.
+ */
+static void
+object_pool_put_referenced_test (void **state)
+{
+    ObjectPool pool = OBJECT_POOL_INIT;
+    GObject *obj;
+
+    obj = g_object_new (G_TYPE_OBJECT, NULL);
+    g_object_ref (obj);
+    assert_false (object_pool_put (&pool, obj));
+    assert_int_equal (pool.count, 0);
+    g_object_unref (obj);
+    g_object_unref (obj);
+}
+/*
+ * Once OBJECT_POOL_SIZE instances are pooled the rest are finalized.
+ */
+static void
+object_pool_put_full_test (void **state)
+{
+    ObjectPool pool = OBJECT_POOL_INIT;
+    GObject *obj;
+    guint i;
+
+    for (i = 0; i < OBJECT_POOL_SIZE; ++i) {
+        obj = g_object_new (G_TYPE_OBJECT, NULL);
+        assert_true (object_pool_put (&pool, obj));
+        g_object_unref (obj);
+    }
+    obj = g_object_new (G_TYPE_OBJECT, NULL);
+    assert_false (object_pool_put (&pool, obj));
+    g_object_unref (obj);
+    while ((obj = object_pool_get (&pool)) != NULL) {
+        g_object_unref (obj);
+    }
+}
+
+static void
+object_pool_disabled_test (void **state)
+{
+    ObjectPool pool = OBJECT_POOL_INIT;
+    GObject *obj;
+
+    object_pool_set_enabled (FALSE);
+    obj = g_object_new (G_TYPE_OBJECT, NULL);
+    assert_false (object_pool_put (&pool, obj));
+    g_object_unref (obj);
+    object_pool_set_enabled (TRUE);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (object_pool_put_get_test),
+        cmocka_unit_test (object_pool_put_referenced_test),
+        cmocka_unit_test (object_pool_put_full_test),
+        cmocka_unit_test (object_pool_disabled_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
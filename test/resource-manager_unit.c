@@ -31,10 +31,12 @@
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include "control-message.h"
 #include "resource-manager.h"
 #include "tcti-echo.h"
 #include "sink-interface.h"
 #include "source-interface.h"
+#include "tabrmd.h"
 #include "tpm2-command.h"
 #include "tpm2-header.h"
 #include "util.h"
@@ -51,15 +53,25 @@ typedef struct test_data {
     TPMA_CC         command_attrs;
 } test_data_t;
 
+/*
+ * The ResourceManager submits commands with access_broker_submit and
+ * collects the response with access_broker_complete. Submission always
+ * succeeds here, the mock data is all in the complete function.
+ */
+TSS2_RC
+__wrap_access_broker_submit (AccessBroker *access_broker,
+                             Tpm2Command  *command)
+{
+    return TSS2_RC_SUCCESS;
+}
 /**
  * Mock function for testing the resource_manager_process_tpm2_command
- * function which depends on the access_broker_send_command and must
+ * function which depends on the access_broker_complete and must
  * handle the call and the associated error conditions.
  */
 Tpm2Response*
-__wrap_access_broker_send_command (AccessBroker *access_broker,
-                                   Tpm2Command  *command,
-                                   TSS2_RC      *rc)
+__wrap_access_broker_complete (AccessBroker *access_broker,
+                               TSS2_RC      *rc)
 {
     Tpm2Response *response;
 
@@ -88,7 +100,8 @@ __wrap_sink_enqueue (Sink      *self,
                      GObject   *obj)
 {
     test_data_t *data = mock_ptr_type (test_data_t*);
-    data->response = TPM2_RESPONSE (obj);
+    g_clear_object (&data->response);
+    data->response = TPM2_RESPONSE (g_object_ref (obj));
 }
 TSS2_RC
 __wrap_access_broker_context_saveflush (AccessBroker *broker,
@@ -97,6 +110,33 @@ __wrap_access_broker_context_saveflush (AccessBroker *broker,
 {
    return mock_type (TSS2_RC);
 }
+/*
+ * Wrap call to access_broker_context_flush. Pops the RC off the mock
+ * stack and returns it to the caller.
+ */
+TSS2_RC
+__wrap_access_broker_context_flush (AccessBroker *broker,
+                                    TPM2_HANDLE    handle)
+{
+    return mock_type (TSS2_RC);
+}
+/*
+ * Wrap call to access_broker_context_save. Pops two parameters off the
+ * stack with the 'mock' command. The first is the RC which is returned
+ * directly to the caller. The other is the sequence number the TPM
+ * assigned to the saved context.
+ */
+TSS2_RC
+__wrap_access_broker_context_save (AccessBroker *broker,
+                                   TPM2_HANDLE    handle,
+                                   TPMS_CONTEXT *context)
+{
+    TSS2_RC rc       = mock_type (TSS2_RC);
+    UINT64  sequence = mock_type (UINT64);
+
+    context->sequence = sequence;
+    return rc;
+}
 /*
  * Wrap call to access_broker_context_load. Pops two parameters off the
  * stack with the 'mock' command. The first is the RC which is returned
@@ -134,7 +174,9 @@ resource_manager_setup (void **state)
     data->access_broker = access_broker_new (TCTI (data->tcti_echo));
     session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT);
     data->resource_manager = resource_manager_new (data->access_broker,
-                                                   session_list);
+                                                   session_list,
+                                                   0,
+                                                   0);
     g_clear_object (&session_list);
     iostream = create_connection_iostream (&data->client_fd);
     data->connection = connection_new (iostream, 10, handle_map);
@@ -154,8 +196,9 @@ resource_manager_setup_two_transient_handles (void **state)
     resource_manager_setup (state);
     data = *state;
 
-    data->vhandles [0] = TPM2_HR_TRANSIENT + 0x1;
-    data->vhandles [1] = TPM2_HR_TRANSIENT + 0x2;
+    /* the first vhandles issued for slots 0 and 1 of a HandleMap */
+    data->vhandles [0] = TPM2_HR_TRANSIENT + 0x000001;
+    data->vhandles [1] = TPM2_HR_TRANSIENT + 0x010001;
     data->command_attrs = (2 << 25) + TPM2_CC_StartAuthSession; /* 2 handles + TPM2_StartAuthSession */
 
     /* create Tpm2Command that we'll be transforming */
@@ -170,14 +213,78 @@ resource_manager_setup_two_transient_handles (void **state)
     buffer [7]  = 0x00;
     buffer [8]  = TPM2_CC_StartAuthSession >> 8;
     buffer [9]  = TPM2_CC_StartAuthSession & 0xff;
-    buffer [10] = TPM2_HT_TRANSIENT;
-    buffer [11] = 0x00;
-    buffer [12] = 0x00;
-    buffer [13] = data->vhandles [0] & 0xff; /* first virtual handle */
-    buffer [14] = TPM2_HT_TRANSIENT;
-    buffer [15] = 0x00;
-    buffer [16] = 0x00;
-    buffer [17] = data->vhandles [1] & 0xff; /* second virtual handle */
+    /* first virtual handle */
+    *(TPM2_HANDLE*)&buffer [10] = htobe32 (data->vhandles [0]);
+    /* second virtual handle */
+    *(TPM2_HANDLE*)&buffer [14] = htobe32 (data->vhandles [1]);
+    data->command = tpm2_command_new (data->connection,
+                                      buffer,
+                                      buffer_size,
+                                      data->command_attrs);
+    return 0;
+}
+/*
+ * Same as the above but the ResourceManager is created with room for
+ * transient objects to remain resident in the TPM between commands.
+ */
+static int
+resource_manager_setup_two_transient_handles_resident (void **state)
+{
+    test_data_t *data;
+    SessionList *session_list;
+
+    resource_manager_setup_two_transient_handles (state);
+    data = *state;
+
+    g_object_unref (data->resource_manager);
+    session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT);
+    data->resource_manager = resource_manager_new (data->access_broker,
+                                                   session_list,
+                                                   3,
+                                                   3);
+    g_clear_object (&session_list);
+    return 0;
+}
+/*
+ * Setup a ResourceManager that keeps sessions resident and a Tpm2Command
+ * with a single policy session handle in its handle area. The
+ * SessionList in the ResourceManager is populated with an entry for this
+ * session that is marked as loaded.
+ */
+static int
+resource_manager_setup_session_resident (void **state)
+{
+    test_data_t  *data;
+    SessionList  *session_list;
+    SessionEntry *session_entry;
+    guint8       *buffer;
+    size_t        buffer_size;
+
+    resource_manager_setup (state);
+    data = *state;
+
+    g_object_unref (data->resource_manager);
+    session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT);
+    data->resource_manager = resource_manager_new (data->access_broker,
+                                                   session_list,
+                                                   0,
+                                                   3);
+    data->vhandles [0] = TPM2_HR_POLICY_SESSION + 0x1;
+    session_entry = session_entry_new (data->connection, data->vhandles [0]);
+    session_entry_set_loaded (session_entry, TRUE);
+    session_list_insert (session_list, session_entry);
+    g_object_unref (session_entry);
+    g_clear_object (&session_list);
+
+    data->command_attrs = (1 << 25) + TPM2_CC_PolicyPCR; /* 1 handle */
+    buffer_size = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE);
+    buffer = calloc (1, buffer_size);
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    buffer [5]  = buffer_size;
+    buffer [8]  = TPM2_CC_PolicyPCR >> 8;
+    buffer [9]  = TPM2_CC_PolicyPCR & 0xff;
+    buffer [10] = TPM2_HT_POLICY_SESSION;
+    buffer [13] = data->vhandles [0] & 0xff;
     data->command = tpm2_command_new (data->connection,
                                       buffer,
                                       buffer_size,
@@ -207,6 +314,7 @@ resource_manager_teardown (void **state)
         g_debug ("resource_manager unref Tpm2Command");
         g_object_unref (data->command);
     }
+    g_clear_object (&data->response);
     free (data);
     return 0;
 }
@@ -225,7 +333,7 @@ resource_manager_type_test (void **state)
  * A test: Ensure that the Sink interface to the ResourceManager works. We
  * create a Tpm2Command, send it through the ResourceManager enqueue
  * function then pull it out the other end by reaching in to the
- * ResourceManagers internal MessageQueue.
+ * ResourceManagers internal FairQueue.
  * We *DO NOT* use the sink interface here since we've mock'd that for
  * other purposes and it would make the test largely meaningless.
  */
@@ -239,7 +347,7 @@ resource_manager_sink_enqueue_test (void **state)
     buffer = calloc (1, TPM_HEADER_SIZE);
     data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
     resource_manager_enqueue (SINK (data->resource_manager), G_OBJECT (data->command));
-    command_out = TPM2_COMMAND (message_queue_dequeue (data->resource_manager->in_queue));
+    command_out = TPM2_COMMAND (fair_queue_dequeue (data->resource_manager->in_queue));
 
     assert_int_equal (data->command, command_out);
     assert_int_equal (1, 1);
@@ -271,8 +379,8 @@ resource_manager_process_tpm2_command_success_test (void **state)
      */
     g_object_ref (response);
 
-    will_return (__wrap_access_broker_send_command, TSS2_RC_SUCCESS);
-    will_return (__wrap_access_broker_send_command, response);
+    will_return (__wrap_access_broker_complete, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_complete, response);
     /**
      * The sink_enqueue wrap function will assign the Tpm2Response it's passed
      * to the test data structure.
@@ -283,6 +391,355 @@ resource_manager_process_tpm2_command_success_test (void **state)
     assert_int_equal (data->response, response);
     g_object_unref (response);
 }
+/*
+ * While the TPM executes a command the next one is left on the queue. The
+ * FairQueue picks what to serve next only once the command in flight is
+ * done.
+ */
+static void
+resource_manager_process_tpm2_command_next_queued_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command_next;
+    Tpm2Response *response;
+    Connection *connection;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    GObject *obj;
+    gint client_fd;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 11, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    command_next = tpm2_command_new (connection,
+                                     calloc (1, TPM_HEADER_SIZE),
+                                     TPM_HEADER_SIZE,
+                                     (TPMA_CC){ 0, });
+    resource_manager_enqueue (SINK (data->resource_manager),
+                              G_OBJECT (command_next));
+
+    data->command = tpm2_command_new (data->connection,
+                                      calloc (1, TPM_HEADER_SIZE),
+                                      TPM_HEADER_SIZE,
+                                      (TPMA_CC){ 0, });
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_access_broker_complete, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_complete, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    obj = fair_queue_try_dequeue (data->resource_manager->in_queue);
+    assert_ptr_equal (obj, command_next);
+    g_object_unref (obj);
+    g_object_unref (response);
+    g_object_unref (command_next);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * A command with no handles and no auth area doesn't touch any context.
+ * The session below is due to be re-saved but no mock RC is pushed for
+ * the context load / save functions so doing so would fail the test.
+ */
+static void
+resource_manager_process_tpm2_command_no_contexts_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    SessionEntry *session_entry;
+    guint8 *buffer;
+
+    data->resource_manager->context_gap_max = 0x100;
+    data->resource_manager->context_counter = 0x1000;
+    session_entry = session_entry_new (data->connection,
+                                       TPM2_HR_HMAC_SESSION + 0x1);
+    session_entry_get_context (session_entry)->sequence = 0x10;
+    session_list_insert (data->resource_manager->session_list, session_entry);
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+
+    will_return (__wrap_access_broker_complete, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_complete, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    assert_int_equal (session_entry_get_context (session_entry)->sequence,
+                      0x10);
+    g_object_unref (response);
+    g_object_unref (session_entry);
+}
+/*
+ * Send a TPM2_HashSequenceStart through the ResourceManager. The TPM
+ * responds with the sequence object in 'phandle' when 'tpm_responds' is
+ * set, otherwise the command must be answered without reaching the TPM.
+ * Returns the response code the client got.
+ */
+static TSS2_RC
+resource_manager_hash_sequence_start (test_data_t *data,
+                                      TPM2_HANDLE  phandle,
+                                      gboolean     tpm_responds)
+{
+    TPMA_CC attributes = TPMA_CC_RHANDLE + TPM2_CC_HashSequenceStart;
+    Tpm2Command *command;
+    Tpm2Response *response;
+    guint8 *buffer;
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)&buffer [2] = htobe32 (TPM_HEADER_SIZE);
+    *(TPM2_CC*)&buffer [6] = htobe32 (TPM2_CC_HashSequenceStart);
+    command = tpm2_command_new (data->connection,
+                                buffer,
+                                TPM_HEADER_SIZE,
+                                attributes);
+    if (tpm_responds) {
+        buffer = calloc (1, TPM_HEADER_SIZE + sizeof (TPM2_HANDLE));
+        *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+        *(UINT32*)&buffer [2] = htobe32 (TPM_HEADER_SIZE +
+                                         sizeof (TPM2_HANDLE));
+        *(TPM2_HANDLE*)&buffer [TPM_HEADER_SIZE] = htobe32 (phandle);
+        response = tpm2_response_new (data->connection,
+                                      buffer,
+                                      TPM_HEADER_SIZE + sizeof (TPM2_HANDLE),
+                                      attributes);
+        will_return (__wrap_access_broker_complete, TSS2_RC_SUCCESS);
+        will_return (__wrap_access_broker_complete, response);
+        /* without resident objects the sequence is saved after the command */
+        will_return (__wrap_access_broker_context_saveflush, TSS2_RC_SUCCESS);
+    }
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager, command);
+    g_object_unref (command);
+
+    return tpm2_response_get_code (data->response);
+}
+/*
+ * Every command returning a transient handle counts against the transient
+ * object quota, not just those loading objects. Once a client has as many
+ * hash sequences as its HandleMap holds the next one is refused with
+ * TSS2_RESMGR_RC_OBJECT_MEMORY before it reaches the TPM.
+ */
+static void
+resource_manager_process_tpm2_command_sequence_quota_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_RC rc;
+    guint i;
+
+    for (i = 0; i < MAX_ENTRIES_DEFAULT; ++i) {
+        rc = resource_manager_hash_sequence_start (data,
+                                                   TPM2_HR_TRANSIENT + i,
+                                                   TRUE);
+        assert_int_equal (rc, TSS2_RC_SUCCESS);
+        assert_int_equal (tpm2_response_get_handle_type (data->response),
+                          TPM2_HT_TRANSIENT);
+    }
+    rc = resource_manager_hash_sequence_start (data, 0, FALSE);
+    assert_int_equal (rc, TSS2_RESMGR_RC_OBJECT_MEMORY);
+    rc = resource_manager_hash_sequence_start (data, 0, FALSE);
+    assert_int_equal (rc, TSS2_RESMGR_RC_OBJECT_MEMORY);
+}
+/*
+ * In run-to-completion mode a command passed to the Sink interface is
+ * processed before resource_manager_enqueue returns and nothing is left
+ * on the queue for the ResourceManager thread. The ControlMessage meant
+ * for the ResourceManager thread must not be taken off its queue.
+ */
+static void
+resource_manager_enqueue_run_to_completion_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    ControlMessage *msg;
+    GObject *obj;
+
+    resource_manager_set_run_to_completion (data->resource_manager, TRUE);
+    msg = control_message_new (CHECK_CANCEL);
+    resource_manager_enqueue (SINK (data->resource_manager), G_OBJECT (msg));
+    data->command = tpm2_command_new (data->connection,
+                                      calloc (1, TPM_HEADER_SIZE),
+                                      TPM_HEADER_SIZE,
+                                      (TPMA_CC){ 0, });
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_access_broker_complete, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_complete, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_enqueue (SINK (data->resource_manager),
+                              G_OBJECT (data->command));
+    assert_int_equal (data->response, response);
+    obj = fair_queue_try_dequeue (data->resource_manager->in_queue);
+    assert_ptr_equal (obj, msg);
+    assert_null (fair_queue_try_dequeue (data->resource_manager->in_queue));
+    g_object_unref (obj);
+    g_object_unref (msg);
+    g_object_unref (response);
+}
+/*
+ * Once the queueing delay is over budget new commands are answered with
+ * TPM2_RC_RETRY right away, unless they come from a client with a higher
+ * weight than we shed. Those are still queued.
+ */
+static void
+resource_manager_enqueue_shed_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    GObject *obj;
+
+    resource_manager_set_load_shedding (data->resource_manager, 1000, 1);
+    data->resource_manager->queue_delay = 5000;
+    data->command = tpm2_command_new (data->connection,
+                                      calloc (1, TPM_HEADER_SIZE),
+                                      TPM_HEADER_SIZE,
+                                      (TPMA_CC){ 0, });
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_enqueue (SINK (data->resource_manager),
+                              G_OBJECT (data->command));
+    assert_int_equal (tpm2_response_get_code (data->response), TPM2_RC_RETRY);
+    assert_null (fair_queue_try_dequeue (data->resource_manager->in_queue));
+
+    connection_set_identity (data->connection, "pid:1");
+    resource_manager_set_weight (data->resource_manager, "pid:1", 2);
+    command = tpm2_command_new (data->connection,
+                                calloc (1, TPM_HEADER_SIZE),
+                                TPM_HEADER_SIZE,
+                                (TPMA_CC){ 0, });
+    resource_manager_enqueue (SINK (data->resource_manager),
+                              G_OBJECT (command));
+    obj = fair_queue_try_dequeue (data->resource_manager->in_queue);
+    assert_ptr_equal (obj, command);
+    g_object_unref (obj);
+    g_object_unref (command);
+}
+/*
+ * Commands the client canceled or that are past their deadline are
+ * answered with TPM2_RC_CANCELED and never reach the AccessBroker: the
+ * access_broker_complete mock has nothing queued so it would fail if they
+ * did.
+ */
+static void
+resource_manager_process_tpm2_command_canceled_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    data->command = tpm2_command_new (data->connection,
+                                      calloc (1, TPM_HEADER_SIZE),
+                                      TPM_HEADER_SIZE,
+                                      (TPMA_CC){ 0, });
+    connection_cancel (data->connection);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (tpm2_response_get_code (data->response),
+                      TPM2_RC_CANCELED);
+}
+
+static void
+resource_manager_process_tpm2_command_deadline_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    connection_set_timeout (data->connection, 1);
+    data->command = tpm2_command_new (data->connection,
+                                      calloc (1, TPM_HEADER_SIZE),
+                                      TPM_HEADER_SIZE,
+                                      (TPMA_CC){ 0, });
+    assert_int_equal (tpm2_command_get_deadline (data->command),
+                      tpm2_command_get_timestamp (data->command) + 1000);
+    g_usleep (2000);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (tpm2_response_get_code (data->response),
+                      TPM2_RC_CANCELED);
+}
+/*
+ * When the TPM responds with TPM2_RC_OBJECT_MEMORY the ResourceManager
+ * must evict the resident transient objects and send the command again.
+ * The client must only see the response to the second attempt.
+ */
+static void
+resource_manager_process_tpm2_command_object_memory_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response_fail, *response;
+    HandleMapEntry *entry;
+    guint8 *buffer;
+
+    entry = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x2,
+                                  TPM2_HR_TRANSIENT + 0x1);
+    g_queue_push_head (data->resource_manager->resident_queue, entry);
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    response_fail = tpm2_response_new_rc (data->connection,
+                                          TPM2_RC_OBJECT_MEMORY);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+
+    will_return (__wrap_access_broker_complete, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_complete, response_fail);
+    will_return (__wrap_access_broker_context_saveflush, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_complete, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_complete, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    assert_int_equal (g_queue_get_length (data->resource_manager->resident_queue), 0);
+    g_object_unref (response);
+}
+/*
+ * When the TPM responds with TPM2_RC_RETRY the command isn't answered.
+ * The contexts loaded for it are released and its virtual handles are put
+ * back so it can be processed again once it's due.
+ */
+static void
+resource_manager_process_tpm2_command_retry_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    HandleMapEntry *entry;
+    HandleMap *map;
+    TPM2_HANDLE phandles [2] = {
+        TPM2_HR_TRANSIENT + 0xeb,
+        TPM2_HR_TRANSIENT + 0xbe,
+    };
+    size_t i;
+
+    map = connection_get_trans_map (data->connection);
+    for (i = 0; i < 2; ++i) {
+        entry = handle_map_entry_new (0, data->vhandles [i]);
+        handle_map_insert (map, data->vhandles [i], entry);
+        g_object_unref (entry);
+        will_return (__wrap_access_broker_context_load, TSS2_RC_SUCCESS);
+        will_return (__wrap_access_broker_context_load, phandles [i]);
+        will_return (__wrap_access_broker_context_saveflush, TSS2_RC_SUCCESS);
+    }
+    g_object_unref (map);
+    response = tpm2_response_new_rc (data->connection, TPM2_RC_RETRY);
+    will_return (__wrap_access_broker_complete, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_complete, response);
+    assert_false (resource_manager_process_tpm2_command (data->resource_manager,
+                                                         data->command));
+    assert_null (data->response);
+    assert_int_equal (tpm2_command_get_retries (data->command), 1);
+    assert_true (tpm2_command_get_not_before (data->command) > 0);
+    for (i = 0; i < 2; ++i) {
+        assert_int_equal (tpm2_command_get_handle (data->command, i),
+                          data->vhandles [i]);
+    }
+}
 static void
 resource_manager_flushsave_context_test (void **state)
 {
@@ -294,6 +751,28 @@ resource_manager_flushsave_context_test (void **state)
     will_return (__wrap_access_broker_context_saveflush, TSS2_RC_SUCCESS);
     resource_manager_flushsave_context (entry, data->resource_manager);
     assert_int_equal (handle_map_entry_get_phandle (entry), 0);
+    assert_true (handle_map_entry_get_context_valid (entry));
+    g_object_unref (entry);
+}
+/*
+ * When the HandleMapEntry already holds a valid saved context the
+ * flushsave_context function must only flush the object. No mock RC is
+ * pushed for access_broker_context_saveflush so calling it would fail
+ * the test.
+ */
+static void
+resource_manager_flushsave_context_valid_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    TPM2_HANDLE vhandle = TPM2_HR_TRANSIENT + 0x1, phandle = TPM2_HR_TRANSIENT + 0x2;
+
+    entry = handle_map_entry_new (phandle, vhandle);
+    handle_map_entry_set_context_valid (entry, TRUE);
+    will_return (__wrap_access_broker_context_flush, TSS2_RC_SUCCESS);
+    resource_manager_flushsave_context (entry, data->resource_manager);
+    assert_int_equal (handle_map_entry_get_phandle (entry), 0);
+    g_object_unref (entry);
 }
 /*
  * This test case pushes an error RC on to the mock stack for the
@@ -353,7 +832,7 @@ resource_manager_load_contexts_test (void **state)
     HandleMapEntry *entry;
     GSList         *entry_slist;
     HandleMap      *map;
-    SessionList    *loaded_sessions;
+    LoadedSessions  loaded_sessions = LOADED_SESSIONS_INIT;
     TPM2_HANDLE      phandles [2] = {
         TPM2_HR_TRANSIENT + 0xeb,
         TPM2_HR_TRANSIENT + 0xbe,
@@ -375,19 +854,241 @@ resource_manager_load_contexts_test (void **state)
         handle_map_insert (map, vhandles [i], entry);
         g_object_unref (entry);
     }
-    loaded_sessions = session_list_new (50);
     g_debug ("before resource_manager_load_contexts");
     rc = resource_manager_load_contexts (data->resource_manager,
                                          data->command,
                                          &entry_slist,
-                                         loaded_sessions);
+                                         &loaded_sessions);
     g_debug ("after resource_manager_load_contexts");
     assert_int_equal (rc, TSS2_RC_SUCCESS);
     for (i = 0; i < handle_count; ++i) {
         handle_ret = tpm2_command_get_handle (data->command, i);
         assert_int_equal (phandles [i], handle_ret);
     }
-    g_object_unref (loaded_sessions);
+    loaded_sessions_clear (&loaded_sessions);
+}
+/*
+ * When transient objects are kept resident, HandleMapEntry objects with a
+ * physical handle are already loaded in the TPM. Loading the contexts for
+ * the command must map the virtual handles to the physical ones without
+ * calling access_broker_context_load.
+ */
+static void
+resource_manager_load_contexts_resident_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    GSList         *entry_slist = NULL;
+    HandleMap      *map;
+    LoadedSessions  loaded_sessions = LOADED_SESSIONS_INIT;
+    TPM2_HANDLE      phandles [2] = {
+        TPM2_HR_TRANSIENT + 0xeb,
+        TPM2_HR_TRANSIENT + 0xbe,
+    };
+    TPM2_HANDLE      vhandles [3] = { 0 };
+    TPM2_HANDLE      handle_ret;
+    TSS2_RC         rc = TSS2_RC_SUCCESS;
+    size_t          handle_count = 2, i;
+
+    tpm2_command_get_handles (data->command, vhandles, &handle_count);
+    map = connection_get_trans_map (data->connection);
+    for (i = 0; i < handle_count; ++i) {
+        entry = handle_map_entry_new (phandles [i], vhandles [i]);
+        handle_map_insert (map, vhandles [i], entry);
+        g_object_unref (entry);
+    }
+    g_object_unref (map);
+    rc = resource_manager_load_contexts (data->resource_manager,
+                                         data->command,
+                                         &entry_slist,
+                                         &loaded_sessions);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (g_slist_length (entry_slist), handle_count);
+    for (i = 0; i < handle_count; ++i) {
+        handle_ret = tpm2_command_get_handle (data->command, i);
+        assert_int_equal (phandles [i], handle_ret);
+    }
+    /* neither context was ever saved so both a load and a save were saved */
+    assert_int_equal (data->resource_manager->loads_avoided, handle_count);
+    assert_int_equal (data->resource_manager->saves_avoided, handle_count);
+    /* kept resident, and so charged to the connection until flushed */
+    post_process_entry_list (data->resource_manager,
+                             &entry_slist,
+                             data->connection,
+                             data->command_attrs);
+    assert_int_equal (connection_get_resident (data->connection),
+                      handle_count);
+    for (i = 0; i < handle_count; ++i) {
+        will_return (__wrap_access_broker_context_flush, TSS2_RC_SUCCESS);
+    }
+    resource_manager_on_connection_removed (NULL,
+                                            data->connection,
+                                            data->resource_manager);
+    assert_int_equal (connection_get_resident (data->connection), 0);
+    loaded_sessions_clear (&loaded_sessions);
+}
+/*
+ * When sessions are kept resident a session that is already loaded in the
+ * TPM must be used as is. No mock RC is pushed for the
+ * access_broker_context_load function so calling it would fail the test.
+ * The session must still be added to the list of loaded sessions.
+ */
+static void
+resource_manager_load_contexts_session_resident_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    GSList         *entry_slist = NULL;
+    LoadedSessions  loaded_sessions = LOADED_SESSIONS_INIT;
+    TSS2_RC         rc = TSS2_RC_SUCCESS;
+
+    rc = resource_manager_load_contexts (data->resource_manager,
+                                         data->command,
+                                         &entry_slist,
+                                         &loaded_sessions);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (loaded_sessions.count, 1);
+    assert_int_equal (tpm2_command_get_handle (data->command, 0),
+                      data->vhandles [0]);
+    assert_int_equal (data->resource_manager->loads_avoided, 1);
+    assert_int_equal (data->resource_manager->saves_avoided, 1);
+    loaded_sessions_clear (&loaded_sessions);
+}
+/*
+ * A session saved by the RM that has fallen more than half the context gap
+ * behind the context counter must be loaded and saved again. The new
+ * sequence number becomes the context counter.
+ */
+static void
+resource_manager_regap_sessions_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    SessionEntry   *session_entry;
+    TPM2_HANDLE     handle = TPM2_HR_HMAC_SESSION + 0x1;
+
+    data->resource_manager->context_gap_max = 0x100;
+    data->resource_manager->context_counter = 0x1000;
+    session_entry = session_entry_new (data->connection, handle);
+    session_entry_get_context (session_entry)->sequence = 0x10;
+    session_list_insert (data->resource_manager->session_list, session_entry);
+
+    will_return (__wrap_access_broker_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_context_load, handle);
+    will_return (__wrap_access_broker_context_save, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_context_save, 0x1001);
+    resource_manager_regap_sessions (data->resource_manager);
+
+    assert_int_equal (session_entry_get_context (session_entry)->sequence,
+                      0x1001);
+    assert_int_equal (data->resource_manager->context_counter, 0x1001);
+    g_object_unref (session_entry);
+}
+/*
+ * If the session can't be saved again it's left loaded in the TPM. Without
+ * resident sessions nothing would track it so it must be flushed and
+ * dropped from the SessionList.
+ */
+static void
+resource_manager_regap_sessions_save_fail_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    SessionEntry   *session_entry;
+    TPM2_HANDLE     handle = TPM2_HR_HMAC_SESSION + 0x1;
+
+    data->resource_manager->context_gap_max = 0x100;
+    data->resource_manager->context_counter = 0x1000;
+    session_entry = session_entry_new (data->connection, handle);
+    session_entry_get_context (session_entry)->sequence = 0x10;
+    session_list_insert (data->resource_manager->session_list, session_entry);
+
+    will_return (__wrap_access_broker_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_access_broker_context_load, handle);
+    will_return (__wrap_access_broker_context_save, TPM2_RC_CONTEXT_GAP);
+    will_return (__wrap_access_broker_context_save, 0);
+    will_return (__wrap_access_broker_context_flush, TSS2_RC_SUCCESS);
+    resource_manager_regap_sessions (data->resource_manager);
+
+    assert_int_equal (session_list_size (data->resource_manager->session_list),
+                      0);
+    g_object_unref (session_entry);
+}
+/*
+ * Create a session saved by its client on the test connection and close
+ * the connection so that the session is abandoned. The caller gets a
+ * reference to the session.
+ */
+static SessionEntry*
+resource_manager_abandon_session_helper (test_data_t *data,
+                                         TPM2_HANDLE  handle)
+{
+    SessionEntry *session_entry;
+
+    session_entry = session_entry_new (data->connection, handle);
+    session_entry_set_state (session_entry, SESSION_ENTRY_SAVED_CLIENT);
+    session_list_insert (data->resource_manager->session_list, session_entry);
+    resource_manager_on_connection_removed (NULL,
+                                            data->connection,
+                                            data->resource_manager);
+    return session_entry;
+}
+/*
+ * When more sessions are abandoned than the store holds the oldest are
+ * flushed from the TPM.
+ */
+static void
+resource_manager_abandon_max_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    SessionEntry   *session_entry [2];
+    GQueue         *queue = data->resource_manager->abandoned_session_queue;
+
+    resource_manager_set_abandoned_limits (data->resource_manager, 1, 0);
+    session_entry [0] =
+        resource_manager_abandon_session_helper (data,
+                                                 TPM2_HR_HMAC_SESSION + 0x1);
+    assert_int_equal (g_queue_get_length (queue), 1);
+
+    will_return (__wrap_access_broker_context_flush, TSS2_RC_SUCCESS);
+    session_entry [1] =
+        resource_manager_abandon_session_helper (data,
+                                                 TPM2_HR_HMAC_SESSION + 0x2);
+    assert_int_equal (g_queue_get_length (queue), 1);
+    assert_ptr_equal (g_queue_peek_head (queue), session_entry [1]);
+    assert_int_equal (resource_manager_expire_abandoned (data->resource_manager),
+                      -1);
+    g_object_unref (session_entry [0]);
+    g_object_unref (session_entry [1]);
+}
+/*
+ * Abandoned sessions are kept until they're older than the time to live,
+ * then resource_manager_expire_abandoned flushes them from the TPM.
+ */
+static void
+resource_manager_expire_abandoned_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    SessionEntry   *session_entry;
+    GQueue         *queue = data->resource_manager->abandoned_session_queue;
+    gint64          ttl = 10 * G_USEC_PER_SEC, expire_time;
+
+    resource_manager_set_abandoned_limits (data->resource_manager, 4, ttl);
+    session_entry =
+        resource_manager_abandon_session_helper (data,
+                                                 TPM2_HR_HMAC_SESSION + 0x1);
+    assert_int_equal (session_entry_get_state (session_entry),
+                      SESSION_ENTRY_SAVED_CLIENT_CLOSED);
+    assert_int_equal (g_queue_get_length (queue), 1);
+
+    expire_time = resource_manager_expire_abandoned (data->resource_manager);
+    assert_int_equal (expire_time,
+                      session_entry_get_closed_time (session_entry) + ttl);
+    assert_int_equal (g_queue_get_length (queue), 1);
+
+    session_entry->closed_time -= ttl;
+    will_return (__wrap_access_broker_context_flush, TSS2_RC_SUCCESS);
+    expire_time = resource_manager_expire_abandoned (data->resource_manager);
+    assert_int_equal (expire_time, -1);
+    assert_int_equal (g_queue_get_length (queue), 0);
+    g_object_unref (session_entry);
 }
 int
 main (int   argc,
@@ -403,9 +1104,39 @@ main (int   argc,
         cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_success_test,
                                          resource_manager_setup,
                                          resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_no_contexts_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_next_queued_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_sequence_quota_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_enqueue_run_to_completion_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_enqueue_shed_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_canceled_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_deadline_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_object_memory_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_retry_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
         cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_test,
                                          resource_manager_setup,
                                          resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_valid_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
         cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_fail_test,
                                          resource_manager_setup,
                                          resource_manager_teardown),
@@ -415,6 +1146,24 @@ main (int   argc,
         cmocka_unit_test_setup_teardown (resource_manager_load_contexts_test,
                                          resource_manager_setup_two_transient_handles,
                                          resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_load_contexts_resident_test,
+                                         resource_manager_setup_two_transient_handles_resident,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_load_contexts_session_resident_test,
+                                         resource_manager_setup_session_resident,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_regap_sessions_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_regap_sessions_save_fail_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_abandon_max_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_expire_abandoned_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
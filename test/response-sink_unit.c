@@ -26,11 +26,20 @@
  */
 #include <glib.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include "connection.h"
+#include "handle-map.h"
 #include "response-sink.h"
+#include "tpm2-response.h"
+#include "util.h"
+
+#define SENT_TEST_WORKERS     4
+#define SENT_TEST_CONNECTIONS 8
+#define SENT_TEST_RESPONSES   32
 
 /**
  * Test to allcoate and destroy a ResponseSink.
@@ -40,9 +49,79 @@ response_sink_allocate_test (void **state)
 {
     ResponseSink *sink;
 
-    sink = response_sink_new ();
+    sink = response_sink_new (1);
+
+    g_object_unref (sink);
+}
+/*
+ * 'response-sent' handler doing what the CommandSource does: the command
+ * answered is no longer in flight for the connection or in total.
+ */
+static void
+response_sink_test_on_response_sent (ResponseSink *sink,
+                                     Connection   *connection,
+                                     gint         *in_flight)
+{
+    /* widen the window where emissions from different workers overlap */
+    g_usleep (100);
+    connection_in_flight_dec (connection);
+    g_atomic_int_add (in_flight, -1);
+}
+/*
+ * Workers write responses, and emit 'response-sent', for different
+ * connections at the same time. Each emission must reach the handler with
+ * its own Connection so every in flight count gets back to 0.
+ */
+static void
+response_sink_response_sent_workers_test (void **state)
+{
+    ResponseSink *sink;
+    Connection   *connections [SENT_TEST_CONNECTIONS];
+    Tpm2Response *response;
+    HandleMap    *handle_map;
+    GIOStream    *iostream;
+    gint          client_fds [SENT_TEST_CONNECTIONS];
+    gint          in_flight = 0;
+    guint         i, j, tries;
+
+    sink = response_sink_new (SENT_TEST_WORKERS);
+    g_signal_connect (sink,
+                      "response-sent",
+                      (GCallback) response_sink_test_on_response_sent,
+                      &in_flight);
+    assert_int_equal (thread_start (THREAD (sink)), 0);
+    for (i = 0; i < SENT_TEST_CONNECTIONS; ++i) {
+        handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+        iostream = create_connection_iostream (&client_fds [i]);
+        connections [i] = connection_new (iostream, i, handle_map);
+        g_object_unref (handle_map);
+        g_object_unref (iostream);
+    }
+    for (j = 0; j < SENT_TEST_RESPONSES; ++j) {
+        for (i = 0; i < SENT_TEST_CONNECTIONS; ++i) {
+            connection_in_flight_inc (connections [i]);
+            g_atomic_int_inc (&in_flight);
+            response = tpm2_response_new_rc (connections [i],
+                                             TSS2_RC_SUCCESS);
+            sink_enqueue (SINK (sink), G_OBJECT (response));
+            g_object_unref (response);
+        }
+    }
+    for (tries = 0; g_atomic_int_get (&in_flight) > 0 && tries < 1000; ++tries) {
+        g_usleep (10000);
+    }
+    assert_int_equal (g_atomic_int_get (&in_flight), 0);
+    for (i = 0; i < SENT_TEST_CONNECTIONS; ++i) {
+        assert_int_equal (connection_get_in_flight (connections [i]), 0);
+    }
 
+    thread_cancel (THREAD (sink));
+    thread_join (THREAD (sink));
     g_object_unref (sink);
+    for (i = 0; i < SENT_TEST_CONNECTIONS; ++i) {
+        g_object_unref (connections [i]);
+        close (client_fds [i]);
+    }
 }
 
 int
@@ -51,6 +130,7 @@ main (int argc,
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test (response_sink_allocate_test),
+        cmocka_unit_test (response_sink_response_sent_workers_test),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
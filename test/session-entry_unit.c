@@ -126,6 +126,16 @@ session_entry_get_handle_test (void **state)
     assert_int_equal (handle, TEST_HANDLE);
 }
 
+static void
+session_entry_loaded_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_false (session_entry_get_loaded (data->session_entry));
+    session_entry_set_loaded (data->session_entry, TRUE);
+    assert_true (session_entry_get_loaded (data->session_entry));
+}
+
 gint
 main (gint argc,
       gchar *arvg[])
@@ -143,6 +153,9 @@ main (gint argc,
         cmocka_unit_test_setup_teardown (session_entry_get_handle_test,
                                          session_entry_setup,
                                          session_entry_teardown),
+        cmocka_unit_test_setup_teardown (session_entry_loaded_test,
+                                         session_entry_setup,
+                                         session_entry_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Microbenchmark for the SessionList with many sessions. The list is
+ * filled with 'sessions' SessionEntry objects spread over Connections with
+ * BENCH_PER_CONNECTION entries each. Then the operations the
+ * ResourceManager performs per command or per connection are timed:
+ * looking up an entry by handle, counting the entries for a connection
+ * (done on each insert) and removing all of the entries for a connection
+ * when it's closed. The same is done with a GList searched with
+ * g_list_find_custom, the way the SessionList used to store its entries,
+ * for comparison. The average time per operation is printed.
+ */
+#include <glib.h>
+#include <glib-object.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "handle-map.h"
+#include "session-entry.h"
+#include "session-list.h"
+#include "util.h"
+
+#define BENCH_SESSIONS_DEFAULT 10000
+#define BENCH_PER_CONNECTION   10
+#define BENCH_LOOKUPS          100000
+
+typedef struct {
+    Connection   **connections;
+    guint          connection_count;
+    SessionEntry **entries;
+    guint          entry_count;
+} bench_data_t;
+
+static gint
+bench_compare_on_handle (gconstpointer a,
+                         gconstpointer b)
+{
+    TPM2_HANDLE handle_a = session_entry_get_handle (SESSION_ENTRY (a));
+    TPM2_HANDLE handle_b = *(TPM2_HANDLE*)b;
+
+    return handle_a == handle_b ? 0 : 1;
+}
+
+static gint
+bench_compare_on_connection (gconstpointer a,
+                             gconstpointer b)
+{
+    return SESSION_ENTRY (a)->connection == b ? 0 : 1;
+}
+
+static void
+bench_print (const gchar *name,
+             const gchar *op,
+             gint64       time,
+             guint        ops)
+{
+    g_print ("%-8s %-18s %-12.1f\n", name, op, (gdouble)time * 1000 / ops);
+}
+/*
+ * The old storage: a GList of entries searched linearly.
+ */
+static void
+bench_run_glist (bench_data_t *data)
+{
+    GList *list = NULL, *link;
+    TPM2_HANDLE handle;
+    gint64 start;
+    guint i, count = 0;
+
+    for (i = data->entry_count; i > 0; --i) {
+        list = g_list_prepend (list, g_object_ref (data->entries [i - 1]));
+    }
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_LOOKUPS; ++i) {
+        handle = session_entry_get_handle (
+            data->entries [g_random_int_range (0, data->entry_count)]);
+        link = g_list_find_custom (list, &handle, bench_compare_on_handle);
+        g_assert (link != NULL);
+    }
+    bench_print ("GList", "lookup handle", g_get_monotonic_time () - start,
+                 BENCH_LOOKUPS);
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < data->connection_count; ++i) {
+        for (link = list; link != NULL; link = link->next) {
+            if (SESSION_ENTRY (link->data)->connection == data->connections [i]) {
+                ++count;
+            }
+        }
+    }
+    g_assert (count == data->entry_count);
+    bench_print ("GList", "connection count", g_get_monotonic_time () - start,
+                 data->connection_count);
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < data->connection_count; ++i) {
+        while ((link = g_list_find_custom (list,
+                                           data->connections [i],
+                                           bench_compare_on_connection))
+               != NULL)
+        {
+            g_object_unref (link->data);
+            list = g_list_delete_link (list, link);
+        }
+    }
+    g_assert (list == NULL);
+    bench_print ("GList", "remove connection", g_get_monotonic_time () - start,
+                 data->connection_count);
+}
+/*
+ * The SessionList with its handle and Connection indexes.
+ */
+static void
+bench_run_session_list (bench_data_t *data)
+{
+    SessionList *list;
+    SessionEntry *entry;
+    gint64 start;
+    guint i, count = 0;
+
+    list = session_list_new (BENCH_PER_CONNECTION);
+    for (i = 0; i < data->entry_count; ++i) {
+        session_list_insert (list, data->entries [i]);
+    }
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < BENCH_LOOKUPS; ++i) {
+        entry = data->entries [g_random_int_range (0, data->entry_count)];
+        session_list_lock (list);
+        entry = session_list_lookup_handle (list,
+                                            session_entry_get_handle (entry));
+        session_list_unlock (list);
+        g_assert (entry != NULL);
+        g_object_unref (entry);
+    }
+    bench_print ("indexed", "lookup handle", g_get_monotonic_time () - start,
+                 BENCH_LOOKUPS);
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < data->connection_count; ++i) {
+        session_list_lock (list);
+        count += session_list_connection_count (list, data->connections [i]);
+        session_list_unlock (list);
+    }
+    g_assert (count == data->entry_count);
+    bench_print ("indexed", "connection count", g_get_monotonic_time () - start,
+                 data->connection_count);
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < data->connection_count; ++i) {
+        session_list_lock (list);
+        while ((entry = session_list_lookup_connection (list,
+                                                        data->connections [i]))
+               != NULL)
+        {
+            session_list_remove (list, entry);
+            g_object_unref (entry);
+        }
+        session_list_unlock (list);
+    }
+    g_assert (session_list_size (list) == 0);
+    bench_print ("indexed", "remove connection", g_get_monotonic_time () - start,
+                 data->connection_count);
+    g_object_unref (list);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    bench_data_t data = { 0, };
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    guint i, sessions = BENCH_SESSIONS_DEFAULT;
+    gint client_fd;
+
+    if (argc > 1) {
+        sessions = strtoul (argv [1], NULL, 10);
+    }
+    if (sessions == 0 || sessions % BENCH_PER_CONNECTION != 0) {
+        g_printerr ("usage: %s [sessions > 0, multiple of %u]\n", argv [0],
+                    BENCH_PER_CONNECTION);
+        return 1;
+    }
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    data.connection_count = sessions / BENCH_PER_CONNECTION;
+    data.connections = g_new0 (Connection*, data.connection_count);
+    for (i = 0; i < data.connection_count; ++i) {
+        data.connections [i] = connection_new (iostream, i, handle_map);
+    }
+    data.entry_count = sessions;
+    data.entries = g_new0 (SessionEntry*, data.entry_count);
+    for (i = 0; i < data.entry_count; ++i) {
+        data.entries [i] =
+            session_entry_new (data.connections [i % data.connection_count],
+                               TPM2_HR_HMAC_SESSION + i);
+    }
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+
+    g_print ("%u sessions, %u connections\n", data.entry_count,
+             data.connection_count);
+    g_print ("%-8s %-18s %-12s\n", "list", "operation", "time/op (ns)");
+    bench_run_glist (&data);
+    bench_run_session_list (&data);
+
+    for (i = 0; i < data.entry_count; ++i) {
+        g_object_unref (data.entries [i]);
+    }
+    for (i = 0; i < data.connection_count; ++i) {
+        g_object_unref (data.connections [i]);
+    }
+    g_free (data.entries);
+    g_free (data.connections);
+    close (client_fd);
+    return 0;
+}
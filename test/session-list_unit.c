@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2017, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <glib.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "session-list.h"
+#include "util.h"
+
+#define TEST_HANDLE_0    0x03000000
+#define TEST_HANDLE_1    0x03000001
+#define TEST_HANDLE_2    0x03000002
+#define TEST_MAX_ENTRIES 2
+
+typedef struct {
+    Connection   *connection [2];
+    gint          client_fd [2];
+    HandleMap    *handle_map;
+    SessionList  *session_list;
+} test_data_t;
+/*
+ * Setup function: create a SessionList and two Connections to associate
+ * SessionEntry objects with.
+ */
+static int
+session_list_setup (void **state)
+{
+    test_data_t *data = NULL;
+    GIOStream *iostream;
+    guint i;
+
+    data = calloc (1, sizeof (test_data_t));
+    data->handle_map = handle_map_new (TPM2_HT_TRANSIENT, 100);
+    for (i = 0; i < 2; ++i) {
+        iostream = create_connection_iostream (&data->client_fd [i]);
+        data->connection [i] = connection_new (iostream, i, data->handle_map);
+        g_object_unref (iostream);
+    }
+    data->session_list = session_list_new (TEST_MAX_ENTRIES);
+
+    *state = data;
+    return 0;
+}
+
+static int
+session_list_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint i;
+
+    g_object_unref (data->session_list);
+    for (i = 0; i < 2; ++i) {
+        g_object_unref (data->connection [i]);
+        close (data->client_fd [i]);
+    }
+    g_object_unref (data->handle_map);
+    free (data);
+    return 0;
+}
+/*
+ * Create a SessionEntry and insert it in the list. The list holds the only
+ * reference to the entry when this returns TRUE.
+ */
+static gboolean
+session_list_insert_new (SessionList *list,
+                         Connection  *connection,
+                         TPM2_HANDLE  handle)
+{
+    SessionEntry *entry;
+    gboolean ret;
+
+    entry = session_entry_new (connection, handle);
+    ret = session_list_insert (list, entry);
+    g_object_unref (entry);
+    return ret;
+}
+/*
+ * Insert an entry and find it by its handle and its Connection.
+ */
+static void
+session_list_insert_lookup_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    SessionEntry *entry;
+
+    assert_true (session_list_insert_new (data->session_list,
+                                          data->connection [0],
+                                          TEST_HANDLE_0));
+    assert_int_equal (session_list_size (data->session_list), 1);
+
+    entry = session_list_lookup_handle (data->session_list, TEST_HANDLE_0);
+    assert_non_null (entry);
+    assert_int_equal (session_entry_get_handle (entry), TEST_HANDLE_0);
+    g_object_unref (entry);
+
+    entry = session_list_lookup_connection (data->session_list,
+                                            data->connection [0]);
+    assert_non_null (entry);
+    assert_int_equal (session_entry_get_handle (entry), TEST_HANDLE_0);
+    g_object_unref (entry);
+
+    assert_null (session_list_lookup_handle (data->session_list,
+                                             TEST_HANDLE_1));
+    assert_null (session_list_lookup_connection (data->session_list,
+                                                 data->connection [1]));
+}
+/*
+ * Removing an entry by handle, by connection or with session_list_remove
+ * must remove it from both indexes.
+ */
+static void
+session_list_remove_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    SessionEntry *entry;
+
+    session_list_insert_new (data->session_list,
+                             data->connection [0],
+                             TEST_HANDLE_0);
+    session_list_insert_new (data->session_list,
+                             data->connection [0],
+                             TEST_HANDLE_1);
+    session_list_insert_new (data->session_list,
+                             data->connection [1],
+                             TEST_HANDLE_2);
+
+    assert_true (session_list_remove_handle (data->session_list,
+                                             TEST_HANDLE_0));
+    assert_false (session_list_remove_handle (data->session_list,
+                                              TEST_HANDLE_0));
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     data->connection [0]),
+                      1);
+
+    assert_true (session_list_remove_connection (data->session_list,
+                                                 data->connection [0]));
+    assert_null (session_list_lookup_handle (data->session_list,
+                                             TEST_HANDLE_1));
+    assert_false (session_list_remove_connection (data->session_list,
+                                                  data->connection [0]));
+
+    entry = session_list_lookup_handle (data->session_list, TEST_HANDLE_2);
+    session_list_lock (data->session_list);
+    session_list_remove (data->session_list, entry);
+    session_list_unlock (data->session_list);
+    assert_null (session_list_lookup_connection (data->session_list,
+                                                 data->connection [1]));
+    g_object_unref (entry);
+    assert_int_equal (session_list_size (data->session_list), 0);
+}
+/*
+ * session_list_remove_last removes the most recently inserted entry and
+ * passes the list's reference to the caller.
+ */
+static void
+session_list_remove_last_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    SessionEntry *entry;
+
+    session_list_insert_new (data->session_list,
+                             data->connection [0],
+                             TEST_HANDLE_0);
+    session_list_insert_new (data->session_list,
+                             data->connection [1],
+                             TEST_HANDLE_1);
+
+    entry = session_list_remove_last (data->session_list);
+    assert_non_null (entry);
+    assert_int_equal (session_entry_get_handle (entry), TEST_HANDLE_1);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     data->connection [1]),
+                      0);
+    g_object_unref (entry);
+    assert_int_equal (session_list_size (data->session_list), 1);
+}
+/*
+ * An entry can only be in the list once and there can only be one entry
+ * for each handle.
+ */
+static void
+session_list_insert_duplicate_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    SessionEntry *entry;
+
+    entry = session_entry_new (data->connection [0], TEST_HANDLE_0);
+    assert_true (session_list_insert (data->session_list, entry));
+    assert_false (session_list_insert (data->session_list, entry));
+    g_object_unref (entry);
+
+    assert_false (session_list_insert_new (data->session_list,
+                                           data->connection [1],
+                                           TEST_HANDLE_0));
+    assert_int_equal (session_list_size (data->session_list), 1);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     data->connection [1]),
+                      0);
+}
+/*
+ * Each Connection can have at most max_per_connection entries.
+ */
+static void
+session_list_is_full_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (session_list_insert_new (data->session_list,
+                                          data->connection [0],
+                                          TEST_HANDLE_0));
+    assert_true (session_list_insert_new (data->session_list,
+                                          data->connection [0],
+                                          TEST_HANDLE_1));
+    assert_true (session_list_is_full (data->session_list,
+                                       data->connection [0]));
+    assert_false (session_list_insert_new (data->session_list,
+                                           data->connection [0],
+                                           TEST_HANDLE_2));
+    assert_false (session_list_is_full (data->session_list,
+                                        data->connection [1]));
+    assert_true (session_list_insert_new (data->session_list,
+                                          data->connection [1],
+                                          TEST_HANDLE_2));
+}
+/*
+ * Changing the Connection of an entry with session_list_set_connection
+ * moves it to the index of the new Connection.
+ */
+static void
+session_list_set_connection_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    SessionEntry *entry;
+    Connection *connection;
+
+    session_list_insert_new (data->session_list,
+                             data->connection [0],
+                             TEST_HANDLE_0);
+    entry = session_list_lookup_handle (data->session_list, TEST_HANDLE_0);
+    session_list_set_connection (data->session_list,
+                                 entry,
+                                 data->connection [1]);
+    connection = session_entry_get_connection (entry);
+    assert_ptr_equal (connection, data->connection [1]);
+    g_object_unref (connection);
+    g_object_unref (entry);
+
+    assert_null (session_list_lookup_connection (data->session_list,
+                                                 data->connection [0]));
+    entry = session_list_lookup_connection (data->session_list,
+                                            data->connection [1]);
+    assert_non_null (entry);
+    assert_int_equal (session_entry_get_handle (entry), TEST_HANDLE_0);
+    g_object_unref (entry);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     data->connection [0]),
+                      0);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     data->connection [1]),
+                      1);
+}
+/*
+ * session_list_foreach visits entries in the order they were inserted and
+ * the callback may remove the entry it's passed.
+ */
+static void
+session_list_foreach_remove (gpointer data,
+                             gpointer user_data)
+{
+    SessionEntry *entry = SESSION_ENTRY (data);
+    SessionList *list = SESSION_LIST (user_data);
+
+    session_list_remove (list, entry);
+}
+
+static void
+session_list_foreach_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    session_list_insert_new (data->session_list,
+                             data->connection [0],
+                             TEST_HANDLE_0);
+    session_list_insert_new (data->session_list,
+                             data->connection [0],
+                             TEST_HANDLE_1);
+    session_list_insert_new (data->session_list,
+                             data->connection [1],
+                             TEST_HANDLE_2);
+    session_list_lock (data->session_list);
+    session_list_foreach (data->session_list,
+                          session_list_foreach_remove,
+                          data->session_list);
+    session_list_unlock (data->session_list);
+    assert_int_equal (session_list_size (data->session_list), 0);
+    assert_null (session_list_lookup_connection (data->session_list,
+                                                 data->connection [0]));
+}
+
+gint
+main (gint argc,
+      gchar *arvg[])
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (session_list_insert_lookup_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_remove_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_remove_last_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_insert_duplicate_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_is_full_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_set_connection_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_foreach_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -32,6 +32,7 @@
 #include <cmocka.h>
 
 #include "tpm2-command.h"
+#include "tpm2-header.h"
 #include "util.h"
 
 #define HANDLE_FIRST  0x80000000
@@ -289,6 +290,58 @@ tpm2_command_get_connection_test (void **state)
     assert_int_equal (data->connection, tpm2_command_get_connection (data->command));
 }
 
+/*
+ * Canceling the connection cancels the commands created before it but not
+ * the ones created after.
+ */
+static void
+tpm2_command_is_canceled_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+
+    assert_false (tpm2_command_is_canceled (data->command));
+    assert_int_equal (tpm2_command_get_deadline (data->command), 0);
+    connection_cancel (data->connection);
+    assert_true (tpm2_command_is_canceled (data->command));
+    command = tpm2_command_new (data->connection,
+                                calloc (1, TPM_HEADER_SIZE),
+                                TPM_HEADER_SIZE,
+                                (TPMA_CC){ 0, });
+    assert_false (tpm2_command_is_canceled (command));
+    g_object_unref (command);
+}
+
+/*
+ * A released command is pooled and handed out by the next call to
+ * tpm2_command_new with none of its old state.
+ */
+static void
+tpm2_command_pool_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command, *reused;
+
+    command = tpm2_command_new (data->connection,
+                                calloc (1, TPM_HEADER_SIZE),
+                                TPM_HEADER_SIZE,
+                                TPMA_CC_NV);
+    command->parsed = TRUE;
+    command->auth_count = 1;
+    g_object_unref (command);
+    reused = tpm2_command_new (data->connection,
+                               calloc (1, TPM_HEADER_SIZE),
+                               TPM_HEADER_SIZE,
+                               0);
+    assert_ptr_equal (reused, command);
+    assert_int_equal (G_OBJECT (reused)->ref_count, 1);
+    assert_int_equal (tpm2_command_get_attributes (reused), 0);
+    assert_false (reused->parsed);
+    assert_int_equal (reused->auth_count, 0);
+    assert_ptr_equal (reused->connection, data->connection);
+    g_object_unref (reused);
+}
+
 static void
 tpm2_command_get_buffer_test (void **state)
 {
@@ -547,6 +600,60 @@ tpm2_command_foreach_auth_test (void **state)
                                tpm2_command_foreach_auth_callback,
                                &callback_state);
 }
+/*
+ * The size field in the cmd_with_auths header doesn't match the buffer,
+ * tpm2_command_parse must reject it.
+ */
+static void
+tpm2_command_parse_size_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_int_equal (tpm2_command_parse (data->command),
+                      TPM2_RC_COMMAND_SIZE);
+    assert_false (data->command->parsed);
+}
+/*
+ * With the size fixed the command parses and both authorizations are
+ * found. tpm2_command_foreach_auth then uses the recorded offsets.
+ */
+static void
+tpm2_command_parse_auths_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    callback_auth_state_t callback_state = {
+        .command = data->command,
+        .counter = 0,
+        .handles_count = 2,
+        .handles = {
+            0x02000000,
+            0x02000001,
+        },
+    };
+
+    *(UINT32*)&data->buffer [2] = htobe32 (data->buffer_size);
+    assert_int_equal (tpm2_command_parse (data->command), TSS2_RC_SUCCESS);
+    assert_true (data->command->parsed);
+    assert_int_equal (data->command->auth_count, 2);
+    tpm2_command_foreach_auth (data->command,
+                               tpm2_command_foreach_auth_callback,
+                               &callback_state);
+    assert_int_equal (callback_state.counter, 2);
+}
+/*
+ * An auth area that claims one byte more than the two authorizations in it
+ * leaves a truncated third authorization which must be rejected.
+ */
+static void
+tpm2_command_parse_auth_overrun_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    *(UINT32*)&data->buffer [2] = htobe32 (data->buffer_size);
+    *(UINT32*)&data->buffer [18] = htobe32 (0x93);
+    assert_int_equal (tpm2_command_parse (data->command), TPM2_RC_AUTHSIZE);
+    assert_false (data->command->parsed);
+}
 static void
 tpm2_command_flush_context_handle_test (void **state)
 {
@@ -656,6 +763,12 @@ main (gint    argc,
         cmocka_unit_test_setup_teardown (tpm2_command_get_connection_test,
                                          tpm2_command_setup,
                                          tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_is_canceled_test,
+                                         tpm2_command_setup,
+                                         tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_pool_test,
+                                         tpm2_command_setup,
+                                         tpm2_command_teardown),
         cmocka_unit_test_setup_teardown (tpm2_command_get_buffer_test,
                                          tpm2_command_setup,
                                          tpm2_command_teardown),
@@ -701,6 +814,15 @@ main (gint    argc,
         cmocka_unit_test_setup_teardown (tpm2_command_foreach_auth_test,
                                          tpm2_command_setup_with_auths,
                                          tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_parse_size_test,
+                                         tpm2_command_setup_with_auths,
+                                         tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_parse_auths_test,
+                                         tpm2_command_setup_with_auths,
+                                         tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_parse_auth_overrun_test,
+                                         tpm2_command_setup_with_auths,
+                                         tpm2_command_teardown),
         cmocka_unit_test_setup_teardown (tpm2_command_flush_context_handle_test,
                                          tpm2_command_setup_flush_context_no_handle,
                                          tpm2_command_teardown),
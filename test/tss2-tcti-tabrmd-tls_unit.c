@@ -35,6 +35,7 @@
 
 #include <sapi/tpm20.h>
 
+#include "tcti-tabrmd.h"
 #include "tcti-tabrmd-tls.h"
 #include "tcti-tabrmd-tls-priv.h"
 #include "tpm2-header.h"
@@ -1004,18 +1005,31 @@ tcti_tabrmd_tls_receive_get_size_and_body_test (void **state)
     assert_int_equal (size, sizeof (buffer_in));
 }
 /*
- * This test sets up the call_cancel mock function to return values
- * indicating success. It then ensures that an invocation of the cancel
- * convenience macro invokes the underlying function correctly.
+ * This test ensures that an invocation of the cancel convenience macro
+ * sends the daemon a TCTI_TABRMD_CC_CANCEL command and leaves the TCTI
+ * waiting for the response to the canceled command.
  */
 static void
 tcti_tabrmd_tls_cancel_test (void **state)
 {
     data_t *data = *state;
+    uint8_t command_out [TPM_HEADER_SIZE] = { 0 };
+    GInputStream *istream;
     TSS2_RC rc;
+    ssize_t ret;
+    GError *error = NULL;
 
     rc = Tss2_Tcti_Cancel (data->context);
-    assert_int_equal (rc, TSS2_TCTI_RC_NOT_IMPLEMENTED);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    istream = g_io_stream_get_input_stream (data->server);
+    ret = g_input_stream_read (istream,
+                               command_out,
+                               sizeof (command_out),
+                               NULL,
+                               &error);
+    assert_int_equal (ret, TPM_HEADER_SIZE);
+    assert_int_equal (get_command_size (command_out), TPM_HEADER_SIZE);
+    assert_int_equal (get_command_code (command_out), TCTI_TABRMD_CC_CANCEL);
     assert_int_equal (TSS2_TCTI_TABRMD_TLS_STATE (data->context),
                       TABRMD_TLS_STATE_RECEIVE);
 }